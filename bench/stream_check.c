@@ -0,0 +1,463 @@
+// Equivalence checks for the parsers that keep state across PTY reads: the redactor and the
+// trigger automaton; and a round trip through the JSON writer's string escaping.
+//
+//   cmdr-stream-check [-r rounds] [-s seed]
+//
+// Each stream check generates terminal output, feeds it in one piece and then in random pieces
+// (single bytes included), and fails if the results differ or if the one-piece result is wrong.
+// Exits 1 on the first failure, printing the seed to reproduce it with.
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_writer.h"
+#include "redact.h"
+#include "server.h"
+#include "trigger.h"
+#include "utils.h"
+
+// normally defined in server.c, which the checks do not link
+volatile bool force_exit = false;
+struct lws_context *context;
+struct server *server;
+struct endpoints endpoints = {"/ws", "/", "/token", ""};
+
+static uint64_t rng_state;
+static int rounds = 200;
+static int failures;
+
+// xorshift64*, reproducible from -s
+static uint32_t rnd(uint32_t n) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32_t)((rng_state * 0x2545f4914f6cdd1dULL) >> 32) % n;
+}
+
+static void fail(const char *check, uint64_t seed, const char *what) {
+  fprintf(stderr, "%s: %s (seed %llu)\n", check, what, (unsigned long long)seed);
+  failures++;
+}
+
+// growable byte string
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} buf_t;
+
+static void buf_put(buf_t *b, const char *data, size_t len) {
+  if (b->len + len > b->cap) {
+    b->cap = (b->len + len) * 2;
+    b->data = xrealloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void buf_puts(buf_t *b, const char *s) { buf_put(b, s, strlen(s)); }
+
+static void buf_random(buf_t *b, const char *alphabet, size_t len) {
+  size_t n = strlen(alphabet);
+  for (size_t i = 0; i < len; i++) buf_put(b, &alphabet[rnd((uint32_t)n)], 1);
+}
+
+// len distinct bytes of alphabet in random order
+static void buf_distinct(buf_t *b, const char *alphabet, size_t len) {
+  char pool[256];
+  size_t n = strlen(alphabet);
+  memcpy(pool, alphabet, n);
+  for (size_t i = 0; i < len && i < n; i++) {
+    size_t k = i + rnd((uint32_t)(n - i));
+    char c = pool[k];
+    pool[k] = pool[i];
+    pool[i] = c;
+    buf_put(b, &c, 1);
+  }
+}
+
+// Piece lengths: mostly short, so every state boundary gets crossed, some single bytes and some
+// over REDACT_HOLD
+static size_t piece(size_t left) {
+  size_t n;
+  switch (rnd(4)) {
+    case 0:
+      n = 1;
+      break;
+    case 1:
+      n = 1 + rnd(16);
+      break;
+    case 2:
+      n = 1 + rnd(256);
+      break;
+    default:
+      n = 1 + rnd(4096);
+      break;
+  }
+  return n < left ? n : left;
+}
+
+// redact_feed
+
+#define ALNUM "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"
+
+static void append_cb(void *ctx, const char *data, size_t len) { buf_put((buf_t *)ctx, data, len); }
+
+// A secret of every rule, the part that must not survive recorded in `secrets` (NUL separated)
+static void put_secret(buf_t *b, buf_t *secrets) {
+  static const char *prefixes[] = {"AKIA", "ghp_", "github_pat_", "glpat-", "xoxb-", "sk_live_", "CMDRTEST"};
+  buf_t s = {0};
+  switch (rnd(4)) {
+    case 0:
+      buf_puts(b, prefixes[rnd(sizeof(prefixes) / sizeof(prefixes[0]))]);
+      buf_random(&s, ALNUM, 16 + rnd(40));
+      break;
+    case 1:
+      buf_puts(b, "Authorization: Bearer ");
+      buf_random(&s, ALNUM "-._~+/", 20 + rnd(40));
+      break;
+    case 2:
+      buf_puts(b, rnd(2) ? "DB_PASSWORD=" : "export api_key=");
+      buf_random(&s, ALNUM "_-", 16 + rnd(24));
+      break;
+    default:
+      // entropy, spread out enough that the heuristic can't miss it: the first bytes stay
+      // readable, the rest is checked
+      buf_random(b, ALNUM, 4);
+      buf_distinct(&s, ALNUM "+/", 40 + rnd(24));
+      break;
+  }
+  buf_put(b, s.data, s.len);
+  buf_put(secrets, s.data, s.len);
+  buf_put(secrets, "", 1);
+  free(s.data);
+}
+
+// Terminal output with secrets in it, some glued to SGR sequences, between plain text, long token
+// runs over REDACT_HOLD and binary bytes
+static void make_redact_stream(buf_t *b, buf_t *secrets) {
+  int items = 50 + (int)rnd(200);
+  for (int i = 0; i < items; i++) {
+    switch (rnd(8)) {
+      case 0:
+      case 1:
+        if (rnd(3) == 0) buf_puts(b, "\033[1;32m");
+        put_secret(b, secrets);
+        break;
+      case 2:
+        buf_random(b, "abcdefghij", 1 + rnd(REDACT_HOLD + 200));
+        break;
+      case 3: {
+        char bin[32];
+        for (size_t k = 0; k < sizeof(bin); k++) bin[k] = (char)rnd(256);
+        buf_put(b, bin, 1 + rnd(sizeof(bin)));
+        break;
+      }
+      case 4:
+        buf_puts(b, "\r\n");
+        break;
+      default:
+        buf_random(b, "lorem ipsum dolor sit amet ", 1 + rnd(60));
+        break;
+    }
+    buf_puts(b, rnd(4) ? " " : "\r\n");
+  }
+}
+
+static void redact_stream(const redact_rules_t *rules, const buf_t *in, bool whole, buf_t *out) {
+  redactor_t *r = redactor_new(rules);
+  for (size_t off = 0, n; off < in->len; off += n) {
+    n = whole ? in->len : piece(in->len - off);
+    redact_feed(r, in->data + off, n, append_cb, out);
+  }
+  redact_flush(r, append_cb, out);
+  redactor_free(r);
+}
+
+static void check_redact() {
+  redact_rules_t *rules = redact_rules_new();
+  redact_rules_add(rules, REDACT_DEFAULT ",prefix:CMDRTEST");
+  for (int round = 0; round < rounds; round++) {
+    uint64_t seed = rng_state;
+    buf_t in = {0}, secrets = {0}, whole = {0}, pieces = {0};
+    make_redact_stream(&in, &secrets);
+    redact_stream(rules, &in, true, &whole);
+    redact_stream(rules, &in, false, &pieces);
+
+    if (whole.len != in.len) fail("redact", seed, "masking changed the length");
+    if (pieces.len != whole.len || memcmp(pieces.data, whole.data, whole.len) != 0)
+      fail("redact", seed, "pieces differ from one piece");
+    for (size_t off = 0; off < secrets.len; off += strlen(secrets.data + off) + 1) {
+      if (memmem(whole.data, whole.len, secrets.data + off, strlen(secrets.data + off)) != NULL) {
+        fail("redact", seed, "secret left readable");
+        break;
+      }
+    }
+    free(in.data);
+    free(secrets.data);
+    free(whole.data);
+    free(pieces.data);
+    if (failures > 0) break;
+  }
+  redact_rules_free(rules);
+}
+
+// trigger_scan
+//
+// A line still being written is reported at the end of each read, so the reported text depends
+// on where reads end. What must not depend on it is which patterns match on which line: lines
+// start with their number, and the (line, pattern) pairs are compared.
+
+#define TRIGGER_LINES 64
+
+static const char *trigger_patterns[] = {"error:", "BUILD SUCCESSFUL", "Password:", "panic", "[y/N]", "err"};
+#define TRIGGER_PATTERN_COUNT (sizeof(trigger_patterns) / sizeof(trigger_patterns[0]))
+
+typedef struct {
+  bool hit[TRIGGER_LINES][TRIGGER_PATTERN_COUNT];
+  bool unnumbered;  // a report without its line number
+} trigger_hits_t;
+
+static void trigger_cb_record(void *ctx, int pattern, const char *line, size_t len) {
+  trigger_hits_t *hits = ctx;
+  char *end;
+  long n = len > 1 && line[0] == 'L' ? strtol(line + 1, &end, 10) : -1;
+  if (n < 0 || n >= TRIGGER_LINES || (size_t)(end - line) >= len || *end != ' ') {
+    hits->unnumbered = true;
+    return;
+  }
+  hits->hit[n][pattern] = true;
+}
+
+// Lines of words, colour changes and occasionally a pattern, upper case or with an SGR
+// sequence in the middle of it; `planted` records which pattern went into which line
+static void make_trigger_stream(buf_t *b, bool planted[TRIGGER_LINES][TRIGGER_PATTERN_COUNT]) {
+  for (int line = 0; line < TRIGGER_LINES; line++) {
+    char number[16];
+    snprintf(number, sizeof(number), "L%d ", line);
+    buf_puts(b, number);
+    int words = (int)rnd(12);
+    for (int w = 0; w < words; w++) {
+      switch (rnd(6)) {
+        case 0: {
+          size_t p = rnd(TRIGGER_PATTERN_COUNT);
+          const char *pattern = trigger_patterns[p];
+          size_t cut = rnd((uint32_t)strlen(pattern) + 1);
+          for (size_t i = 0; pattern[i]; i++) {
+            if (i == cut && rnd(2)) buf_puts(b, "\033[31m");
+            char c = rnd(3) == 0 && pattern[i] >= 'a' && pattern[i] <= 'z' ? pattern[i] - 32 : pattern[i];
+            buf_put(b, &c, 1);
+          }
+          planted[line][p] = true;
+          break;
+        }
+        case 1:
+          buf_puts(b, "\033[0m");
+          break;
+        case 2:
+          buf_puts(b, "\033]0;title\a");
+          break;
+        default:
+          buf_random(b, "abcdfghijkmnoqtuvwxyz", 1 + rnd(12));
+          break;
+      }
+      buf_puts(b, " ");
+    }
+    buf_puts(b, rnd(4) ? "\r\n" : "\n");
+  }
+}
+
+static void scan_stream(const buf_t *in, bool whole, trigger_hits_t *hits) {
+  trigger_set_t *set = trigger_set_new((char *const *)trigger_patterns, TRIGGER_PATTERN_COUNT);
+  trigger_scanner_t *scanner = trigger_scanner_new(set);
+  for (size_t off = 0, n; off < in->len; off += n) {
+    n = whole ? in->len : piece(in->len - off);
+    trigger_scan(scanner, in->data + off, n, trigger_cb_record, hits);
+  }
+  trigger_scanner_free(scanner);
+}
+
+static void check_trigger() {
+  for (int round = 0; round < rounds && failures == 0; round++) {
+    uint64_t seed = rng_state;
+    buf_t in = {0};
+    bool planted[TRIGGER_LINES][TRIGGER_PATTERN_COUNT] = {{false}};
+    trigger_hits_t whole = {{{false}}, false}, pieces = {{{false}}, false};
+    make_trigger_stream(&in, planted);
+    scan_stream(&in, true, &whole);
+    scan_stream(&in, false, &pieces);
+
+    if (whole.unnumbered || pieces.unnumbered) fail("trigger", seed, "match reported without its line");
+    if (memcmp(whole.hit, pieces.hit, sizeof(whole.hit)) != 0) fail("trigger", seed, "pieces differ from one piece");
+    for (int line = 0; line < TRIGGER_LINES; line++) {
+      for (size_t p = 0; p < TRIGGER_PATTERN_COUNT; p++) {
+        if (planted[line][p] && !whole.hit[line][p]) {
+          fail("trigger", seed, "planted pattern not reported");
+          line = TRIGGER_LINES;
+          break;
+        }
+      }
+    }
+    free(in.data);
+  }
+}
+
+// json_writer_string_len
+//
+// Strings of control characters, quotes, backslashes and UTF-8 up to 4 bytes are written as an
+// array into a writer that starts small, and decoded back by a strict parser of JSON strings.
+
+#define JSON_STRINGS 64
+
+static void put_utf8(buf_t *b, uint32_t cp) {
+  char s[4];
+  size_t n;
+  if (cp < 0x80) {
+    s[0] = (char)cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    s[0] = (char)(0xc0 | cp >> 6);
+    s[1] = (char)(0x80 | (cp & 0x3f));
+    n = 2;
+  } else if (cp < 0x10000) {
+    s[0] = (char)(0xe0 | cp >> 12);
+    s[1] = (char)(0x80 | (cp >> 6 & 0x3f));
+    s[2] = (char)(0x80 | (cp & 0x3f));
+    n = 3;
+  } else {
+    s[0] = (char)(0xf0 | cp >> 18);
+    s[1] = (char)(0x80 | (cp >> 12 & 0x3f));
+    s[2] = (char)(0x80 | (cp >> 6 & 0x3f));
+    s[3] = (char)(0x80 | (cp & 0x3f));
+    n = 4;
+  }
+  buf_put(b, s, n);
+}
+
+static void make_json_string(buf_t *b) {
+  size_t len = rnd(40);
+  for (size_t i = 0; i < len; i++) {
+    switch (rnd(6)) {
+      case 0:
+        put_utf8(b, rnd(0x20));
+        break;
+      case 1:
+        buf_put(b, &"\"\\/\x7f"[rnd(4)], 1);
+        break;
+      case 2:
+        put_utf8(b, 0x80 + rnd(0x800 - 0x80));
+        break;
+      case 3: {
+        uint32_t cp = 0x800 + rnd(0x10000 - 0x800);
+        put_utf8(b, cp >= 0xd800 && cp < 0xe000 ? 0x2028 : cp);
+        break;
+      }
+      case 4:
+        put_utf8(b, 0x10000 + rnd(0x110000 - 0x10000));
+        break;
+      default:
+        put_utf8(b, 0x20 + rnd(0x5f));
+        break;
+    }
+  }
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Decodes the string starting at *p (its opening quote) into out, false if it is not valid JSON
+static bool parse_json_string(const char **p, const char *end, buf_t *out) {
+  const char *s = *p;
+  if (s >= end || *s++ != '"') return false;
+  while (s < end && *s != '"') {
+    unsigned char c = (unsigned char)*s++;
+    if (c < 0x20) return false;
+    if (c != '\\') {
+      buf_put(out, (const char *)&c, 1);
+      continue;
+    }
+    if (s >= end) return false;
+    char e = *s++;
+    const char *plain = strchr("\"\\/bfnrt", e);
+    if (plain != NULL && e != '\0') {
+      buf_put(out, &"\"\\/\b\f\n\r\t"[plain - "\"\\/bfnrt"], 1);
+      continue;
+    }
+    if (e != 'u' || end - s < 4) return false;
+    uint32_t cp = 0;
+    for (int i = 0; i < 4; i++) {
+      int d = hex_digit(*s++);
+      if (d < 0) return false;
+      cp = cp << 4 | (uint32_t)d;
+    }
+    // the writer only escapes control characters, never as surrogate pairs
+    if (cp >= 0xd800 && cp < 0xe000) return false;
+    put_utf8(out, cp);
+  }
+  if (s >= end) return false;
+  *p = s + 1;
+  return true;
+}
+
+static void check_json() {
+  for (int round = 0; round < rounds && failures == 0; round++) {
+    uint64_t seed = rng_state;
+    buf_t strings[JSON_STRINGS] = {{0}};
+    json_writer_t w;
+    json_writer_init(&w, 0, 0);
+    json_writer_begin_array(&w);
+    for (int i = 0; i < JSON_STRINGS; i++) {
+      make_json_string(&strings[i]);
+      json_writer_string_len(&w, strings[i].data != NULL ? strings[i].data : "", strings[i].len);
+    }
+    json_writer_end_array(&w);
+    size_t len = 0;
+    char *json = json_writer_finish(&w, &len);
+
+    const char *p = json, *end = json + len;
+    bool ok = len >= 2 && *p++ == '[';
+    for (int i = 0; ok && i < JSON_STRINGS; i++) {
+      buf_t decoded = {0};
+      ok = (i == 0 || *p++ == ',') && parse_json_string(&p, end, &decoded) && decoded.len == strings[i].len &&
+           (decoded.len == 0 || memcmp(decoded.data, strings[i].data, decoded.len) == 0);
+      free(decoded.data);
+    }
+    if (!ok || p + 1 != end || *p != ']') fail("json", seed, "strings do not round trip");
+    for (int i = 0; i < JSON_STRINGS; i++) free(strings[i].data);
+    free(json);
+  }
+}
+
+int main(int argc, char **argv) {
+  uint64_t seed = 1;
+  int c;
+  while ((c = getopt(argc, argv, "r:s:h")) != -1) {
+    switch (c) {
+      case 'r':
+        rounds = atoi(optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-r rounds] [-s seed]\n", argv[0]);
+        return c == 'h' ? 0 : 1;
+    }
+  }
+  rng_state = seed != 0 ? seed : 1;
+
+  check_redact();
+  check_trigger();
+  check_json();
+  if (failures > 0) return 1;
+  printf("stream checks passed, %d rounds\n", rounds);
+  return 0;
+}
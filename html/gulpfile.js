@@ -5,31 +5,83 @@ const inlineSource = require('gulp-inline-source');
 const rename = require('gulp-rename');
 const through2 = require('through2');
 
-const genHeader = (size, buf, len) => {
-    let idx = 0;
-    let data = 'unsigned char index_html[] = {\n  ';
-
-    for (const value of buf) {
-        idx++;
+const fs = require('fs');
+const path = require('path');
+const zlib = require('zlib');
 
-        const current = value < 0 ? value + 256 : value;
+// byte array initializer body, 12 values per line
+const genBytes = buf => {
+    let data = '  ';
+    for (let idx = 1; idx <= buf.length; idx++) {
+        const current = buf[idx - 1];
 
         data += '0x';
         data += (current >>> 4).toString(16);
         data += (current & 0xf).toString(16);
 
-        if (idx === len) {
+        if (idx === buf.length) {
             data += '\n';
         } else {
             data += idx % 12 === 0 ? ',\n  ' : ', ';
         }
     }
+    return data;
+};
 
+const genHeader = (size, buf, len) => {
+    let data = 'unsigned char index_html[] = {\n';
+    data += genBytes(buf);
     data += '};\n';
     data += `unsigned int index_html_len = ${len};\n`;
     data += `unsigned int index_html_size = ${size};\n`;
     return data;
 };
+
+const contentTypes = {
+    '.js': 'application/javascript',
+    '.css': 'text/css',
+    '.png': 'image/png',
+    '.svg': 'image/svg+xml',
+    '.woff2': 'font/woff2',
+};
+// formats that are already compressed
+const storeOnly = ['.png', '.woff2'];
+
+// Lazily loaded chunks, served by callback_http from `<index>assets/...`. Their names carry a
+// content hash, so the server can mark them immutable.
+const genAssets = () => {
+    const dir = 'dist/assets';
+    const files = fs.existsSync(dir) ? fs.readdirSync(dir).sort() : [];
+    let arrays = '';
+    let table = '';
+
+    files
+        .filter(name => contentTypes[path.extname(name)] !== undefined)
+        .forEach((name, idx) => {
+            const ext = path.extname(name);
+            const raw = fs.readFileSync(path.join(dir, name));
+            const gzip = !storeOnly.includes(ext);
+            const buf = gzip ? zlib.gzipSync(raw, { level: 9 }) : raw;
+
+            arrays += `static const unsigned char html_asset_${idx}[] = {\n${genBytes(buf)}};\n`;
+            table += `  {"assets/${name}", "${contentTypes[ext]}", html_asset_${idx}, ${buf.length}, ${raw.length}, ${gzip ? 1 : 0}},\n`;
+        });
+
+    let data = '\nstruct html_asset {\n';
+    data += '  const char *path;  // relative to the index path\n';
+    data += '  const char *content_type;\n';
+    data += '  const unsigned char *data;\n';
+    data += '  unsigned int len;   // length of data\n';
+    data += '  unsigned int size;  // uncompressed size\n';
+    data += '  int gzip;           // data is gzip compressed\n';
+    data += '};\n';
+    data += arrays;
+    data += 'static const struct html_asset html_assets[] = {\n';
+    data += table;
+    data += '  {NULL, NULL, NULL, 0, 0, 0}\n';
+    data += '};\n';
+    return data;
+};
 let fileSize = 0;
 
 task('clean', () => {
@@ -58,7 +110,7 @@ task(
             .pipe(
                 through2.obj((file, enc, cb) => {
                     const buf = file.contents;
-                    file.contents = Buffer.from(genHeader(fileSize, buf, buf.length));
+                    file.contents = Buffer.from(genHeader(fileSize, buf, buf.length) + genAssets());
                     return cb(null, file);
                 })
             )
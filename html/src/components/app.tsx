@@ -1,12 +1,10 @@
 import { h, Component } from 'preact';
+import { lazy, Suspense } from 'preact/compat';
 
 import { Terminal } from './terminal';
-import { AIBar } from './ai-bar';
 import { Login } from './auth';
 import { SessionSidebar } from './session-sidebar';
-import { UpdateChecker } from './UpdateChecker';
-import { Settings } from './Settings';
-import { Theme } from './Settings';
+import type { Theme } from './Settings';
 import { themes } from './settings/themes';
 import { authService } from '../services/firebase';
 import { localSessionService } from '../services/local-session';
@@ -53,6 +51,13 @@ const clientOptions = {
     closeOnDisconnect: false,
     isWindows: false,
     unicodeVersion: '11',
+    screenDiff: false,
+    enablePredictiveEcho: true,
+    predictiveEchoThreshold: 30,
+    bufferSize: defaultSettings.performance.bufferSize,
+    frameRateLimit: defaultSettings.performance.frameRateLimit,
+    remoteScrollback: true,
+    localScrollback: 1000,
     defaultShell: defaultShell,
 } as ClientOptions;
 const termOptions = {
@@ -85,12 +90,22 @@ const termOptions = {
     allowProposedApi: true,
 } as ITerminalOptions;
 
+// Off the critical path: fetched as separate chunks the first time they render
+const AIBar = lazy(() => import(/* webpackChunkName: "ai-bar" */ './ai-bar').then(m => ({ default: m.AIBar })));
+const Settings = lazy(() =>
+    import(/* webpackChunkName: "settings" */ './Settings').then(m => ({ default: m.Settings }))
+);
+const UpdateChecker = lazy(() =>
+    import(/* webpackChunkName: "update" */ './UpdateChecker').then(m => ({ default: m.UpdateChecker }))
+);
+
 // Make termOptions globally accessible
 (window as any).termOptions = termOptions;
 const flowControl = {
     limit: 100000,
     highWater: 10,
     lowWater: 4,
+    adaptive: true,
 } as FlowControl;
 
 interface AppState {
@@ -100,6 +115,7 @@ interface AppState {
     sidebarCollapsed: boolean;
     currentTheme: string;
     settingsVisible: boolean;
+    settingsLoaded: boolean;
     aiBarVisible: boolean;
     webSocket: WebSocket | null;
 }
@@ -114,6 +130,7 @@ export class App extends Component<{}, AppState> {
             sidebarCollapsed: false,
             currentTheme: localStorage.getItem('cmdr-theme') || 'cmdr-dark',
             settingsVisible: false,
+            settingsLoaded: false,
             aiBarVisible: false,
             webSocket: null,
         };
@@ -204,6 +221,12 @@ export class App extends Component<{}, AppState> {
             }
         }
         
+        // Output policy, sent to the server with the next handshake
+        if (settings.performance) {
+            clientOptions.bufferSize = settings.performance.bufferSize;
+            clientOptions.frameRateLimit = settings.performance.frameRateLimit;
+        }
+
         // Apply terminal behavior settings (cursor, scrollback, etc.)
         if (settings.terminalBehavior) {
             // Update global termOptions for new terminal instances
@@ -390,7 +413,7 @@ export class App extends Component<{}, AppState> {
     };
 
     handleSettingsOpen = () => {
-        this.setState({ settingsVisible: true });
+        this.setState({ settingsVisible: true, settingsLoaded: true });
     };
 
     handleSettingsClose = () => {
@@ -618,7 +641,8 @@ export class App extends Component<{}, AppState> {
     };
 
     render() {
-        const { user, loading, activeSessionId, sidebarCollapsed, currentTheme, settingsVisible, aiBarVisible } = this.state;
+        const { user, loading, activeSessionId, sidebarCollapsed, currentTheme, settingsVisible, settingsLoaded, aiBarVisible } =
+            this.state;
 
         if (loading) {
             return (
@@ -634,11 +658,13 @@ export class App extends Component<{}, AppState> {
 
         return (
             <div class={`app-container ${sidebarCollapsed ? 'sidebar-collapsed' : ''}`}>
-                <UpdateChecker 
-                    webSocket={this.state.webSocket}
-                    disabled={process.env.NODE_ENV === 'development'}
-                    checkInterval={3600000} // 1 hour
-                />
+                <Suspense fallback={null}>
+                    <UpdateChecker 
+                        webSocket={this.state.webSocket}
+                        disabled={process.env.NODE_ENV === 'development'}
+                        checkInterval={3600000} // 1 hour
+                    />
+                </Suspense>
                 <SessionSidebar
                     user={user}
                     activeSessionId={activeSessionId}
@@ -649,7 +675,11 @@ export class App extends Component<{}, AppState> {
                     onOpenSettings={this.handleSettingsOpen}
                 />
                 <div class="main-content">
-                    {aiBarVisible && <AIBar onCommandGenerated={this.handleCommandGenerated} />}
+                    {aiBarVisible && (
+                        <Suspense fallback={null}>
+                            <AIBar onCommandGenerated={this.handleCommandGenerated} />
+                        </Suspense>
+                    )}
                     <Terminal
                         id="terminal-container"
                         wsUrl={wsUrl}
@@ -662,16 +692,20 @@ export class App extends Component<{}, AppState> {
                         onWebSocketDisconnect={this.handleWebSocketDisconnect}
                     />
                 </div>
-                <Settings
-                    isVisible={settingsVisible}
-                    onClose={this.handleSettingsClose}
-                    currentTheme={currentTheme}
-                    onThemeChange={this.handleThemeChange}
-                    onFontSizeChange={this.handleFontSizeChange}
-                    onFontFamilyChange={this.handleFontFamilyChange}
-                    onPreferenceChange={this.handlePreferenceChange}
-                    websocket={this.state.webSocket || undefined}
-                />
+                {settingsLoaded && (
+                    <Suspense fallback={null}>
+                        <Settings
+                            isVisible={settingsVisible}
+                            onClose={this.handleSettingsClose}
+                            currentTheme={currentTheme}
+                            onThemeChange={this.handleThemeChange}
+                            onFontSizeChange={this.handleFontSizeChange}
+                            onFontFamilyChange={this.handleFontFamilyChange}
+                            onPreferenceChange={this.handlePreferenceChange}
+                            websocket={this.state.webSocket || undefined}
+                        />
+                    </Suspense>
+                )}
             </div>
         );
     }
@@ -8,6 +8,7 @@ interface Session {
     id: string;
     name: string;
     current_directory: string;
+    title?: string;
     last_access: string;
     is_active: boolean;
     created_at?: string;
@@ -19,12 +20,20 @@ function tabToSession(tab: LocalTab): Session {
         id: tab.id,
         name: tab.name,
         current_directory: tab.current_directory || '~',
+        title: tab.title,
         last_access: tab.last_access || new Date().toISOString(),
         is_active: tab.is_active || false,
         created_at: tab.created_at,
     };
 }
 
+// output trigger matches of a session, from the 'cmdr-trigger' events of the terminal
+interface TriggerBadge {
+    count: number;
+    pattern: string;
+    line: string;
+}
+
 interface SessionSidebarProps {
     user: User;
     activeSessionId: string | null;
@@ -50,11 +59,37 @@ export function SessionSidebar({
     const [showUserMenu, setShowUserMenu] = useState(false);
     const [editingSessionId, setEditingSessionId] = useState<string | null>(null);
     const [editingName, setEditingName] = useState('');
+    const [triggers, setTriggers] = useState<Record<string, TriggerBadge>>({});
 
     useEffect(() => {
         loadSessions();
     }, []);
 
+    useEffect(() => {
+        const onTrigger = (event: Event) => {
+            const { session_id, events } = (event as CustomEvent).detail;
+            if (!events?.length) return;
+            const last = events[events.length - 1];
+            setTriggers(prev => ({
+                ...prev,
+                [session_id]: {
+                    count: (prev[session_id]?.count || 0) + events.length,
+                    pattern: last.pattern,
+                    line: last.line,
+                },
+            }));
+        };
+        window.addEventListener('cmdr-trigger', onTrigger);
+        return () => window.removeEventListener('cmdr-trigger', onTrigger);
+    }, []);
+
+    const clearTriggers = (sessionId: string) => {
+        if (!triggers[sessionId]) return;
+        const rest = { ...triggers };
+        delete rest[sessionId];
+        setTriggers(rest);
+    };
+
     const loadSessions = async () => {
         try {
             setLoading(true);
@@ -260,7 +295,10 @@ export function SessionSidebar({
                             <div
                                 key={session.id}
                                 className={`session-item ${activeSessionId === session.id ? 'active' : ''}`}
-                                onClick={() => onSessionChange(session.id)}
+                                onClick={() => {
+                                    clearTriggers(session.id);
+                                    onSessionChange(session.id);
+                                }}
                             >
                                 <div className="session-content">
                                     {editingSessionId === session.id ? (
@@ -276,7 +314,17 @@ export function SessionSidebar({
                                     ) : (
                                         <Fragment>
                                             <div className="session-info">
-                                                <div className="session-name">{session.name}</div>
+                                                <div className="session-name" title={session.title}>
+                                                    {session.name}
+                                                    {triggers[session.id] && (
+                                                        <span
+                                                            className="session-trigger"
+                                                            title={`${triggers[session.id].pattern}: ${triggers[session.id].line}`}
+                                                        >
+                                                            {triggers[session.id].count}
+                                                        </span>
+                                                    )}
+                                                </div>
                                                 <div className="session-meta">
                                                     <span className="session-time">
                                                         {formatSessionTime(session.last_access)}
@@ -0,0 +1,205 @@
+// speculative local echo, modeled after mosh's prediction engine
+// https://mosh.org/mosh-paper.pdf
+import { bind } from 'decko';
+import type { IDecoration, IDisposable, IMarker, ITerminalAddon, Terminal } from '@xterm/xterm';
+
+export interface PredictionOptions {
+    // only show predictions once the smoothed round trip exceeds this many ms, 0 shows them always
+    threshold: number;
+}
+
+type PredictionKind = 'char' | 'erase' | 'move';
+
+interface Prediction {
+    kind: PredictionKind;
+    char: string;
+    x: number; // column the prediction applies to
+    cursor: number; // predicted cursor column afterwards
+    marker: IMarker;
+    decoration?: IDecoration;
+    time: number;
+    superseded?: boolean; // a char erased again before the server echoed it
+}
+
+// prompts where the remote side turns echo off, never guess the input there
+const PASSWORD_PROMPT = /(password|passphrase|passcode|pin)[^:]*:\s*$/i;
+// single width characters only, wide ones would need the unicode tables of the terminal
+const PREDICTABLE = /^[\x20-\x7e\u00a0-\u024f]$/;
+const MIN_TIMEOUT = 1000;
+
+export class PredictionAddon implements ITerminalAddon {
+    private disposables: IDisposable[] = [];
+    private terminal: Terminal;
+    private predictions: Prediction[] = [];
+    private srtt = 0;
+    private parsing = false;
+    private echoOff = false;
+
+    constructor(private options: PredictionOptions) {}
+
+    activate(terminal: Terminal) {
+        this.terminal = terminal;
+        this.disposables.push(terminal.onWriteParsed(this.reconcile));
+        this.disposables.push(terminal.buffer.onBufferChange(() => this.reset()));
+    }
+
+    dispose() {
+        this.reset();
+        for (const d of this.disposables) {
+            d.dispose();
+        }
+        this.disposables.length = 0;
+    }
+
+    // Hint from the server about the PTY line discipline. Canonical mode with echo off is a
+    // password style prompt. Raw mode says little, readline turns echo off but prints input itself.
+    @bind
+    public setEchoHint(echo: boolean, canonical: boolean) {
+        this.echoOff = canonical && !echo;
+        if (this.echoOff) this.reset();
+    }
+
+    // called before server output is handed to the terminal
+    @bind
+    public consume() {
+        this.parsing = true;
+    }
+
+    // called with user input before it is sent to the server
+    @bind
+    public predict(data: string) {
+        if (!this.canPredict()) {
+            this.reset();
+            return;
+        }
+
+        const { cols } = this.terminal;
+        const last = this.predictions[this.predictions.length - 1];
+        const cursor = last ? last.cursor : this.terminal.buffer.active.cursorX;
+
+        if (PREDICTABLE.test(data)) {
+            // wrapping and insertion in the middle of the line redraw more than the typed key
+            if (cursor >= cols - 1 || !this.atLineEnd(cursor)) return this.reset();
+            this.add('char', data, cursor, cursor + 1);
+        } else if (data === '\x7f' || data === '\b') {
+            if (cursor === 0 || !this.atLineEnd(cursor)) return this.reset();
+            if (last?.kind === 'char' && last.x === cursor - 1) {
+                last.superseded = true;
+                last.decoration?.dispose();
+            }
+            this.add('erase', ' ', cursor - 1, cursor - 1);
+        } else if (data === '\x1b[D' || data === '\x1bOD') {
+            if (cursor === 0) return this.reset();
+            this.add('move', '', cursor - 1, cursor - 1);
+        } else if (data === '\x1b[C' || data === '\x1bOC') {
+            if (this.atLineEnd(cursor + 1)) return this.reset();
+            this.add('move', '', cursor + 1, cursor + 1);
+        } else {
+            // enter, control keys and pastes change too much to guess
+            this.reset();
+        }
+    }
+
+    private canPredict(): boolean {
+        const { terminal } = this;
+        const buffer = terminal.buffer.active;
+        if (this.echoOff || buffer.type === 'alternate') return false;
+        // the cursor is only trustworthy once all output has been parsed, or relative to a prediction
+        if (this.predictions.length === 0 && this.parsing) return false;
+
+        const line = buffer.getLine(buffer.baseY + buffer.cursorY);
+        if (line && PASSWORD_PROMPT.test(line.translateToString(false, 0, buffer.cursorX))) return false;
+        return true;
+    }
+
+    // true if there is nothing but blanks from the column to the end of the cursor line
+    private atLineEnd(x: number): boolean {
+        const buffer = this.terminal.buffer.active;
+        const line = buffer.getLine(buffer.baseY + buffer.cursorY);
+        return !line || line.translateToString(true).length <= x;
+    }
+
+    private add(kind: PredictionKind, char: string, x: number, cursor: number) {
+        const marker = this.terminal.registerMarker(0);
+        if (!marker) return;
+        const prediction: Prediction = { kind, char, x, cursor, marker, time: performance.now() };
+        if (kind !== 'move' && this.srtt >= this.options.threshold) this.render(prediction);
+        this.predictions.push(prediction);
+    }
+
+    private render(prediction: Prediction) {
+        const { terminal } = this;
+        const decoration = terminal.registerDecoration({
+            marker: prediction.marker,
+            x: prediction.x,
+            width: 1,
+            layer: 'top',
+        });
+        if (!decoration) return;
+
+        decoration.onRender(el => {
+            const { theme, fontFamily, fontSize } = terminal.options;
+            el.textContent = prediction.char;
+            el.style.fontFamily = fontFamily || 'monospace';
+            el.style.fontSize = `${fontSize}px`;
+            el.style.lineHeight = el.style.height;
+            el.style.textDecoration = prediction.kind === 'char' ? 'underline' : 'none';
+            el.style.color = theme?.foreground || '#ffffff';
+            el.style.backgroundColor = theme?.background || '#000000';
+        });
+        prediction.decoration = decoration;
+    }
+
+    // check outstanding predictions against what the server actually drew
+    @bind
+    private reconcile() {
+        this.parsing = false;
+        if (this.predictions.length === 0) return;
+
+        const buffer = this.terminal.buffer.active;
+        const now = performance.now();
+        const timeout = Math.max(MIN_TIMEOUT, this.srtt * 3);
+
+        // confirm in typing order, output for later keys can't arrive before output for earlier ones
+        let confirmed = 0;
+        for (const p of this.predictions) {
+            if (p.marker.isDisposed || now - p.time > timeout) return this.reset();
+
+            const cell = buffer.getLine(p.marker.line)?.getCell(p.x);
+            const chars = cell?.getChars() || ' ';
+            const onLine = buffer.baseY + buffer.cursorY === p.marker.line;
+            let ok = false;
+            if (p.kind === 'char') {
+                if (chars !== p.char && chars !== ' ' && !p.superseded) return this.reset();
+                ok = chars === p.char || (p.superseded === true && chars === ' ');
+            } else if (p.kind === 'erase') {
+                ok = chars === ' ' && onLine && buffer.cursorX <= p.x;
+            } else {
+                ok = onLine && buffer.cursorX === p.cursor;
+            }
+            if (!ok) break;
+            confirmed++;
+        }
+
+        for (const p of this.predictions.splice(0, confirmed)) {
+            if (p.kind === 'char' && !p.superseded) {
+                const rtt = now - p.time;
+                this.srtt = this.srtt === 0 ? rtt : this.srtt * 0.875 + rtt * 0.125;
+            }
+            this.drop(p);
+        }
+    }
+
+    private drop(prediction: Prediction) {
+        prediction.decoration?.dispose();
+        prediction.marker.dispose();
+    }
+
+    @bind
+    public reset() {
+        for (const p of this.predictions) {
+            this.drop(p);
+        }
+        this.predictions.length = 0;
+    }
+}
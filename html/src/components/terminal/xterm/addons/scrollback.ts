@@ -0,0 +1,225 @@
+import { bind } from 'decko';
+import type { IDisposable, ITerminalAddon, Terminal } from '@xterm/xterm';
+
+export interface ScrollbackRequest {
+    start?: number;
+    end?: number;
+    skip?: number;
+    count: number;
+}
+
+interface ScrollbackOptions {
+    // sends FETCH_SCROLLBACK
+    fetch: (request: ScrollbackRequest) => void;
+    pageLines?: number;
+}
+
+// lines kept in the pager, pages falling out are fetched again when scrolled back into view
+const MAX_PAGER_LINES = 5000;
+// distance from either end of the pager that triggers the next fetch
+const FETCH_MARGIN = 400;
+
+// CSI, OSC, and two-byte escapes; the pager shows plain text
+// eslint-disable-next-line no-control-regex
+const ESCAPES = /\x1b\[[0-?]*[ -/]*[@-~]|\x1b\][^\x07\x1b]*(?:\x07|\x1b\\)?|\x1b[@-_]|[\x00-\x08\x0b-\x1f\x7f]/g;
+
+function toText(line: string): string {
+    // carriage returns overprint, keep what was written last
+    const text = line.endsWith('\r') ? line.slice(0, -1) : line;
+    const cr = text.lastIndexOf('\r');
+    return (cr >= 0 ? text.slice(cr + 1) : text).replace(ESCAPES, '');
+}
+
+// Server-backed history. The terminal keeps only a short local scrollback; scrolling up past
+// its top opens a pager that fetches older lines from the server ring buffer page by page.
+export class ScrollbackAddon implements ITerminalAddon {
+    private terminal: Terminal;
+    private disposables: IDisposable[] = [];
+    private pager?: HTMLElement;
+    private textDecoder = new TextDecoder();
+
+    // server line numbers of the lines in the pager
+    private first = 0;
+    private end = 0;
+    // where the pager stops, the first line the terminal still has locally
+    private liveEnd = 0;
+    private oldest = 0;
+    private loading = false;
+
+    constructor(private options: ScrollbackOptions) {}
+
+    activate(terminal: Terminal): void {
+        this.terminal = terminal;
+        this.disposables.push(terminal.onKey(() => this.close()));
+        terminal.element?.addEventListener('wheel', this.onTerminalWheel, { capture: true, passive: true });
+    }
+
+    dispose(): void {
+        this.close();
+        this.terminal.element?.removeEventListener('wheel', this.onTerminalWheel, { capture: true });
+        for (const d of this.disposables) d.dispose();
+        this.disposables.length = 0;
+    }
+
+    private get pageLines() {
+        return this.options.pageLines ?? 500;
+    }
+
+    // logical lines the terminal still holds, wrapped rows count once
+    private localLines(): number {
+        const buffer = this.terminal.buffer.active;
+        let lines = 0;
+        for (let i = 0; i < buffer.length; i++) {
+            if (!buffer.getLine(i)?.isWrapped) lines++;
+        }
+        return lines;
+    }
+
+    @bind
+    private onTerminalWheel(event: WheelEvent) {
+        const buffer = this.terminal.buffer.active;
+        if (this.pager || event.deltaY >= 0 || buffer.type !== 'normal' || buffer.viewportY > 0) return;
+        this.open();
+    }
+
+    private open() {
+        const { terminal } = this;
+        if (!terminal.element || this.loading) return;
+
+        const pager = document.createElement('div');
+        const theme = terminal.options.theme ?? {};
+        pager.style.cssText = `position: absolute;
+inset: 0;
+z-index: 10;
+overflow-y: auto;
+white-space: pre;
+padding: 0 4px;
+box-sizing: border-box;`;
+        pager.style.background = theme.background ?? '#000';
+        pager.style.color = theme.foreground ?? '#fff';
+        pager.style.fontFamily = terminal.options.fontFamily ?? 'monospace';
+        pager.style.fontSize = `${terminal.options.fontSize ?? 13}px`;
+        pager.style.lineHeight = `${terminal.options.lineHeight ?? 1}`;
+        pager.tabIndex = -1;
+        pager.addEventListener('scroll', this.onPagerScroll);
+        pager.addEventListener('wheel', this.onPagerWheel, { passive: true });
+        pager.addEventListener('keydown', this.onPagerKey);
+        terminal.element.appendChild(pager);
+        pager.focus();
+
+        this.pager = pager;
+        this.first = this.end = this.liveEnd = 0;
+        this.loading = true;
+        this.options.fetch({ skip: this.localLines(), count: this.pageLines });
+    }
+
+    @bind
+    public close() {
+        if (!this.pager) return;
+        this.pager.remove();
+        this.pager = undefined;
+        this.loading = false;
+        this.terminal.focus();
+    }
+
+    // SCROLLBACK payload: "<first>;<end>;<oldest>;" followed by the raw output of the lines
+    @bind
+    public onPage(data: Uint8Array) {
+        const header: number[] = [];
+        let pos = 0;
+        while (header.length < 3) {
+            const sep = data.indexOf(0x3b, pos);
+            if (sep < 0) return;
+            header.push(Number(this.textDecoder.decode(data.subarray(pos, sep))));
+            pos = sep + 1;
+        }
+        const [first, end, oldest] = header;
+        this.loading = false;
+        this.oldest = oldest;
+
+        const { pager } = this;
+        if (!pager) return;
+
+        const lines = this.textDecoder.decode(data.subarray(pos)).split('\n');
+        // the range ends at the start of line `end`, so the text ends with its newline
+        if (lines.length > end - first) lines.length = end - first;
+        const nodes = lines.map(line => {
+            const div = document.createElement('div');
+            div.textContent = toText(line) || ' ';
+            return div;
+        });
+
+        if (pager.childElementCount === 0) {
+            // first page, anchored at the bottom where the local scrollback begins
+            this.first = first;
+            this.end = this.liveEnd = end;
+            pager.append(...nodes);
+            pager.scrollTop = pager.scrollHeight;
+            if (end === first) this.close();
+            return;
+        }
+
+        if (end === this.first && first < end) {
+            const height = pager.scrollHeight;
+            pager.prepend(...nodes);
+            pager.scrollTop += pager.scrollHeight - height;
+            this.first = first;
+            this.trim(false);
+        } else if (first === this.end && first < end) {
+            pager.append(...nodes);
+            this.end = end;
+            this.trim(true);
+        }
+    }
+
+    // keep the DOM bounded, dropping lines from the end away from the scroll direction
+    private trim(fromTop: boolean) {
+        const { pager } = this;
+        if (!pager) return;
+        while (pager.childElementCount > MAX_PAGER_LINES) {
+            if (fromTop) {
+                const node = pager.firstElementChild as HTMLElement;
+                const height = node.offsetHeight;
+                node.remove();
+                pager.scrollTop -= height;
+                this.first++;
+            } else {
+                pager.lastElementChild?.remove();
+                this.end--;
+            }
+        }
+    }
+
+    @bind
+    private onPagerScroll() {
+        const { pager } = this;
+        if (!pager || this.loading) return;
+        const lineHeight = pager.scrollHeight / Math.max(pager.childElementCount, 1);
+        if (pager.scrollTop < FETCH_MARGIN && this.first > this.oldest) {
+            this.loading = true;
+            this.options.fetch({ end: this.first, count: this.pageLines });
+        } else if (
+            pager.scrollHeight - pager.scrollTop - pager.clientHeight < Math.max(FETCH_MARGIN, lineHeight) &&
+            this.end < this.liveEnd
+        ) {
+            this.loading = true;
+            this.options.fetch({ start: this.end, count: Math.min(this.pageLines, this.liveEnd - this.end) });
+        }
+    }
+
+    // scrolling down past the newest page returns to the live terminal
+    @bind
+    private onPagerWheel(event: WheelEvent) {
+        const { pager } = this;
+        if (!pager || event.deltaY <= 0 || this.end < this.liveEnd) return;
+        if (pager.scrollTop + pager.clientHeight >= pager.scrollHeight - 1) this.close();
+    }
+
+    @bind
+    private onPagerKey(event: KeyboardEvent) {
+        if (event.key === 'Escape' || event.key === 'q') {
+            event.preventDefault();
+            this.close();
+        }
+    }
+}
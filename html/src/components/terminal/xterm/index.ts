@@ -6,10 +6,13 @@ import { ClipboardAddon } from '@xterm/addon-clipboard';
 import { WebglAddon } from '@xterm/addon-webgl';
 import { FitAddon } from '@xterm/addon-fit';
 import { WebLinksAddon } from '@xterm/addon-web-links';
-import { ImageAddon } from '@xterm/addon-image';
 import { Unicode11Addon } from '@xterm/addon-unicode11';
 import { OverlayAddon } from './addons/overlay';
-import { ZmodemAddon } from './addons/zmodem';
+import { PredictionAddon } from './addons/prediction';
+import { ScrollbackAddon } from './addons/scrollback';
+import type { ScrollbackRequest } from './addons/scrollback';
+import type { ZmodemAddon } from './addons/zmodem';
+import { WorkerSocket } from './socket';
 
 import '@xterm/xterm/css/xterm.css';
 
@@ -28,12 +31,19 @@ enum Command {
     OUTPUT = '0',
     SET_WINDOW_TITLE = '1',
     SET_PREFERENCES = '2',
+    SCREEN_FRAME = '5',
+    TERMINAL_MODE = '6',
+    SCROLLBACK = '7',
+    TRIGGER_EVENT = '8',
 
     // client side
     INPUT = '0',
     RESIZE_TERMINAL = '1',
     PAUSE = '2',
     RESUME = '3',
+    ACK_STATE = '4',
+    FLOW_REPORT = '5',
+    FETCH_SCROLLBACK = '6',
 }
 type Preferences = ITerminalOptions & ClientOptions;
 
@@ -51,13 +61,26 @@ export interface ClientOptions {
     trzszDragInitTimeout: number;
     unicodeVersion: string;
     closeOnDisconnect: boolean;
+    screenDiff: boolean;
+    enablePredictiveEcho: boolean;
+    predictiveEchoThreshold: number;
+    // output policy enforced by the server: read-ahead bound in bytes, max OUTPUT frames per second
+    bufferSize?: number;
+    frameRateLimit?: number;
+    // keep localScrollback lines in the terminal, older history is paged in from the server
+    remoteScrollback: boolean;
+    localScrollback: number;
     defaultShell?: string;
+    // output triggers of the session (case-insensitive text), matches arrive as 'cmdr-trigger' events
+    triggers?: string[];
 }
 
 export interface FlowControl {
     limit: number;
     highWater: number;
     lowWater: number;
+    // retune the values above from measured render throughput, they only seed the estimate
+    adaptive?: boolean;
 }
 
 export interface XtermOptions {
@@ -83,8 +106,6 @@ export class Xterm {
     private disposables: IDisposable[] = [];
     private textEncoder = new TextEncoder();
     private textDecoder = new TextDecoder();
-    private written = 0;
-    private pending = 0;
 
     private terminal: Terminal;
     private fitAddon = new FitAddon();
@@ -94,16 +115,21 @@ export class Xterm {
     private webglAddon?: WebglAddon;
     private canvasAddon?: CanvasAddon;
     private zmodemAddon?: ZmodemAddon;
+    private predictionAddon?: PredictionAddon;
+    private scrollbackAddon?: ScrollbackAddon;
 
-    private socket?: WebSocket;
+    private socket?: WorkerSocket;
     private token: string;
     private opened = false;
     private title?: string;
+    private titleReceived = false;
     private titleFixed?: string;
     private resizeOverlay = true;
     private reconnect = true;
     private doReconnect = true;
     private closeOnDisconnect = false;
+    private screenDiff = false;
+    private termMode = { echo: true, canonical: true };
 
     // Session management properties
     private currentSessionId?: string;
@@ -161,7 +187,10 @@ export class Xterm {
 
     @bind
     public open(parent: HTMLElement) {
-        this.terminal = new Terminal(this.options.termOptions);
+        const { remoteScrollback, localScrollback } = this.options.clientOptions;
+        const termOptions = { ...this.options.termOptions };
+        if (remoteScrollback) termOptions.scrollback = Math.min(termOptions.scrollback ?? 1000, localScrollback);
+        this.terminal = new Terminal(termOptions);
         const { terminal, fitAddon, overlayAddon, clipboardAddon, webLinksAddon } = this;
         window.term = terminal as CmdrTerminal;
         window.term.fit = () => {
@@ -175,19 +204,30 @@ export class Xterm {
 
         terminal.open(parent);
         fitAddon.fit();
+
+        if (remoteScrollback) {
+            this.scrollbackAddon = new ScrollbackAddon({ fetch: this.fetchScrollback });
+            terminal.loadAddon(this.scrollbackAddon);
+        }
+    }
+
+    @bind
+    private fetchScrollback(request: ScrollbackRequest) {
+        this.socket?.send(this.textEncoder.encode(Command.FETCH_SCROLLBACK + JSON.stringify(request)));
     }
 
     @bind
     private initListeners() {
         const { terminal, fitAddon, overlayAddon, register, sendData } = this;
         register(
-            terminal.onTitleChange(data => {
-                if (data && data !== '' && !this.titleFixed) {
-                    document.title = data + ' | ' + this.title;
-                }
+            terminal.onTitleChange(data => this.setProgramTitle(data))
+        );
+        register(
+            terminal.onData(data => {
+                this.predictionAddon?.predict(data);
+                sendData(data);
             })
         );
-        register(terminal.onData(data => sendData(data)));
         register(terminal.onBinary(data => sendData(Uint8Array.from(data, v => v.charCodeAt(0)))));
         register(
             terminal.onResize(({ cols, rows }) => {
@@ -211,27 +251,10 @@ export class Xterm {
         register(addEventListener(window, 'beforeunload', this.onWindowUnload));
     }
 
+    // flow control accounting lives in the socket worker, see onSocketOutput
     @bind
     public writeData(data: string | Uint8Array) {
-        const { terminal, textEncoder } = this;
-        const { limit, highWater, lowWater } = this.options.flowControl;
-
-        this.written += data.length;
-        if (this.written > limit) {
-            terminal.write(data, () => {
-                this.pending = Math.max(this.pending - 1, 0);
-                if (this.pending < lowWater) {
-                    this.socket?.send(textEncoder.encode(Command.RESUME));
-                }
-            });
-            this.pending++;
-            this.written = 0;
-            if (this.pending > highWater) {
-                this.socket?.send(textEncoder.encode(Command.PAUSE));
-            }
-        } else {
-            terminal.write(data);
-        }
+        this.terminal.write(data);
     }
 
     @bind
@@ -254,10 +277,10 @@ export class Xterm {
 
     @bind
     public connect() {
-        this.socket = new WebSocket(this.options.wsUrl, ['tty']);
+        this.socket = new WorkerSocket(this.options.wsUrl, ['tty'], this.options.flowControl);
         const { socket, register } = this;
 
-        socket.binaryType = 'arraybuffer';
+        socket.onOutput = this.onSocketOutput;
         register(addEventListener(socket, 'open', this.onSocketOpen));
         register(addEventListener(socket, 'message', this.onSocketData as EventListener));
         register(addEventListener(socket, 'close', this.onSocketClose as EventListener));
@@ -271,9 +294,11 @@ export class Xterm {
         const { textEncoder, terminal, overlayAddon } = this;
         const selectedShell = this.options.clientOptions.defaultShell || 'bash';
         
+        this.titleReceived = false;
+
         // Notify about WebSocket connection
         if (this.options.onWebSocketConnect && this.socket) {
-            this.options.onWebSocketConnect(this.socket);
+            this.options.onWebSocketConnect(this.socket as unknown as WebSocket);
         }
         
         // Shell paths mapping - ensure we use full paths 
@@ -288,18 +313,28 @@ export class Xterm {
         // Get the full path of the shell
         const shellPath = shellPaths[selectedShell] || selectedShell;
         
+        // The transport is negotiated in the handshake, before preferences arrive
+        const screenDiff = this.parseOptsFromUrlQuery(window.location.search).screenDiff;
+        this.screenDiff = screenDiff ?? this.options.clientOptions.screenDiff;
+
         const msg = JSON.stringify({ 
             AuthToken: this.token, 
             columns: terminal.cols, 
             rows: terminal.rows,
             sessionId: this.currentSessionId || 'default',
-            defaultShell: shellPath  // Use the full path
+            defaultShell: shellPath,  // Use the full path
+            transport: this.screenDiff ? 'screen' : 'stream',
+            bufferSize: this.options.clientOptions.bufferSize,
+            frameRateLimit: this.options.clientOptions.frameRateLimit,
+            // a reattach replays only what the local scrollback can hold
+            scrollback: this.scrollbackAddon ? terminal.options.scrollback + terminal.rows : 0,
+            triggers: this.options.clientOptions.triggers,
         });
         this.socket?.send(textEncoder.encode(msg));
         
         console.log(`[cmdr] Using shell: ${shellPath}`);
 
-        if (this.opened) {
+        if (this.opened || this.screenDiff) {
             terminal.reset();
             terminal.options.disableStdin = false;
             overlayAddon.showOverlay(this.currentSessionId ? `Session: ${this.currentSessionId}` : 'Reconnected', 300);
@@ -384,18 +419,55 @@ export class Xterm {
         return prefs;
     }
 
+    // OUTPUT frames, already coalesced per animation frame by the socket worker; still UTF-8,
+    // see flush() in socket.worker.ts
+    @bind
+    private onSocketOutput(data: ArrayBuffer, ack: boolean) {
+        this.predictionAddon?.consume();
+        this.writeFunc(data);
+        if (ack) {
+            // an empty write completes once everything queued before it has been parsed
+            this.terminal.write('', () => this.socket?.written());
+        }
+    }
+
     @bind
     private onSocketData(event: MessageEvent) {
+        // text frames are JSON for the update service
+        if (typeof event.data === 'string') return;
         const { textDecoder } = this;
         const rawData = event.data as ArrayBuffer;
         const cmd = String.fromCharCode(new Uint8Array(rawData)[0]);
         const data = rawData.slice(1);
 
         switch (cmd) {
-            case Command.OUTPUT:
-                this.writeFunc(data);
+            case Command.SCREEN_FRAME:
+                this.predictionAddon?.consume();
+                this.writeScreenFrame(new Uint8Array(data));
+                break;
+            case Command.SCROLLBACK:
+                this.scrollbackAddon?.onPage(new Uint8Array(data));
+                break;
+            case Command.TRIGGER_EVENT:
+                // { session_id, triggers, events: [{ seq, time, pattern, line }] }
+                window.dispatchEvent(
+                    new CustomEvent('cmdr-trigger', { detail: JSON.parse(textDecoder.decode(data)) })
+                );
+                break;
+            case Command.TERMINAL_MODE:
+                {
+                    const mode = new Uint8Array(data)[0] - 0x30;
+                    this.termMode = { echo: (mode & 1) !== 0, canonical: (mode & 2) !== 0 };
+                    this.predictionAddon?.setEchoHint(this.termMode.echo, this.termMode.canonical);
+                }
                 break;
             case Command.SET_WINDOW_TITLE:
+                // the first title of a connection names the server, later ones are set by the program
+                if (this.titleReceived) {
+                    this.setProgramTitle(textDecoder.decode(data));
+                    break;
+                }
+                this.titleReceived = true;
                 this.title = textDecoder.decode(data);
                 document.title = this.title;
                 break;
@@ -412,21 +484,57 @@ export class Xterm {
         }
     }
 
+    @bind
+    private setProgramTitle(data: string) {
+        if (data && data !== '' && !this.titleFixed) {
+            document.title = data + ' | ' + this.title;
+        }
+    }
+
+    // Each frame is "<state number>;" followed by the sequence that repaints the changed rows.
+    // Acknowledge once xterm.js has applied it, the server diffs the next frame against that state.
+    @bind
+    private writeScreenFrame(data: Uint8Array) {
+        const sep = data.indexOf(0x3b);
+        if (sep < 0) return;
+        const num = this.textDecoder.decode(data.subarray(0, sep));
+        this.terminal.write(data.subarray(sep + 1), () => {
+            this.socket?.send(this.textEncoder.encode(Command.ACK_STATE + num));
+        });
+    }
+
     @bind
     private applyPreferences(prefs: Preferences) {
         const { terminal, fitAddon, register } = this;
         if (prefs.enableZmodem || prefs.enableTrzsz) {
-            this.zmodemAddon = new ZmodemAddon({
-                zmodem: prefs.enableZmodem,
-                trzsz: prefs.enableTrzsz,
-                windows: prefs.isWindows,
-                trzszDragInitTimeout: prefs.trzszDragInitTimeout,
-                onSend: this.sendCb,
-                sender: this.sendData,
-                writer: this.writeData,
+            // output stays queued until the addon is loaded, a transfer may start right away
+            const queued: ArrayBuffer[] = [];
+            this.writeFunc = data => {
+                queued.push(data);
+            };
+            import(/* webpackChunkName: "zmodem" */ './addons/zmodem').then(({ ZmodemAddon }) => {
+                this.zmodemAddon = new ZmodemAddon({
+                    zmodem: prefs.enableZmodem,
+                    trzsz: prefs.enableTrzsz,
+                    windows: prefs.isWindows,
+                    trzszDragInitTimeout: prefs.trzszDragInitTimeout,
+                    onSend: this.sendCb,
+                    sender: this.sendData,
+                    writer: this.writeData,
+                });
+                this.writeFunc = data => this.zmodemAddon?.consume(data);
+                terminal.loadAddon(register(this.zmodemAddon));
+                for (const data of queued) this.zmodemAddon.consume(data);
+                queued.length = 0;
+            });
+        }
+
+        if (prefs.enablePredictiveEcho) {
+            this.predictionAddon = new PredictionAddon({
+                threshold: prefs.predictiveEchoThreshold ?? 30,
             });
-            this.writeFunc = data => this.zmodemAddon?.consume(data);
-            terminal.loadAddon(register(this.zmodemAddon));
+            terminal.loadAddon(register(this.predictionAddon));
+            this.predictionAddon.setEchoHint(this.termMode.echo, this.termMode.canonical);
         }
 
         for (const [key, value] of Object.entries(prefs)) {
@@ -464,10 +572,21 @@ export class Xterm {
                     break;
                 case 'enableSixel':
                     if (value) {
-                        terminal.loadAddon(register(new ImageAddon()));
-                        console.log('[cmdr] Sixel enabled');
+                        import(/* webpackChunkName: "image" */ '@xterm/addon-image').then(({ ImageAddon }) => {
+                            terminal.loadAddon(register(new ImageAddon()));
+                            console.log('[cmdr] Sixel enabled');
+                        });
                     }
                     break;
+                case 'enablePredictiveEcho':
+                    if (value) console.log('[cmdr] predictive echo enabled');
+                    break;
+                case 'predictiveEchoThreshold':
+                    console.log(`[cmdr] predictive echo threshold: ${value}ms`);
+                    break;
+                case 'screenDiff':
+                    if (value) console.log('[cmdr] screen-diff transport enabled');
+                    break;
                 case 'closeOnDisconnect':
                     if (value) {
                         console.log('[cmdr] close on disconnect enabled (Reconnect disabled)');
@@ -0,0 +1,85 @@
+import { socketWorker } from './socket.worker';
+import type { FlowControl } from '.';
+
+export type OutputHandler = (data: ArrayBuffer, ack: boolean) => void;
+
+// Main thread side of the socket worker. Looks enough like a WebSocket for the existing
+// consumers (update service, settings), while OUTPUT frames skip event dispatch entirely and
+// arrive batched through onOutput.
+export class WorkerSocket extends EventTarget {
+    private static workerUrl?: string;
+
+    public readyState: number = WebSocket.CONNECTING;
+    public binaryType: BinaryType = 'arraybuffer';
+    public onOutput?: OutputHandler;
+    private worker: Worker;
+
+    constructor(url: string, protocols: string[], flowControl: FlowControl) {
+        super();
+        if (!WorkerSocket.workerUrl) {
+            const source = `(${socketWorker.toString()})();`;
+            WorkerSocket.workerUrl = URL.createObjectURL(new Blob([source], { type: 'text/javascript' }));
+        }
+
+        // resolve relative endpoints here, the blob worker has no useful base url
+        const wsUrl = new URL(url, window.location.href).href;
+        this.worker = new Worker(WorkerSocket.workerUrl);
+        this.worker.onmessage = this.onWorkerMessage;
+        this.worker.postMessage({ type: 'connect', url: wsUrl, protocols, flowControl });
+    }
+
+    send(data: string | ArrayBuffer | ArrayBufferView) {
+        if (this.readyState !== WebSocket.OPEN) return;
+        if (typeof data === 'string') {
+            this.worker.postMessage({ type: 'send', data });
+            return;
+        }
+        const view =
+            data instanceof ArrayBuffer
+                ? new Uint8Array(data)
+                : new Uint8Array(data.buffer, data.byteOffset, data.byteLength);
+        // transfer a private copy, the caller may reuse its buffer
+        const buffer = view.slice().buffer;
+        this.worker.postMessage({ type: 'send', data: buffer }, [buffer]);
+    }
+
+    // tell the worker a batch flagged with `ack` has been rendered
+    written() {
+        this.worker.postMessage({ type: 'written' });
+    }
+
+    close(code?: number, reason?: string) {
+        if (this.readyState >= WebSocket.CLOSING) return;
+        this.readyState = WebSocket.CLOSING;
+        this.worker.postMessage({ type: 'close', code, reason });
+    }
+
+    private onWorkerMessage = (event: MessageEvent) => {
+        const msg = event.data;
+        switch (msg.type) {
+            case 'output':
+                this.onOutput?.(msg.data, msg.ack);
+                break;
+            case 'binary':
+            case 'text':
+                this.dispatchEvent(new MessageEvent('message', { data: msg.data }));
+                break;
+            case 'open':
+                this.readyState = WebSocket.OPEN;
+                this.dispatchEvent(new Event('open'));
+                break;
+            case 'error':
+                this.dispatchEvent(new Event('error'));
+                break;
+            case 'close':
+                this.readyState = WebSocket.CLOSED;
+                this.worker.terminate();
+                this.dispatchEvent(
+                    new CloseEvent('close', { code: msg.code, reason: msg.reason, wasClean: msg.wasClean })
+                );
+                break;
+            default:
+                break;
+        }
+    };
+}
@@ -0,0 +1,201 @@
+// Runs the terminal WebSocket off the main thread. This function is serialized into a blob
+// worker, so it must stay self-contained: no imports, no references to outer scope.
+export function socketWorker() {
+    const ctx = self as any;
+    const OUTPUT = '0'.charCodeAt(0);
+    const PAUSE = '2'.charCodeAt(0);
+    const RESUME = '3'.charCodeAt(0);
+    const FLOW_REPORT = '5'.charCodeAt(0);
+
+    // adaptive flow control: hold at most TARGET_LATENCY ms of output the terminal has not
+    // rendered yet, acknowledged in windows of about ACK_INTERVAL ms
+    const TARGET_LATENCY = 100;
+    const ACK_INTERVAL = 25;
+    const MIN_LIMIT = 16 * 1024;
+    const MAX_LIMIT = 1024 * 1024;
+    const MIN_BUDGET = 256 * 1024;
+    const MAX_BUDGET = 8 * 1024 * 1024;
+    const REPORT_INTERVAL = 1000;
+
+    let socket: WebSocket | undefined;
+    let flow = { limit: 100000, highWater: 10, lowWater: 4, adaptive: true };
+    let written = 0;
+    let pending = 0;
+    let paused = false;
+
+    // acknowledged windows not rendered yet, oldest first
+    let windows: { bytes: number; posted: number }[] = [];
+    let lastRendered = 0;
+    let rate = 0; // bytes rendered per second
+    let latency = 0; // ms from posting a window until the terminal finished writing it
+    let lastReport = 0;
+    let reported = { limit: 0, highWater: 0 };
+
+    // OUTPUT payloads received since the last flush
+    let chunks: Uint8Array[] = [];
+    let size = 0;
+    let scheduled = false;
+
+    const schedule: (cb: () => void) => void =
+        typeof ctx.requestAnimationFrame === 'function'
+            ? cb => ctx.requestAnimationFrame(cb)
+            : cb => setTimeout(cb, 16);
+
+    const sendCommand = (cmd: number) => {
+        if (socket?.readyState === WebSocket.OPEN) socket.send(new Uint8Array([cmd]));
+    };
+
+    // Hand everything received in this frame to the main thread as one transferable buffer.
+    // The bytes are not decoded here: with zmodem/trzsz the addon needs them byte-exact, and
+    // xterm decodes UTF-8 straight into its buffer, where a string would be copied to the main
+    // thread (strings are not transferable) and then converted from UTF-16 instead.
+    const flush = () => {
+        scheduled = false;
+        if (size === 0) return;
+
+        let data: Uint8Array;
+        if (chunks.length === 1) {
+            data = chunks[0];
+        } else {
+            data = new Uint8Array(size);
+            let offset = 0;
+            for (const chunk of chunks) {
+                data.set(chunk, offset);
+                offset += chunk.length;
+            }
+        }
+
+        // ask for a write acknowledgement every `limit` bytes, same accounting as the main thread did
+        written += size;
+        const ack = written > flow.limit;
+        if (ack) {
+            windows.push({ bytes: written, posted: performance.now() });
+            written = 0;
+            pending++;
+            if (pending > flow.highWater && !paused) {
+                paused = true;
+                sendCommand(PAUSE);
+            }
+        }
+
+        chunks = [];
+        size = 0;
+        const buffer =
+            data.byteOffset === 0 && data.byteLength === data.buffer.byteLength
+                ? data.buffer
+                : data.slice().buffer;
+        ctx.postMessage({ type: 'output', data: buffer, ack }, [buffer]);
+    };
+
+    const clamp = (value: number, min: number, max: number) => Math.min(Math.max(value, min), max);
+
+    const report = (now: number) => {
+        const changed = (a: number, b: number) => Math.abs(a - b) > b / 4;
+        if (now - lastReport < REPORT_INTERVAL) return;
+        if (!changed(flow.limit, reported.limit) && !changed(flow.highWater, reported.highWater)) return;
+        if (socket?.readyState !== WebSocket.OPEN) return;
+
+        lastReport = now;
+        reported = { limit: flow.limit, highWater: flow.highWater };
+        const json = JSON.stringify({
+            rate: Math.round(rate),
+            latency: Math.round(latency),
+            limit: flow.limit,
+            highWater: flow.highWater,
+            lowWater: flow.lowWater,
+        });
+        socket.send(String.fromCharCode(FLOW_REPORT) + json);
+    };
+
+    // A window's service time starts when it was posted or when the one before it finished
+    // rendering, whichever is later, so a backlog does not count against the render rate.
+    const tune = (rendered: { bytes: number; posted: number }, now: number) => {
+        const service = Math.max(now - Math.max(rendered.posted, lastRendered), 1);
+        const sample = (rendered.bytes * 1000) / service;
+        rate = rate === 0 ? sample : rate * 0.75 + sample * 0.25;
+        latency = latency === 0 ? now - rendered.posted : latency * 0.75 + (now - rendered.posted) * 0.25;
+        lastRendered = now;
+        if (!flow.adaptive) return;
+
+        const budget = clamp((rate * TARGET_LATENCY) / 1000, MIN_BUDGET, MAX_BUDGET);
+        const limit = Math.round(clamp((rate * ACK_INTERVAL) / 1000, MIN_LIMIT, MAX_LIMIT));
+        const highWater = clamp(Math.round(budget / limit), 2, 64);
+        flow = { limit, highWater, lowWater: Math.max(1, Math.floor(highWater / 2)), adaptive: true };
+        report(now);
+    };
+
+    const onMessage = (event: MessageEvent) => {
+        if (typeof event.data === 'string') {
+            flush();
+            ctx.postMessage({ type: 'text', data: event.data });
+            return;
+        }
+
+        const frame = new Uint8Array(event.data as ArrayBuffer);
+        if (frame.length > 0 && frame[0] === OUTPUT) {
+            chunks.push(frame.subarray(1));
+            size += frame.length - 1;
+            if (!scheduled) {
+                scheduled = true;
+                schedule(flush);
+            }
+            return;
+        }
+
+        // keep other commands ordered after the output that preceded them
+        flush();
+        const buffer = frame.buffer;
+        ctx.postMessage({ type: 'binary', data: buffer }, [buffer]);
+    };
+
+    const connect = (url: string, protocols: string[]) => {
+        written = 0;
+        pending = 0;
+        paused = false;
+        windows = [];
+        lastRendered = 0;
+        lastReport = 0;
+        reported = { limit: 0, highWater: 0 };
+        chunks = [];
+        size = 0;
+
+        socket = new WebSocket(url, protocols);
+        socket.binaryType = 'arraybuffer';
+        socket.onopen = () => ctx.postMessage({ type: 'open' });
+        socket.onmessage = onMessage;
+        socket.onerror = () => ctx.postMessage({ type: 'error' });
+        socket.onclose = (event: CloseEvent) => {
+            flush();
+            ctx.postMessage({ type: 'close', code: event.code, reason: event.reason, wasClean: event.wasClean });
+            socket = undefined;
+        };
+    };
+
+    ctx.onmessage = (event: MessageEvent) => {
+        const msg = event.data;
+        switch (msg.type) {
+            case 'connect':
+                if (msg.flowControl) flow = { ...flow, ...msg.flowControl };
+                connect(msg.url, msg.protocols);
+                break;
+            case 'send':
+                if (socket?.readyState === WebSocket.OPEN) socket.send(msg.data);
+                break;
+            case 'written': {
+                const rendered = windows.shift();
+                if (rendered) tune(rendered, performance.now());
+                pending = Math.max(pending - 1, 0);
+                if (pending < flow.lowWater && paused) {
+                    paused = false;
+                    sendCommand(RESUME);
+                }
+                break;
+            }
+            case 'close':
+                socket?.close(msg.code, msg.reason);
+                break;
+            default:
+                break;
+        }
+    };
+}
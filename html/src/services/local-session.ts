@@ -3,6 +3,7 @@ export interface LocalSession {
     name: string;
     command: string;
     working_dir: string;
+    title?: string;
     created_at: number;
     last_used: number;
     is_active: boolean;
@@ -13,6 +14,7 @@ export interface LocalTab {
     id: string;
     name: string;
     current_directory: string;
+    title?: string;
     last_access: string;
     is_active: boolean;
     created_at?: string;
@@ -35,6 +37,7 @@ class LocalSessionService {
             id: session.id,
             name: session.name,
             current_directory: session.working_dir,
+            title: session.title,
             last_access: new Date(session.last_used * 1000).toISOString(),
             is_active: session.is_active,
             created_at: new Date(session.created_at * 1000).toISOString(),
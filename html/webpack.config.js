@@ -62,12 +62,16 @@ module.exports = {
     ...(isProduction ? [
       new MiniCssExtractPlugin({
         filename: '[name].[contenthash].css',
+        chunkFilename: 'assets/[name].[contenthash:8].css',
       })
     ] : [])
   ],
 
   output: {
     filename: isProduction ? '[name].[contenthash].js' : '[name].js',
+    // lazy chunks are embedded next to index.html and fetched relative to it
+    chunkFilename: isProduction ? 'assets/[name].[contenthash:8].js' : 'assets/[name].js',
+    publicPath: '',
     path: path.resolve(__dirname, 'dist'),
     clean: true,
   },
@@ -78,6 +82,11 @@ module.exports = {
       new TerserPlugin(),
       new CssMinimizerPlugin(),
     ],
+    // Only initial chunks are inlined into index.html. Dynamic imports (zmodem/trzsz, the image
+    // addon, AI bar, settings and update UI) stay out of the critical path.
+    splitChunks: {
+      chunks: 'async',
+    },
   },
 
   devServer: {
@@ -0,0 +1,372 @@
+#!/usr/bin/env python3
+"""Soak test: cycle connect/spawn/output/disconnect/reattach and the HTTP API against a local
+cmdr for thousands of iterations, sample /api/metrics along the way and fail when RSS, heap,
+open fds, child processes or threads keep growing.
+
+    python3 scripts/soak.py --binary build/cmdr --cycles 5000
+
+Growth is the least squares slope over the samples taken after --warmup cycles, in units per
+1000 cycles, so steady-state noise and one-off caches do not count as leaks. Only the standard
+library is used; the WebSocket client below speaks just enough of RFC 6455 for cmdr.
+
+    python3 scripts/soak.py --binary build/cmdr --idle 1000
+
+measures the idle footprint instead: that many connections open their own session, see the
+prompt and stay quiet, and the heap growth per connection has to stay under --max-idle-bytes.
+Raise `ulimit -n` for 10k connections, each one takes a socket and a PTY on both sides.
+"""
+
+import argparse
+import base64
+import http.client
+import json
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+# client -> server
+INPUT, RESIZE, FETCH_SCROLLBACK = b'0', b'1', b'6'
+# server -> client
+OUTPUT, SCROLLBACK = ord('0'), ord('7')
+
+METRICS = ('rss_kb', 'heap_in_use', 'heap_total', 'fds', 'children', 'threads')
+
+
+class WebSocket:
+    def __init__(self, port, path='/ws', protocol='tty', timeout=5.0):
+        self.sock = socket.create_connection(('127.0.0.1', port), timeout=timeout)
+        key = base64.b64encode(os.urandom(16)).decode()
+        request = (
+            f'GET {path} HTTP/1.1\r\nHost: 127.0.0.1:{port}\r\nUpgrade: websocket\r\n'
+            f'Connection: Upgrade\r\nSec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n'
+            f'Sec-WebSocket-Protocol: {protocol}\r\n\r\n'
+        )
+        self.sock.sendall(request.encode())
+        self.buf = b''
+        while b'\r\n\r\n' not in self.buf:
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise ConnectionError('closed during handshake')
+            self.buf += chunk
+        head, self.buf = self.buf.split(b'\r\n\r\n', 1)
+        if not head.startswith(b'HTTP/1.1 101'):
+            raise ConnectionError(head.split(b'\r\n', 1)[0].decode(errors='replace'))
+
+    def send(self, payload, opcode=0x2):
+        mask = os.urandom(4)
+        n = len(payload)
+        if n < 126:
+            header = struct.pack('!BB', 0x80 | opcode, 0x80 | n)
+        elif n < 65536:
+            header = struct.pack('!BBH', 0x80 | opcode, 0x80 | 126, n)
+        else:
+            header = struct.pack('!BBQ', 0x80 | opcode, 0x80 | 127, n)
+        masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+        self.sock.sendall(header + mask + masked)
+
+    def _read(self, n):
+        while len(self.buf) < n:
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise ConnectionError('closed')
+            self.buf += chunk
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def recv(self):
+        """Next data message, None once the server closed."""
+        message = b''
+        while True:
+            b0, b1 = self._read(2)
+            n = b1 & 0x7F
+            if n == 126:
+                n = struct.unpack('!H', self._read(2))[0]
+            elif n == 127:
+                n = struct.unpack('!Q', self._read(8))[0]
+            payload = self._read(n)
+            opcode = b0 & 0x0F
+            if opcode == 0x8:
+                return None
+            if opcode == 0x9:
+                self.send(payload, 0xA)
+                continue
+            if opcode == 0xA:
+                continue
+            message += payload
+            if b0 & 0x80:
+                return message
+
+    def wait_for(self, predicate, timeout=5.0):
+        deadline = time.monotonic() + timeout
+        seen = b''
+        while time.monotonic() < deadline:
+            self.sock.settimeout(max(deadline - time.monotonic(), 0.01))
+            try:
+                msg = self.recv()
+            except socket.timeout:
+                break
+            if msg is None:
+                break
+            if msg and msg[0] == OUTPUT:
+                seen += msg[1:]
+            if predicate(msg, seen):
+                return True
+        return False
+
+    def close(self):
+        try:
+            self.send(struct.pack('!H', 1000), 0x8)
+        except OSError:
+            pass
+        self.sock.close()
+
+
+def http_get(port, path):
+    conn = http.client.HTTPConnection('127.0.0.1', port, timeout=5)
+    try:
+        conn.request('GET', path)
+        response = conn.getresponse()
+        return response.status, response.read()
+    finally:
+        conn.close()
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+def slope(points):
+    """Least squares slope of (x, y) points."""
+    n = len(points)
+    if n < 2:
+        return 0.0
+    mx = sum(x for x, _ in points) / n
+    my = sum(y for _, y in points) / n
+    var = sum((x - mx) ** 2 for x, _ in points)
+    return sum((x - mx) * (y - my) for x, y in points) / var if var else 0.0
+
+
+def terminal_cycle(port, cycle, session_id, stats):
+    ws = WebSocket(port)
+    try:
+        handshake = {
+            'columns': 80,
+            'rows': 24,
+            'sessionId': session_id,
+            'defaultShell': '/bin/sh',
+            'scrollback': 200,
+        }
+        ws.send(json.dumps(handshake).encode())
+
+        marker = f'soak-{cycle}-2'.encode()
+        ws.send(INPUT + f'echo soak-{cycle}-$((1+1))\r'.encode())
+        if not ws.wait_for(lambda msg, seen: marker in seen):
+            stats['timeouts'] += 1
+
+        if cycle % 3 == 0:
+            # a burst large enough to go through read-ahead and flow control
+            end = f'soak-{cycle}-done'.encode()
+            ws.send(INPUT + f'seq 1 5000; echo soak-{cycle}-done\r'.encode())
+            if not ws.wait_for(lambda msg, seen: seen.count(end) >= 2, timeout=10):
+                stats['timeouts'] += 1
+        if cycle % 5 == 0:
+            ws.send(RESIZE + json.dumps({'columns': 100 + cycle % 40, 'rows': 30}).encode())
+        if cycle % 7 == 0:
+            ws.send(FETCH_SCROLLBACK + json.dumps({'skip': 0, 'count': 50}).encode())
+            if not ws.wait_for(lambda msg, seen: bool(msg) and msg[0] == SCROLLBACK):
+                stats['timeouts'] += 1
+    finally:
+        ws.close()
+
+
+def api_cycle(port, stats):
+    for path in ('/token', '/api/sessions', '/api/sessions/test/health'):
+        status, _ = http_get(port, path)
+        if status != 200:
+            stats['api_errors'] += 1
+    status, body = http_get(port, '/api/sessions/create')
+    if status == 200:
+        session_id = json.loads(body).get('session_id')
+        if session_id:
+            http_get(port, f'/api/sessions/{session_id}/delete')
+    else:
+        stats['api_errors'] += 1
+
+
+def idle_footprint(port, args):
+    # one full cycle first, so one-off allocations are not charged to the idle connections
+    terminal_cycle(port, 0, 'idle-warmup', {'timeouts': 0})
+    time.sleep(0.5)
+    before = sample(port, 0)
+    sockets, missed = [], 0
+    try:
+        for i in range(args.idle):
+            ws = WebSocket(port)
+            sockets.append(ws)
+            handshake = {'columns': 80, 'rows': 24, 'sessionId': f'idle-{i}', 'defaultShell': '/bin/sh'}
+            ws.send(json.dumps(handshake).encode())
+            if not ws.wait_for(lambda msg, seen: len(seen) > 0):
+                missed += 1
+        # prompts written and the read buffers released
+        time.sleep(1)
+        after = sample(port, len(sockets))
+    finally:
+        for ws in sockets:
+            ws.close()
+
+    n = len(sockets)
+    result = {
+        'connections': n,
+        'no_prompt': missed,
+        'heap_per_connection': (after['heap_in_use'] - before['heap_in_use']) / n,
+        'rss_per_connection': (after['rss_kb'] - before['rss_kb']) * 1024 / n,
+        'fds_per_connection': (after['fds'] - before['fds']) / n,
+        'before': before,
+        'after': after,
+    }
+    if args.out:
+        with open(args.out, 'w') as f:
+            json.dump(result, f, indent=2)
+
+    print(
+        f'{n} idle connections: heap {result["heap_per_connection"]:.0f} B, '
+        f'rss {result["rss_per_connection"]:.0f} B, fds {result["fds_per_connection"]:.1f} per connection '
+        f'(limit {args.max_idle_bytes:.0f} B heap)'
+    )
+    if before['heap_in_use'] < 0:
+        print('heap usage is not available on this platform')
+        return 1
+    if missed:
+        print(f'{missed} connections never saw their prompt')
+    return 1 if missed or result['heap_per_connection'] > args.max_idle_bytes else 0
+
+
+def sample(port, cycle):
+    status, body = http_get(port, '/api/metrics')
+    if status != 200:
+        raise RuntimeError(f'/api/metrics returned {status}, is the binary current?')
+    metrics = json.loads(body)
+    metrics['cycle'] = cycle
+    metrics['time'] = time.time()
+    return metrics
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--binary', default='build/cmdr')
+    parser.add_argument('--port', type=int, default=0, help='0 picks a free port')
+    parser.add_argument('--cycles', type=int, default=2000)
+    parser.add_argument('--sessions', type=int, default=8, help='session ids cycled through, so most connects reattach')
+    parser.add_argument('--sample-every', type=int, default=50)
+    parser.add_argument('--warmup', type=int, default=200, help='cycles excluded from the growth fit')
+    parser.add_argument('--out', help='write all samples to this JSON file')
+    parser.add_argument('--max-rss-kb', type=float, default=2048, help='per 1000 cycles')
+    parser.add_argument('--max-heap', type=float, default=1 << 20, help='bytes per 1000 cycles')
+    parser.add_argument('--max-fds', type=float, default=1, help='per 1000 cycles')
+    parser.add_argument('--max-children', type=float, default=1, help='per 1000 cycles')
+    parser.add_argument('--max-threads', type=float, default=1, help='per 1000 cycles')
+    parser.add_argument('--idle', type=int, default=0, help='measure this many idle connections instead of cycling')
+    parser.add_argument('--max-idle-bytes', type=float, default=48 * 1024, help='heap per idle connection')
+    args = parser.parse_args()
+
+    port = args.port or free_port()
+    workdir = tempfile.mkdtemp(prefix='cmdr-soak-')
+    log = open(os.path.join(workdir, 'cmdr.log'), 'w')
+    server = subprocess.Popen(
+        [os.path.abspath(args.binary), '-W', '-p', str(port), '-d', '3', '/bin/sh'],
+        cwd=workdir,
+        stdout=log,
+        stderr=subprocess.STDOUT,
+    )
+    print(f'cmdr pid {server.pid} on port {port}, log in {log.name}')
+
+    samples = []
+    stats = {'timeouts': 0, 'api_errors': 0, 'connect_errors': 0}
+    try:
+        for _ in range(100):
+            try:
+                http_get(port, '/token')
+                break
+            except OSError:
+                time.sleep(0.1)
+
+        if args.idle:
+            return idle_footprint(port, args)
+
+        samples.append(sample(port, 0))
+        started = time.monotonic()
+        for cycle in range(1, args.cycles + 1):
+            if server.poll() is not None:
+                raise RuntimeError(f'cmdr exited with {server.returncode} at cycle {cycle}')
+            try:
+                terminal_cycle(port, cycle, f'soak-{cycle % args.sessions}', stats)
+            except (OSError, ConnectionError):
+                stats['connect_errors'] += 1
+            if cycle % 10 == 0:
+                api_cycle(port, stats)
+            if cycle % args.sample_every == 0:
+                s = sample(port, cycle)
+                samples.append(s)
+                rate = cycle / (time.monotonic() - started)
+                print(
+                    f'cycle {cycle:6d}  rss {s["rss_kb"]:7d} kB  heap {s["heap_in_use"] // 1024:7d} kB  '
+                    f'fds {s["fds"]:4d}  children {s["children"]:3d}  threads {s["threads"]:3d}  '
+                    f'({rate:.0f} cycles/s)',
+                    flush=True,
+                )
+
+        # let the last shells be reaped before the final sample
+        time.sleep(1)
+        samples.append(sample(port, args.cycles))
+    finally:
+        server.terminate()
+        try:
+            server.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            server.kill()
+        log.close()
+
+    if args.out:
+        with open(args.out, 'w') as f:
+            json.dump({'stats': stats, 'samples': samples}, f, indent=2)
+
+    limits = {
+        'rss_kb': args.max_rss_kb,
+        'heap_in_use': args.max_heap,
+        'heap_total': None,
+        'fds': args.max_fds,
+        'children': args.max_children,
+        'threads': args.max_threads,
+    }
+    steady = [s for s in samples if s['cycle'] >= args.warmup]
+    failed = False
+    print(f'\n{"metric":12s} {"start":>12s} {"end":>12s} {"per 1k cycles":>14s} {"limit":>12s}')
+    for name in METRICS:
+        points = [(s['cycle'] / 1000, s[name]) for s in steady if s[name] >= 0]
+        if not points:
+            print(f'{name:12s} {"n/a":>12s}')
+            continue
+        growth = slope(points)
+        limit = limits[name]
+        over = limit is not None and growth > limit
+        failed |= over
+        print(
+            f'{name:12s} {points[0][1]:12d} {points[-1][1]:12d} {growth:14.1f} '
+            f'{"-" if limit is None else f"{limit:.0f}":>12s}{"  FAIL" if over else ""}'
+        )
+    print(f'\n{stats}')
+
+    if len(steady) < 3:
+        print('not enough samples after warmup to judge growth')
+        return 1
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
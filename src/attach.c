@@ -0,0 +1,542 @@
+#include <errno.h>
+#include <getopt.h>
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#endif
+
+#include "attach.h"
+#include "server.h"
+#include "session_persistence.h"
+#include "utils.h"
+
+#ifndef _WIN32
+
+struct attach_client {
+  uv_pipe_t pipe;
+  struct pss_tty *pss;    // NULL until ATTACH_HELLO
+  attach_client_t *next;  // in pss->attached
+  char *buf;              // unparsed input, reads land here directly
+  size_t len;
+  size_t cap;
+  bool closing;
+};
+
+typedef struct {
+  uv_write_t req;
+  char data[];
+} frame_req_t;
+
+static uv_pipe_t *listener = NULL;
+static char *listen_path = NULL;
+
+static void put_be32(char *p, uint32_t v) {
+  p[0] = (char)(v >> 24);
+  p[1] = (char)(v >> 16);
+  p[2] = (char)(v >> 8);
+  p[3] = (char)v;
+}
+
+static uint32_t get_be32(const char *p) {
+  const unsigned char *u = (const unsigned char *)p;
+  return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+static uint16_t get_be16(const char *p) {
+  const unsigned char *u = (const unsigned char *)p;
+  return (uint16_t)(u[0] << 8 | u[1]);
+}
+
+void attach_default_path(char *path, size_t len) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir != NULL && *dir != '\0')
+    snprintf(path, len, "%s/cmdr.sock", dir);
+  else
+    snprintf(path, len, "/tmp/cmdr-%u.sock", (unsigned)getuid());
+}
+
+static void client_close_cb(uv_handle_t *handle) {
+  attach_client_t *c = (attach_client_t *)handle;
+  free(c->buf);
+  free(c);
+}
+
+static void unlink_client(attach_client_t *c) {
+  if (c->pss == NULL) return;
+  for (attach_client_t **p = &c->pss->attached; *p != NULL; p = &(*p)->next) {
+    if (*p == c) {
+      *p = c->next;
+      break;
+    }
+  }
+  c->pss = NULL;
+}
+
+static void client_close(attach_client_t *c) {
+  if (c->closing) return;
+  c->closing = true;
+  unlink_client(c);
+  uv_close((uv_handle_t *)&c->pipe, client_close_cb);
+}
+
+static void write_cb(uv_write_t *req, int status) { free(req); }
+
+static void send_frame(attach_client_t *c, char type, const char *data, size_t len) {
+  if (c->closing) return;
+  if (uv_stream_get_write_queue_size((uv_stream_t *)&c->pipe) > ATTACH_QUEUE_MAX) {
+    lwsl_warn("attach client is not reading, dropping it\n");
+    client_close(c);
+    return;
+  }
+
+  frame_req_t *req = xmalloc(sizeof(frame_req_t) + ATTACH_HEADER_LEN + len);
+  req->data[0] = type;
+  put_be32(req->data + 1, (uint32_t)len);
+  if (len > 0) memcpy(req->data + ATTACH_HEADER_LEN, data, len);
+  uv_buf_t b = uv_buf_init(req->data, (unsigned int)(ATTACH_HEADER_LEN + len));
+  if (uv_write(&req->req, (uv_stream_t *)&c->pipe, &b, 1, write_cb) != 0) {
+    free(req);
+    client_close(c);
+  }
+}
+
+static void shutdown_cb(uv_shutdown_t *req, int status) {
+  attach_client_t *c = (attach_client_t *)req->data;
+  free(req);
+  uv_close((uv_handle_t *)&c->pipe, client_close_cb);
+}
+
+// last frame, the connection closes once it is written
+static void client_finish(attach_client_t *c, char type, const char *data, size_t len) {
+  send_frame(c, type, data, len);
+  if (c->closing) return;
+  c->closing = true;
+  unlink_client(c);
+  uv_read_stop((uv_stream_t *)&c->pipe);
+  uv_shutdown_t *req = xmalloc(sizeof(uv_shutdown_t));
+  req->data = c;
+  if (uv_shutdown(req, (uv_stream_t *)&c->pipe, shutdown_cb) != 0) {
+    free(req);
+    uv_close((uv_handle_t *)&c->pipe, client_close_cb);
+  }
+}
+
+static void client_error(attach_client_t *c, const char *message) {
+  client_finish(c, ATTACH_ERROR, message, strlen(message));
+}
+
+// attach to the WebSocket connection that currently owns the session's process, the recent
+// scrollback goes first so the local terminal starts out with the same screen
+static void hello(attach_client_t *c, const char *data, size_t len) {
+  char id[128];
+  if (len == 0 || len >= sizeof(id)) {
+    client_error(c, "invalid session id");
+    return;
+  }
+  memcpy(id, data, len);
+  id[len] = '\0';
+
+  persistent_session_t *session = NULL;
+  if (server->persistent_registry != NULL && persistent_session_validate_id(id))
+    session = persistent_session_find_by_id(server->persistent_registry, id);
+  if (session == NULL) {
+    client_error(c, "no such session");
+    return;
+  }
+  struct pss_tty *pss = (struct pss_tty *)session->current_pss;
+  if (pss == NULL || pss->process == NULL || !process_running(pss->process)) {
+    client_error(c, "the session has no running process, open it in the browser first");
+    return;
+  }
+
+  if (session->buffer != NULL) {
+    uint64_t end = terminal_buffer_end_line(session->buffer);
+    uint64_t first = end > ATTACH_REPLAY_LINES ? end - ATTACH_REPLAY_LINES : 0;
+    size_t n = 0;
+    char *lines = terminal_buffer_read_lines(session->buffer, &first, &end, ATTACH_FRAME_MAX, true, &n);
+    if (lines != NULL) {
+      if (n > 0) send_frame(c, ATTACH_OUTPUT, lines, n);
+      free(lines);
+    }
+  }
+  if (c->closing) return;
+
+  c->pss = pss;
+  c->next = pss->attached;
+  pss->attached = c;
+  lwsl_notice("attached to session %s, pid: %d\n", id, pss->process->pid);
+}
+
+static void handle_frame(attach_client_t *c, char type, const char *data, size_t len) {
+  struct pss_tty *pss = c->pss;
+  if (type == ATTACH_HELLO) {
+    if (pss == NULL) hello(c, data, len);
+    return;
+  }
+  if (pss == NULL || pss->process == NULL) return;
+
+  switch (type) {
+    case ATTACH_INPUT: {
+      if (!server->writable || len == 0) break;
+      int err = pty_write(pss->process, pty_buf_init((char *)data, len));
+      if (err) lwsl_err("uv_write: %s (%s)\n", uv_err_name(err), uv_strerror(err));
+      break;
+    }
+    case ATTACH_RESIZE:
+      if (len < 4) break;
+      pss->process->columns = get_be16(data);
+      pss->process->rows = get_be16(data + 2);
+      pty_resize_coalesced(pss->process);
+      if (pss->screen != NULL) screen_transport_resize(pss->screen, pss->process->columns, pss->process->rows);
+      break;
+    default:
+      break;
+  }
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  attach_client_t *c = (attach_client_t *)handle;
+  if (c->cap - c->len < suggested_size) {
+    c->cap = c->len + suggested_size;
+    c->buf = xrealloc(c->buf, c->cap);
+  }
+  *buf = uv_buf_init(c->buf + c->len, (unsigned int)suggested_size);
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
+  attach_client_t *c = (attach_client_t *)stream;
+  if (n < 0) {
+    client_close(c);
+    return;
+  }
+  c->len += (size_t)n;
+
+  size_t off = 0;
+  while (!c->closing && c->len - off >= ATTACH_HEADER_LEN) {
+    uint32_t len = get_be32(c->buf + off + 1);
+    if (len > ATTACH_FRAME_MAX) {
+      client_error(c, "frame too large");
+      return;
+    }
+    if (c->len - off < ATTACH_HEADER_LEN + len) break;
+    handle_frame(c, c->buf[off], c->buf + off + ATTACH_HEADER_LEN, len);
+    off += ATTACH_HEADER_LEN + len;
+  }
+  if (c->closing) return;
+  memmove(c->buf, c->buf + off, c->len - off);
+  c->len -= off;
+}
+
+static void on_connection(uv_stream_t *stream, int status) {
+  if (status < 0) {
+    lwsl_err("attach socket: %s\n", uv_strerror(status));
+    return;
+  }
+  attach_client_t *c = xmalloc(sizeof(attach_client_t));
+  memset(c, 0, sizeof(attach_client_t));
+  uv_pipe_init(server->loop, &c->pipe, 0);
+  if (uv_accept(stream, (uv_stream_t *)&c->pipe) != 0) {
+    uv_close((uv_handle_t *)&c->pipe, client_close_cb);
+    return;
+  }
+  uv_read_start((uv_stream_t *)&c->pipe, alloc_cb, read_cb);
+}
+
+// a socket file nobody listens on is left over from a crash and can go
+static bool socket_in_use(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) != 0 || !S_ISSOCK(st.st_mode)) return false;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+  bool in_use = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  close(fd);
+  if (!in_use) unlink(path);
+  return in_use;
+}
+
+static void listener_close_cb(uv_handle_t *handle) { free(handle); }
+
+bool attach_listen(uv_loop_t *loop, const char *path) {
+  if (socket_in_use(path)) {
+    lwsl_err("attach socket %s is in use by another cmdr\n", path);
+    return false;
+  }
+  listener = xmalloc(sizeof(uv_pipe_t));
+  uv_pipe_init(loop, listener, 0);
+  int err = uv_pipe_bind(listener, path);
+  // same user only, attaching is as good as a shell
+  if (err == 0 && chmod(path, 0600) != 0) err = -errno;
+  if (err == 0) err = uv_listen((uv_stream_t *)listener, 16, on_connection);
+  if (err != 0) {
+    lwsl_err("attach socket %s: %s\n", path, uv_strerror(err));
+    uv_close((uv_handle_t *)listener, listener_close_cb);
+    listener = NULL;
+    return false;
+  }
+  listen_path = strdup(path);
+  lwsl_notice(" Attach socket: %s\n", path);
+  return true;
+}
+
+void attach_close() {
+  if (listener == NULL) return;
+  uv_close((uv_handle_t *)listener, listener_close_cb);
+  listener = NULL;
+  unlink(listen_path);
+  free(listen_path);
+  listen_path = NULL;
+}
+
+void attach_output(struct pss_tty *pss, const char *data, size_t len) {
+  attach_client_t *c = pss->attached;
+  while (c != NULL) {
+    attach_client_t *next = c->next;  // a client that fell behind unlinks itself
+    send_frame(c, ATTACH_OUTPUT, data, len);
+    c = next;
+  }
+}
+
+void attach_end(struct pss_tty *pss, int code) {
+  static const char closed[] = "the browser connection owning the process closed";
+  char exit_code[4];
+  put_be32(exit_code, (uint32_t)code);
+  while (pss->attached != NULL) {
+    if (code >= 0)
+      client_finish(pss->attached, ATTACH_EXIT, exit_code, sizeof(exit_code));
+    else
+      client_finish(pss->attached, ATTACH_ERROR, closed, sizeof(closed) - 1);
+  }
+}
+
+// client side, plain blocking I/O
+
+static volatile sig_atomic_t winch = 1;  // the size goes out once at start
+
+static void winch_handler(int sig) { winch = 1; }
+
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+// one write per frame, payloads are at most a stdin read
+static bool put_frame(int fd, char type, const char *data, size_t len) {
+  char frame[ATTACH_HEADER_LEN + 4096];
+  if (len > sizeof(frame) - ATTACH_HEADER_LEN) return false;
+  frame[0] = type;
+  put_be32(frame + 1, (uint32_t)len);
+  memcpy(frame + ATTACH_HEADER_LEN, data, len);
+  return write_all(fd, frame, ATTACH_HEADER_LEN + len);
+}
+
+static bool send_size(int fd) {
+  struct winsize ws;
+  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0 || ws.ws_row == 0) return true;
+  char size[4] = {(char)(ws.ws_col >> 8), (char)ws.ws_col, (char)(ws.ws_row >> 8), (char)ws.ws_row};
+  return put_frame(fd, ATTACH_RESIZE, size, sizeof(size));
+}
+
+static void attach_usage() {
+  fprintf(stderr,
+          "USAGE:\n"
+          "    cmdr attach [options] <session id>\n\n"
+          "Attach this terminal to a session open in the browser, press ^] to detach.\n"
+          "The server has to run with --attach-socket.\n\n"
+          "OPTIONS:\n"
+          "    -s, --socket            Attach socket path (default: $XDG_RUNTIME_DIR/cmdr.sock or /tmp/cmdr-<uid>.sock)\n"
+          "    -h, --help              Print this text and exit\n");
+}
+
+enum { ATTACHED, DETACHED, EXITED, FAILED };
+
+int attach_main(int argc, char **argv) {
+  static const struct option options[] = {
+      {"socket", required_argument, NULL, 's'}, {"help", no_argument, NULL, 'h'}, {NULL, 0, 0, 0}};
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  attach_default_path(addr.sun_path, sizeof(addr.sun_path));
+
+  int c;
+  while ((c = getopt_long(argc, argv, "s:h", options, NULL)) != -1) {
+    switch (c) {
+      case 's':
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", optarg);
+        break;
+      case 'h':
+        attach_usage();
+        return 0;
+      default:
+        attach_usage();
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    attach_usage();
+    return 1;
+  }
+  const char *session_id = argv[optind];
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "cmdr: cannot connect to %s: %s (is cmdr running with --attach-socket?)\n", addr.sun_path,
+            strerror(errno));
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  if (!put_frame(fd, ATTACH_HELLO, session_id, strlen(session_id))) {
+    fprintf(stderr, "cmdr: invalid session id: %s\n", session_id);
+    return 1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = winch_handler;  // no SA_RESTART, poll() has to wake up
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGWINCH, &sa, NULL);
+
+  struct termios saved;
+  bool raw = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+  if (raw) {
+    struct termios t = saved;
+    cfmakeraw(&t);
+    tcsetattr(STDIN_FILENO, TCSANOW, &t);
+  }
+
+  int state = ATTACHED, code = 0;
+  char message[256] = "connection closed by the server";
+  char in[4096];
+  size_t cap = 64 * 1024, len = 0;
+  char *buf = xmalloc(cap);
+  struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+
+  while (state == ATTACHED) {
+    if (winch) {
+      winch = 0;
+      if (!send_size(fd)) state = FAILED;
+    }
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      snprintf(message, sizeof(message), "poll: %s", strerror(errno));
+      state = FAILED;
+      break;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP)) {
+      ssize_t n = read(STDIN_FILENO, in, sizeof(in));
+      if (n <= 0) {
+        state = DETACHED;
+        break;
+      }
+      char *key = memchr(in, ATTACH_DETACH_KEY, (size_t)n);
+      size_t n_input = key != NULL ? (size_t)(key - in) : (size_t)n;
+      if (n_input > 0 && !put_frame(fd, ATTACH_INPUT, in, n_input)) state = FAILED;
+      if (key != NULL && state == ATTACHED) state = DETACHED;
+    }
+
+    if (state == ATTACHED && fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (cap - len < 64 * 1024) {
+        cap = len + 64 * 1024;
+        buf = xrealloc(buf, cap);
+      }
+      ssize_t n = read(fd, buf + len, cap - len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        state = FAILED;
+        break;
+      }
+      len += (size_t)n;
+
+      size_t off = 0;
+      while (state == ATTACHED && len - off >= ATTACH_HEADER_LEN) {
+        uint32_t n_frame = get_be32(buf + off + 1);
+        if (n_frame > ATTACH_FRAME_MAX) {
+          snprintf(message, sizeof(message), "invalid frame from the server");
+          state = FAILED;
+          break;
+        }
+        if (len - off < ATTACH_HEADER_LEN + n_frame) break;
+        const char *payload = buf + off + ATTACH_HEADER_LEN;
+        switch (buf[off]) {
+          case ATTACH_OUTPUT:
+            if (!write_all(STDOUT_FILENO, payload, n_frame)) state = DETACHED;
+            break;
+          case ATTACH_ERROR:
+            snprintf(message, sizeof(message), "%.*s", (int)n_frame, payload);
+            state = FAILED;
+            break;
+          case ATTACH_EXIT:
+            code = n_frame >= 4 ? (int)get_be32(payload) : 0;
+            state = EXITED;
+            break;
+          default:
+            break;
+        }
+        off += ATTACH_HEADER_LEN + n_frame;
+      }
+      memmove(buf, buf + off, len - off);
+      len -= off;
+    }
+  }
+
+  if (raw) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+  free(buf);
+  close(fd);
+
+  switch (state) {
+    case DETACHED:
+      fprintf(stderr, "\r\n[detached from %s]\n", session_id);
+      return 0;
+    case EXITED:
+      fprintf(stderr, "\r\n[process exited with code %d]\n", code);
+      return code;
+    default:
+      fprintf(stderr, "\r\ncmdr: %s\n", message);
+      return 1;
+  }
+}
+
+#else
+
+void attach_default_path(char *path, size_t len) { snprintf(path, len, "%s", ""); }
+
+bool attach_listen(uv_loop_t *loop, const char *path) {
+  lwsl_err("--attach-socket is not supported on Windows\n");
+  return false;
+}
+
+void attach_close() {}
+
+void attach_output(struct pss_tty *pss, const char *data, size_t len) {}
+
+void attach_end(struct pss_tty *pss, int code) {}
+
+int attach_main(int argc, char **argv) {
+  fprintf(stderr, "cmdr: attach is not supported on Windows\n");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef CMDR_ATTACH_H
+#define CMDR_ATTACH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <uv.h>
+
+// `cmdr attach` talks to the server over the --attach-socket UNIX socket, next to the session's
+// WebSocket client and straight to its PTY. Every frame is a type byte, the payload length as a
+// big-endian uint32, and the payload.
+#define ATTACH_HELLO 'A'   // client: session id, answered with the recent output or ATTACH_ERROR
+#define ATTACH_INPUT '0'   // client: bytes for the PTY
+#define ATTACH_RESIZE '1'  // client: columns and rows, big-endian uint16 each
+#define ATTACH_OUTPUT '0'  // server: PTY output
+#define ATTACH_ERROR 'E'   // server: message, the connection is closed after it
+#define ATTACH_EXIT 'X'    // server: exit code as big-endian int32, the process is gone
+
+#define ATTACH_HEADER_LEN 5
+#define ATTACH_FRAME_MAX (1024 * 1024)
+// output a client may leave unread before it is dropped
+#define ATTACH_QUEUE_MAX (4 * 1024 * 1024)
+// scrollback lines sent on attach
+#define ATTACH_REPLAY_LINES 1000
+// ^] detaches the local terminal
+#define ATTACH_DETACH_KEY 0x1d
+
+struct pss_tty;
+typedef struct attach_client attach_client_t;
+
+// $XDG_RUNTIME_DIR/cmdr.sock, /tmp/cmdr-<uid>.sock without it
+void attach_default_path(char *path, size_t len);
+
+bool attach_listen(uv_loop_t *loop, const char *path);
+void attach_close();
+
+// PTY output of a WebSocket connection, mirrored to the clients attached to it
+void attach_output(struct pss_tty *pss, const char *data, size_t len);
+// the process exited, or the WebSocket connection owning it closed (code < 0)
+void attach_end(struct pss_tty *pss, int code);
+
+// `cmdr attach [-s socket] <session id>`, argv[0] is "attach"
+int attach_main(int argc, char **argv);
+
+#endif  // CMDR_ATTACH_H
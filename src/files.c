@@ -0,0 +1,298 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "files.h"
+#include "server.h"
+#include "session_persistence.h"
+#include "utils.h"
+
+// The directory transfers are confined to, malloc'd; NULL for an unknown session. It is the same
+// for every session: a session's working directory follows the cwd its shell reports (OSC 7),
+// which any program in the PTY can set to "/".
+static char *session_root(const char *session_id) {
+  bool found = false;
+  if (server->persistent_registry != NULL && persistent_session_validate_id(session_id))
+    found = persistent_session_find_by_id(server->persistent_registry, session_id) != NULL;
+  if (!found && server->session_mgr != NULL) found = session_find_by_id(server->session_mgr, session_id) != NULL;
+  if (!found || server->files_root == NULL) return NULL;
+  return strdup(server->files_root);
+}
+
+static bool inside(const char *root, const char *path) {
+  size_t n = strlen(root);
+  if (n == 1) return true;  // root is "/"
+  return strncmp(path, root, n) == 0 && (path[n] == '\0' || path[n] == '/');
+}
+
+// realpath of root/rel, NULL with *status set when it is missing or resolves outside root
+static char *resolve(const char *root, const char *rel, int *status) {
+  char joined[PATH_MAX];
+  if (snprintf(joined, sizeof(joined), "%s/%s", root, rel) >= (int)sizeof(joined)) {
+    *status = HTTP_STATUS_BAD_REQUEST;
+    return NULL;
+  }
+  char *real = realpath(joined, NULL);
+  if (real == NULL) {
+    *status = errno == EACCES ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_NOT_FOUND;
+    return NULL;
+  }
+  if (!inside(root, real)) {
+    free(real);
+    *status = HTTP_STATUS_FORBIDDEN;
+    return NULL;
+  }
+  return real;
+}
+
+// where an upload of `path` ends up: the resolved parent directory plus the file name as given
+static char *upload_path(const char *session_id, const char *path, int *status) {
+  const char *slash = strrchr(path, '/');
+  const char *name = slash != NULL ? slash + 1 : path;
+  if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    *status = HTTP_STATUS_BAD_REQUEST;
+    return NULL;
+  }
+
+  char *root = session_root(session_id);
+  if (root == NULL) {
+    *status = HTTP_STATUS_NOT_FOUND;
+    return NULL;
+  }
+  char parent[PATH_MAX];
+  snprintf(parent, sizeof(parent), "%.*s", slash != NULL ? (int)(slash - path) : 0, path);
+  char *dir = resolve(root, parent, status);
+  free(root);
+  if (dir == NULL) return NULL;
+
+  size_t len = strlen(dir) + strlen(name) + 2;
+  char *dest = xmalloc(len);
+  snprintf(dest, len, "%s/%s", dir, name);
+  free(dir);
+  return dest;
+}
+
+static char *part_path(const char *dest) {
+  size_t len = strlen(dest) + sizeof(".part");
+  char *part = xmalloc(len);
+  snprintf(part, len, "%s.part", dest);
+  return part;
+}
+
+// single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range, anything else sends the whole file
+static bool parse_range(const char *range, uint64_t size, uint64_t *start, uint64_t *end) {
+  *start = 0;
+  *end = size;
+  if (range == NULL || strncmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL) return true;
+
+  const char *p = range + 6;
+  char *e;
+  if (*p == '-') {
+    uint64_t n = strtoull(p + 1, &e, 10);
+    if (e == p + 1 || n == 0) return false;
+    *start = n < size ? size - n : 0;
+    return true;
+  }
+
+  uint64_t first = strtoull(p, &e, 10);
+  if (e == p || *e != '-' || first >= size) return false;
+  p = e + 1;
+  if (*p != '\0') {
+    uint64_t last = strtoull(p, &e, 10);
+    if (e == p || last < first) return false;
+    if (last + 1 < size) *end = last + 1;
+  }
+  *start = first;
+  return true;
+}
+
+static file_transfer_t *transfer_new(int fd) {
+  file_transfer_t *t = xmalloc(sizeof(file_transfer_t));
+  memset(t, 0, sizeof(file_transfer_t));
+  t->fd = fd;
+  return t;
+}
+
+int files_open_download(const char *session_id, const char *path, const char *range, file_transfer_t **out) {
+  if (!server->writable) return HTTP_STATUS_FORBIDDEN;
+  char *root = session_root(session_id);
+  if (root == NULL) return HTTP_STATUS_NOT_FOUND;
+  int status = 0;
+  char *file = resolve(root, path, &status);
+  free(root);
+  if (file == NULL) return status;
+
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  free(file);
+  if (fd < 0) return errno == EACCES ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_NOT_FOUND;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return HTTP_STATUS_NOT_FOUND;
+  }
+  uint64_t start, end;
+  if (!parse_range(range, (uint64_t)st.st_size, &start, &end)) {
+    close(fd);
+    return HTTP_STATUS_REQ_RANGE_NOT_SATISFIABLE;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, (off_t)start, (off_t)(end - start), POSIX_FADV_SEQUENTIAL);
+#endif
+
+  file_transfer_t *t = transfer_new(fd);
+  t->offset = start;
+  t->end = end;
+  t->size = (uint64_t)st.st_size;
+  *out = t;
+  return 0;
+}
+
+int files_open_upload(const char *session_id, const char *path, uint64_t offset, file_transfer_t **out) {
+  if (!server->writable) return HTTP_STATUS_FORBIDDEN;
+  int status = 0;
+  char *dest = upload_path(session_id, path, &status);
+  if (dest == NULL) return status;
+
+  char *part = part_path(dest);
+  int fd = open(part, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0666);
+  free(part);
+  if (fd < 0) {
+    free(dest);
+    return errno == EACCES ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  }
+
+  // resuming past what was kept would leave a hole
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < offset) {
+    close(fd);
+    free(dest);
+    return HTTP_STATUS_REQ_RANGE_NOT_SATISFIABLE;
+  }
+  if (ftruncate(fd, (off_t)offset) != 0 || lseek(fd, (off_t)offset, SEEK_SET) < 0) {
+    close(fd);
+    free(dest);
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  }
+
+  file_transfer_t *t = transfer_new(fd);
+  t->offset = offset;
+  t->path = dest;
+  *out = t;
+  return 0;
+}
+
+int files_upload_offset(const char *session_id, const char *path, uint64_t *offset) {
+  if (!server->writable) return HTTP_STATUS_FORBIDDEN;
+  int status = 0;
+  char *dest = upload_path(session_id, path, &status);
+  if (dest == NULL) return status;
+
+  char *part = part_path(dest);
+  struct stat st;
+  *offset = lstat(part, &st) == 0 && S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0;
+  free(part);
+  free(dest);
+  return 0;
+}
+
+bool files_upload_write(file_transfer_t *t, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t n = write(t->fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      lwsl_err("upload %s: write failed: %d (%s)\n", t->path, errno, strerror(errno));
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+    t->offset += (uint64_t)n;
+  }
+  return true;
+}
+
+bool files_upload_finish(file_transfer_t *t) {
+  char *part = part_path(t->path);
+  bool ok = close(t->fd) == 0 && rename(part, t->path) == 0;
+  t->fd = -1;
+  if (ok)
+    lwsl_notice("upload %s: %llu bytes\n", t->path, (unsigned long long)t->offset);
+  else
+    lwsl_err("upload %s: %d (%s)\n", t->path, errno, strerror(errno));
+  free(part);
+  return ok;
+}
+
+#ifdef __linux__
+// kernel copies page cache to socket, nothing goes through lws or user space
+static int send_zero_copy(struct lws *wsi, file_transfer_t *t) {
+  // whatever lws still holds (the headers) has to reach the socket first
+  if (lws_has_buffered_out(wsi)) return 0;
+
+  int sock = lws_get_socket_fd(wsi);
+  size_t budget = FILES_WRITE_BUDGET;
+  while (t->offset < t->end && budget > 0) {
+    size_t n = t->end - t->offset < budget ? (size_t)(t->end - t->offset) : budget;
+    off_t off = (off_t)t->offset;
+    ssize_t sent = sendfile(sock, t->fd, &off, n);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EINTR) break;
+      lwsl_warn("sendfile failed: %d (%s)\n", errno, strerror(errno));
+      return -1;
+    }
+    if (sent == 0) return -1;  // file shrank under us
+    t->offset += (uint64_t)sent;
+    budget -= (size_t)sent;
+  }
+  return t->offset == t->end;
+}
+#endif
+
+static int send_buffered(struct lws *wsi, file_transfer_t *t) {
+  if (t->buffer == NULL) t->buffer = xmalloc(LWS_PRE + FILES_CHUNK);
+  size_t budget = FILES_WRITE_BUDGET;
+  do {
+    size_t n = FILES_CHUNK;
+    int m = lws_get_peer_write_allowance(wsi);
+    if (m == 0) return 0;
+    if (m > 0 && (size_t)m < n) n = (size_t)m;
+    if (t->end - t->offset < n) n = (size_t)(t->end - t->offset);
+
+    ssize_t r = pread(t->fd, t->buffer + LWS_PRE, n, (off_t)t->offset);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    if (lws_write_http(wsi, t->buffer + LWS_PRE, (size_t)r) < r) return -1;
+    t->offset += (uint64_t)r;
+    budget -= (size_t)r < budget ? (size_t)r : budget;
+  } while (t->offset < t->end && budget > 0 && !lws_send_pipe_choked(wsi));
+  return t->offset == t->end;
+}
+
+int files_send(struct lws *wsi, file_transfer_t *t) {
+  int n;
+#ifdef __linux__
+  n = lws_is_ssl(wsi) ? send_buffered(wsi, t) : send_zero_copy(wsi, t);
+#else
+  n = send_buffered(wsi, t);
+#endif
+  if (n == 0) lws_callback_on_writable(wsi);
+  return n;
+}
+
+void files_transfer_free(file_transfer_t *t) {
+  if (t->fd >= 0) close(t->fd);
+  free(t->path);
+  free(t->buffer);
+  free(t);
+}
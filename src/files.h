@@ -0,0 +1,48 @@
+#ifndef CMDR_FILES_H
+#define CMDR_FILES_H
+
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// File transfer next to the terminal stream, only with --writable and confined to --files-root
+// (default: --cwd, or the directory cmdr was started in):
+//
+//   GET  /api/files/<session>/<path>                 download, honours a single `Range: bytes=` range
+//   GET  /api/files/<session>/<path>?partial=1       {"offset":n}, bytes of an interrupted upload kept
+//   POST /api/files/<session>/<path>[?offset=n]      upload the body, resuming at n
+//
+// Uploads go to <path>.part and are renamed over <path> once the whole body arrived.
+#define FILES_PREFIX "/api/files/"
+
+// pread/lws_write_http chunk when sendfile can't be used (TLS, non Linux)
+#define FILES_CHUNK (256 * 1024)
+// bytes sent per writable callback, so one download can't stall the loop
+#define FILES_WRITE_BUDGET (8 * 1024 * 1024)
+
+typedef struct {
+  int fd;
+  uint64_t offset;  // next byte to send or write
+  uint64_t end;     // download: one past the last byte to send
+  uint64_t size;    // download: file size
+  char *path;       // upload: destination, written as path.part until complete
+  char *buffer;     // download: LWS_PRE + FILES_CHUNK, allocated on the first non-sendfile write
+} file_transfer_t;
+
+// Each returns 0 or the HTTP status to fail the request with. `path` is relative to the files root
+// and must resolve inside it.
+int files_open_download(const char *session_id, const char *path, const char *range, file_transfer_t **out);
+int files_open_upload(const char *session_id, const char *path, uint64_t offset, file_transfer_t **out);
+int files_upload_offset(const char *session_id, const char *path, uint64_t *offset);
+
+bool files_upload_write(file_transfer_t *t, const void *data, size_t len);
+bool files_upload_finish(file_transfer_t *t);
+
+// Sends download data until the socket is choked or the write budget is spent.
+// Returns 1 when the range is sent, 0 to continue on the next writable callback, -1 on error.
+int files_send(struct lws *wsi, file_transfer_t *t);
+
+// An unfinished upload keeps its .part file for a later resume.
+void files_transfer_free(file_transfer_t *t);
+
+#endif  // CMDR_FILES_H
@@ -23770,3 +23770,15 @@ unsigned char index_html[] = {
 };
 unsigned int index_html_len = 285208;
 unsigned int index_html_size = 1073750;
+
+struct html_asset {
+  const char *path;  // relative to the index path
+  const char *content_type;
+  const unsigned char *data;
+  unsigned int len;   // length of data
+  unsigned int size;  // uncompressed size
+  int gzip;           // data is gzip compressed
+};
+static const struct html_asset html_assets[] = {
+  {NULL, NULL, NULL, 0, 0, 0}
+};
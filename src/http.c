@@ -1,10 +1,18 @@
 #include <libwebsockets.h>
+#include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
 #include <json.h>
 
+#include "files.h"
 #include "html.h"
+#include "json_writer.h"
+#include "metrics.h"
+#include "probes.h"
+#include "profile.h"
 #include "server.h"
+#include "session_persistence.h"
+#include "trace.h"
 #include "utils.h"
 
 enum { AUTH_OK, AUTH_FAIL, AUTH_ERROR };
@@ -50,23 +58,27 @@ static bool accept_gzip(struct lws *wsi) {
   return len > 0 && strstr(buf, "gzip") != NULL;
 }
 
+static bool inflate_gzip(const unsigned char *in, size_t in_len, char *out, size_t out_len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 16 + 15) != Z_OK) return false;
+
+  stream.avail_in = in_len;
+  stream.avail_out = out_len;
+  stream.next_in = (void *)in;
+  stream.next_out = (void *)out;
+
+  int ret = inflate(&stream, Z_SYNC_FLUSH);
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END;
+}
+
 static bool uncompress_html(char **output, size_t *output_len) {
   if (html_cache == NULL || html_cache_len == 0) {
-    z_stream stream;
-    memset(&stream, 0, sizeof(stream));
-    if (inflateInit2(&stream, 16 + 15) != Z_OK) return false;
-
     html_cache_len = index_html_size;
     html_cache = xmalloc(html_cache_len);
 
-    stream.avail_in = index_html_len;
-    stream.avail_out = html_cache_len;
-    stream.next_in = (void *)index_html;
-    stream.next_out = (void *)html_cache;
-
-    int ret = inflate(&stream, Z_SYNC_FLUSH);
-    inflateEnd(&stream);
-    if (ret != Z_STREAM_END) {
+    if (!inflate_gzip(index_html, index_html_len, html_cache, html_cache_len)) {
       free(html_cache);
       html_cache = NULL;
       html_cache_len = 0;
@@ -80,8 +92,157 @@ static bool uncompress_html(char **output, size_t *output_len) {
   return true;
 }
 
+// lazily loaded frontend chunk embedded in html.h, requested as `<index>assets/<name>`
+static const struct html_asset *find_asset(const char *path) {
+  size_t prefix = strlen(endpoints.index);
+  if (strncmp(path, endpoints.index, prefix) != 0) return NULL;
+  for (const struct html_asset *asset = html_assets; asset->path != NULL; asset++) {
+    if (strcmp(path + prefix, asset->path) == 0) return asset;
+  }
+  return NULL;
+}
+
+// Asset names carry a content hash, so they can be cached forever. Sent as stored when the
+// client takes gzip, inflated into a private buffer otherwise.
+static int serve_asset(struct lws *wsi, struct pss_http *pss, const struct html_asset *asset, unsigned char **p,
+                       unsigned char *end) {
+  static const char cache_control[] = "public, max-age=31536000, immutable";
+  char *output = (char *)asset->data;
+  size_t output_len = asset->len;
+  bool compressed = asset->gzip != 0;
+
+#ifdef LWS_WITH_HTTP_STREAM_COMPRESSION
+  bool send_gzip = false;
+#else
+  bool send_gzip = accept_gzip(wsi);
+#endif
+  if (compressed && !send_gzip) {
+    output = xmalloc(asset->size);
+    output_len = asset->size;
+    if (!inflate_gzip(asset->data, asset->len, output, output_len)) {
+      free(output);
+      return 1;
+    }
+    compressed = false;
+  }
+
+  if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *)asset->content_type,
+                                   (int)strlen(asset->content_type), p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (const unsigned char *)cache_control,
+                                   (int)strlen(cache_control), p, end) ||
+      (compressed &&
+       lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, (unsigned char *)"gzip", 4, p, end)) ||
+      lws_add_http_header_content_length(wsi, (unsigned long)output_len, p, end) ||
+      lws_finalize_http_header(wsi, p, end)) {
+    if (output != (char *)asset->data) free(output);
+    return 1;
+  }
+
+  pss->buffer = pss->ptr = output;
+  pss->len = output_len;
+  pss->embedded = output == (char *)asset->data;
+  return 0;
+}
+
 static void pss_buffer_free(struct pss_http *pss) {
-  if (pss->buffer != (char *)index_html && pss->buffer != html_cache) free(pss->buffer);
+  if (pss->buffer != (char *)index_html && pss->buffer != html_cache && !pss->embedded) free(pss->buffer);
+  pss->embedded = false;
+}
+
+// 200 with a malloc'd JSON body, which the pss owns from here on
+static int respond_json(struct lws *wsi, struct pss_http *pss, char *json, size_t len) {
+  unsigned char buffer[LWS_PRE + 512], *p = buffer + LWS_PRE, *end = buffer + sizeof(buffer);
+  if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE,
+                                   (unsigned char *)"application/json;charset=utf-8", 30, &p, end) ||
+      lws_add_http_header_content_length(wsi, (unsigned long)len, &p, end) || lws_finalize_http_header(wsi, &p, end) ||
+      lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0) {
+    free(json);
+    return 1;
+  }
+
+  pss->buffer = pss->ptr = json;
+  pss->len = len;
+  lws_callback_on_writable(wsi);
+  return 0;
+}
+
+// FILES_PREFIX requests, see files.h. Returns 1 when the response is complete, 0 while the body
+// or the file is still to be transferred, -1 to drop the connection.
+static int files_request(struct lws *wsi, struct pss_http *pss) {
+  char session_id[64], arg[32];
+  const char *rest = pss->path + sizeof(FILES_PREFIX) - 1;
+  const char *slash = strchr(rest, '/');
+  if (slash == NULL || slash == rest || slash[1] == '\0' || (size_t)(slash - rest) >= sizeof(session_id)) {
+    lws_return_http_status(wsi, HTTP_STATUS_BAD_REQUEST, NULL);
+    return 1;
+  }
+  snprintf(session_id, sizeof(session_id), "%.*s", (int)(slash - rest), rest);
+  const char *path = slash + 1;
+  int status;
+
+  // the body arrives in LWS_CALLBACK_HTTP_BODY, answered on LWS_CALLBACK_HTTP_BODY_COMPLETION
+  if (lws_hdr_total_length(wsi, WSI_TOKEN_POST_URI) > 0) {
+    uint64_t offset = 0;
+    if (lws_get_urlarg_by_name(wsi, "offset=", arg, sizeof(arg)) != NULL) offset = strtoull(arg, NULL, 10);
+    status = files_open_upload(session_id, path, offset, &pss->transfer);
+    if (status != 0) {
+      lws_return_http_status(wsi, status, NULL);
+      return 1;
+    }
+    return 0;
+  }
+
+  if (lws_get_urlarg_by_name(wsi, "partial=", arg, sizeof(arg)) != NULL) {
+    uint64_t offset = 0;
+    status = files_upload_offset(session_id, path, &offset);
+    if (status != 0) {
+      lws_return_http_status(wsi, status, NULL);
+      return 1;
+    }
+    char *json = xmalloc(48);
+    int n = snprintf(json, 48, "{\"offset\":%llu}", (unsigned long long)offset);
+    return respond_json(wsi, pss, json, (size_t)n) ? -1 : 0;
+  }
+
+  char range[64] = "";
+  if (lws_hdr_copy(wsi, range, sizeof(range), WSI_TOKEN_HTTP_RANGE) < 0) range[0] = '\0';
+  status = files_open_download(session_id, path, range, &pss->transfer);
+  if (status != 0) {
+    lws_return_http_status(wsi, status, NULL);
+    return 1;
+  }
+
+  file_transfer_t *t = pss->transfer;
+  bool partial = t->offset > 0 || t->end < t->size;
+  char disposition[300], content_range[80];
+  const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+  int disposition_len = snprintf(disposition, sizeof(disposition), "attachment; filename=\"%.255s\"", name);
+  for (char *c = disposition + 22; c < disposition + disposition_len - 1; c++) {
+    if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) *c = '_';
+  }
+  int content_range_len = snprintf(content_range, sizeof(content_range), "bytes %llu-%llu/%llu",
+                                   (unsigned long long)t->offset, (unsigned long long)t->end - 1,
+                                   (unsigned long long)t->size);
+
+  unsigned char buffer[LWS_PRE + 1024], *p = buffer + LWS_PRE, *end = buffer + sizeof(buffer);
+  if (lws_add_http_header_status(wsi, partial ? HTTP_STATUS_PARTIAL_CONTENT : HTTP_STATUS_OK, &p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (unsigned char *)"application/octet-stream", 24,
+                                   &p, end) ||
+      lws_add_http_header_by_name(wsi, (unsigned char *)"accept-ranges:", (unsigned char *)"bytes", 5, &p, end) ||
+      lws_add_http_header_by_name(wsi, (unsigned char *)"content-disposition:", (unsigned char *)disposition,
+                                  disposition_len, &p, end) ||
+      (partial && lws_add_http_header_by_name(wsi, (unsigned char *)"content-range:", (unsigned char *)content_range,
+                                              content_range_len, &p, end)) ||
+      lws_add_http_header_content_length(wsi, (unsigned long)(t->end - t->offset), &p, end) ||
+      lws_finalize_http_header(wsi, &p, end) ||
+      lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+    return -1;
+
+  if (t->offset == t->end) return 1;
+  lws_callback_on_writable(wsi);
+  return 0;
 }
 
 static void access_log(struct lws *wsi, const char *path) {
@@ -91,7 +252,7 @@ static void access_log(struct lws *wsi, const char *path) {
   lwsl_notice("HTTP %s - %s\n", path, rip);
 }
 
-int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+static int http_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
   struct pss_http *pss = (struct pss_http *)user;
   unsigned char buffer[4096 + LWS_PRE], *p, *end;
   char buf[256];
@@ -100,7 +261,14 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
   switch (reason) {
     case LWS_CALLBACK_HTTP:
       access_log(wsi, (const char *)in);
+      // a truncated path names another resource, for an upload another file
+      if (strlen((const char *)in) >= sizeof(pss->path)) {
+        pss->path[0] = '\0';
+        lws_return_http_status(wsi, HTTP_STATUS_REQ_URI_TOO_LONG, NULL);
+        goto try_to_reuse;
+      }
       snprintf(pss->path, sizeof(pss->path), "%s", (const char *)in);
+      CMDR_PROBE2(http__request__start, wsi, pss->path);
       switch (check_auth(wsi, pss)) {
         case AUTH_OK:
           break;
@@ -131,6 +299,32 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         break;
       }
 
+      // --trace snapshot, Chrome/Perfetto trace JSON
+      if (strcmp(pss->path, "/api/trace") == 0) {
+        size_t n = 0;
+        char *json = trace_enabled ? trace_json(&n) : NULL;
+        if (json == NULL) {
+          lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
+          goto try_to_reuse;
+        }
+        if (respond_json(wsi, pss, json, n)) return 1;
+        break;
+      }
+
+      if (strncmp(pss->path, FILES_PREFIX, sizeof(FILES_PREFIX) - 1) == 0) {
+        int n = files_request(wsi, pss);
+        if (n < 0) return 1;
+        if (n > 0) goto try_to_reuse;
+        break;
+      }
+
+      // process resource usage, sampled by scripts/soak.py
+      if (strcmp(pss->path, "/api/metrics") == 0) {
+        char *json = metrics_json();
+        if (respond_json(wsi, pss, json, strlen(json))) return 1;
+        break;
+      }
+
       // Session management endpoints
       if (strncmp(pss->path, "/api/sessions", 13) == 0) {
         // For simplicity, we'll use URL-based routing instead of HTTP method detection
@@ -151,10 +345,17 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
                                                           server->command ?: "bash", 
                                                           server->cwd ?: getenv("HOME"));
           if (new_session) {
-            size_t len = 256;
-            response = malloc(len);
-            snprintf(response, len, "{\"status\":\"created\",\"session_id\":\"%s\",\"name\":\"%s\"}", 
-                    new_session->id, new_session->name);
+            json_writer_t w;
+            json_writer_init(&w, 0, 128);
+            json_writer_begin_object(&w);
+            json_writer_key(&w, "status");
+            json_writer_string(&w, "created");
+            json_writer_key(&w, "session_id");
+            json_writer_string(&w, new_session->id);
+            json_writer_key(&w, "name");
+            json_writer_string(&w, new_session->name);
+            json_writer_end_object(&w);
+            response = json_writer_finish(&w, NULL);
             session_manager_save(server->session_mgr);
           } else {
             response = strdup("{\"error\":\"Failed to create session\"}");
@@ -197,6 +398,52 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
               status = HTTP_STATUS_NOT_FOUND;
             }
             free(id_copy);
+          } else if (strstr(session_id, "/events") != NULL) {
+            // Output trigger matches of a persistent session, the last SESSION_EVENTS of them
+            char *id_copy = strdup(session_id);
+            char *events_pos = strstr(id_copy, "/events");
+            if (events_pos) *events_pos = '\0';
+
+            persistent_session_t *session = persistent_session_find_by_id(server->persistent_registry, id_copy);
+            if (session) {
+              response = persistent_session_get_events_json(session, 0, 0, NULL);
+            } else {
+              response = strdup("{\"error\":\"Session not found\"}");
+              status = HTTP_STATUS_NOT_FOUND;
+            }
+            free(id_copy);
+          } else if (strstr(session_id, "/commands/") != NULL) {
+            // Output of one indexed command, read from the session's ring buffer
+            // URL format: /api/sessions/{id}/commands/{seq}/output
+            char *id_copy = strdup(session_id);
+            char *commands_pos = strstr(id_copy, "/commands/");
+            *commands_pos = '\0';
+            char *seq_end = NULL;
+            unsigned long long seq = strtoull(commands_pos + 10, &seq_end, 10);
+
+            persistent_session_t *session = persistent_session_find_by_id(server->persistent_registry, id_copy);
+            if (session && strcmp(seq_end, "/output") == 0) {
+              response = persistent_session_get_command_output_json(session, seq);
+            }
+            if (response == NULL) {
+              response = strdup(session ? "{\"error\":\"Command not found\"}" : "{\"error\":\"Session not found\"}");
+              status = HTTP_STATUS_NOT_FOUND;
+            }
+            free(id_copy);
+          } else if (strstr(session_id, "/commands") != NULL) {
+            // Shell commands of a persistent session, from OSC 133 marks in its output
+            char *id_copy = strdup(session_id);
+            char *commands_pos = strstr(id_copy, "/commands");
+            if (commands_pos) *commands_pos = '\0';
+
+            persistent_session_t *session = persistent_session_find_by_id(server->persistent_registry, id_copy);
+            if (session) {
+              response = persistent_session_get_commands_json(session);
+            } else {
+              response = strdup("{\"error\":\"Session not found\"}");
+              status = HTTP_STATUS_NOT_FOUND;
+            }
+            free(id_copy);
           } else if (strstr(session_id, "/rename/") != NULL) {
             // Rename session - extract session ID and new name from URL
             // URL format: /api/sessions/{id}/rename/{new_name}
@@ -219,9 +466,15 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
               }
               
               if (session_rename(server->session_mgr, id_copy, decoded_name)) {
-                size_t resp_len = strlen(decoded_name) + 100;
-                response = malloc(resp_len);
-                snprintf(response, resp_len, "{\"status\":\"renamed\",\"new_name\":\"%s\"}", decoded_name);
+                json_writer_t w;
+                json_writer_init(&w, 0, strlen(decoded_name) + 64);
+                json_writer_begin_object(&w);
+                json_writer_key(&w, "status");
+                json_writer_string(&w, "renamed");
+                json_writer_key(&w, "new_name");
+                json_writer_string(&w, decoded_name);
+                json_writer_end_object(&w);
+                response = json_writer_finish(&w, NULL);
                 session_manager_save(server->session_mgr);
               } else {
                 response = strdup("{\"error\":\"Session not found\"}");
@@ -254,14 +507,27 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
             // Get specific session details
             struct session_data *session = session_find_by_id(server->session_mgr, session_id);
             if (session) {
-              size_t len = 512;
-              response = malloc(len);
-              snprintf(response, len, 
-                "{\"id\":\"%s\",\"name\":\"%s\",\"command\":\"%s\",\"cwd\":\"%s\",\"created\":%ld,\"lastUsed\":%ld,\"active\":%s,\"archived\":%s}",
-                session->id, session->name, session->command, session->working_dir,
-                session->created_at, session->last_used,
-                session->is_active ? "true" : "false",
-                session->is_archived ? "true" : "false");
+              json_writer_t w;
+              json_writer_init(&w, 0, 256);
+              json_writer_begin_object(&w);
+              json_writer_key(&w, "id");
+              json_writer_string(&w, session->id);
+              json_writer_key(&w, "name");
+              json_writer_string(&w, session->name);
+              json_writer_key(&w, "command");
+              json_writer_string(&w, session->command);
+              json_writer_key(&w, "cwd");
+              json_writer_string(&w, session->working_dir);
+              json_writer_key(&w, "created");
+              json_writer_int(&w, session->created_at);
+              json_writer_key(&w, "lastUsed");
+              json_writer_int(&w, session->last_used);
+              json_writer_key(&w, "active");
+              json_writer_bool(&w, session->is_active);
+              json_writer_key(&w, "archived");
+              json_writer_bool(&w, session->is_archived);
+              json_writer_end_object(&w);
+              response = json_writer_finish(&w, NULL);
               session_update_last_used(session);
               session_manager_save(server->session_mgr);
             } else {
@@ -301,6 +567,17 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         goto try_to_reuse;
       }
 
+      const struct html_asset *asset = find_asset(pss->path);
+      if (asset != NULL) {
+        if (serve_asset(wsi, pss, asset, &p, end)) return 1;
+        if (lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0) {
+          pss_buffer_free(pss);
+          return 1;
+        }
+        lws_callback_on_writable(wsi);
+        break;
+      }
+
       if (strcmp(pss->path, endpoints.index) != 0) {
         lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
         goto try_to_reuse;
@@ -340,6 +617,13 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       break;
 
     case LWS_CALLBACK_HTTP_WRITEABLE:
+      if (pss->transfer != NULL) {
+        int n = files_send(wsi, pss->transfer);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        goto try_to_reuse;
+      }
+
       if (!pss->buffer || pss->len == 0) {
         goto try_to_reuse;
       }
@@ -375,6 +659,34 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
     case LWS_CALLBACK_HTTP_FILE_COMPLETION:
       goto try_to_reuse;
+
+    case LWS_CALLBACK_HTTP_BODY:
+      // a failed write keeps the .part file, the client resumes from ?partial=1
+      if (pss->transfer != NULL && !files_upload_write(pss->transfer, in, len)) return -1;
+      break;
+
+    case LWS_CALLBACK_HTTP_BODY_COMPLETION:
+      if (pss->transfer != NULL) {
+        uint64_t size = pss->transfer->offset;
+        bool ok = files_upload_finish(pss->transfer);
+        files_transfer_free(pss->transfer);
+        pss->transfer = NULL;
+        if (!ok) {
+          lws_return_http_status(wsi, HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+          goto try_to_reuse;
+        }
+        char *json = xmalloc(48);
+        int n = snprintf(json, 48, "{\"size\":%llu}", (unsigned long long)size);
+        if (respond_json(wsi, pss, json, (size_t)n)) return 1;
+      }
+      break;
+
+    case LWS_CALLBACK_CLOSED_HTTP:
+      if (pss != NULL && pss->transfer != NULL) {
+        files_transfer_free(pss->transfer);
+        pss->transfer = NULL;
+      }
+      break;
 #if (defined(LWS_OPENSSL_SUPPORT) || defined(LWS_WITH_TLS)) && !defined(LWS_WITH_MBEDTLS)
     case LWS_CALLBACK_OPENSSL_PERFORM_CLIENT_CERT_VERIFICATION:
       if (!len || (SSL_get_verify_result((SSL *)in) != X509_V_OK)) {
@@ -394,7 +706,23 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
   /* if we're on HTTP1.1 or 2.0, will keep the idle connection alive */
 try_to_reuse:
+  if (pss->transfer != NULL) {
+    files_transfer_free(pss->transfer);
+    pss->transfer = NULL;
+  }
+  CMDR_PROBE2(http__request__done, wsi, pss->path);
   if (lws_http_transaction_completed(wsi)) return -1;
 
   return 0;
 }
+
+int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  PROFILE_ENTER(PROF_HTTP);
+  uint64_t trace_ts = TRACE_ON ? trace_now() : 0;
+  int ret = http_callback(wsi, reason, user, in, len);
+  if (TRACE_ON && reason == LWS_CALLBACK_HTTP) trace_span("http_request", "http", trace_ts, 0, TRACE_FLOW_NONE, 0);
+  if (TRACE_ON && reason == LWS_CALLBACK_HTTP_WRITEABLE)
+    trace_span("http_write", "http", trace_ts, 0, TRACE_FLOW_NONE, 0);
+  PROFILE_LEAVE(PROF_HTTP);
+  return ret;
+}
@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "inband.h"
+
+struct signature {
+  inband_kind_t kind;
+  const char *s;
+  size_t len;
+};
+
+// "**" ZDLE 'B' '0', a zmodem hex header without its frame type digit
+#define ZHEX "**\x18" "B0"
+
+// ZRQINIT (sz) and ZRINIT (rz) headers, the line trz/tsz print to wake the client up
+static const struct signature starts[] = {
+    {INBAND_ZMODEM, ZHEX "0", 6},
+    {INBAND_ZMODEM, ZHEX "1", 6},
+    {INBAND_TRZSZ, "::TRZSZ:TRANSFER:", 17},
+};
+
+// ZFIN and the CAN run of an abort (ZDLE never repeats in valid data), trzsz's closing EXIT or
+// FAIL message
+static const struct signature ends[] = {
+    {INBAND_ZMODEM, ZHEX "8", 6},
+    {INBAND_ZMODEM, "\x18\x18\x18\x18\x18", 5},
+    {INBAND_TRZSZ, "#EXIT:", 6},
+    {INBAND_TRZSZ, "#FAIL:", 6},
+    {INBAND_TRZSZ, "#fail:", 6},
+};
+
+// Position of sig at or after `from`, relative to data: matches that begin in the tail of the
+// previous read are negative.
+static bool find(const inband_detector_t *d, const char *data, size_t len, const struct signature *sig, long from,
+                 long *at) {
+  if (from < 0) {
+    char window[2 * INBAND_SIG_MAX];
+    size_t head = len < INBAND_SIG_MAX ? len : INBAND_SIG_MAX;
+    memcpy(window, d->tail, d->tail_len);
+    memcpy(window + d->tail_len, data, head);
+    size_t window_len = d->tail_len + head;
+    for (size_t i = (size_t)(from + (long)d->tail_len); i < d->tail_len && i + sig->len <= window_len; i++) {
+      if (memcmp(window + i, sig->s, sig->len) == 0) {
+        *at = (long)i - (long)d->tail_len;
+        return true;
+      }
+    }
+  }
+
+  size_t start = from > 0 ? (size_t)from : 0;
+  if (start >= len) return false;
+  const char *p = memmem(data + start, len - start, sig->s, sig->len);
+  if (p == NULL) return false;
+  *at = p - data;
+  return true;
+}
+
+static void keep_tail(inband_detector_t *d, const char *data, size_t len) {
+  size_t max = sizeof(d->tail);
+  if (len >= max) {
+    memcpy(d->tail, data + len - max, max);
+    d->tail_len = max;
+    return;
+  }
+  size_t keep = d->tail_len + len > max ? max - len : d->tail_len;
+  memmove(d->tail, d->tail + d->tail_len - keep, keep);
+  memcpy(d->tail + keep, data, len);
+  d->tail_len = keep + len;
+}
+
+// End of what still belongs to a transfer after its end signature at `end`: the rest of a ZFIN
+// header (its hex digits, CR, LF with or without the high bit, XON) and the "OO" sz sends last,
+// the backspaces after an abort's CANs, the rest of trzsz's message line
+static size_t trailer(inband_kind_t kind, const char *data, size_t end, size_t len) {
+  if (kind == INBAND_TRZSZ) {
+    const char *eol = memchr(data + end, '\n', len - end);
+    return eol != NULL ? (size_t)(eol - data) + 1 : len;
+  }
+  for (int n = 0; n < 12 && end < len && data[end] != '\0' && strchr("0123456789abcdef", data[end]) != NULL; n++)
+    end++;
+  while (end < len && (data[end] == '\r' || data[end] == '\n' || data[end] == '\x8a' || data[end] == 0x11 ||
+                       data[end] == 0x18 || data[end] == '\b'))
+    end++;
+  for (int n = 0; n < 2 && end < len && data[end] == 'O'; n++) end++;
+  return end;
+}
+
+size_t inband_scan(inband_detector_t *d, const char *data, size_t len, uint64_t now_ms) {
+  long from = -(long)d->tail_len, at;
+  if (d->kind != INBAND_NONE && now_ms - d->last_ms > INBAND_IDLE_MS) d->kind = INBAND_NONE;
+
+  if (d->kind == INBAND_NONE) {
+    for (size_t i = 0; i < sizeof(starts) / sizeof(starts[0]); i++) {
+      if (find(d, data, len, &starts[i], from, &at)) {
+        d->kind = starts[i].kind;
+        from = at + (long)starts[i].len;
+        break;
+      }
+    }
+    if (d->kind == INBAND_NONE) {
+      keep_tail(d, data, len);
+      return 0;
+    }
+  }
+
+  d->last_ms = now_ms;
+  for (size_t i = 0; i < sizeof(ends) / sizeof(ends[0]); i++) {
+    if (ends[i].kind == d->kind && find(d, data, len, &ends[i], from, &at)) {
+      d->kind = INBAND_NONE;
+      d->tail_len = 0;
+      return trailer(ends[i].kind, data, at + (long)ends[i].len > 0 ? (size_t)(at + (long)ends[i].len) : 0, len);
+    }
+  }
+  keep_tail(d, data, len);
+  return len;
+}
+
+const char *inband_name(inband_kind_t kind) {
+  switch (kind) {
+    case INBAND_ZMODEM:
+      return "zmodem";
+    case INBAND_TRZSZ:
+      return "trzsz";
+    default:
+      return "none";
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef CMDR_INBAND_H
+#define CMDR_INBAND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// longest start/end signature, see inband.c
+#define INBAND_SIG_MAX 18
+// a transfer that stops producing output for this long is assumed dead
+#define INBAND_IDLE_MS 3000
+
+// zmodem/trzsz transfers running through the PTY
+typedef enum { INBAND_NONE, INBAND_ZMODEM, INBAND_TRZSZ } inband_kind_t;
+
+// streaming detector, signatures split across PTY reads are still found
+typedef struct {
+  inband_kind_t kind;
+  uint64_t last_ms;  // time of the last read while a transfer runs
+  size_t tail_len;
+  char tail[INBAND_SIG_MAX - 1];
+} inband_detector_t;
+
+// Feeds one PTY read. Returns how many of its leading bytes are transfer data: all of them when it
+// starts or continues a transfer, up to the end signature when it ends one (d->kind is INBAND_NONE
+// again afterwards, what follows is terminal output such as the prompt), 0 outside a transfer.
+size_t inband_scan(inband_detector_t *d, const char *data, size_t len, uint64_t now_ms);
+
+const char *inband_name(inband_kind_t kind);
+
+#endif  // CMDR_INBAND_H
@@ -0,0 +1,168 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_writer.h"
+#include "utils.h"
+
+void json_writer_init(json_writer_t *w, size_t pre, size_t hint) {
+  w->pre = pre;
+  w->len = 0;
+  w->cap = hint > 64 ? hint : 64;
+  w->comma = false;
+  w->buf = xmalloc(pre + w->cap);
+}
+
+void json_writer_free(json_writer_t *w) {
+  free(w->buf);
+  w->buf = NULL;
+}
+
+char *json_writer_finish(json_writer_t *w, size_t *len) {
+  w->buf[w->pre + w->len] = '\0';
+  if (len != NULL) *len = w->len;
+  char *buf = w->buf;
+  w->buf = NULL;
+  return buf;
+}
+
+// room for n more bytes and the NUL, doubling keeps a long list linear overall
+static char *reserve(json_writer_t *w, size_t n) {
+  if (w->len + n + 1 > w->cap) {
+    size_t cap = w->cap * 2;
+    if (cap < w->len + n + 1) cap = w->len + n + 1;
+    w->buf = xrealloc(w->buf, w->pre + cap);
+    w->cap = cap;
+  }
+  return w->buf + w->pre + w->len;
+}
+
+static void put(json_writer_t *w, const char *s, size_t n) {
+  memcpy(reserve(w, n), s, n);
+  w->len += n;
+}
+
+static void put_char(json_writer_t *w, char c) {
+  *reserve(w, 1) = c;
+  w->len++;
+}
+
+// separator before a value, a key or an opening bracket
+static void value(json_writer_t *w) {
+  if (w->comma) put_char(w, ',');
+  w->comma = true;
+}
+
+void json_writer_begin_object(json_writer_t *w) {
+  value(w);
+  put_char(w, '{');
+  w->comma = false;
+}
+
+void json_writer_end_object(json_writer_t *w) {
+  put_char(w, '}');
+  w->comma = true;
+}
+
+void json_writer_begin_array(json_writer_t *w) {
+  value(w);
+  put_char(w, '[');
+  w->comma = false;
+}
+
+void json_writer_end_array(json_writer_t *w) {
+  put_char(w, ']');
+  w->comma = true;
+}
+
+void json_writer_key(json_writer_t *w, const char *key) {
+  json_writer_string(w, key);
+  put_char(w, ':');
+  w->comma = false;
+}
+
+void json_writer_string(json_writer_t *w, const char *s) {
+  if (s == NULL)
+    json_writer_null(w);
+  else
+    json_writer_string_len(w, s, strlen(s));
+}
+
+// Quotes, backslashes and control characters are escaped, everything else (UTF-8 included) is
+// copied as is.
+void json_writer_string_len(json_writer_t *w, const char *s, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  value(w);
+  // worst case, every byte becomes \u00XX
+  char *p = reserve(w, 6 * len + 2), *start = p;
+  *p++ = '"';
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      *p++ = (char)c;
+      continue;
+    }
+    *p++ = '\\';
+    switch (c) {
+      case '"':
+      case '\\':
+        *p++ = (char)c;
+        break;
+      case '\n':
+        *p++ = 'n';
+        break;
+      case '\r':
+        *p++ = 'r';
+        break;
+      case '\t':
+        *p++ = 't';
+        break;
+      case '\b':
+        *p++ = 'b';
+        break;
+      case '\f':
+        *p++ = 'f';
+        break;
+      default:
+        *p++ = 'u';
+        *p++ = '0';
+        *p++ = '0';
+        *p++ = hex[c >> 4];
+        *p++ = hex[c & 0xf];
+        break;
+    }
+  }
+  *p++ = '"';
+  w->len += (size_t)(p - start);
+}
+
+void json_writer_int(json_writer_t *w, int64_t v) {
+  char num[24];
+  value(w);
+  put(w, num, (size_t)snprintf(num, sizeof(num), "%" PRId64, v));
+}
+
+void json_writer_uint(json_writer_t *w, uint64_t v) {
+  char num[24];
+  value(w);
+  put(w, num, (size_t)snprintf(num, sizeof(num), "%" PRIu64, v));
+}
+
+void json_writer_bool(json_writer_t *w, bool v) {
+  value(w);
+  if (v)
+    put(w, "true", 4);
+  else
+    put(w, "false", 5);
+}
+
+void json_writer_null(json_writer_t *w) {
+  value(w);
+  put(w, "null", 4);
+}
+
+void json_writer_raw(json_writer_t *w, const char *json, size_t len) {
+  value(w);
+  put(w, json, len);
+}
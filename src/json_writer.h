@@ -0,0 +1,40 @@
+#ifndef CMDR_JSON_WRITER_H
+#define CMDR_JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming JSON output into one growable buffer, for replies that would otherwise be built as a
+// json-c tree only to be stringified. Commas are inserted automatically; nesting is not checked.
+typedef struct {
+  char *buf;
+  size_t pre;   // headroom before the JSON, LWS_PRE to lws_write the result in place
+  size_t len;   // JSON bytes after the headroom
+  size_t cap;   // allocated bytes after the headroom, one is kept for the terminating NUL
+  bool comma;   // a value precedes the next key or array element
+} json_writer_t;
+
+// hint: expected JSON length, the buffer only grows if it was too small
+void json_writer_init(json_writer_t *w, size_t pre, size_t hint);
+void json_writer_free(json_writer_t *w);
+// Hands over the buffer: the NUL-terminated JSON starts at pre. *len may be NULL.
+char *json_writer_finish(json_writer_t *w, size_t *len);
+
+void json_writer_begin_object(json_writer_t *w);
+void json_writer_end_object(json_writer_t *w);
+void json_writer_begin_array(json_writer_t *w);
+void json_writer_end_array(json_writer_t *w);
+void json_writer_key(json_writer_t *w, const char *key);
+
+// NULL is written as null
+void json_writer_string(json_writer_t *w, const char *s);
+void json_writer_string_len(json_writer_t *w, const char *s, size_t len);
+void json_writer_int(json_writer_t *w, int64_t v);
+void json_writer_uint(json_writer_t *w, uint64_t v);
+void json_writer_bool(json_writer_t *w, bool v);
+void json_writer_null(json_writer_t *w);
+// an already serialized value
+void json_writer_raw(json_writer_t *w, const char *json, size_t len);
+
+#endif  // CMDR_JSON_WRITER_H
@@ -0,0 +1,134 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "json_writer.h"
+#include "metrics.h"
+#include "pool.h"
+#include "server.h"
+#include "session_persistence.h"
+
+#ifdef __linux__
+// "Name:   value kB" lines of /proc/self/status
+static void read_status(metrics_t *m) {
+  FILE *fp = fopen("/proc/self/status", "r");
+  if (fp == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "VmRSS:", 6) == 0)
+      m->rss_kb = strtoll(line + 6, NULL, 10);
+    else if (strncmp(line, "Threads:", 8) == 0)
+      m->threads = strtoll(line + 8, NULL, 10);
+  }
+  fclose(fp);
+}
+
+static int64_t count_fds() {
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == NULL) return -1;
+  int64_t n = 0;
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    if (e->d_name[0] != '.') n++;
+  }
+  closedir(dir);
+  return n - 1;  // the fd of the directory being read
+}
+
+// processes whose parent is us, zombies included
+static int64_t count_children() {
+  DIR *dir = opendir("/proc");
+  if (dir == NULL) return -1;
+  pid_t self = getpid();
+  int64_t n = 0;
+  struct dirent *e;
+  char path[300], stat[512];
+  while ((e = readdir(dir)) != NULL) {
+    if (!isdigit((unsigned char)e->d_name[0])) continue;
+    snprintf(path, sizeof(path), "/proc/%s/stat", e->d_name);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) continue;
+    size_t len = fread(stat, 1, sizeof(stat) - 1, fp);
+    fclose(fp);
+    stat[len] = '\0';
+    // "pid (comm) state ppid ...", comm may contain spaces and parentheses
+    char *p = strrchr(stat, ')');
+    int ppid;
+    char state;
+    if (p != NULL && sscanf(p + 1, " %c %d", &state, &ppid) == 2 && ppid == self) n++;
+  }
+  closedir(dir);
+  return n;
+}
+#endif
+
+void metrics_sample(metrics_t *m) {
+  m->rss_kb = m->heap_in_use = m->heap_total = m->fds = m->children = m->threads = -1;
+#ifdef __linux__
+  read_status(m);
+  m->fds = count_fds();
+  m->children = count_children();
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+  m->heap_in_use = (int64_t)(mi.uordblks + mi.hblkhd);
+  m->heap_total = (int64_t)(mi.arena + mi.hblkhd);
+#endif
+}
+
+char *metrics_json() {
+  metrics_t m;
+  metrics_sample(&m);
+  size_t sessions = server->persistent_registry != NULL ? server->persistent_registry->total_count : 0;
+  pool_class_stats_t pools[POOL_CLASSES + 1];
+  pool_stats(pools);
+
+  json_writer_t w;
+  json_writer_init(&w, 0, 2048);
+  json_writer_begin_object(&w);
+  json_writer_key(&w, "rss_kb");
+  json_writer_int(&w, m.rss_kb);
+  json_writer_key(&w, "heap_in_use");
+  json_writer_int(&w, m.heap_in_use);
+  json_writer_key(&w, "heap_total");
+  json_writer_int(&w, m.heap_total);
+  json_writer_key(&w, "fds");
+  json_writer_int(&w, m.fds);
+  json_writer_key(&w, "children");
+  json_writer_int(&w, m.children);
+  json_writer_key(&w, "threads");
+  json_writer_int(&w, m.threads);
+  json_writer_key(&w, "clients");
+  json_writer_int(&w, server->client_count);
+  json_writer_key(&w, "sessions");
+  json_writer_uint(&w, sessions);
+  // one entry per size class, the last ("size":0) counts the blocks too big for a class
+  json_writer_key(&w, "pools");
+  json_writer_begin_array(&w);
+  for (int i = 0; i <= POOL_CLASSES; i++) {
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "size");
+    json_writer_uint(&w, pools[i].size);
+    json_writer_key(&w, "hits");
+    json_writer_uint(&w, pools[i].hits);
+    json_writer_key(&w, "misses");
+    json_writer_uint(&w, pools[i].misses);
+    json_writer_key(&w, "in_use");
+    json_writer_int(&w, pools[i].in_use);
+    json_writer_key(&w, "high_water");
+    json_writer_int(&w, pools[i].high_water);
+    json_writer_key(&w, "cached");
+    json_writer_int(&w, pools[i].cached);
+    json_writer_end_object(&w);
+  }
+  json_writer_end_array(&w);
+  json_writer_end_object(&w);
+  return json_writer_finish(&w, NULL);
+}
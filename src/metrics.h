@@ -0,0 +1,21 @@
+#ifndef CMDR_METRICS_H
+#define CMDR_METRICS_H
+
+#include <stdint.h>
+
+// process resource usage, -1 where the platform does not tell
+typedef struct {
+  int64_t rss_kb;
+  int64_t heap_in_use;  // bytes handed out by malloc
+  int64_t heap_total;   // bytes malloc holds from the system, free chunks included
+  int64_t fds;
+  int64_t children;
+  int64_t threads;
+} metrics_t;
+
+void metrics_sample(metrics_t *m);
+
+// /api/metrics body, malloc'd
+char *metrics_json();
+
+#endif  // CMDR_METRICS_H
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "osc.h"
+#include "utils.h"
+
+enum { STATE_GROUND, STATE_ESC, STATE_CODE, STATE_DATA, STATE_DATA_ESC };
+
+osc_scanner_t *osc_scanner_new() {
+  osc_scanner_t *scanner = xmalloc(sizeof(osc_scanner_t));
+  memset(scanner, 0, sizeof(osc_scanner_t));
+  return scanner;
+}
+
+void osc_scanner_free(osc_scanner_t *scanner) { free(scanner); }
+
+// ESC ] code ; payload and the terminator, BEL or ESC \ (term bytes)
+static void dispatch(osc_scanner_t *s, size_t end, size_t term, osc_cb cb, void *ctx) {
+  if (s->code >= 0 && !s->overflow) {
+    s->buf[s->len] = '\0';
+    s->end = end;
+    s->length = 2 + s->digits + 1 + s->len + term;
+    cb(ctx, s->code, s->buf, s->len);
+  }
+  s->state = STATE_GROUND;
+}
+
+// Everything outside an OSC string is skipped with memchr, so plain output costs one pass
+// over the bytes without branching per character.
+void osc_scan(osc_scanner_t *s, const char *data, size_t len, osc_cb cb, void *ctx) {
+  const char *p = data, *end = data + len;
+
+  while (p < end) {
+    switch (s->state) {
+      case STATE_GROUND:
+        p = memchr(p, 0x1b, end - p);
+        if (p == NULL) return;
+        p++;
+        s->state = STATE_ESC;
+        break;
+      case STATE_ESC:
+        if (*p == ']') {
+          s->state = STATE_CODE;
+          s->code = -1;
+          s->digits = 0;
+          s->len = 0;
+          s->overflow = false;
+        } else if (*p != 0x1b) {
+          s->state = STATE_GROUND;
+        }
+        p++;
+        break;
+      case STATE_CODE:
+        if (*p >= '0' && *p <= '9') {
+          s->code = (s->code < 0 ? 0 : s->code * 10) + (*p - '0');
+          if (s->code > 100000) s->code = 100000;
+          s->digits++;
+          p++;
+        } else if (*p == ';') {
+          s->state = STATE_DATA;
+          p++;
+        } else {
+          // not a numeric OSC, still has to be skipped up to its terminator
+          s->code = -1;
+          s->state = STATE_DATA;
+        }
+        break;
+      case STATE_DATA:
+        for (; p < end; p++) {
+          char c = *p;
+          if (c == 0x07) {
+            p++;
+            dispatch(s, p - data, 1, cb, ctx);
+            break;
+          }
+          if (c == 0x1b) {
+            p++;
+            s->state = STATE_DATA_ESC;
+            break;
+          }
+          if (c == 0x18 || c == 0x1a) {
+            p++;
+            s->state = STATE_GROUND;
+            break;
+          }
+          if (s->len < OSC_MAX_LEN)
+            s->buf[s->len++] = c;
+          else
+            s->overflow = true;
+        }
+        break;
+      case STATE_DATA_ESC:
+        if (*p == '\\') {
+          p++;
+          dispatch(s, p - data, 2, cb, ctx);
+        } else {
+          // unterminated string, the ESC starts a new sequence
+          s->state = STATE_ESC;
+        }
+        break;
+      default:
+        s->state = STATE_GROUND;
+        break;
+    }
+  }
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Decode an OSC 7 payload (file://host/path, percent-encoded) into a local path.
+// Directories reported from other hosts, e.g. inside ssh, are rejected.
+bool osc_parse_cwd(const char *payload, size_t len, char *path, size_t path_len) {
+  if (len < 8 || strncmp(payload, "file://", 7) != 0 || path_len == 0) return false;
+
+  const char *host = payload + 7, *end = payload + len;
+  const char *slash = memchr(host, '/', end - host);
+  if (slash == NULL) return false;
+
+  size_t host_len = slash - host;
+  if (host_len > 0 && !(host_len == 9 && strncmp(host, "localhost", 9) == 0)) {
+    char hostname[256];
+    if (gethostname(hostname, sizeof(hostname)) != 0) return false;
+    hostname[sizeof(hostname) - 1] = '\0';
+    if (strlen(hostname) != host_len || strncmp(host, hostname, host_len) != 0) return false;
+  }
+
+  size_t n = 0;
+  for (const char *p = slash; p < end; p++) {
+    char c = *p;
+    if (c == '%' && end - p > 2 && hex_value(p[1]) >= 0 && hex_value(p[2]) >= 0) {
+      c = (char)(hex_value(p[1]) << 4 | hex_value(p[2]));
+      p += 2;
+    }
+    if (c == '\0' || n + 1 >= path_len) return false;
+    path[n++] = c;
+  }
+  path[n] = '\0';
+  return true;
+}
@@ -0,0 +1,37 @@
+#ifndef CMDR_OSC_H
+#define CMDR_OSC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// longest OSC payload kept, longer ones (inline images, clipboard) are skipped
+#define OSC_MAX_LEN 2048
+
+// OSC commands the scanner reports
+#define OSC_ICON_TITLE 0
+#define OSC_TITLE 2
+#define OSC_CWD 7
+#define OSC_SHELL_MARK 133  // shell integration: A prompt, B command line, C output, D[;exit code] done
+
+typedef void (*osc_cb)(void *ctx, int code, const char *payload, size_t len);
+
+// streaming scanner, state is carried across PTY reads
+typedef struct {
+  int state;
+  int code;            // numeric command, -1 while still reading it
+  int digits;
+  bool overflow;
+  size_t len;
+  char buf[OSC_MAX_LEN + 1];
+  // while a sequence is reported: offset in the scanned data just past it, and its length
+  // (it may have started in an earlier read)
+  size_t end;
+  size_t length;
+} osc_scanner_t;
+
+osc_scanner_t *osc_scanner_new();
+void osc_scanner_free(osc_scanner_t *scanner);
+void osc_scan(osc_scanner_t *scanner, const char *data, size_t len, osc_cb cb, void *ctx);
+bool osc_parse_cwd(const char *payload, size_t len, char *path, size_t path_len);
+
+#endif  // CMDR_OSC_H
@@ -0,0 +1,211 @@
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef POOL_DEBUG
+#include <pthread.h>
+#endif
+
+#include "pool.h"
+#include "utils.h"
+
+#define POOL_LIVE 0x4c495645u  // "LIVE"
+#define POOL_FREE 0x46524545u  // "FREE"
+#define POOL_LARGE POOL_CLASSES
+#define POISON 0xdd
+// bytes of a poisoned block checked on reuse
+#define POISON_CHECK 256
+
+// in front of every block, 16 bytes keep the payload aligned like malloc's
+typedef struct pool_header {
+  uint32_t magic;
+  uint32_t cls;
+  union {
+    struct pool_header *next;  // free list, while free
+    size_t size;               // requested size of a large block, while live
+  };
+#ifdef POOL_DEBUG
+  size_t requested;
+  const char *file;
+  int line;
+  struct pool_header *live_prev, *live_next;
+#endif
+} __attribute__((aligned(16))) pool_header_t;
+
+static __thread pool_header_t *free_lists[POOL_CLASSES];
+static __thread uint32_t free_counts[POOL_CLASSES];
+
+static struct {
+  uint64_t hits, misses;
+  int64_t in_use, high_water, cached;
+} stats[POOL_CLASSES + 1];
+
+#ifdef POOL_DEBUG
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_header_t *live;
+#endif
+
+static inline size_t class_size(uint32_t cls) { return (size_t)1 << (POOL_MIN_SHIFT + cls); }
+
+static inline uint32_t class_of(size_t size) {
+  uint32_t cls = 0;
+  while (class_size(cls) < size) cls++;
+  return cls;
+}
+
+static inline uint32_t class_keep(uint32_t cls) {
+  size_t keep = POOL_CACHE_BYTES / class_size(cls);
+  return keep < 4 ? 4 : (uint32_t)keep;
+}
+
+static void count_in(uint32_t cls, bool hit) {
+  __atomic_add_fetch(hit ? &stats[cls].hits : &stats[cls].misses, 1, __ATOMIC_RELAXED);
+  int64_t in_use = __atomic_add_fetch(&stats[cls].in_use, 1, __ATOMIC_RELAXED);
+  int64_t high = __atomic_load_n(&stats[cls].high_water, __ATOMIC_RELAXED);
+  while (in_use > high &&
+         !__atomic_compare_exchange_n(&stats[cls].high_water, &high, in_use, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static void bad_free(pool_header_t *h, void *p) {
+  if (h->magic == POOL_FREE)
+    lwsl_err("pool: double free of %p\n", p);
+  else
+    lwsl_err("pool: %p was not allocated from the pool\n", p);
+  abort();
+}
+
+#ifdef POOL_DEBUG
+static void track(pool_header_t *h, size_t size, const char *file, int line) {
+  h->requested = size;
+  h->file = file;
+  h->line = line;
+  pthread_mutex_lock(&live_lock);
+  h->live_prev = NULL;
+  h->live_next = live;
+  if (live != NULL) live->live_prev = h;
+  live = h;
+  pthread_mutex_unlock(&live_lock);
+}
+
+static void untrack(pool_header_t *h) {
+  pthread_mutex_lock(&live_lock);
+  if (h->live_prev != NULL)
+    h->live_prev->live_next = h->live_next;
+  else
+    live = h->live_next;
+  if (h->live_next != NULL) h->live_next->live_prev = h->live_prev;
+  pthread_mutex_unlock(&live_lock);
+}
+
+// a freed block that changed was written through a stale pointer
+static void check_poison(pool_header_t *h) {
+  size_t n = class_size(h->cls) < POISON_CHECK ? class_size(h->cls) : POISON_CHECK;
+  const unsigned char *data = (const unsigned char *)(h + 1);
+  for (size_t i = 0; i < n; i++) {
+    if (data[i] != POISON) {
+      lwsl_err("pool: block %p (%zu bytes, last allocated at %s:%d) modified after free\n", (void *)(h + 1),
+               class_size(h->cls), h->file, h->line);
+      abort();
+    }
+  }
+}
+#endif
+
+void *pool_alloc_at(size_t size, const char *file, int line) {
+  pool_header_t *h;
+  if (size > POOL_MAX_SIZE) {
+    h = xmalloc(sizeof(pool_header_t) + size);
+    h->cls = POOL_LARGE;
+    h->size = size;
+    count_in(POOL_LARGE, false);
+  } else {
+    uint32_t cls = class_of(size);
+    h = free_lists[cls];
+    bool hit = h != NULL;
+    if (hit) {
+      free_lists[cls] = h->next;
+      free_counts[cls]--;
+      __atomic_sub_fetch(&stats[cls].cached, 1, __ATOMIC_RELAXED);
+#ifdef POOL_DEBUG
+      check_poison(h);
+#endif
+    } else {
+      h = xmalloc(sizeof(pool_header_t) + class_size(cls));
+      h->cls = cls;
+    }
+    count_in(cls, hit);
+  }
+  h->magic = POOL_LIVE;
+#ifdef POOL_DEBUG
+  track(h, size, file, line);
+#endif
+  return h + 1;
+}
+
+void pool_free(void *p) {
+  if (p == NULL) return;
+  pool_header_t *h = (pool_header_t *)p - 1;
+  if (h->magic != POOL_LIVE) bad_free(h, p);
+  h->magic = POOL_FREE;
+  __atomic_sub_fetch(&stats[h->cls].in_use, 1, __ATOMIC_RELAXED);
+#ifdef POOL_DEBUG
+  untrack(h);
+#endif
+
+  uint32_t cls = h->cls;
+  if (cls == POOL_LARGE || free_counts[cls] >= class_keep(cls)) {
+    free(h);
+    return;
+  }
+#ifdef POOL_DEBUG
+  memset(p, POISON, class_size(cls));
+#endif
+  h->next = free_lists[cls];
+  free_lists[cls] = h;
+  free_counts[cls]++;
+  __atomic_add_fetch(&stats[cls].cached, 1, __ATOMIC_RELAXED);
+}
+
+void *pool_realloc_at(void *p, size_t size, const char *file, int line) {
+  if (p == NULL) return pool_alloc_at(size, file, line);
+  pool_header_t *h = (pool_header_t *)p - 1;
+  if (h->magic != POOL_LIVE) bad_free(h, p);
+
+  size_t old = h->cls == POOL_LARGE ? h->size : class_size(h->cls);
+  if (size <= old) {
+#ifdef POOL_DEBUG
+    h->requested = size;
+#endif
+    return p;
+  }
+  void *q = pool_alloc_at(size, file, line);
+  memcpy(q, p, old);
+  pool_free(p);
+  return q;
+}
+
+void pool_stats(pool_class_stats_t *out) {
+  for (uint32_t cls = 0; cls <= POOL_LARGE; cls++) {
+    out[cls].size = cls == POOL_LARGE ? 0 : class_size(cls);
+    out[cls].hits = __atomic_load_n(&stats[cls].hits, __ATOMIC_RELAXED);
+    out[cls].misses = __atomic_load_n(&stats[cls].misses, __ATOMIC_RELAXED);
+    out[cls].in_use = __atomic_load_n(&stats[cls].in_use, __ATOMIC_RELAXED);
+    out[cls].high_water = __atomic_load_n(&stats[cls].high_water, __ATOMIC_RELAXED);
+    out[cls].cached = __atomic_load_n(&stats[cls].cached, __ATOMIC_RELAXED);
+  }
+}
+
+int pool_report_leaks() {
+  int n = 0;
+#ifdef POOL_DEBUG
+  pthread_mutex_lock(&live_lock);
+  for (pool_header_t *h = live; h != NULL; h = h->live_next) {
+    lwsl_warn("pool: leaked %zu bytes at %p, allocated at %s:%d\n", h->requested, (void *)(h + 1), h->file, h->line);
+    n++;
+  }
+  pthread_mutex_unlock(&live_lock);
+#endif
+  return n;
+}
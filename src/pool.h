@@ -0,0 +1,43 @@
+#ifndef CMDR_POOL_H
+#define CMDR_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-class pools for the short-lived blocks of the PTY <-> WebSocket paths: PTY reads,
+// pty_buf_t, write requests and outgoing frames. Classes are powers of two from 64 bytes to
+// 64K; each thread keeps its own free lists, so there is no locking, and larger requests go
+// straight to malloc. Blocks must be released with pool_free, never free.
+//
+// Built with POOL_DEBUG (cmake -DWITH_POOL_DEBUG=ON), freed blocks are poisoned and checked on
+// reuse, and pool_report_leaks lists the blocks still live with their allocation site. Double
+// and foreign frees abort in every build.
+#define POOL_MIN_SHIFT 6
+#define POOL_CLASSES 11  // 64 .. 64K
+#define POOL_MAX_SIZE ((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))
+// free blocks a thread keeps per class, at least 4 of the biggest
+#define POOL_CACHE_BYTES (256 * 1024)
+
+#define pool_alloc(size) pool_alloc_at(size, __FILE__, __LINE__)
+#define pool_realloc(p, size) pool_realloc_at(p, size, __FILE__, __LINE__)
+
+void *pool_alloc_at(size_t size, const char *file, int line);
+void *pool_realloc_at(void *p, size_t size, const char *file, int line);
+void pool_free(void *p);
+
+typedef struct {
+  size_t size;          // block size, 0 for the malloc'd blocks above POOL_MAX_SIZE
+  uint64_t hits;        // served from a free list
+  uint64_t misses;      // had to malloc
+  int64_t in_use;
+  int64_t high_water;   // most blocks in use at once
+  int64_t cached;       // free blocks kept for reuse
+} pool_class_stats_t;
+
+// POOL_CLASSES entries and one for the large blocks
+void pool_stats(pool_class_stats_t *stats);
+
+// logs the blocks still allocated, returns their number (always 0 without POOL_DEBUG)
+int pool_report_leaks();
+
+#endif  // CMDR_POOL_H
@@ -0,0 +1,35 @@
+#ifndef CMDR_PROBES_H
+#define CMDR_PROBES_H
+
+// USDT probes under the "cmdr" provider, compiled in with -DWITH_USDT=ON. An untraced probe is a
+// single nop, so the arguments must stay cheap to evaluate. scripts/bpftrace has ready-made
+// scripts; `bpftrace -l 'usdt:/path/to/cmdr:cmdr:*'` lists them all.
+//
+//   pty__read(pid, bytes)                    pty__write(req, pid, bytes)
+//   pty__write__done(req, pid, bytes)        pty__pause(pid)    pty__resume(pid)
+//   process__spawn(pid, argv0)               process__exit(pid, exit_code, signal)
+//   ws__receive(wsi, command, bytes)         ws__send(wsi, bytes)
+//   session__attach(id, wsi)                 session__detach(id, wsi)
+//   session__save__start(id)                 session__save__done(id, ok)
+//   session__load__start(id)                 session__load__done(id, ok)
+//   http__request__start(wsi, path)          http__request__done(wsi, path)
+
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+
+#define CMDR_PROBE1(name, a) DTRACE_PROBE1(cmdr, name, a)
+#define CMDR_PROBE2(name, a, b) DTRACE_PROBE2(cmdr, name, a, b)
+#define CMDR_PROBE3(name, a, b, c) DTRACE_PROBE3(cmdr, name, a, b, c)
+#else
+#define CMDR_PROBE1(name, a) \
+  do {                       \
+  } while (0)
+#define CMDR_PROBE2(name, a, b) \
+  do {                          \
+  } while (0)
+#define CMDR_PROBE3(name, a, b, c) \
+  do {                             \
+  } while (0)
+#endif
+
+#endif  // CMDR_PROBES_H
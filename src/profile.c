@@ -0,0 +1,212 @@
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+#include "utils.h"
+
+bool profile_enabled = false;
+
+static const char *scope_names[PROF_SCOPE_COUNT] = {
+    "read_cb", "process_read_cb", "wsi_output", "terminal_buffer_append", "callback_http", "persistence", "json",
+};
+
+// all counters in ticks, updated with relaxed atomics (the updater runs on its own thread)
+typedef struct {
+  uint64_t calls;
+  uint64_t total;
+  uint64_t self;
+  uint64_t max;
+  uint64_t allocs;
+  uint64_t alloc_bytes;
+} scope_stats_t;
+
+static scope_stats_t stats[PROF_SCOPE_COUNT];
+static uint64_t other_allocs, other_alloc_bytes;
+
+// Self time per call stack. The key holds the stack as 4 bits per frame (scope + 1), innermost
+// frame in the low bits; slots are claimed with a CAS and never freed.
+#define FOLDED_SLOTS 512
+typedef struct {
+  uint64_t key;
+  uint64_t self;
+} folded_slot_t;
+
+static folded_slot_t folded[FOLDED_SLOTS];
+
+typedef struct {
+  uint64_t child;  // ticks spent in profiled callees
+} frame_t;
+
+static __thread frame_t stack[PROFILE_MAX_DEPTH];
+static __thread int depth;
+static __thread uint64_t path;
+
+static uv_timer_t *timer;
+static char *folded_path;
+static uint64_t base_ticks, base_ns;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// TSC cycles where available, nanoseconds otherwise
+static inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+static double ns_per_tick() {
+  uint64_t t = ticks() - base_ticks;
+  return t > 0 ? (double)(now_ns() - base_ns) / (double)t : 1.0;
+}
+
+static inline void add(uint64_t *counter, uint64_t value) { __atomic_fetch_add(counter, value, __ATOMIC_RELAXED); }
+
+static void update_max(uint64_t *counter, uint64_t value) {
+  uint64_t cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+  while (value > cur && !__atomic_compare_exchange_n(counter, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void folded_add(uint64_t key, uint64_t self) {
+  size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 55) & (FOLDED_SLOTS - 1);
+  for (size_t n = 0; n < FOLDED_SLOTS; n++, i = (i + 1) & (FOLDED_SLOTS - 1)) {
+    uint64_t cur = __atomic_load_n(&folded[i].key, __ATOMIC_ACQUIRE);
+    if (cur == 0) {
+      if (__atomic_compare_exchange_n(&folded[i].key, &cur, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        cur = key;
+    }
+    if (cur == key) {
+      add(&folded[i].self, self);
+      return;
+    }
+  }
+}
+
+uint64_t profile_enter(profile_scope_t scope) {
+  if (depth < PROFILE_MAX_DEPTH) {
+    stack[depth].child = 0;
+    path = path << 4 | (uint64_t)(scope + 1);
+  }
+  depth++;
+  return ticks();
+}
+
+void profile_leave(profile_scope_t scope, uint64_t start) {
+  uint64_t elapsed = ticks() - start;
+  scope_stats_t *st = &stats[scope];
+  add(&st->calls, 1);
+  add(&st->total, elapsed);
+  update_max(&st->max, elapsed);
+
+  if (depth == 0) return;
+  depth--;
+  if (depth >= PROFILE_MAX_DEPTH) return;  // too deep, inclusive time only
+
+  uint64_t child = stack[depth].child;
+  uint64_t self = elapsed > child ? elapsed - child : 0;
+  add(&st->self, self);
+  folded_add(path, self);
+  path >>= 4;
+  if (depth > 0) stack[depth - 1].child += elapsed;
+}
+
+void profile_alloc(size_t size) {
+  if (depth == 0 || depth > PROFILE_MAX_DEPTH) {
+    add(&other_allocs, 1);
+    add(&other_alloc_bytes, size);
+    return;
+  }
+  int scope = (int)(path & 0xf) - 1;
+  add(&stats[scope].allocs, 1);
+  add(&stats[scope].alloc_bytes, size);
+}
+
+// one line per call stack: "cmdr;read_cb;process_read_cb <self microseconds>"
+static void write_folded(double ns) {
+  char tmp[1024];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", folded_path);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    lwsl_warn("profile: can not write %s\n", tmp);
+    return;
+  }
+
+  for (size_t i = 0; i < FOLDED_SLOTS; i++) {
+    uint64_t key = __atomic_load_n(&folded[i].key, __ATOMIC_ACQUIRE);
+    uint64_t us = (uint64_t)(__atomic_load_n(&folded[i].self, __ATOMIC_RELAXED) * ns / 1000);
+    if (key == 0 || us == 0) continue;
+
+    int frames[PROFILE_MAX_DEPTH], n = 0;
+    for (; key != 0 && n < PROFILE_MAX_DEPTH; key >>= 4) frames[n++] = (int)(key & 0xf) - 1;
+    fputs("cmdr", fp);
+    while (n > 0) fprintf(fp, ";%s", scope_names[frames[--n]]);
+    fprintf(fp, " %llu\n", (unsigned long long)us);
+  }
+
+  fclose(fp);
+  if (rename(tmp, folded_path) != 0) lwsl_warn("profile: can not write %s\n", folded_path);
+}
+
+static void profile_dump() {
+  double ns = ns_per_tick();
+  lwsl_notice("profile: %-24s %10s %11s %11s %9s %9s %9s %10s\n", "scope", "calls", "total ms", "self ms", "avg us",
+              "max us", "allocs", "alloc KiB");
+  for (int i = 0; i < PROF_SCOPE_COUNT; i++) {
+    scope_stats_t *st = &stats[i];
+    uint64_t calls = __atomic_load_n(&st->calls, __ATOMIC_RELAXED);
+    if (calls == 0) continue;
+    uint64_t total = __atomic_load_n(&st->total, __ATOMIC_RELAXED);
+    lwsl_notice("profile: %-24s %10llu %11.1f %11.1f %9.1f %9.1f %9llu %10.1f\n", scope_names[i],
+                (unsigned long long)calls, total * ns / 1e6, __atomic_load_n(&st->self, __ATOMIC_RELAXED) * ns / 1e6,
+                total * ns / 1e3 / calls, __atomic_load_n(&st->max, __ATOMIC_RELAXED) * ns / 1e3,
+                (unsigned long long)__atomic_load_n(&st->allocs, __ATOMIC_RELAXED),
+                __atomic_load_n(&st->alloc_bytes, __ATOMIC_RELAXED) / 1024.0);
+  }
+  lwsl_notice("profile: %-24s %10s %11s %11s %9s %9s %9llu %10.1f\n", "(unattributed)", "", "", "", "", "",
+              (unsigned long long)__atomic_load_n(&other_allocs, __ATOMIC_RELAXED),
+              __atomic_load_n(&other_alloc_bytes, __ATOMIC_RELAXED) / 1024.0);
+  write_folded(ns);
+}
+
+static void timer_cb(uv_timer_t *handle) { profile_dump(); }
+
+static void timer_close_cb(uv_handle_t *handle) { free(handle); }
+
+bool profile_start(uv_loop_t *loop, const char *path) {
+  folded_path = strdup(path != NULL && path[0] != '\0' ? path : "cmdr-profile.folded");
+  base_ticks = ticks();
+  base_ns = now_ns();
+
+  timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(loop, timer);
+  uv_timer_start(timer, timer_cb, PROFILE_INTERVAL_SEC * 1000, PROFILE_INTERVAL_SEC * 1000);
+  uv_unref((uv_handle_t *)timer);
+
+  profile_enabled = true;
+  lwsl_notice("profiling enabled, folded stacks: %s\n", folded_path);
+  return true;
+}
+
+void profile_stop() {
+  if (!profile_enabled) return;
+  profile_dump();
+  profile_enabled = false;
+  uv_timer_stop(timer);
+  uv_close((uv_handle_t *)timer, timer_close_cb);
+  timer = NULL;
+  free(folded_path);
+  folded_path = NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef CMDR_PROFILE_H
+#define CMDR_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// subsystems the hot paths are attributed to
+typedef enum {
+  PROF_READ_CB,        // pty.c read_cb
+  PROF_PROCESS_READ,   // protocol.c process_read_cb
+  PROF_WSI_OUTPUT,     // protocol.c wsi_output
+  PROF_BUFFER_APPEND,  // terminal_buffer_append
+  PROF_HTTP,           // callback_http
+  PROF_PERSIST,        // session state save/load
+  PROF_JSON,           // JSON parsing and serialization
+  PROF_SCOPE_COUNT
+} profile_scope_t;
+
+#define PROFILE_MAX_DEPTH 16
+#define PROFILE_INTERVAL_SEC 10
+
+// set once by profile_start(), read on every hot path
+extern bool profile_enabled;
+
+bool profile_start(uv_loop_t *loop, const char *folded_path);
+void profile_stop();
+uint64_t profile_enter(profile_scope_t scope);
+void profile_leave(profile_scope_t scope, uint64_t start);
+void profile_alloc(size_t size);
+
+// With profiling off these cost one well-predicted branch each.
+#define PROFILE_ENTER(scope) \
+  uint64_t profile_start_##scope = __builtin_expect(profile_enabled, 0) ? profile_enter(scope) : 0
+#define PROFILE_LEAVE(scope) \
+  do { \
+    if (__builtin_expect(profile_enabled, 0)) profile_leave(scope, profile_start_##scope); \
+  } while (0)
+
+#endif  // CMDR_PROFILE_H
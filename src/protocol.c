@@ -6,9 +6,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "pool.h"
+#include "probes.h"
+#include "profile.h"
 #include "pty.h"
 #include "server.h"
 #include "session_persistence.h"
+#include "trace.h"
 #include "utils.h"
 
 // initial message list
@@ -36,9 +40,11 @@ static int send_initial_message(struct lws *wsi, int index) {
   return lws_write(wsi, p, (size_t)n, LWS_WRITE_BINARY);
 }
 
-static json_object *parse_window_size(const char *buf, size_t len, uint16_t *cols, uint16_t *rows) {
+json_object *parse_window_size(const char *buf, size_t len, uint16_t *cols, uint16_t *rows) {
   json_tokener *tok = json_tokener_new();
+  PROFILE_ENTER(PROF_JSON);
   json_object *obj = json_tokener_parse_ex(tok, buf, len);
+  PROFILE_LEAVE(PROF_JSON);
   struct json_object *o = NULL;
 
   if (json_object_object_get_ex(obj, "columns", &o)) *cols = (uint16_t)json_object_get_int(o);
@@ -71,35 +77,212 @@ static bool check_host_origin(struct lws *wsi) {
 }
 
 static pty_ctx_t *pty_ctx_init(struct pss_tty *pss) {
-  pty_ctx_t *ctx = xmalloc(sizeof(pty_ctx_t));
+  pty_ctx_t *ctx = pool_alloc(sizeof(pty_ctx_t));
   ctx->pss = pss;
   ctx->ws_closed = false;
   return ctx;
 }
 
-static void pty_ctx_free(pty_ctx_t *ctx) { free(ctx); }
+static void pty_ctx_free(pty_ctx_t *ctx) { pool_free(ctx); }
 
-static void process_read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
+static void frame_timer_cb(uv_timer_t *timer) {
+  struct pss_tty *pss = (struct pss_tty *)timer->data;
+  if (pss != NULL) lws_callback_on_writable(pss->wsi);
+}
+
+static void frame_timer_close_cb(uv_handle_t *handle) { free(handle); }
+
+// minimum time between two frames: the client's frameRateLimit, never faster than
+// SCREEN_FRAME_INTERVAL_MS for the screen-diff transport
+static uint32_t frame_interval(struct pss_tty *pss) {
+  if (pss->screen != NULL && pss->frame_interval_ms < SCREEN_FRAME_INTERVAL_MS) return SCREEN_FRAME_INTERVAL_MS;
+  return pss->frame_interval_ms;
+}
+
+// coalesce PTY output into at most one frame per frame_interval(), screen-diff or OUTPUT
+static void schedule_frame(struct pss_tty *pss) {
+  if (pss->frame_timer == NULL) {
+    pss->frame_timer = xmalloc(sizeof(uv_timer_t));
+    uv_timer_init(server->loop, pss->frame_timer);
+    pss->frame_timer->data = pss;
+  }
+  if (uv_is_active((uv_handle_t *)pss->frame_timer)) return;
+
+  uint64_t now = uv_now(server->loop);
+  uint64_t last = pss->screen != NULL ? pss->screen->last_frame_ms : pss->last_output_ms;
+  uint64_t due = last + frame_interval(pss);
+  uv_timer_start(pss->frame_timer, frame_timer_cb, due > now ? due - now : 0, 0);
+}
+
+// pick up ECHO/ICANON changes made by the program and queue a TERMINAL_MODE message
+static void check_terminal_mode(struct pss_tty *pss) {
+  if (!pty_update_mode(pss->process)) return;
+  if (pss->persistent_session != NULL) pss->persistent_session->terminal_mode = pss->process->mode;
+  pss->mode_pending = true;
+  lws_callback_on_writable(pss->wsi);
+}
+
+static void osc_handler(void *ctx, int code, const char *payload, size_t len) {
+  struct pss_tty *pss = (struct pss_tty *)ctx;
+  struct session_data *session =
+      server->session_mgr && pss->session_id ? session_find_by_id(server->session_mgr, pss->session_id) : NULL;
+  char path[MAX_PATH_LENGTH];
+
+  switch (code) {
+    case OSC_ICON_TITLE:
+    case OSC_TITLE:
+      if (pss->title != NULL && strcmp(pss->title, payload) == 0) break;
+      free(pss->title);
+      pss->title = strdup(payload);
+      pss->title_pending = true;
+      lws_callback_on_writable(pss->wsi);
+      if (pss->persistent_session) persistent_session_set_title(pss->persistent_session, payload);
+      if (session != NULL) {
+        free(session->title);
+        session->title = strdup(payload);
+      }
+      break;
+    case OSC_CWD:
+      if (!osc_parse_cwd(payload, len, path, sizeof(path))) break;
+      if (pss->persistent_session) persistent_session_set_working_directory(pss->persistent_session, path);
+      if (session != NULL && strcmp(session->working_dir, path) != 0) {
+        free(session->working_dir);
+        session->working_dir = strdup(path);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// keep every OUTPUT frame self-contained valid UTF-8, false if nothing is left to send yet
+static bool utf8_align(struct pss_tty *pss, pty_buf_t *buf) {
+  char *out;
+  size_t out_len;
+  if (utf8_stream_frame(&pss->utf8, buf->base, buf->len, &out, &out_len)) {
+    pool_free(buf->base);
+    buf->base = out;
+  }
+  buf->len = out_len;
+  return out_len > 0;
+}
+
+static void set_read_ahead(struct pss_tty *pss, size_t bytes) {
+  if (bytes < READ_AHEAD_MIN) bytes = READ_AHEAD_MIN;
+  if (bytes > READ_AHEAD_MAX) bytes = READ_AHEAD_MAX;
+  if (pss->buffer_size > 0 && bytes > pss->buffer_size) bytes = pss->buffer_size;
+  if (bytes != pss->read_ahead) lwsl_info("read-ahead for %s: %zu -> %zu bytes\n", pss->address, pss->read_ahead, bytes);
+  pss->read_ahead = bytes;
+}
+
+// read-ahead budget, transfer data is not rendered so it may queue up to READ_AHEAD_MAX
+static size_t read_ahead(struct pss_tty *pss) {
+  if (!pss->in_transfer) return pss->read_ahead;
+  return pss->buffer_size > 0 && pss->buffer_size < READ_AHEAD_MAX ? pss->buffer_size : READ_AHEAD_MAX;
+}
+
+// How many leading bytes of the read belong to a zmodem/trzsz transfer. Such data bypasses
+// scrollback, persistence and OSC scanning, and goes out uncompressed without a frame rate limit.
+static size_t inband_transfer(struct pss_tty *pss, pty_buf_t *buf) {
+  if (pss->inband == NULL) return 0;
+  inband_kind_t before = pss->inband->kind;
+  size_t transfer = inband_scan(pss->inband, buf->base, buf->len, uv_now(server->loop));
+  inband_kind_t after = pss->inband->kind;
+  if (after != before) {
+    if (after != INBAND_NONE)
+      lwsl_notice("%s transfer started, pid: %d\n", inband_name(after), pss->process->pid);
+    else
+      lwsl_notice("%s transfer finished, pid: %d\n", inband_name(before), pss->process->pid);
+    lws_set_extension_option(pss->wsi, "permessage-deflate", "compression_level",
+                             after != INBAND_NONE ? "0" : DEFLATE_LEVEL);
+  }
+  pss->in_transfer = after != INBAND_NONE;
+  return transfer;
+}
+
+static void queue_output(struct pss_tty *pss, pty_buf_t *buf) {
+  if (pss->pty_buf == NULL) {
+    pss->pty_buf = buf;
+    pss->trace_id = TRACE_ON ? trace_flow() : 0;
+    return;
+  }
+  pty_buf_t *queued = pss->pty_buf;
+  queued->base = pool_realloc(queued->base, queued->len + buf->len);
+  memcpy(queued->base + queued->len, buf->base, buf->len);
+  queued->len += buf->len;
+  pty_buf_free(buf);
+}
+
+// FLOW_REPORT: the client's tuned ack window, roughly what it renders in one animation frame
+static void apply_flow_report(struct pss_tty *pss, const char *data, size_t len) {
+  json_tokener *tok = json_tokener_new();
+  PROFILE_ENTER(PROF_JSON);
+  json_object *obj = json_tokener_parse_ex(tok, data, (int)len);
+  PROFILE_LEAVE(PROF_JSON);
+  struct json_object *o = NULL;
+  if (json_object_object_get_ex(obj, "limit", &o)) {
+    int64_t limit = json_object_get_int64(o);
+    set_read_ahead(pss, limit > 0 ? (size_t)limit : 0);
+  }
+  json_object_put(obj);
+  json_tokener_free(tok);
+}
+
+static void process_read(pty_process *process, pty_buf_t *buf, bool eof) {
   pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
   if (ctx->ws_closed) {
     pty_buf_free(buf);
     return;
   }
+  // terminal output is what follows the transfer data, if any: the prompt after a transfer ended
+  size_t transfer = !eof && buf != NULL ? inband_transfer(ctx->pss, buf) : 0;
+  const char *data = buf != NULL ? buf->base + transfer : NULL;
+  size_t len = buf != NULL && !eof ? buf->len - transfer : 0;
+  if (!eof) {
+    check_terminal_mode(ctx->pss);
+    if (ctx->pss->osc != NULL && len > 0) osc_scan(ctx->pss->osc, data, len, osc_handler, ctx->pss);
+  }
 
   // Store data in persistent session if available
-  if (ctx->pss->persistent_session && buf && buf->len > 0) {
-    persistent_session_handle_pty_output(ctx->pss->persistent_session, buf->base, buf->len);
+  if (ctx->pss->persistent_session && len > 0) {
+    uint64_t trace_ts = TRACE_ON ? trace_now() : 0;
+    persistent_session_handle_pty_output(ctx->pss->persistent_session, data, len);
+    if (TRACE_ON) trace_span("persist_append", "output", trace_ts, trace_flow(), TRACE_FLOW_STEP, len);
     session_log(LOG_DEBUG, ((struct persistent_session*)ctx->pss->persistent_session)->id,
-                "Stored %zu bytes in persistent session", buf->len);
+                "Stored %zu bytes in persistent session", len);
   }
+  if (ctx->pss->attached != NULL && len > 0) attach_output(ctx->pss, data, len);
 
-  if (eof && !process_running(process))
+  if (eof && !process_running(process)) {
     ctx->pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
-  else
-    ctx->pss->pty_buf = buf;
+  } else if (eof) {
+    // read error while the process is still alive, nothing to forward
+  } else if (ctx->pss->screen != NULL) {
+    // the model absorbs the output, so the PTY never waits for the socket
+    if (len > 0) screen_feed(ctx->pss->screen->model, data, len);
+    pty_buf_free(buf);
+    schedule_frame(ctx->pss);
+    if (ctx->pss->initialized) pty_resume(process);
+    return;
+  } else if (!server->binary_output && !utf8_align(ctx->pss, buf)) {
+    // only the start of a multibyte sequence, wait for the rest
+    pty_buf_free(buf);
+    pty_resume(process);
+    return;
+  } else {
+    queue_output(ctx->pss, buf);
+    // keep draining the PTY while the socket is busy, up to the read-ahead budget
+    if (ctx->pss->pty_buf->len < read_ahead(ctx->pss) && !ctx->pss->client_paused) pty_resume(process);
+  }
   lws_callback_on_writable(ctx->pss->wsi);
 }
 
+static void process_read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
+  PROFILE_ENTER(PROF_PROCESS_READ);
+  process_read(process, buf, eof);
+  PROFILE_LEAVE(PROF_PROCESS_READ);
+}
+
 static void process_exit_cb(pty_process *process) {
   pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
   if (ctx->ws_closed) {
@@ -108,6 +291,7 @@ static void process_exit_cb(pty_process *process) {
   }
 
   lwsl_notice("process exited with code %d, pid: %d\n", process->exit_code, process->pid);
+  attach_end(ctx->pss, process->exit_code);
   ctx->pss->process = NULL;
   ctx->pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
   lws_callback_on_writable(ctx->pss->wsi);
@@ -121,9 +305,10 @@ static char **build_args(struct pss_tty *pss) {
   char **argv;
   
   // If user specified a shell, use it instead of server command
-  if (strlen(pss->default_shell) > 0) {
+  if (pss->default_shell != NULL) {
     argv = xmalloc((1 + pss->argc + 1) * sizeof(char *));
-    argv[n++] = strdup(pss->default_shell);
+    // only the array is owned by the process, see process_free()
+    argv[n++] = pss->default_shell;
   } else {
     argv = xmalloc((server->argc + pss->argc + 1) * sizeof(char *));
     for (i = 0; i < server->argc; i++) {
@@ -135,6 +320,13 @@ static char **build_args(struct pss_tty *pss) {
     argv[n++] = pss->args[i];
   }
 
+  // bash reads the integration as its rc file, which loads ~/.bashrc
+  if (server->shell_integration != NULL && n == 1 && shell_integration_kind(argv[0]) == SHELL_BASH) {
+    argv = xrealloc(argv, 4 * sizeof(char *));
+    argv[n++] = "--rcfile";
+    argv[n++] = server->shell_integration->bash_rcfile;
+  }
+
   argv[n] = NULL;
 
   return argv;
@@ -150,11 +342,29 @@ static char **build_env(struct pss_tty *pss) {
   i++;
 
   // CMDR_USER
-  if (strlen(pss->user) > 0) {
+  if (pss->user != NULL) {
     envp = xrealloc(envp, (++n) * sizeof(char *));
-    envp[i] = xmalloc(40);
-    snprintf(envp[i], 40, "CMDR_USER=%s", pss->user);
+    envp[i] = xmalloc(strlen(pss->user) + 11);
+    sprintf(envp[i], "CMDR_USER=%s", pss->user);
+    i++;
+  }
+
+  // zsh finds the integration through ZDOTDIR, which then restores the user's
+  const char *shell = pss->default_shell != NULL ? pss->default_shell : server->argv[0];
+  if (server->shell_integration != NULL && pss->argc == 0 && (pss->default_shell != NULL || server->argc == 1) &&
+      shell_integration_kind(shell) == SHELL_ZSH) {
+    const char *zdotdir = server->shell_integration->zdotdir;
+    const char *user_zdotdir = getenv("ZDOTDIR");
+    n += user_zdotdir != NULL ? 2 : 1;
+    envp = xrealloc(envp, n * sizeof(char *));
+    envp[i] = xmalloc(strlen(zdotdir) + 9);
+    sprintf(envp[i], "ZDOTDIR=%s", zdotdir);
     i++;
+    if (user_zdotdir != NULL) {
+      envp[i] = xmalloc(strlen(user_zdotdir) + 19);
+      sprintf(envp[i], "CMDR_USER_ZDOTDIR=%s", user_zdotdir);
+      i++;
+    }
   }
 
   envp[i] = NULL;
@@ -164,16 +374,30 @@ static char **build_env(struct pss_tty *pss) {
 
 static bool spawn_process(struct pss_tty *pss, uint16_t columns, uint16_t rows) {
   pty_process *process = process_init((void *)pty_ctx_init(pss), server->loop, build_args(pss), build_env(pss));
-  if (server->cwd != NULL) process->cwd = strdup(server->cwd);
+  // respawn where the shell last reported to be, otherwise in the configured directory
+  if (pss->persistent_session != NULL && pss->persistent_session->cwd_tracked)
+    process->cwd = strdup(pss->persistent_session->working_directory);
+  else if (server->cwd != NULL)
+    process->cwd = strdup(server->cwd);
   if (columns > 0) process->columns = columns;
   if (rows > 0) process->rows = rows;
+  uint64_t trace_ts = TRACE_ON ? trace_now() : 0;
   if (pty_spawn(process, process_read_cb, process_exit_cb) != 0) {
     lwsl_err("pty_spawn: %d (%s)\n", errno, strerror(errno));
+    pty_ctx_free(process->ctx);
     process_free(process);
+    free(process);
     return false;
   }
+  if (TRACE_ON) trace_span("spawn", "process", trace_ts, 0, TRACE_FLOW_NONE, 0);
   lwsl_notice("started process, pid: %d\n", process->pid);
+  CMDR_PROBE2(process__spawn, process->pid, process->argv[0]);
   pss->process = process;
+  pss->osc = osc_scanner_new();
+  if (server->binary_output) {
+    pss->inband = xmalloc(sizeof(inband_detector_t));
+    memset(pss->inband, 0, sizeof(inband_detector_t));
+  }
   lws_callback_on_writable(pss->wsi);
 
   return true;
@@ -181,23 +405,159 @@ static bool spawn_process(struct pss_tty *pss, uint16_t columns, uint16_t rows)
 
 static void wsi_output(struct lws *wsi, pty_buf_t *buf) {
   if (buf == NULL) return;
-  char *message = xmalloc(LWS_PRE + 1 + buf->len);
+  PROFILE_ENTER(PROF_WSI_OUTPUT);
+  char *message = pool_alloc(LWS_PRE + 1 + buf->len);
   char *ptr = message + LWS_PRE;
 
   *ptr = OUTPUT;
   memcpy(ptr + 1, buf->base, buf->len);
   size_t n = buf->len + 1;
+  CMDR_PROBE2(ws__send, wsi, n);
 
   if (lws_write(wsi, (unsigned char *)ptr, n, LWS_WRITE_BINARY) < n) {
     lwsl_err("write OUTPUT to WS\n");
   }
 
+  pool_free(message);
+  PROFILE_LEAVE(PROF_WSI_OUTPUT);
+}
+
+static void wsi_window_title(struct lws *wsi, struct pss_tty *pss) {
+  size_t len = strlen(pss->title);
+  char *message = pool_alloc(LWS_PRE + 1 + len);
+  char *ptr = message + LWS_PRE;
+
+  *ptr = SET_WINDOW_TITLE;
+  memcpy(ptr + 1, pss->title, len);
+  if (lws_write(wsi, (unsigned char *)ptr, len + 1, LWS_WRITE_BINARY) < len + 1) {
+    lwsl_err("write SET_WINDOW_TITLE to WS\n");
+  }
+  pss->title_pending = false;
+  pool_free(message);
+}
+
+static void wsi_terminal_mode(struct lws *wsi, struct pss_tty *pss) {
+  unsigned char message[LWS_PRE + 2];
+  unsigned char *p = &message[LWS_PRE];
+
+  p[0] = TERMINAL_MODE;
+  p[1] = (unsigned char)('0' + (pss->process->mode & (PTY_MODE_ECHO | PTY_MODE_CANONICAL)));
+  if (lws_write(wsi, p, 2, LWS_WRITE_BINARY) < 2) {
+    lwsl_err("write TERMINAL_MODE to WS\n");
+  }
+  pss->mode_pending = false;
+}
+
+static void wsi_screen_frame(struct lws *wsi, struct pss_tty *pss) {
+  size_t len = 0;
+  char *message = screen_transport_frame(pss->screen, LWS_PRE + 1, &len);
+  pss->screen->last_frame_ms = uv_now(server->loop);
+  if (message == NULL) return;
+
+  char *ptr = message + LWS_PRE;
+  *ptr = SCREEN_FRAME;
+  if (lws_write(wsi, (unsigned char *)ptr, len + 1, LWS_WRITE_BINARY) < len + 1) {
+    lwsl_err("write SCREEN_FRAME to WS\n");
+  }
+
   free(message);
 }
 
-static bool check_auth(struct lws *wsi, struct pss_tty *pss) {
+// trigger matches since the last TRIGGER_EVENT, as the /api/sessions/{id}/events JSON
+static void wsi_trigger_events(struct lws *wsi, struct pss_tty *pss) {
+  persistent_session_t *session = pss->persistent_session;
+  size_t len = 0;
+  char *message = persistent_session_get_events_json(session, pss->event_sent, LWS_PRE + 1, &len);
+  pss->event_sent = session->event_seq;
+
+  char *ptr = message + LWS_PRE;
+  *ptr = TRIGGER_EVENT;
+  if (lws_write(wsi, (unsigned char *)ptr, len + 1, LWS_WRITE_BINARY) < len + 1) {
+    lwsl_err("write TRIGGER_EVENT to WS\n");
+  }
+  free(message);
+}
+
+static void wsi_scrollback(struct lws *wsi, struct pss_tty *pss) {
+  unsigned char *ptr = (unsigned char *)pss->scrollback + LWS_PRE;
+  if (lws_write(wsi, ptr, pss->scrollback_len, LWS_WRITE_BINARY) < pss->scrollback_len) {
+    lwsl_err("write SCROLLBACK to WS\n");
+  }
+  free(pss->scrollback);
+  pss->scrollback = NULL;
+  pss->scrollback_len = 0;
+}
+
+// FETCH_SCROLLBACK: {"start": n} pages forward from line n, {"end": n} backward from line n,
+// {"skip": n} backward leaving out the n newest lines the client still has. The reply is
+// "<first>;<end>;<oldest>;" followed by the raw output of lines [first, end) from the
+// persistent session buffer.
+static void fetch_scrollback(struct pss_tty *pss, const char *data, size_t len) {
+  json_tokener *tok = json_tokener_new();
+  PROFILE_ENTER(PROF_JSON);
+  json_object *obj = json_tokener_parse_ex(tok, data, (int)len);
+  PROFILE_LEAVE(PROF_JSON);
+  struct json_object *o = NULL;
+  int64_t count = SCROLLBACK_PAGE_LINES;
+  if (json_object_object_get_ex(obj, "count", &o)) count = json_object_get_int64(o);
+  if (count < 1) count = 1;
+  if (count > SCROLLBACK_PAGE_LINES_MAX) count = SCROLLBACK_PAGE_LINES_MAX;
+
+  terminal_buffer_t *buffer = pss->persistent_session != NULL ? pss->persistent_session->buffer : NULL;
+  uint64_t oldest = 0, first = 0, end = 0;
+  char *lines = NULL;
+  size_t lines_len = 0;
+  if (buffer != NULL) {
+    oldest = terminal_buffer_oldest_line(buffer);
+    if (json_object_object_get_ex(obj, "start", &o)) {
+      int64_t start = json_object_get_int64(o);
+      first = start > 0 ? (uint64_t)start : 0;
+      end = first + (uint64_t)count;
+      lines = terminal_buffer_read_lines(buffer, &first, &end, SCROLLBACK_PAGE_BYTES_MAX, false, &lines_len);
+    } else {
+      end = terminal_buffer_end_line(buffer);
+      if (json_object_object_get_ex(obj, "end", &o)) {
+        int64_t e = json_object_get_int64(o);
+        if (e >= 0 && (uint64_t)e < end) end = (uint64_t)e;
+      } else if (json_object_object_get_ex(obj, "skip", &o)) {
+        int64_t skip = json_object_get_int64(o);
+        if (skip > 0) end = (uint64_t)skip < end ? end - (uint64_t)skip : 0;
+      }
+      first = end > (uint64_t)count ? end - (uint64_t)count : 0;
+      lines = terminal_buffer_read_lines(buffer, &first, &end, SCROLLBACK_PAGE_BYTES_MAX, true, &lines_len);
+    }
+  }
+  json_object_put(obj);
+  json_tokener_free(tok);
+
+  char header[80];
+  int n = snprintf(header, sizeof(header), "%c%llu;%llu;%llu;", SCROLLBACK, (unsigned long long)first,
+                   (unsigned long long)end, (unsigned long long)oldest);
+
+  // a newer request supersedes a reply that has not been sent yet
+  if (pss->scrollback != NULL) free(pss->scrollback);
+  pss->scrollback = xmalloc(LWS_PRE + n + lines_len);
+  memcpy(pss->scrollback + LWS_PRE, header, n);
+  if (lines != NULL) {
+    memcpy(pss->scrollback + LWS_PRE + n, lines, lines_len);
+    free(lines);
+  }
+  pss->scrollback_len = n + lines_len;
+  lws_callback_on_writable(pss->wsi);
+}
+
+// the user name from --auth-header, NULL without the header
+static char *auth_user(struct lws *wsi) {
+  char user[256];
+  if (lws_hdr_custom_copy(wsi, user, sizeof(user), server->auth_header, strlen(server->auth_header)) <= 0) return NULL;
+  return strdup(user);
+}
+
+static bool check_auth(struct lws *wsi) {
   if (server->auth_header != NULL) {
-    return lws_hdr_custom_copy(wsi, pss->user, sizeof(pss->user), server->auth_header, strlen(server->auth_header)) > 0;
+    char *user = auth_user(wsi);
+    free(user);
+    return user != NULL;
   }
 
   if (server->credential != NULL) {
@@ -211,8 +571,8 @@ static bool check_auth(struct lws *wsi, struct pss_tty *pss) {
 
 int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
   struct pss_tty *pss = (struct pss_tty *)user;
-  char buf[256];
-  size_t n = 0;
+  char buf[256] = {0};
+  int n = 0;
 
   switch (reason) {
     case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
@@ -224,14 +584,20 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         lwsl_warn("refuse to serve WS client due to the --max-clients option.\n");
         return 1;
       }
-      if (!check_auth(wsi, pss)) return 1;
+      if (!check_auth(wsi)) return 1;
 
-      n = lws_hdr_copy(wsi, pss->path, sizeof(pss->path), WSI_TOKEN_GET_URI);
+      // nothing is kept in pss here, CLOSED skips connections that were never established
+      n = lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_GET_URI);
 #if defined(LWS_ROLE_H2)
-      if (n <= 0) n = lws_hdr_copy(wsi, pss->path, sizeof(pss->path), WSI_TOKEN_HTTP_COLON_PATH);
+      if (n <= 0) n = lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_COLON_PATH);
 #endif
-      if (strncmp(pss->path, endpoints.ws, n) != 0) {
-        lwsl_warn("refuse to serve WS client for illegal ws path: %s\n", pss->path);
+      // -1 when the path does not fit, and then buf holds nothing to compare
+      if (n <= 0) {
+        lwsl_warn("refuse to serve WS client without a usable ws path\n");
+        return 1;
+      }
+      if (strcmp(buf, endpoints.ws) != 0) {
+        lwsl_warn("refuse to serve WS client for illegal ws path: %s\n", buf);
         return 1;
       }
 
@@ -248,8 +614,13 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       pss->authenticated = false;
       pss->wsi = wsi;
       pss->lws_close_status = LWS_CLOSE_STATUS_NOSTATUS;
-      // Initialize default shell to empty (will be set from JSON message)
-      pss->default_shell[0] = '\0';
+      pss->read_ahead = READ_AHEAD_DEFAULT;
+      pss->buffer_size = 0;
+      pss->client_paused = false;
+      pss->frame_interval_ms = 0;
+      pss->last_output_ms = 0;
+      // default shell and session id are set from the JSON message
+      if (server->auth_header != NULL) pss->user = auth_user(wsi);
 
       if (server->url_arg) {
         while (lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, n++) > 0) {
@@ -263,8 +634,9 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
       server->client_count++;
 
-      lws_get_peer_simple(lws_get_network_wsi(wsi), pss->address, sizeof(pss->address));
-      lwsl_notice("WS   %s - %s, clients: %d\n", pss->path, pss->address, server->client_count);
+      lws_get_peer_simple(lws_get_network_wsi(wsi), buf, sizeof(buf));
+      pss->address = strdup(buf);
+      lwsl_notice("WS   %s - %s, clients: %d\n", endpoints.ws, pss->address, server->client_count);
       break;
 
     case LWS_CALLBACK_SERVER_WRITEABLE:
@@ -289,21 +661,59 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         return 1;
       }
 
+      if (pss->title_pending && pss->title != NULL) {
+        wsi_window_title(wsi, pss);
+        lws_callback_on_writable(wsi);
+        break;
+      }
+
+      if (pss->mode_pending && pss->process != NULL) {
+        wsi_terminal_mode(wsi, pss);
+        lws_callback_on_writable(wsi);
+        break;
+      }
+
+      if (pss->scrollback != NULL) {
+        wsi_scrollback(wsi, pss);
+        lws_callback_on_writable(wsi);
+        break;
+      }
+
+      if (pss->persistent_session != NULL && pss->persistent_session->event_seq > pss->event_sent) {
+        wsi_trigger_events(wsi, pss);
+        lws_callback_on_writable(wsi);
+        break;
+      }
+
+      if (pss->screen != NULL) {
+        if (screen_transport_ready(pss->screen)) wsi_screen_frame(wsi, pss);
+        break;
+      }
+
       if (pss->pty_buf != NULL) {
+        // frameRateLimit: hold the output back, later reads are coalesced into the same frame
+        if (pss->frame_interval_ms > 0 && !pss->in_transfer &&
+            uv_now(server->loop) < pss->last_output_ms + pss->frame_interval_ms) {
+          schedule_frame(pss);
+          break;
+        }
+        pss->last_output_ms = uv_now(server->loop);
+        uint64_t trace_ts = TRACE_ON ? trace_now() : 0;
         wsi_output(wsi, pss->pty_buf);
+        if (TRACE_ON) trace_span("lws_write", "output", trace_ts, pss->trace_id, TRACE_FLOW_END, pss->pty_buf->len);
         pty_buf_free(pss->pty_buf);
         pss->pty_buf = NULL;
-        pty_resume(pss->process);
+        if (!pss->client_paused) pty_resume(pss->process);
       }
       break;
 
     case LWS_CALLBACK_RECEIVE:
       if (pss->buffer == NULL) {
-        pss->buffer = xmalloc(len);
+        pss->buffer = pool_alloc(len);
         pss->len = len;
         memcpy(pss->buffer, in, len);
       } else {
-        pss->buffer = xrealloc(pss->buffer, pss->len + len);
+        pss->buffer = pool_realloc(pss->buffer, pss->len + len);
         memcpy(pss->buffer + pss->len, in, len);
         pss->len += len;
       }
@@ -320,11 +730,23 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       if (lws_remaining_packet_payload(wsi) > 0 || !lws_is_final_fragment(wsi)) {
         return 0;
       }
+      CMDR_PROBE3(ws__receive, wsi, command, pss->len);
 
       switch (command) {
         case INPUT:
           if (!server->writable) break;
+          // prompts like getpass() may flip echo before printing anything
+          check_terminal_mode(pss);
+          uint64_t trace_ts = 0;
+          if (TRACE_ON) {
+            trace_ts = trace_now();
+            trace_set_flow(trace_new_id());
+          }
           int err = pty_write(pss->process, pty_buf_init(pss->buffer + 1, pss->len - 1));
+          if (TRACE_ON) {
+            trace_span("ws_receive", "input", trace_ts, trace_flow(), TRACE_FLOW_BEGIN, pss->len - 1);
+            trace_set_flow(0);
+          }
           if (err) {
             lwsl_err("uv_write: %s (%s)\n", uv_err_name(err), uv_strerror(err));
             return -1;
@@ -334,28 +756,50 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
           if (pss->process == NULL) break;
           json_object_put(
               parse_window_size(pss->buffer + 1, pss->len - 1, &pss->process->columns, &pss->process->rows));
-          pty_resize(pss->process);
+          pty_resize_coalesced(pss->process);
+          if (pss->screen != NULL) {
+            screen_transport_resize(pss->screen, pss->process->columns, pss->process->rows);
+            schedule_frame(pss);
+          }
+          break;
+        case ACK_STATE:
+          if (pss->screen == NULL) break;
+          {
+            char num[24];
+            size_t num_len = pss->len - 1 < sizeof(num) - 1 ? pss->len - 1 : sizeof(num) - 1;
+            memcpy(num, pss->buffer + 1, num_len);
+            num[num_len] = '\0';
+            if (screen_transport_ack(pss->screen, strtoull(num, NULL, 10)) && pss->screen->model->dirty)
+              schedule_frame(pss);
+          }
           break;
         case PAUSE:
+          pss->client_paused = true;
           pty_pause(pss->process);
           break;
         case RESUME:
-          pty_resume(pss->process);
+          pss->client_paused = false;
+          // reading restarts once the queued output is out
+          if (pss->pty_buf == NULL || pss->pty_buf->len < read_ahead(pss)) pty_resume(pss->process);
+          break;
+        case FLOW_REPORT:
+          apply_flow_report(pss, pss->buffer + 1, pss->len - 1);
+          break;
+        case FETCH_SCROLLBACK:
+          fetch_scrollback(pss, pss->buffer + 1, pss->len - 1);
           break;
         case JSON_DATA:
           // Quick check if this is an update message - allow it even with active process
           {
             bool is_update_message = false;
             if (pss->len > 20) { // Minimum length for {"type":"update"}
-              char *buf_str = malloc(pss->len + 1);
-              if (buf_str) {
-                memcpy(buf_str, pss->buffer, pss->len);
-                buf_str[pss->len] = '\0';
-                if (strstr(buf_str, "\"type\":\"update\"")) {
-                  is_update_message = true;
-                }
-                free(buf_str);
+              char *buf_str = pool_alloc(pss->len + 1);
+              memcpy(buf_str, pss->buffer, pss->len);
+              buf_str[pss->len] = '\0';
+              if (strstr(buf_str, "\"type\":\"update\"")) {
+                is_update_message = true;
               }
+              pool_free(buf_str);
             }
             
             if (pss->process != NULL && !is_update_message) break;
@@ -376,20 +820,7 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
                   lwsl_user("Received update message: action=%s\n", action);
                   
                   // Send immediate response that we're checking
-                  json_object *response = json_object_new_object();
-                  json_object_object_add(response, "type", json_object_new_string("update_status"));
-                  json_object_object_add(response, "status", json_object_new_string("checking"));
-                  json_object_object_add(response, "message", json_object_new_string("Checking for updates from cloud backend..."));
-                  
-                  const char *response_str = json_object_to_json_string(response);
-                  size_t response_len = strlen(response_str);
-                  unsigned char *response_buf = malloc(LWS_PRE + response_len);
-                  if (response_buf) {
-                    memcpy(response_buf + LWS_PRE, response_str, response_len);
-                    lws_write(wsi, response_buf + LWS_PRE, response_len, LWS_WRITE_TEXT);
-                    free(response_buf);
-                  }
-                  json_object_put(response);
+                  server_send_update_status(wsi, "checking", "Checking for updates from cloud backend...", NULL);
                   
                   // Handle the update request
                   server_handle_update_message(wsi, action, NULL);
@@ -415,24 +846,37 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
             }
           }
           
+          // Lines the client keeps locally, replayed on reattach; older ones are fetched on demand
+          size_t replay_lines = 0;
+          struct json_object *scrollback_obj = NULL;
+          if (json_object_object_get_ex(obj, "scrollback", &scrollback_obj)) {
+            int lines = json_object_get_int(scrollback_obj);
+            if (lines > 0) replay_lines = (size_t)lines;
+          }
+
           // Parse sessionId if provided
           struct json_object *session_obj = NULL;
           if (json_object_object_get_ex(obj, "sessionId", &session_obj)) {
             const char *session_id = json_object_get_string(session_obj);
             if (session_id != NULL && strlen(session_id) > 0) {
-              strncpy(pss->session_id, session_id, sizeof(pss->session_id) - 1);
-              pss->session_id[sizeof(pss->session_id) - 1] = '\0';
+              free(pss->session_id);
+              pss->session_id = strdup(session_id);
               lwsl_notice("Session ID set to: %s\n", pss->session_id);
               
               // Create or attach to persistent session
               if (server->persistent_registry) {
                 char *cwd = getcwd(NULL, 0);
                 pss->persistent_session = persistent_session_handle_websocket_connection(
-                    server->persistent_registry, session_id, pss, wsi, cwd);
+                    server->persistent_registry, session_id, pss, wsi, cwd, replay_lines);
                 if (cwd) free(cwd);
                 
                 if (pss->persistent_session) {
                   lwsl_notice("Connected to persistent session: %s\n", session_id);
+                  // restore the last title the program set, sent after the initial messages
+                  if (pss->persistent_session->title != NULL) {
+                    pss->title = strdup(pss->persistent_session->title);
+                    pss->title_pending = true;
+                  }
                 } else {
                   lwsl_err("Failed to create/connect to persistent session: %s\n", session_id);
                 }
@@ -450,38 +894,94 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
                   }
                 } else {
                   lwsl_notice("Creating new legacy session: %s\n", session_id);
-                  session = session_create(server->session_mgr, session_id, "bash", getcwd(NULL, 0));
+                  char *cwd = getcwd(NULL, 0);
+                  session = session_create(server->session_mgr, session_id, "bash", cwd);
+                  free(cwd);
                 }
               }
             }
           } else {
             // Default session if none specified
-            strcpy(pss->session_id, "default");
+            free(pss->session_id);
+            pss->session_id = strdup("default");
             
             // Create default persistent session
             if (server->persistent_registry) {
               char *cwd = getcwd(NULL, 0);
               pss->persistent_session = persistent_session_handle_websocket_connection(
-                  server->persistent_registry, "default", pss, wsi, cwd);
+                  server->persistent_registry, "default", pss, wsi, cwd, replay_lines);
               if (cwd) free(cwd);
             }
           }
           
+          // Output triggers of the session, an empty list clears them. They are saved with the
+          // session, so read-only clients can't change them. Matches from before this connection
+          // are left to /api/sessions/{id}/events.
+          struct json_object *triggers_obj = NULL;
+          if (pss->persistent_session != NULL) {
+            if (server->writable && json_object_object_get_ex(obj, "triggers", &triggers_obj) &&
+                json_object_is_type(triggers_obj, json_type_array)) {
+              size_t count = json_object_array_length(triggers_obj);
+              char **patterns = xmalloc((count + 1) * sizeof(char *));
+              for (size_t i = 0; i < count; i++)
+                patterns[i] = (char *)json_object_get_string(json_object_array_get_idx(triggers_obj, i));
+              persistent_session_set_triggers(pss->persistent_session, patterns, count);
+              free(patterns);
+            }
+            pss->event_sent = pss->persistent_session->event_seq;
+          }
+
           // Parse defaultShell if provided
           struct json_object *shell_obj = NULL;
           if (json_object_object_get_ex(obj, "defaultShell", &shell_obj)) {
             const char *shell_path = json_object_get_string(shell_obj);
             if (shell_path != NULL && strlen(shell_path) > 0) {
-              strncpy(pss->default_shell, shell_path, sizeof(pss->default_shell) - 1);
-              pss->default_shell[sizeof(pss->default_shell) - 1] = '\0';
+              free(pss->default_shell);
+              pss->default_shell = strdup(shell_path);
               lwsl_notice("Default shell set to: %s\n", pss->default_shell);
             } else {
-              strcpy(pss->default_shell, "/usr/bin/bash"); // fallback to bash
+              free(pss->default_shell);
+              pss->default_shell = strdup("/usr/bin/bash"); // fallback to bash
             }
           } else {
-            strcpy(pss->default_shell, "/usr/bin/bash"); // fallback to bash
+            free(pss->default_shell);
+            pss->default_shell = strdup("/usr/bin/bash"); // fallback to bash
           }
           
+          // Opt into the screen-diff transport for high-latency links
+          struct json_object *transport_obj = NULL;
+          if (json_object_object_get_ex(obj, "transport", &transport_obj)) {
+            const char *transport = json_object_get_string(transport_obj);
+            if (transport != NULL && strcmp(transport, "screen") == 0) {
+              if (server->binary_output) {
+                // zmodem/trzsz need the output bytes, which the screen model would render instead
+                lwsl_warn("screen-diff transport refused for %s: zmodem/trzsz is enabled\n", pss->address);
+              } else {
+                pss->screen = screen_transport_new(columns, rows);
+                lwsl_notice("using screen-diff transport for %s\n", pss->address);
+              }
+            }
+          }
+
+          // Output policy from the client's performance settings
+          struct json_object *policy_obj = NULL;
+          if (json_object_object_get_ex(obj, "bufferSize", &policy_obj)) {
+            int64_t size = json_object_get_int64(policy_obj);
+            if (size > 0) {
+              if (size < BUFFER_SIZE_MIN) size = BUFFER_SIZE_MIN;
+              if (size > READ_AHEAD_MAX) size = READ_AHEAD_MAX;
+              pss->buffer_size = (size_t)size;
+              pss->read_ahead = pss->buffer_size < READ_AHEAD_DEFAULT ? pss->buffer_size : READ_AHEAD_DEFAULT;
+            }
+          }
+          if (json_object_object_get_ex(obj, "frameRateLimit", &policy_obj)) {
+            int fps = json_object_get_int(policy_obj);
+            pss->frame_interval_ms = fps > 0 && fps < 1000 ? 1000 / fps : 0;
+          }
+          if (pss->buffer_size > 0 || pss->frame_interval_ms > 0)
+            lwsl_notice("output policy for %s: read-ahead %zu bytes, frame interval %u ms\n", pss->address,
+                        pss->read_ahead, pss->frame_interval_ms);
+
           json_object_put(obj);
           if (!spawn_process(pss, columns, rows)) return 1;
           break;
@@ -491,7 +991,7 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       }
 
       if (pss->buffer != NULL) {
-        free(pss->buffer);
+        pool_free(pss->buffer);
         pss->buffer = NULL;
       }
       break;
@@ -509,11 +1009,35 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         pss->persistent_session = NULL;
       }
       
-      if (pss->buffer != NULL) free(pss->buffer);
+      if (pss->buffer != NULL) pool_free(pss->buffer);
       if (pss->pty_buf != NULL) pty_buf_free(pss->pty_buf);
+      if (pss->scrollback != NULL) free(pss->scrollback);
+      if (pss->frame_timer != NULL) {
+        uv_timer_stop(pss->frame_timer);
+        pss->frame_timer->data = NULL;
+        uv_close((uv_handle_t *)pss->frame_timer, frame_timer_close_cb);
+        pss->frame_timer = NULL;
+      }
+      if (pss->screen != NULL) {
+        screen_transport_free(pss->screen);
+        pss->screen = NULL;
+      }
+      if (pss->osc != NULL) osc_scanner_free(pss->osc);
+      free(pss->inband);
+      attach_end(pss, -1);
+      if (pss->utf8.replaced > 0)
+        lwsl_notice("replaced %llu invalid UTF-8 sequences in %llu frames\n", (unsigned long long)pss->utf8.replaced,
+                    (unsigned long long)pss->utf8.slow_frames);
+      if (pss->title != NULL) free(pss->title);
+      free(pss->user);
+      free(pss->address);
+      free(pss->session_id);
+      // the process only read argv at spawn time
+      free(pss->default_shell);
       for (int i = 0; i < pss->argc; i++) {
         free(pss->args[i]);
       }
+      free(pss->args);
 
       if (pss->process != NULL) {
         ((pty_ctx_t *)pss->process->ctx)->ws_closed = true;
@@ -7,8 +7,10 @@
 #include <unistd.h>
 
 #ifndef _WIN32
+#include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <termios.h>
 
 #if defined(__OpenBSD__) || defined(__APPLE__)
 #include <util.h>
@@ -26,7 +28,11 @@ extern char **environ;
 #endif
 #endif
 
+#include "pool.h"
+#include "probes.h"
+#include "profile.h"
 #include "pty.h"
+#include "trace.h"
 #include "utils.h"
 
 #ifdef _WIN32
@@ -36,7 +42,7 @@ void (WINAPI *pClosePseudoConsole)(HPCON);
 #endif
 
 static void alloc_cb(uv_handle_t *unused, size_t suggested_size, uv_buf_t *buf) {
-  buf->base = xmalloc(suggested_size);
+  buf->base = pool_alloc(suggested_size);
   buf->len = suggested_size;
 }
 
@@ -47,8 +53,8 @@ static void async_free_cb(uv_handle_t *handle) {
 }
 
 pty_buf_t *pty_buf_init(char *base, size_t len) {
-  pty_buf_t *buf = xmalloc(sizeof(pty_buf_t));
-  buf->base = xmalloc(len);
+  pty_buf_t *buf = pool_alloc(sizeof(pty_buf_t));
+  buf->base = pool_alloc(len);
   memcpy(buf->base, base, len);
   buf->len = len;
   return buf;
@@ -56,28 +62,57 @@ pty_buf_t *pty_buf_init(char *base, size_t len) {
 
 void pty_buf_free(pty_buf_t *buf) {
   if (buf == NULL) return;
-  if (buf->base != NULL) free(buf->base);
-  free(buf);
+  pool_free(buf->base);
+  pool_free(buf);
 }
 
 static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
-  uv_read_stop(stream);
   pty_process *process = (pty_process *) stream->data;
-  if (n <= 0) {
-    if (n == UV_ENOBUFS || n == 0) return;
+  if (n == UV_ENOBUFS || n == 0) {
+    // nothing read (EAGAIN), keep reading
+    pool_free(buf->base);
+    return;
+  }
+  PROFILE_ENTER(PROF_READ_CB);
+  // one read per resume, the owner decides when to read again
+  uv_read_stop(stream);
+  process->paused = true;
+  if (n < 0) {
     process->read_cb(process, NULL, true);
     goto done;
   }
+  uint64_t trace_ts = 0;
+  if (TRACE_ON) {
+    trace_ts = trace_now();
+    trace_set_flow(trace_new_id());
+  }
+  CMDR_PROBE2(pty__read, process->pid, n);
   process->read_cb(process, pty_buf_init(buf->base, (size_t) n), false);
+  if (TRACE_ON) {
+    trace_span("pty_read", "output", trace_ts, trace_flow(), TRACE_FLOW_BEGIN, (uint64_t) n);
+    trace_set_flow(0);
+  }
 
 done:
-  free(buf->base);
+  pool_free(buf->base);
+  PROFILE_LEAVE(PROF_READ_CB);
 }
 
+typedef struct {
+  uv_write_t req;
+  int pid;
+  uint64_t trace_id;
+  uint64_t trace_ts;
+} write_req_t;
+
 static void write_cb(uv_write_t *req, int unused) {
+  write_req_t *wr = (write_req_t *) req;
   pty_buf_t *buf = (pty_buf_t *) req->data;
+  CMDR_PROBE3(pty__write__done, req, wr->pid, buf->len);
+  if (TRACE_ON && wr->trace_ts != 0)
+    trace_span("pty_write", "input", wr->trace_ts, wr->trace_id, TRACE_FLOW_END, buf->len);
   pty_buf_free(buf);
-  free(req);
+  pool_free(wr);
 }
 
 pty_process *process_init(void *ctx, uv_loop_t *loop, char *argv[], char *envp[]) {
@@ -107,11 +142,12 @@ void process_free(pty_process *process) {
   if (process->pty != NULL) pClosePseudoConsole(process->pty);
   if (process->handle != NULL) CloseHandle(process->handle);
 #else
-  close(process->pty);
-  uv_thread_join(&process->tid);
+  // a failed spawn has no PTY
+  if (process->pid > 0) close(process->pty);
 #endif
   if (process->in != NULL) uv_close((uv_handle_t *) process->in, close_cb);
   if (process->out != NULL) uv_close((uv_handle_t *) process->out, close_cb);
+  if (process->resize_timer != NULL) uv_close((uv_handle_t *) process->resize_timer, close_cb);
   if (process->argv != NULL) free(process->argv);
   if (process->cwd != NULL) free(process->cwd);
   char **p = process->envp;
@@ -122,12 +158,16 @@ void process_free(pty_process *process) {
 void pty_pause(pty_process *process) {
   if (process == NULL) return;
   if (process->paused) return;
+  CMDR_PROBE1(pty__pause, process->pid);
   uv_read_stop((uv_stream_t *) process->out);
+  process->paused = true;
 }
 
 void pty_resume(pty_process *process) {
   if (process == NULL) return;
   if (!process->paused) return;
+  CMDR_PROBE1(pty__resume, process->pid);
+  process->paused = false;
   process->out->data = process;
   uv_read_start((uv_stream_t *) process->out, alloc_cb, read_cb);
 }
@@ -138,9 +178,13 @@ int pty_write(pty_process *process, pty_buf_t *buf) {
     return UV_ESRCH;
   }
   uv_buf_t b = uv_buf_init(buf->base, buf->len);
-  uv_write_t *req = xmalloc(sizeof(uv_write_t));
-  req->data = buf;
-  return uv_write(req, (uv_stream_t *) process->in, &b, 1, write_cb);
+  write_req_t *wr = pool_alloc(sizeof(write_req_t));
+  wr->req.data = buf;
+  wr->pid = process->pid;
+  CMDR_PROBE3(pty__write, &wr->req, process->pid, buf->len);
+  wr->trace_id = TRACE_ON ? trace_flow() : 0;
+  wr->trace_ts = TRACE_ON ? trace_now() : 0;
+  return uv_write(&wr->req, (uv_stream_t *) process->in, &b, 1, write_cb);
 }
 
 bool pty_resize(pty_process *process) {
@@ -155,6 +199,33 @@ bool pty_resize(pty_process *process) {
 #endif
 }
 
+static void resize_timer_cb(uv_timer_t *timer) {
+  pty_process *process = (pty_process *) timer->data;
+  process->resize_at = uv_now(process->loop);
+  pty_resize(process);
+}
+
+// Dragging a window sends dozens of sizes per second, and full-screen programs repaint on
+// every SIGWINCH. The first change of a burst is applied at once, later ones only leave
+// columns/rows behind for a single trailing resize, so the PTY sees at most one size per
+// PTY_RESIZE_INTERVAL ms and always ends up at the latest.
+void pty_resize_coalesced(pty_process *process) {
+  if (process == NULL) return;
+  if (process->resize_timer != NULL && uv_is_active((uv_handle_t *) process->resize_timer)) return;
+  uint64_t now = uv_now(process->loop);
+  if (now - process->resize_at >= PTY_RESIZE_INTERVAL) {
+    process->resize_at = now;
+    pty_resize(process);
+    return;
+  }
+  if (process->resize_timer == NULL) {
+    process->resize_timer = xmalloc(sizeof(uv_timer_t));
+    uv_timer_init(process->loop, process->resize_timer);
+    process->resize_timer->data = process;
+  }
+  uv_timer_start(process->resize_timer, resize_timer_cb, process->resize_at + PTY_RESIZE_INTERVAL - now, 0);
+}
+
 bool pty_kill(pty_process *process, int sig) {
   if (process == NULL) return false;
 #ifdef _WIN32
@@ -164,6 +235,25 @@ bool pty_kill(pty_process *process, int sig) {
 #endif
 }
 
+// Refresh the cached ECHO/ICANON state of the slave side, returns true if it changed.
+// A single ioctl on the master, cheap enough to run on every read.
+bool pty_update_mode(pty_process *process) {
+  if (process == NULL) return false;
+#ifdef _WIN32
+  return false;
+#else
+  struct termios tio;
+  if (tcgetattr(process->pty, &tio) != 0) return false;
+
+  uint8_t mode = PTY_MODE_VALID;
+  if (tio.c_lflag & ECHO) mode |= PTY_MODE_ECHO;
+  if (tio.c_lflag & ICANON) mode |= PTY_MODE_CANONICAL;
+  if (mode == process->mode) return false;
+  process->mode = mode;
+  return true;
+#endif
+}
+
 #ifdef _WIN32
 bool conpty_init() {
   uv_lib_t kernel;
@@ -295,6 +385,7 @@ static void async_cb(uv_async_t *async) {
   GetExitCodeProcess(process->handle, &exit_code);
   process->exit_code = (int) exit_code;
   process->exit_signal = 1;
+  CMDR_PROBE3(process__exit, process->pid, process->exit_code, process->exit_signal);
   process->exit_cb(process);
 
   uv_close((uv_handle_t *) async, async_free_cb);
@@ -387,29 +478,39 @@ static bool fd_duplicate(int fd, uv_pipe_t *pipe) {
   return status == 0;
 }
 
-static void wait_cb(void *arg) {
-  pty_process *process = (pty_process *) arg;
-
-  pid_t pid;
-  int stat;
-  do
-    pid = waitpid(process->pid, &stat, 0);
-  while (pid != process->pid && errno == EINTR);
+// Spawned processes not reaped yet. One SIGCHLD watcher serves all of them, a waitpid thread
+// per process costs a stack for every idle connection.
+static pty_process *children = NULL;
+static uv_signal_t *sigchld = NULL;
+
+static void sigchld_cb(uv_signal_t *handle, int signum) {
+  // signals coalesce, so every child is polled
+  pty_process **p = &children;
+  while (*p != NULL) {
+    pty_process *process = *p;
+    int stat;
+    pid_t pid = waitpid(process->pid, &stat, WNOHANG);
+    if (pid == 0 || (pid < 0 && errno == EINTR)) {
+      p = &process->next_child;
+      continue;
+    }
+    *p = process->next_child;
 
-  if (WIFEXITED(stat)) {
-    process->exit_code = WEXITSTATUS(stat);
-  }
-  if (WIFSIGNALED(stat)) {
-    int sig = WTERMSIG(stat);
-    process->exit_code = 128 + sig;
-    process->exit_signal = sig;
+    if (pid == process->pid && WIFEXITED(stat)) {
+      process->exit_code = WEXITSTATUS(stat);
+    }
+    if (pid == process->pid && WIFSIGNALED(stat)) {
+      int sig = WTERMSIG(stat);
+      process->exit_code = 128 + sig;
+      process->exit_signal = sig;
+    }
+    uv_async_send(&process->async);
   }
-
-  uv_async_send(&process->async);
 }
 
 static void async_cb(uv_async_t *async) {
   pty_process *process = (pty_process *) async->data;
+  CMDR_PROBE3(process__exit, process->pid, process->exit_code, process->exit_signal);
   process->exit_cb(process);
 
   uv_close((uv_handle_t *) async, async_free_cb);
@@ -420,6 +521,12 @@ int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
   int status = 0;
 
   uv_disable_stdio_inheritance();
+  if (sigchld == NULL) {
+    sigchld = xmalloc(sizeof(uv_signal_t));
+    uv_signal_init(process->loop, sigchld);
+    uv_signal_start(sigchld, sigchld_cb, SIGCHLD);
+    uv_unref((uv_handle_t *) sigchld);
+  }
 
   int master, pid;
   struct winsize size = {process->rows, process->columns, 0, 0};
@@ -472,7 +579,9 @@ int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
   process->exit_cb = exit_cb;
   process->async.data = process;
   uv_async_init(process->loop, &process->async, async_cb);
-  uv_thread_create(&process->tid, wait_cb, process);
+  // an exit before this point is still seen: the SIGCHLD callback runs on this thread, later
+  process->next_child = children;
+  children = process;
 
   return 0;
 
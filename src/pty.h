@@ -16,6 +16,14 @@
 bool conpty_init();
 #endif
 
+// line discipline flags of the PTY, see pty_update_mode()
+#define PTY_MODE_ECHO 0x01
+#define PTY_MODE_CANONICAL 0x02
+#define PTY_MODE_VALID 0x80
+
+// shortest gap between two window size changes applied to the PTY, see pty_resize_coalesced()
+#define PTY_RESIZE_INTERVAL 100
+
 typedef struct {
   char *base;
   size_t len;
@@ -36,7 +44,7 @@ struct pty_process_ {
   HANDLE wait;
 #else
   pid_t pty;
-  uv_thread_t tid;
+  pty_process *next_child;  // in the list waiting for SIGCHLD
 #endif
   char **argv;
   char **envp;
@@ -47,6 +55,9 @@ struct pty_process_ {
   uv_pipe_t *in;
   uv_pipe_t *out;
   bool paused;
+  uint8_t mode;  // PTY_MODE_* flags last seen on the PTY, 0 if never read
+  uv_timer_t *resize_timer;  // trailing resize of a burst, created on the first one
+  uint64_t resize_at;        // loop time of the last applied resize
 
   pty_read_cb read_cb;
   pty_exit_cb exit_cb;
@@ -63,6 +74,8 @@ void pty_pause(pty_process *process);
 void pty_resume(pty_process *process);
 int pty_write(pty_process *process, pty_buf_t *buf);
 bool pty_resize(pty_process *process);
+void pty_resize_coalesced(pty_process *process);
 bool pty_kill(pty_process *process, int sig);
+bool pty_update_mode(pty_process *process);
 
 #endif  // CMDR_PTY_H
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "redact.h"
+#include "utils.h"
+
+#define MASK '*'
+// leading bytes of an entropy match left readable, enough to tell which secret it was
+#define ENTROPY_KEEP 4
+#define PREFIX_MAX 32
+
+enum { CONT_NONE, CONT_PLAIN, CONT_MASK };
+
+static const struct {
+  const char *name;
+  const char *prefixes[8];
+} builtins[] = {
+    {"aws", {"AKIA", "ASIA", NULL}},
+    {"github", {"ghp_", "gho_", "ghu_", "ghs_", "ghr_", "github_pat_", NULL}},
+    {"gitlab", {"glpat-", NULL}},
+    {"slack", {"xoxb-", "xoxp-", "xoxa-", "xoxr-", "xoxs-", NULL}},
+    {"stripe", {"sk_live_", "rk_live_", NULL}},
+};
+
+static const char *assign_names[] = {"password", "passwd", "secret", "token", "api_key", "apikey", "access_key"};
+
+static inline bool is_token(unsigned char c) {
+  unsigned char l = c | 0x20;
+  return (l >= 'a' && l <= 'z') || (c >= '-' && c <= '9') || c == '+' || c == '=' || c == '_' || c == '~';
+}
+
+// bit i set if p[i] is a token byte
+static inline uint64_t token_mask(const unsigned char *p, size_t n) {
+  uint64_t m = 0;
+#if defined(__SSE2__)
+  if (n == 64) {
+    const __m128i lower_bit = _mm_set1_epi8(0x20);
+    for (int k = 0; k < 4; k++) {
+      __m128i c = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+      // unsigned range checks as signed compares: c - lo biased by 0x80, below n - 0x80
+      __m128i alpha = _mm_cmplt_epi8(_mm_sub_epi8(_mm_or_si128(c, lower_bit), _mm_set1_epi8((char)('a' + 0x80))),
+                                     _mm_set1_epi8((char)(26 - 0x80)));
+      __m128i digit = _mm_cmplt_epi8(_mm_sub_epi8(c, _mm_set1_epi8((char)('-' + 0x80))),
+                                     _mm_set1_epi8((char)('9' - '-' + 1 - 0x80)));
+      __m128i other = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('+')), _mm_cmpeq_epi8(c, _mm_set1_epi8('='))),
+                                   _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('_')), _mm_cmpeq_epi8(c, _mm_set1_epi8('~'))));
+      __m128i token = _mm_or_si128(_mm_or_si128(alpha, digit), other);
+      m |= (uint64_t)(uint16_t)_mm_movemask_epi8(token) << (16 * k);
+    }
+    return m;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) m |= (uint64_t)is_token(p[i]) << i;
+  return m;
+}
+
+// Start of the first run of REDACT_MIN_RUN token bytes in p[0 .. n), n if there is none.
+// Runs inside a block are found by and-ing the mask with itself shifted 1, 2, 4 and 8 bytes
+// (bit i is left set if bytes i .. i + 15 are all tokens); runs across blocks by the token
+// bytes ending the previous block.
+static size_t find_run(const unsigned char *p, size_t n) {
+  size_t run = 0;
+  for (size_t base = 0; base < n; base += 64) {
+    size_t len = n - base < 64 ? n - base : 64;
+    uint64_t m = token_mask(p + base, len);
+    size_t lead = m == UINT64_MAX ? 64 : (size_t)__builtin_ctzll(~m);
+    if (run + lead >= REDACT_MIN_RUN) return base - run;
+    uint64_t r = m;
+    r &= r >> 1;
+    r &= r >> 2;
+    r &= r >> 4;
+    r &= r >> 8;
+    if (r != 0) return base + (size_t)__builtin_ctzll(r);
+    run = len == 64 ? (size_t)__builtin_clzll(~m) : 0;
+  }
+  return n;
+}
+
+static bool has_assign_name(const char *name, size_t len) {
+  char lower[PREFIX_MAX + 1];
+  if (len > PREFIX_MAX) len = PREFIX_MAX;
+  for (size_t i = 0; i < len; i++) lower[i] = (char)(name[i] >= 'A' && name[i] <= 'Z' ? name[i] | 0x20 : name[i]);
+  lower[len] = '\0';
+  for (size_t i = 0; i < sizeof(assign_names) / sizeof(assign_names[0]); i++) {
+    if (strstr(lower, assign_names[i]) != NULL) return true;
+  }
+  return false;
+}
+
+static bool high_entropy(const redact_rules_t *rules, const unsigned char *run, size_t n) {
+  if (n > REDACT_ENTROPY_WINDOW) n = REDACT_ENTROPY_WINDOW;
+  bool seen[256] = {false};
+  int distinct = 0;
+  bool upper = false, lower = false, digit = false;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = run[i];
+    if (!seen[c]) {
+      seen[c] = true;
+      distinct++;
+    }
+    upper |= c >= 'A' && c <= 'Z';
+    lower |= c >= 'a' && c <= 'z';
+    digit |= c >= '0' && c <= '9';
+  }
+  return upper && lower && digit && distinct >= rules->min_distinct[n];
+}
+
+static size_t match_prefix(const redact_rules_t *rules, const char *s, size_t n) {
+  for (int i = 0; i < rules->prefix_count; i++) {
+    size_t len = strlen(rules->prefixes[i]);
+    if (n > len && memcmp(s, rules->prefixes[i], len) == 0) return len;
+  }
+  return 0;
+}
+
+// Length of the end of a CSI sequence starting the run, as "1m" after ESC [ (parameter digits
+// and letter final bytes are token bytes too), 0 if there is none
+static size_t csi_end(const char *before, size_t before_len, const char *run, size_t n) {
+  while (before_len > 0 && ((before[before_len - 1] >= '0' && before[before_len - 1] <= '9') || before[before_len - 1] == ';'))
+    before_len--;
+  if (before_len < 2 || before[before_len - 2] != 0x1b || before[before_len - 1] != '[') return 0;
+  size_t i = 0;
+  while (i < n && run[i] >= '0' && run[i] <= '9') i++;
+  return i < n && run[i] >= 0x40 && run[i] <= 0x7e ? i + 1 : 0;
+}
+
+// Offset in the run where masking starts, n if the run is not a secret
+static size_t judge(const redact_rules_t *rules, const char *run, size_t n, const char *before, size_t before_len) {
+  size_t skip = csi_end(before, before_len, run, n);
+  run += skip;
+  n -= skip;
+
+  size_t len = match_prefix(rules, run, n);
+  if (len > 0) return skip + len;
+  if (rules->bearer && before_len >= 7 && strncasecmp(before + before_len - 7, "bearer ", 7) == 0) return skip;
+  const char *eq = memchr(run, '=', n);
+  if (eq != NULL && eq > run) {
+    size_t value = eq - run + 1;
+    if ((len = match_prefix(rules, eq + 1, n - value)) > 0) return skip + value + len;
+    if (rules->assign && n - value >= 4 && has_assign_name(run, eq - run)) return skip + value;
+  }
+  if (rules->entropy && n >= REDACT_ENTROPY_MIN && high_entropy(rules, (const unsigned char *)run, n))
+    return skip + ENTROPY_KEEP;
+  return skip + n;
+}
+
+redact_rules_t *redact_rules_new() {
+  redact_rules_t *rules = xmalloc(sizeof(redact_rules_t));
+  memset(rules, 0, sizeof(redact_rules_t));
+  // 80% of the distinct characters expected in n random base64 ones, 64 (1 - (63/64)^n)
+  double miss = 1;
+  for (int n = 1; n <= REDACT_ENTROPY_WINDOW; n++) {
+    miss *= 63.0 / 64.0;
+    rules->min_distinct[n] = (uint8_t)(0.8 * 64 * (1 - miss));
+  }
+  return rules;
+}
+
+static void add_prefix(redact_rules_t *rules, const char *prefix) {
+  for (int i = 0; i < rules->prefix_count; i++) {
+    if (strcmp(rules->prefixes[i], prefix) == 0) return;
+  }
+  rules->prefixes = xrealloc(rules->prefixes, (rules->prefix_count + 1) * sizeof(char *));
+  rules->prefixes[rules->prefix_count++] = strdup(prefix);
+}
+
+static bool add_rule(redact_rules_t *rules, const char *name) {
+  if (strcmp(name, "none") == 0) return true;
+  if (strcmp(name, "bearer") == 0) {
+    rules->bearer = true;
+    return true;
+  }
+  if (strcmp(name, "assign") == 0) {
+    rules->assign = true;
+    return true;
+  }
+  if (strcmp(name, "entropy") == 0) {
+    rules->entropy = true;
+    return true;
+  }
+  if (strncmp(name, "prefix:", 7) == 0) {
+    const char *prefix = name + 7;
+    size_t len = strlen(prefix);
+    if (len == 0 || len > PREFIX_MAX) return false;
+    for (const char *p = prefix; *p; p++) {
+      if (!is_token((unsigned char)*p)) return false;
+    }
+    add_prefix(rules, prefix);
+    return true;
+  }
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (strcmp(name, builtins[i].name) != 0) continue;
+    for (const char *const *p = builtins[i].prefixes; *p; p++) add_prefix(rules, *p);
+    return true;
+  }
+  return false;
+}
+
+bool redact_rules_add(redact_rules_t *rules, const char *spec) {
+  char *copy = strdup(spec);
+  char *saveptr = NULL;
+  bool ok = true;
+  for (char *name = strtok_r(copy, ",", &saveptr); name != NULL && ok; name = strtok_r(NULL, ",", &saveptr))
+    ok = add_rule(rules, name);
+  free(copy);
+  return ok;
+}
+
+bool redact_rules_empty(const redact_rules_t *rules) {
+  return rules->prefix_count == 0 && !rules->bearer && !rules->assign && !rules->entropy;
+}
+
+void redact_rules_free(redact_rules_t *rules) {
+  if (rules == NULL) return;
+  for (int i = 0; i < rules->prefix_count; i++) free(rules->prefixes[i]);
+  free(rules->prefixes);
+  free(rules);
+}
+
+redactor_t *redactor_new(const redact_rules_t *rules) {
+  redactor_t *r = xmalloc(sizeof(redactor_t));
+  memset(r, 0, sizeof(redactor_t));
+  r->rules = rules;
+  return r;
+}
+
+void redactor_free(redactor_t *r) {
+  if (r == NULL) return;
+  free(r->copy);
+  free(r);
+}
+
+static char *scratch(redactor_t *r, size_t len) {
+  if (r->copy_size < len) {
+    r->copy = xrealloc(r->copy, len);
+    r->copy_size = len;
+  }
+  return r->copy;
+}
+
+static void emit(redactor_t *r, const char *data, size_t len, redact_cb out, void *ctx) {
+  if (len == 0) return;
+  out(ctx, data, len);
+  if (len >= REDACT_CONTEXT) {
+    memcpy(r->tail, data + len - REDACT_CONTEXT, REDACT_CONTEXT);
+    r->tail_len = REDACT_CONTEXT;
+    return;
+  }
+  size_t keep = r->tail_len + len > REDACT_CONTEXT ? REDACT_CONTEXT - len : r->tail_len;
+  memmove(r->tail, r->tail + r->tail_len - keep, keep);
+  memcpy(r->tail + keep, data, len);
+  r->tail_len = keep + len;
+}
+
+// bytes before data[pos], from the previous reads for a run near the start
+static size_t context(const redactor_t *r, const char *data, size_t pos, char *buf) {
+  size_t from_data = pos < REDACT_CONTEXT ? pos : REDACT_CONTEXT;
+  size_t from_tail = REDACT_CONTEXT - from_data;
+  if (from_tail > r->tail_len) from_tail = r->tail_len;
+  memcpy(buf, r->tail + r->tail_len - from_tail, from_tail);
+  memcpy(buf + from_tail, data + pos - from_data, from_data);
+  return from_tail + from_data;
+}
+
+// judges the held run as complete and passes it on, true if it was masked
+static bool release_hold(redactor_t *r, redact_cb out, void *ctx) {
+  bool masked = false;
+  if (r->hold_len >= REDACT_MIN_RUN) {
+    char before[REDACT_CONTEXT];
+    size_t before_len = context(r, r->hold, 0, before);
+    size_t m = judge(r->rules, r->hold, r->hold_len, before, before_len);
+    if (m < r->hold_len) {
+      memset(r->hold + m, MASK, r->hold_len - m);
+      r->masked++;
+      masked = true;
+    }
+  }
+  emit(r, r->hold, r->hold_len, out, ctx);
+  r->hold_len = 0;
+  return masked;
+}
+
+// Read with nothing pending from the previous one. With no run long enough for a rule it is
+// passed on as is, but for an unfinished run at its end.
+static void scan(redactor_t *r, const char *data, size_t len, redact_cb out, void *ctx) {
+  const unsigned char *p = (const unsigned char *)data;
+  size_t end = len;
+  while (end > 0 && is_token(p[end - 1])) end--;
+  if (len - end >= REDACT_HOLD) end = len;
+
+  char *copy = NULL;
+  for (size_t pos = find_run(p, end); pos < end;) {
+    size_t b = pos + REDACT_MIN_RUN;
+    while (b < end && is_token(p[b])) b++;
+    char before[REDACT_CONTEXT];
+    size_t before_len = context(r, data, pos, before);
+    size_t m = judge(r->rules, data + pos, b - pos, before, before_len);
+    if (m < b - pos) {
+      if (copy == NULL) copy = memcpy(scratch(r, end), data, end);
+      memset(copy + pos + m, MASK, b - pos - m);
+      r->masked++;
+    }
+    if (b == len) r->cont = m < b - pos ? CONT_MASK : CONT_PLAIN;
+    pos = b + find_run(p + b, end - b);
+  }
+  emit(r, copy != NULL ? copy : data, end, out, ctx);
+
+  memcpy(r->hold, data + end, len - end);
+  r->hold_len = len - end;
+}
+
+void redact_feed(redactor_t *r, const char *data, size_t len, redact_cb out, void *ctx) {
+  const unsigned char *p = (const unsigned char *)data;
+  size_t lead = 0;
+  if (r->hold_len > 0 || r->cont != CONT_NONE) {
+    while (lead < len && is_token(p[lead])) lead++;
+  }
+
+  // complete the run held back from the last read
+  if (r->hold_len > 0) {
+    size_t take = lead < REDACT_HOLD - r->hold_len ? lead : REDACT_HOLD - r->hold_len;
+    memcpy(r->hold + r->hold_len, data, take);
+    r->hold_len += take;
+    bool closed = take < len && take == lead;
+    if (!closed && r->hold_len < REDACT_HOLD) return;
+    bool masked = release_hold(r, out, ctx);
+    if (!closed) r->cont = masked ? CONT_MASK : CONT_PLAIN;
+    data += take;
+    len -= take;
+    lead -= take;
+  }
+
+  // rest of a run too long to hold, masked if its start was
+  if (r->cont != CONT_NONE) {
+    if (r->cont == CONT_MASK)
+      emit(r, memset(scratch(r, lead), MASK, lead), lead, out, ctx);
+    else
+      emit(r, data, lead, out, ctx);
+    if (lead < len) r->cont = CONT_NONE;
+    data += lead;
+    len -= lead;
+  }
+
+  if (len > 0) scan(r, data, len, out, ctx);
+}
+
+void redact_flush(redactor_t *r, redact_cb out, void *ctx) {
+  if (r->hold_len > 0) release_hold(r, out, ctx);
+  r->cont = CONT_NONE;
+}
@@ -0,0 +1,62 @@
+#ifndef CMDR_REDACT_H
+#define CMDR_REDACT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every rule looks at runs of token bytes (letters, digits and - . / + = _ ~) of at least this
+// length; the prefilter finds them 64 bytes at a time and everything shorter passes untouched
+#define REDACT_MIN_RUN 16
+// longest run carried over to the next read, a longer one is judged on its first bytes
+#define REDACT_HOLD 512
+// bytes before a run kept for the context rules ("Bearer ")
+#define REDACT_CONTEXT 8
+// entropy rule: shortest run it considers, and the window its character spread is measured on
+#define REDACT_ENTROPY_MIN 32
+#define REDACT_ENTROPY_WINDOW 64
+
+#define REDACT_DEFAULT "aws,github,gitlab,slack,stripe,bearer,assign,entropy"
+
+// Rules shared by every session, from --redact
+typedef struct {
+  char **prefixes;  // a run starting with one of these is masked after it
+  int prefix_count;
+  bool bearer;      // the run after "Bearer "
+  bool assign;      // the value of NAME=value when NAME mentions a password, secret, token or key
+  bool entropy;     // base64-like runs mixing upper, lower case and digits with a wide character spread
+  uint8_t min_distinct[REDACT_ENTROPY_WINDOW + 1];
+} redact_rules_t;
+
+typedef void (*redact_cb)(void *ctx, const char *data, size_t len);
+
+// Per-session stream state. Secrets are masked with '*' in place, so the output keeps the
+// length of the input; the tail of a read that could be the start of a secret is held back
+// until the next one.
+typedef struct {
+  const redact_rules_t *rules;
+  char tail[REDACT_CONTEXT];  // last bytes passed on, the context of a run starting the next read
+  size_t tail_len;
+  char hold[REDACT_HOLD];     // unfinished run at the end of the last read
+  size_t hold_len;
+  int cont;                   // the last read ended inside a run too long to hold
+  char *copy;                 // masked copy of a read, the input is never written to
+  size_t copy_size;
+  uint64_t masked;            // runs masked so far
+} redactor_t;
+
+redact_rules_t *redact_rules_new();
+// spec is a comma separated list of rule names (see REDACT_DEFAULT), prefix:<text> or none;
+// false if one of them is unknown
+bool redact_rules_add(redact_rules_t *rules, const char *spec);
+bool redact_rules_empty(const redact_rules_t *rules);
+void redact_rules_free(redact_rules_t *rules);
+
+redactor_t *redactor_new(const redact_rules_t *rules);
+void redactor_free(redactor_t *r);
+// passes data on to out, masked, in one or more pieces (none if all of it is held back)
+void redact_feed(redactor_t *r, const char *data, size_t len, redact_cb out, void *ctx);
+// passes on what is held back, for the end of the stream
+void redact_flush(redactor_t *r, redact_cb out, void *ctx);
+
+#endif  // CMDR_REDACT_H
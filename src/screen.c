@@ -0,0 +1,844 @@
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "screen.h"
+#include "utils.h"
+
+enum { STATE_GROUND, STATE_ESC, STATE_ESC_SKIP, STATE_CSI, STATE_STRING, STATE_STRING_ESC };
+
+#define CELL(s, x, y) (&(s)->cells[(size_t)(y) * (s)->cols + (x)])
+#define ROW_BYTES(s) ((size_t)(s)->cols * sizeof(screen_cell_t))
+
+// growable output buffer, `headroom` bytes are reserved in front for the caller
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} sbuf_t;
+
+static void sbuf_reserve(sbuf_t *sb, size_t n) {
+  if (sb->len + n <= sb->cap) return;
+  while (sb->len + n > sb->cap) sb->cap = sb->cap ? sb->cap * 2 : 4096;
+  sb->data = xrealloc(sb->data, sb->cap);
+}
+
+static void sbuf_put(sbuf_t *sb, const char *s, size_t n) {
+  sbuf_reserve(sb, n);
+  memcpy(sb->data + sb->len, s, n);
+  sb->len += n;
+}
+
+static void sbuf_printf(sbuf_t *sb, const char *fmt, ...) {
+  char tmp[64];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+  va_end(args);
+  if (n > 0) sbuf_put(sb, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+static void sbuf_put_utf8(sbuf_t *sb, uint32_t cp) {
+  char buf[4];
+  size_t n;
+  if (cp < 0x80) {
+    buf[0] = (char)cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    buf[0] = (char)(0xc0 | (cp >> 6));
+    buf[1] = (char)(0x80 | (cp & 0x3f));
+    n = 2;
+  } else if (cp < 0x10000) {
+    buf[0] = (char)(0xe0 | (cp >> 12));
+    buf[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    buf[2] = (char)(0x80 | (cp & 0x3f));
+    n = 3;
+  } else {
+    buf[0] = (char)(0xf0 | (cp >> 18));
+    buf[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    buf[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    buf[3] = (char)(0x80 | (cp & 0x3f));
+    n = 4;
+  }
+  sbuf_put(sb, buf, n);
+}
+
+// column width of a code point, independent of the process locale
+static int cell_width(uint32_t cp) {
+  if (cp < 0x300) return 1;
+  if ((cp >= 0x300 && cp <= 0x36f) || (cp >= 0x200b && cp <= 0x200f) || (cp >= 0xfe00 && cp <= 0xfe0f)) return 0;
+  if ((cp >= 0x1100 && cp <= 0x115f) || (cp >= 0x2e80 && cp <= 0xa4cf && cp != 0x303f) ||
+      (cp >= 0xac00 && cp <= 0xd7a3) || (cp >= 0xf900 && cp <= 0xfaff) || (cp >= 0xfe30 && cp <= 0xfe4f) ||
+      (cp >= 0xff00 && cp <= 0xff60) || (cp >= 0xffe0 && cp <= 0xffe6) || (cp >= 0x1f300 && cp <= 0x1f64f) ||
+      (cp >= 0x1f900 && cp <= 0x1f9ff) || (cp >= 0x20000 && cp <= 0x3fffd))
+    return 2;
+  return 1;
+}
+
+static void blank_cells(screen_t *s, screen_cell_t *cell, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    cell[i].ch = ' ';
+    cell[i].fg = 0;
+    cell[i].bg = s->pen.bg;
+    cell[i].attrs = 0;
+  }
+}
+
+static void clear_rows(screen_t *s, uint16_t top, uint16_t bottom) {
+  for (uint16_t y = top; y <= bottom && y < s->rows; y++) blank_cells(s, CELL(s, 0, y), s->cols);
+}
+
+static void scroll_region_up(screen_t *s, uint16_t top, uint16_t bottom, int n) {
+  int lines = bottom - top + 1;
+  if (n <= 0) return;
+  if (n > lines) n = lines;
+  memmove(CELL(s, 0, top), CELL(s, 0, top + n), (size_t)(lines - n) * ROW_BYTES(s));
+  clear_rows(s, (uint16_t)(bottom - n + 1), bottom);
+}
+
+static void scroll_region_down(screen_t *s, uint16_t top, uint16_t bottom, int n) {
+  int lines = bottom - top + 1;
+  if (n <= 0) return;
+  if (n > lines) n = lines;
+  memmove(CELL(s, 0, top + n), CELL(s, 0, top), (size_t)(lines - n) * ROW_BYTES(s));
+  clear_rows(s, top, (uint16_t)(top + n - 1));
+}
+
+static void linefeed(screen_t *s) {
+  if (s->cursor_y == s->scroll_bottom)
+    scroll_region_up(s, s->scroll_top, s->scroll_bottom, 1);
+  else if (s->cursor_y < s->rows - 1)
+    s->cursor_y++;
+}
+
+static void reverse_index(screen_t *s) {
+  if (s->cursor_y == s->scroll_top)
+    scroll_region_down(s, s->scroll_top, s->scroll_bottom, 1);
+  else if (s->cursor_y > 0)
+    s->cursor_y--;
+}
+
+static void put_char(screen_t *s, uint32_t cp) {
+  int width = cell_width(cp);
+  if (width == 0) return;  // combining marks are left to the client font
+  if (width == 2 && s->cols < 2) width = 1;
+
+  if (s->wrap_pending) {
+    s->cursor_x = 0;
+    linefeed(s);
+    s->wrap_pending = false;
+  }
+  if (width == 2 && s->cursor_x == s->cols - 1) {
+    blank_cells(s, CELL(s, s->cursor_x, s->cursor_y), 1);
+    s->cursor_x = 0;
+    linefeed(s);
+  }
+
+  screen_cell_t *cell = CELL(s, s->cursor_x, s->cursor_y);
+  // never leave half of a wide char behind
+  if (cell->ch == 0 && s->cursor_x > 0) (cell - 1)->ch = ' ';
+  if (s->cursor_x + width < s->cols && cell[width].ch == 0) cell[width].ch = ' ';
+
+  cell->ch = cp;
+  cell->fg = s->pen.fg;
+  cell->bg = s->pen.bg;
+  cell->attrs = s->pen.attrs;
+  if (width == 2) {
+    cell[1] = *cell;
+    cell[1].ch = 0;
+  }
+
+  if (s->cursor_x + width >= s->cols) {
+    s->cursor_x = s->cols - 1;
+    s->wrap_pending = true;
+  } else {
+    s->cursor_x += width;
+  }
+}
+
+static void save_cursor(screen_t *s) {
+  s->saved_x = s->cursor_x;
+  s->saved_y = s->cursor_y;
+  s->saved_pen = s->pen;
+}
+
+static void restore_cursor(screen_t *s) {
+  s->cursor_x = s->saved_x < s->cols ? s->saved_x : s->cols - 1;
+  s->cursor_y = s->saved_y < s->rows ? s->saved_y : s->rows - 1;
+  s->pen = s->saved_pen;
+  s->wrap_pending = false;
+}
+
+static void reset(screen_t *s) {
+  memset(&s->pen, 0, sizeof(s->pen));
+  s->saved_pen = s->pen;
+  if (s->alt_saved != NULL) {
+    free(s->alt_saved);
+    s->alt_saved = NULL;
+  }
+  clear_rows(s, 0, s->rows - 1);
+  s->cursor_x = s->cursor_y = s->saved_x = s->saved_y = 0;
+  s->scroll_top = 0;
+  s->scroll_bottom = s->rows - 1;
+  s->cursor_visible = true;
+  s->wrap_pending = false;
+  s->modes = 0;
+}
+
+static void set_alt_screen(screen_t *s, bool enable, bool with_cursor) {
+  size_t bytes = (size_t)s->rows * ROW_BYTES(s);
+  if (enable && s->alt_saved == NULL) {
+    if (with_cursor) save_cursor(s);
+    s->alt_saved = xmalloc(bytes);
+    memcpy(s->alt_saved, s->cells, bytes);
+    clear_rows(s, 0, s->rows - 1);
+  } else if (!enable && s->alt_saved != NULL) {
+    memcpy(s->cells, s->alt_saved, bytes);
+    free(s->alt_saved);
+    s->alt_saved = NULL;
+    if (with_cursor) restore_cursor(s);
+  }
+}
+
+static int param(screen_t *s, int i, int def) { return i < s->nparams && s->params[i] > 0 ? s->params[i] : def; }
+
+static uint16_t clamp(int v, int max) { return (uint16_t)(v < 0 ? 0 : v > max ? max : v); }
+
+static void set_private_mode(screen_t *s, bool enable) {
+  for (int i = 0; i < (s->nparams ? s->nparams : 1); i++) {
+    uint32_t mode = 0;
+    switch (s->params[i]) {
+      case 1:
+        mode = SCREEN_MODE_APP_CURSOR;
+        break;
+      case 9:
+        mode = SCREEN_MODE_MOUSE_X10;
+        break;
+      case 1000:
+        mode = SCREEN_MODE_MOUSE_NORMAL;
+        break;
+      case 1002:
+        mode = SCREEN_MODE_MOUSE_BUTTON;
+        break;
+      case 1003:
+        mode = SCREEN_MODE_MOUSE_ANY;
+        break;
+      case 1004:
+        mode = SCREEN_MODE_FOCUS;
+        break;
+      case 1006:
+        mode = SCREEN_MODE_MOUSE_SGR;
+        break;
+      case 2004:
+        mode = SCREEN_MODE_BRACKETED_PASTE;
+        break;
+      case 25:
+        s->cursor_visible = enable;
+        break;
+      case 47:
+      case 1047:
+        set_alt_screen(s, enable, false);
+        break;
+      case 1049:
+        set_alt_screen(s, enable, true);
+        break;
+      default:
+        break;
+    }
+    if (enable)
+      s->modes |= mode;
+    else
+      s->modes &= ~mode;
+  }
+}
+
+static uint32_t sgr_color(screen_t *s, int *i) {
+  int kind = param(s, *i + 1, 0);
+  if (kind == 5 && *i + 2 < s->nparams) {
+    uint32_t color = SCREEN_COLOR_INDEXED | (uint32_t)(s->params[*i + 2] & 0xff);
+    *i += 2;
+    return color;
+  }
+  if (kind == 2 && *i + 4 < s->nparams) {
+    uint32_t color = SCREEN_COLOR_RGB | (uint32_t)(s->params[*i + 2] & 0xff) << 16 |
+                     (uint32_t)(s->params[*i + 3] & 0xff) << 8 | (uint32_t)(s->params[*i + 4] & 0xff);
+    *i += 4;
+    return color;
+  }
+  *i = s->nparams;
+  return 0;
+}
+
+static void sgr(screen_t *s) {
+  if (s->nparams == 0) {
+    memset(&s->pen, 0, sizeof(s->pen));
+    return;
+  }
+  for (int i = 0; i < s->nparams; i++) {
+    int p = s->params[i];
+    if (p == 0) {
+      memset(&s->pen, 0, sizeof(s->pen));
+    } else if (p >= 1 && p <= 9) {
+      static const uint32_t attrs[] = {0,
+                                       SCREEN_ATTR_BOLD,
+                                       SCREEN_ATTR_DIM,
+                                       SCREEN_ATTR_ITALIC,
+                                       SCREEN_ATTR_UNDERLINE,
+                                       SCREEN_ATTR_BLINK,
+                                       SCREEN_ATTR_BLINK,
+                                       SCREEN_ATTR_INVERSE,
+                                       SCREEN_ATTR_HIDDEN,
+                                       SCREEN_ATTR_STRIKE};
+      s->pen.attrs |= attrs[p];
+    } else if (p == 21 || p == 22) {
+      s->pen.attrs &= ~(SCREEN_ATTR_BOLD | SCREEN_ATTR_DIM);
+    } else if (p == 23) {
+      s->pen.attrs &= ~SCREEN_ATTR_ITALIC;
+    } else if (p == 24) {
+      s->pen.attrs &= ~SCREEN_ATTR_UNDERLINE;
+    } else if (p == 25) {
+      s->pen.attrs &= ~SCREEN_ATTR_BLINK;
+    } else if (p == 27) {
+      s->pen.attrs &= ~SCREEN_ATTR_INVERSE;
+    } else if (p == 28) {
+      s->pen.attrs &= ~SCREEN_ATTR_HIDDEN;
+    } else if (p == 29) {
+      s->pen.attrs &= ~SCREEN_ATTR_STRIKE;
+    } else if (p >= 30 && p <= 37) {
+      s->pen.fg = SCREEN_COLOR_INDEXED | (uint32_t)(p - 30);
+    } else if (p == 38) {
+      s->pen.fg = sgr_color(s, &i);
+    } else if (p == 39) {
+      s->pen.fg = 0;
+    } else if (p >= 40 && p <= 47) {
+      s->pen.bg = SCREEN_COLOR_INDEXED | (uint32_t)(p - 40);
+    } else if (p == 48) {
+      s->pen.bg = sgr_color(s, &i);
+    } else if (p == 49) {
+      s->pen.bg = 0;
+    } else if (p >= 90 && p <= 97) {
+      s->pen.fg = SCREEN_COLOR_INDEXED | (uint32_t)(p - 90 + 8);
+    } else if (p >= 100 && p <= 107) {
+      s->pen.bg = SCREEN_COLOR_INDEXED | (uint32_t)(p - 100 + 8);
+    }
+  }
+}
+
+static void csi_dispatch(screen_t *s, char final) {
+  if (s->intermediate) return;
+  if (s->prefix == '?') {
+    if (final == 'h' || final == 'l') set_private_mode(s, final == 'h');
+    return;
+  }
+  if (s->prefix != 0) return;
+
+  int n = param(s, 0, 1);
+  screen_cell_t *row = CELL(s, 0, s->cursor_y);
+  uint16_t x = s->cursor_x;
+  s->wrap_pending = false;
+
+  switch (final) {
+    case '@': {
+      int count = n > s->cols - x ? s->cols - x : n;
+      memmove(row + x + count, row + x, (size_t)(s->cols - x - count) * sizeof(screen_cell_t));
+      blank_cells(s, row + x, (size_t)count);
+    } break;
+    case 'A':
+      s->cursor_y = clamp(s->cursor_y - n, s->rows - 1);
+      break;
+    case 'B':
+    case 'e':
+      s->cursor_y = clamp(s->cursor_y + n, s->rows - 1);
+      break;
+    case 'C':
+    case 'a':
+      s->cursor_x = clamp(x + n, s->cols - 1);
+      break;
+    case 'D':
+      s->cursor_x = clamp(x - n, s->cols - 1);
+      break;
+    case 'E':
+      s->cursor_x = 0;
+      s->cursor_y = clamp(s->cursor_y + n, s->rows - 1);
+      break;
+    case 'F':
+      s->cursor_x = 0;
+      s->cursor_y = clamp(s->cursor_y - n, s->rows - 1);
+      break;
+    case 'G':
+    case '`':
+      s->cursor_x = clamp(n - 1, s->cols - 1);
+      break;
+    case 'H':
+    case 'f':
+      s->cursor_y = clamp(param(s, 0, 1) - 1, s->rows - 1);
+      s->cursor_x = clamp(param(s, 1, 1) - 1, s->cols - 1);
+      break;
+    case 'd':
+      s->cursor_y = clamp(n - 1, s->rows - 1);
+      break;
+    case 'J':
+      switch (param(s, 0, 0)) {
+        case 0:
+          blank_cells(s, row + x, (size_t)(s->cols - x));
+          if (s->cursor_y < s->rows - 1) clear_rows(s, s->cursor_y + 1, s->rows - 1);
+          break;
+        case 1:
+          if (s->cursor_y > 0) clear_rows(s, 0, s->cursor_y - 1);
+          blank_cells(s, row, (size_t)x + 1);
+          break;
+        default:
+          clear_rows(s, 0, s->rows - 1);
+          break;
+      }
+      break;
+    case 'K':
+      switch (param(s, 0, 0)) {
+        case 0:
+          blank_cells(s, row + x, (size_t)(s->cols - x));
+          break;
+        case 1:
+          blank_cells(s, row, (size_t)x + 1);
+          break;
+        default:
+          blank_cells(s, row, s->cols);
+          break;
+      }
+      break;
+    case 'L':
+      if (s->cursor_y >= s->scroll_top && s->cursor_y <= s->scroll_bottom)
+        scroll_region_down(s, s->cursor_y, s->scroll_bottom, n);
+      break;
+    case 'M':
+      if (s->cursor_y >= s->scroll_top && s->cursor_y <= s->scroll_bottom)
+        scroll_region_up(s, s->cursor_y, s->scroll_bottom, n);
+      break;
+    case 'P': {
+      int count = n > s->cols - x ? s->cols - x : n;
+      memmove(row + x, row + x + count, (size_t)(s->cols - x - count) * sizeof(screen_cell_t));
+      blank_cells(s, row + s->cols - count, (size_t)count);
+    } break;
+    case 'S':
+      scroll_region_up(s, s->scroll_top, s->scroll_bottom, n);
+      break;
+    case 'T':
+      scroll_region_down(s, s->scroll_top, s->scroll_bottom, n);
+      break;
+    case 'X':
+      blank_cells(s, row + x, (size_t)(n > s->cols - x ? s->cols - x : n));
+      break;
+    case 'm':
+      sgr(s);
+      break;
+    case 'r': {
+      int top = param(s, 0, 1) - 1;
+      int bottom = param(s, 1, s->rows) - 1;
+      if (bottom >= s->rows) bottom = s->rows - 1;
+      if (top < bottom) {
+        s->scroll_top = (uint16_t)top;
+        s->scroll_bottom = (uint16_t)bottom;
+        s->cursor_x = s->cursor_y = 0;
+      }
+    } break;
+    case 's':
+      save_cursor(s);
+      break;
+    case 'u':
+      restore_cursor(s);
+      break;
+    default:
+      break;
+  }
+}
+
+static void execute(screen_t *s, unsigned char c) {
+  switch (c) {
+    case '\b':
+      if (s->cursor_x > 0) s->cursor_x--;
+      s->wrap_pending = false;
+      break;
+    case '\t':
+      s->cursor_x = clamp((s->cursor_x / 8 + 1) * 8, s->cols - 1);
+      break;
+    case '\n':
+    case '\v':
+    case '\f':
+      linefeed(s);
+      s->wrap_pending = false;
+      break;
+    case '\r':
+      s->cursor_x = 0;
+      s->wrap_pending = false;
+      break;
+    default:
+      break;
+  }
+}
+
+static void esc_dispatch(screen_t *s, unsigned char c) {
+  s->state = STATE_GROUND;
+  switch (c) {
+    case '[':
+      s->state = STATE_CSI;
+      s->nparams = 0;
+      s->prefix = 0;
+      s->intermediate = false;
+      memset(s->params, 0, sizeof(s->params));
+      break;
+    case ']':
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+      s->state = STATE_STRING;
+      break;
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+    case '#':
+    case '%':
+      s->state = STATE_ESC_SKIP;
+      break;
+    case '7':
+      save_cursor(s);
+      break;
+    case '8':
+      restore_cursor(s);
+      break;
+    case 'D':
+      linefeed(s);
+      break;
+    case 'E':
+      s->cursor_x = 0;
+      linefeed(s);
+      break;
+    case 'M':
+      reverse_index(s);
+      break;
+    case 'c':
+      reset(s);
+      break;
+    case '=':
+      s->modes |= SCREEN_MODE_APP_KEYPAD;
+      break;
+    case '>':
+      s->modes &= ~SCREEN_MODE_APP_KEYPAD;
+      break;
+    default:
+      break;
+  }
+}
+
+void screen_feed(screen_t *s, const char *data, size_t len) {
+  if (len == 0) return;
+  s->dirty = true;
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)data[i];
+    switch (s->state) {
+      case STATE_GROUND:
+        if (c < 0x80) {
+          if (s->utf8_need > 0) {
+            put_char(s, 0xfffd);
+            s->utf8_need = 0;
+          }
+          if (c == 0x1b)
+            s->state = STATE_ESC;
+          else if (c < 0x20)
+            execute(s, c);
+          else if (c != 0x7f)
+            put_char(s, c);
+        } else if (s->utf8_need > 0 && c >= s->utf8_lo && c <= s->utf8_hi) {
+          s->utf8_cp = (s->utf8_cp << 6) | (c & 0x3f);
+          s->utf8_lo = 0x80;
+          s->utf8_hi = 0xbf;
+          if (--s->utf8_need == 0 && !(s->utf8_cp >= 0x80 && s->utf8_cp <= 0x9f)) put_char(s, s->utf8_cp);
+        } else {
+          // the second byte ranges rule out overlongs, surrogates and code points above U+10FFFF,
+          // as in utf8.c; a broken sequence becomes one U+FFFD and this byte starts over
+          if (s->utf8_need > 0) put_char(s, 0xfffd);
+          s->utf8_need = 0;
+          s->utf8_lo = 0x80;
+          s->utf8_hi = 0xbf;
+          if (c >= 0xc2 && c <= 0xdf) {
+            s->utf8_cp = c & 0x1f;
+            s->utf8_need = 1;
+          } else if (c >= 0xe0 && c <= 0xef) {
+            s->utf8_cp = c & 0x0f;
+            s->utf8_need = 2;
+            if (c == 0xe0) s->utf8_lo = 0xa0;
+            if (c == 0xed) s->utf8_hi = 0x9f;
+          } else if (c >= 0xf0 && c <= 0xf4) {
+            s->utf8_cp = c & 0x07;
+            s->utf8_need = 3;
+            if (c == 0xf0) s->utf8_lo = 0x90;
+            if (c == 0xf4) s->utf8_hi = 0x8f;
+          } else {
+            put_char(s, 0xfffd);
+          }
+        }
+        break;
+      case STATE_ESC:
+        esc_dispatch(s, c);
+        break;
+      case STATE_ESC_SKIP:
+        s->state = STATE_GROUND;
+        break;
+      case STATE_CSI:
+        if (c >= '0' && c <= '9') {
+          if (s->nparams == 0) s->nparams = 1;
+          int *p = &s->params[s->nparams - 1];
+          if (*p < 10000) *p = *p * 10 + (c - '0');
+        } else if (c == ';' || c == ':') {
+          if (s->nparams == 0) s->nparams = 1;
+          if (s->nparams < (int)(sizeof(s->params) / sizeof(s->params[0]))) s->nparams++;
+        } else if (c >= '<' && c <= '?') {
+          s->prefix = (char)c;
+        } else if (c >= 0x20 && c <= 0x2f) {
+          s->intermediate = true;
+        } else if (c >= 0x40 && c <= 0x7e) {
+          s->state = STATE_GROUND;
+          csi_dispatch(s, (char)c);
+        } else if (c == 0x1b) {
+          s->state = STATE_ESC;
+        } else if (c < 0x20) {
+          execute(s, c);
+        }
+        break;
+      case STATE_STRING:
+        if (c == 0x07 || c == 0x18 || c == 0x1a)
+          s->state = STATE_GROUND;
+        else if (c == 0x1b)
+          s->state = STATE_STRING_ESC;
+        break;
+      case STATE_STRING_ESC:
+        s->state = STATE_GROUND;
+        if (c != '\\') esc_dispatch(s, c);
+        break;
+      default:
+        s->state = STATE_GROUND;
+        break;
+    }
+  }
+}
+
+screen_t *screen_new(uint16_t cols, uint16_t rows) {
+  screen_t *s = xmalloc(sizeof(screen_t));
+  memset(s, 0, sizeof(screen_t));
+  s->cols = cols > 0 ? cols : 80;
+  s->rows = rows > 0 ? rows : 24;
+  s->cells = xmalloc((size_t)s->rows * ROW_BYTES(s));
+  reset(s);
+  return s;
+}
+
+void screen_free(screen_t *s) {
+  if (s == NULL) return;
+  free(s->cells);
+  if (s->alt_saved != NULL) free(s->alt_saved);
+  free(s);
+}
+
+static screen_cell_t *resize_grid(screen_t *s, screen_cell_t *old, uint16_t cols, uint16_t rows) {
+  screen_cell_t *cells = xmalloc((size_t)rows * cols * sizeof(screen_cell_t));
+  uint16_t copy_cols = cols < s->cols ? cols : s->cols;
+  // keep the bottom of the old screen, that is where the cursor usually is
+  int skip = s->rows > rows && s->cursor_y >= rows ? s->cursor_y - rows + 1 : 0;
+  for (uint16_t y = 0; y < rows; y++) {
+    screen_cell_t *dst = &cells[(size_t)y * cols];
+    blank_cells(s, dst, cols);
+    if (y + skip < s->rows) memcpy(dst, &old[(size_t)(y + skip) * s->cols], copy_cols * sizeof(screen_cell_t));
+  }
+  free(old);
+  return cells;
+}
+
+void screen_resize(screen_t *s, uint16_t cols, uint16_t rows) {
+  if (cols == 0 || rows == 0 || (cols == s->cols && rows == s->rows)) return;
+  int skip = s->rows > rows && s->cursor_y >= rows ? s->cursor_y - rows + 1 : 0;
+  s->cells = resize_grid(s, s->cells, cols, rows);
+  if (s->alt_saved != NULL) s->alt_saved = resize_grid(s, s->alt_saved, cols, rows);
+  s->cols = cols;
+  s->rows = rows;
+  s->cursor_x = clamp(s->cursor_x, cols - 1);
+  s->cursor_y = clamp(s->cursor_y - skip, rows - 1);
+  s->saved_x = clamp(s->saved_x, cols - 1);
+  s->saved_y = clamp(s->saved_y, rows - 1);
+  s->scroll_top = 0;
+  s->scroll_bottom = rows - 1;
+  s->wrap_pending = false;
+  s->dirty = true;
+}
+
+static screen_t *screen_clone(const screen_t *src) {
+  screen_t *s = xmalloc(sizeof(screen_t));
+  memcpy(s, src, sizeof(screen_t));
+  s->cells = xmalloc((size_t)s->rows * ROW_BYTES(s));
+  memcpy(s->cells, src->cells, (size_t)s->rows * ROW_BYTES(s));
+  s->alt_saved = NULL;
+  return s;
+}
+
+static bool same_size(const screen_t *a, const screen_t *b) { return a->cols == b->cols && a->rows == b->rows; }
+
+static bool row_differs(const screen_t *a, const screen_t *b, uint16_t y) {
+  return memcmp(CELL(a, 0, y), CELL(b, 0, y), ROW_BYTES(a)) != 0;
+}
+
+static void put_color(sbuf_t *sb, uint32_t color, int base) {
+  if (color & SCREEN_COLOR_RGB) {
+    sbuf_printf(sb, ";%d;2;%u;%u;%u", base + 8, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+  } else if (color & SCREEN_COLOR_INDEXED) {
+    uint32_t index = color & 0xff;
+    if (index < 8)
+      sbuf_printf(sb, ";%u", base + index);
+    else if (index < 16)
+      sbuf_printf(sb, ";%u", base + 60 + index - 8);
+    else
+      sbuf_printf(sb, ";%d;5;%u", base + 8, index);
+  }
+}
+
+static void put_sgr(sbuf_t *sb, const screen_cell_t *cell) {
+  static const char *codes[] = {";1", ";2", ";3", ";4", ";5", ";7", ";8", ";9"};
+  sbuf_put(sb, "\x1b[0", 3);
+  for (int i = 0; i < 8; i++) {
+    if (cell->attrs & (1u << i)) sbuf_put(sb, codes[i], 2);
+  }
+  put_color(sb, cell->fg, 30);
+  put_color(sb, cell->bg, 40);
+  sbuf_put(sb, "m", 1);
+}
+
+static bool same_pen(const screen_cell_t *a, const screen_cell_t *b) {
+  return a->fg == b->fg && a->bg == b->bg && a->attrs == b->attrs;
+}
+
+static void render_row(sbuf_t *sb, const screen_t *s, uint16_t y) {
+  const screen_cell_t *row = CELL(s, 0, y);
+  const screen_cell_t plain = {' ', 0, 0, 0};
+  int end = s->cols;
+  while (end > 0 && memcmp(&row[end - 1], &plain, sizeof(plain)) == 0) end--;
+
+  sbuf_printf(sb, "\x1b[%d;1H\x1b[0m", y + 1);
+  screen_cell_t pen = plain;
+  for (int x = 0; x < end; x++) {
+    const screen_cell_t *cell = &row[x];
+    if (cell->ch == 0 && x > 0 && cell_width(row[x - 1].ch) == 2) continue;
+    if (!same_pen(cell, &pen)) {
+      put_sgr(sb, cell);
+      pen = *cell;
+    }
+    sbuf_put_utf8(sb, cell->ch ? cell->ch : ' ');
+  }
+  if (!same_pen(&pen, &plain)) sbuf_put(sb, "\x1b[0m", 4);
+  if (end < s->cols) sbuf_put(sb, "\x1b[K", 3);
+}
+
+static void render_modes(sbuf_t *sb, uint32_t modes) {
+  static const struct {
+    uint32_t mode;
+    int code;
+  } table[] = {{SCREEN_MODE_APP_CURSOR, 1},    {SCREEN_MODE_MOUSE_X10, 9},    {SCREEN_MODE_MOUSE_NORMAL, 1000},
+               {SCREEN_MODE_MOUSE_BUTTON, 1002}, {SCREEN_MODE_MOUSE_ANY, 1003}, {SCREEN_MODE_FOCUS, 1004},
+               {SCREEN_MODE_MOUSE_SGR, 1006},  {SCREEN_MODE_BRACKETED_PASTE, 2004}};
+  for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++)
+    sbuf_printf(sb, "\x1b[?%d%c", table[i].code, modes & table[i].mode ? 'h' : 'l');
+  sbuf_put(sb, modes & SCREEN_MODE_APP_KEYPAD ? "\x1b=" : "\x1b>", 2);
+}
+
+// Render the sequence that turns a display at the acknowledged state, or at any state sent after it,
+// into the current model. Rows are replaced whole, so the frame is idempotent on every such display.
+static void render_frame(sbuf_t *sb, const screen_t *s, const screen_t *acked, const screen_t *sent) {
+  if (acked != NULL && !same_size(acked, s)) acked = NULL;
+  if (sent != NULL && !same_size(sent, s)) sent = NULL;
+
+  sbuf_put(sb, "\x1b[?25l", 6);
+  if (acked == NULL) sbuf_put(sb, "\x1b[0m\x1b[r\x1b[H\x1b[2J", 14);
+  for (uint16_t y = 0; y < s->rows; y++) {
+    if (acked == NULL || row_differs(s, acked, y) || (sent != NULL && row_differs(s, sent, y))) render_row(sb, s, y);
+  }
+  if (acked == NULL || acked->modes != s->modes || (sent != NULL && sent->modes != s->modes))
+    render_modes(sb, s->modes);
+  sbuf_printf(sb, "\x1b[%d;%dH", s->cursor_y + 1, s->cursor_x + 1);
+  if (s->cursor_visible) sbuf_put(sb, "\x1b[?25h", 6);
+}
+
+screen_transport_t *screen_transport_new(uint16_t cols, uint16_t rows) {
+  screen_transport_t *t = xmalloc(sizeof(screen_transport_t));
+  memset(t, 0, sizeof(screen_transport_t));
+  t->model = screen_new(cols, rows);
+  return t;
+}
+
+static void drop_frames(screen_transport_t *t) {
+  screen_free(t->acked);
+  t->acked = NULL;
+  for (int i = 0; i < t->inflight; i++) screen_free(t->sent[i]);
+  t->inflight = 0;
+}
+
+void screen_transport_free(screen_transport_t *t) {
+  if (t == NULL) return;
+  drop_frames(t);
+  screen_free(t->model);
+  free(t);
+}
+
+void screen_transport_resize(screen_transport_t *t, uint16_t cols, uint16_t rows) {
+  if (cols == t->model->cols && rows == t->model->rows) return;
+  screen_resize(t->model, cols, rows);
+  // the client reflowed its own copy, start over from a full repaint
+  drop_frames(t);
+}
+
+bool screen_transport_ready(screen_transport_t *t) { return t->model->dirty && t->inflight < SCREEN_MAX_INFLIGHT; }
+
+char *screen_transport_frame(screen_transport_t *t, size_t headroom, size_t *len) {
+  screen_t *model = t->model;
+  screen_t *last = t->inflight > 0 ? t->sent[t->inflight - 1] : t->acked;
+  model->dirty = false;
+  if (t->inflight >= SCREEN_MAX_INFLIGHT) return NULL;
+
+  // nothing visible changed since the last frame
+  if (last != NULL && same_size(last, model) && last->cursor_x == model->cursor_x &&
+      last->cursor_y == model->cursor_y && last->cursor_visible == model->cursor_visible &&
+      last->modes == model->modes && memcmp(last->cells, model->cells, (size_t)model->rows * ROW_BYTES(model)) == 0)
+    return NULL;
+
+  sbuf_t sb = {NULL, 0, 0};
+  sbuf_reserve(&sb, headroom);
+  sb.len = headroom;
+
+  uint64_t num = t->state_num + 1;
+  sbuf_printf(&sb, "%" PRIu64 ";", num);
+  render_frame(&sb, model, t->acked, t->inflight > 0 ? t->sent[t->inflight - 1] : NULL);
+
+  t->sent[t->inflight] = screen_clone(model);
+  t->sent_num[t->inflight] = num;
+  t->inflight++;
+  t->state_num = num;
+
+  *len = sb.len - headroom;
+  return sb.data;
+}
+
+bool screen_transport_ack(screen_transport_t *t, uint64_t state_num) {
+  int i;
+  for (i = 0; i < t->inflight; i++) {
+    if (t->sent_num[i] == state_num) break;
+  }
+  if (i == t->inflight) return false;
+
+  screen_free(t->acked);
+  for (int j = 0; j < i; j++) screen_free(t->sent[j]);
+  t->acked = t->sent[i];
+  t->acked_num = state_num;
+  t->inflight -= i + 1;
+  memmove(&t->sent[0], &t->sent[i + 1], (size_t)t->inflight * sizeof(t->sent[0]));
+  memmove(&t->sent_num[0], &t->sent_num[i + 1], (size_t)t->inflight * sizeof(t->sent_num[0]));
+  return true;
+}
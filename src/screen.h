@@ -0,0 +1,95 @@
+#ifndef CMDR_SCREEN_H
+#define CMDR_SCREEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// frame cadence and in-flight window of the screen-diff transport
+#define SCREEN_FRAME_INTERVAL_MS 50
+#define SCREEN_MAX_INFLIGHT 4
+
+// cell attribute flags
+#define SCREEN_ATTR_BOLD 0x01
+#define SCREEN_ATTR_DIM 0x02
+#define SCREEN_ATTR_ITALIC 0x04
+#define SCREEN_ATTR_UNDERLINE 0x08
+#define SCREEN_ATTR_BLINK 0x10
+#define SCREEN_ATTR_INVERSE 0x20
+#define SCREEN_ATTR_HIDDEN 0x40
+#define SCREEN_ATTR_STRIKE 0x80
+
+// input modes forwarded to the client so keys and mouse reports stay correct
+#define SCREEN_MODE_APP_CURSOR 0x01
+#define SCREEN_MODE_APP_KEYPAD 0x02
+#define SCREEN_MODE_MOUSE_X10 0x04
+#define SCREEN_MODE_MOUSE_NORMAL 0x08
+#define SCREEN_MODE_MOUSE_BUTTON 0x10
+#define SCREEN_MODE_MOUSE_ANY 0x20
+#define SCREEN_MODE_MOUSE_SGR 0x40
+#define SCREEN_MODE_FOCUS 0x80
+#define SCREEN_MODE_BRACKETED_PASTE 0x100
+
+// cell colors: 0 is the default color, otherwise tagged palette index or 24-bit rgb
+#define SCREEN_COLOR_INDEXED 0x1000000
+#define SCREEN_COLOR_RGB 0x2000000
+
+typedef struct {
+  uint32_t ch;  // unicode code point, 0 for the trailing half of a wide char
+  uint32_t fg;
+  uint32_t bg;
+  uint32_t attrs;
+} screen_cell_t;
+
+// minimal VT100/xterm state model, enough to redraw what the program painted
+typedef struct {
+  uint16_t cols, rows;
+  screen_cell_t *cells;      // rows * cols, row major
+  screen_cell_t *alt_saved;  // primary screen saved while the alternate screen is active
+  uint16_t cursor_x, cursor_y;
+  uint16_t saved_x, saved_y;
+  uint16_t scroll_top, scroll_bottom;
+  bool cursor_visible;
+  bool wrap_pending;
+  uint32_t modes;            // SCREEN_MODE_* input modes the client has to mirror
+  screen_cell_t pen;         // attributes applied to newly written cells
+  screen_cell_t saved_pen;
+
+  // parser state, kept across reads
+  int state;
+  uint32_t utf8_cp;
+  int utf8_need;
+  unsigned char utf8_lo, utf8_hi;  // range of the next continuation byte (RFC 3629)
+  int params[16];
+  int nparams;
+  char prefix;               // private parameter prefix of the CSI sequence ('?', '>', ...)
+  bool intermediate;
+
+  bool dirty;                // changed since the last snapshot taken by the transport
+} screen_t;
+
+// per connection transport state, see screen_transport_frame()
+typedef struct {
+  screen_t *model;                       // live state fed from the PTY
+  screen_t *acked;                       // state last acknowledged by the client, NULL before the first ack
+  screen_t *sent[SCREEN_MAX_INFLIGHT];   // snapshots of unacknowledged frames, oldest first
+  uint64_t sent_num[SCREEN_MAX_INFLIGHT];
+  int inflight;
+  uint64_t state_num;                    // number of the last frame produced
+  uint64_t acked_num;
+  uint64_t last_frame_ms;
+} screen_transport_t;
+
+screen_t *screen_new(uint16_t cols, uint16_t rows);
+void screen_free(screen_t *screen);
+void screen_resize(screen_t *screen, uint16_t cols, uint16_t rows);
+void screen_feed(screen_t *screen, const char *data, size_t len);
+
+screen_transport_t *screen_transport_new(uint16_t cols, uint16_t rows);
+void screen_transport_free(screen_transport_t *transport);
+void screen_transport_resize(screen_transport_t *transport, uint16_t cols, uint16_t rows);
+bool screen_transport_ready(screen_transport_t *transport);
+char *screen_transport_frame(screen_transport_t *transport, size_t headroom, size_t *len);
+bool screen_transport_ack(screen_transport_t *transport, uint64_t state_num);
+
+#endif  // CMDR_SCREEN_H
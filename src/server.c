@@ -12,6 +12,10 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include "pool.h"
+#include "profile.h"
+#include "trace.h"
+#include "trigger.h"
 #include "utils.h"
 
 #ifndef CMDR_VERSION
@@ -51,6 +55,15 @@ static lws_retry_bo_t retry = {
 };
 #endif
 
+// long-only options, outside the range of short option characters
+#define OPT_PROFILE 0x100
+#define OPT_TRACE 0x101
+#define OPT_ATTACH 0x102
+#define OPT_TRIGGER 0x103
+#define OPT_REDACT 0x104
+#define OPT_SHELL_INTEGRATION 0x105
+#define OPT_FILES_ROOT 0x106
+
 // command line options
 static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"interface", required_argument, NULL, 'i'},
@@ -82,6 +95,13 @@ static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"exit-no-conn", no_argument, NULL, 'q'},
                                         {"browser", no_argument, NULL, 'B'},
                                         {"debug", required_argument, NULL, 'd'},
+                                        {"profile", optional_argument, NULL, OPT_PROFILE},
+                                        {"trace", optional_argument, NULL, OPT_TRACE},
+                                        {"attach-socket", optional_argument, NULL, OPT_ATTACH},
+                                        {"trigger", required_argument, NULL, OPT_TRIGGER},
+                                        {"redact", required_argument, NULL, OPT_REDACT},
+                                        {"shell-integration", no_argument, NULL, OPT_SHELL_INTEGRATION},
+                                        {"files-root", required_argument, NULL, OPT_FILES_ROOT},
                                         {"version", no_argument, NULL, 'v'},
                                         {"help", no_argument, NULL, 'h'},
                                         {NULL, 0, 0, 0}};
@@ -91,7 +111,8 @@ static void print_help() {
   // clang-format off
   fprintf(stderr, "cmdr is a tool for sharing terminal over the web\n\n"
           "USAGE:\n"
-          "    cmdr [options] <command> [<arguments...>]\n\n"
+          "    cmdr [options] <command> [<arguments...>]\n"
+          "    cmdr attach [-s socket] <session id>\n\n"
           "VERSION:\n"
           "    %s\n\n"
           "OPTIONS:\n"
@@ -129,6 +150,13 @@ static void print_help() {
           "    -A, --ssl-ca            SSL CA file path for client certificate verification\n"
 #endif
           "    -d, --debug             Set log level (default: 7)\n"
+          "        --profile[=file]    Log CPU/allocation attribution every 10s and write folded stacks to file (default: cmdr-profile.folded)\n"
+          "        --trace[=file]      Record message lifecycle spans, written as Chrome trace JSON on SIGUSR2, exit and at /api/trace (default: cmdr-trace.json)\n"
+          "        --attach-socket[=path] Let `cmdr attach` join sessions over a UNIX socket (default: $XDG_RUNTIME_DIR/cmdr.sock or /tmp/cmdr-<uid>.sock)\n"
+          "        --trigger           Report session output lines containing this text (case-insensitive) as events, repeat to add more\n"
+          "        --redact            Secrets masked in stored session output and state files, comma separated: aws, github, gitlab, slack, stripe, bearer, assign, entropy, prefix:<text> or none (default: all but prefix)\n"
+          "        --shell-integration Mark prompts and commands of bash and zsh with OSC 133, indexing session commands (when the command is just the shell)\n"
+          "        --files-root        Directory the /api/files transfers are confined to, with --writable (default: --cwd or the current directory)\n"
           "    -v, --version           Print the version and exit\n"
           "    -h, --help              Print this text and exit\n\n"
           "Visit https://github.com/tsl0922/cmdr to get more information and report bugs.\n",
@@ -158,6 +186,7 @@ static void print_config() {
   if (server->exit_no_conn) lwsl_notice("  exit_no_conn: true\n");
   if (server->index != NULL) lwsl_notice("  custom index.html: %s\n", server->index);
   if (server->cwd != NULL) lwsl_notice("  working directory: %s\n", server->cwd);
+  if (server->writable) lwsl_notice("  files root: %s\n", server->files_root);
   if (!server->writable) lwsl_warn("The --writable option is not set, will start in readonly mode\n");
 }
 
@@ -198,6 +227,9 @@ static struct server *server_new(int argc, char **argv, int start) {
   }
   *ptr = '\0';  // null terminator
 
+  ts->redact = redact_rules_new();
+  redact_rules_add(ts->redact, REDACT_DEFAULT);
+
   ts->loop = xmalloc(sizeof *ts->loop);
   uv_loop_init(ts->loop);
 
@@ -235,12 +267,17 @@ static void server_free(struct server *ts) {
   if (ts->auth_header != NULL) free(ts->auth_header);
   if (ts->index != NULL) free(ts->index);
   if (ts->cwd != NULL) free(ts->cwd);
+  free(ts->files_root);
   free(ts->command);
   free(ts->prefs_json);
 
   char **p = ts->argv;
   for (; *p; p++) free(*p);
   free(ts->argv);
+  for (int i = 0; i < ts->trigger_count; i++) free(ts->triggers[i]);
+  free(ts->triggers);
+  redact_rules_free(ts->redact);
+  shell_integration_free(ts->shell_integration);
 
   if (strlen(ts->socket_path) > 0) {
     struct stat st;
@@ -344,6 +381,7 @@ int main(int argc, char **argv) {
     print_help();
     return 0;
   }
+  if (strcmp(argv[1], "attach") == 0) return attach_main(argc - 1, argv + 1);
 #ifdef _WIN32
   if (!conpty_init()) {
     fprintf(stderr, "ERROR: ConPTY init failed! Make sure you are on Windows 10 1809 or later.");
@@ -377,6 +415,16 @@ int main(int argc, char **argv) {
   char iface[128] = "";
   char socket_owner[128] = "";
   bool browser = false;
+  bool profile = false;
+  const char *profile_path = NULL;
+  bool trace = false;
+  const char *trace_path = NULL;
+  bool attach = false;
+  const char *attach_path = NULL;
+  bool redact = false;
+  bool shell_integration = false;
+  const char *files_root = NULL;
+  char attach_default[256];
   bool ssl = false;
   char cert_path[1024] = "";
   char key_path[1024] = "";
@@ -422,6 +470,44 @@ int main(int argc, char **argv) {
       case 'B':
         browser = true;
         break;
+      case OPT_PROFILE:
+        profile = true;
+        profile_path = optarg;
+        break;
+      case OPT_TRACE:
+        trace = true;
+        trace_path = optarg;
+        break;
+      case OPT_ATTACH:
+        attach = true;
+        attach_path = optarg;
+        break;
+      case OPT_TRIGGER:
+        if (!trigger_pattern_valid(optarg) || server->trigger_count >= TRIGGER_MAX_PATTERNS) {
+          fprintf(stderr, "cmdr: invalid trigger: %s\n", optarg);
+          return -1;
+        }
+        server->triggers = xrealloc(server->triggers, (server->trigger_count + 1) * sizeof(char *));
+        server->triggers[server->trigger_count++] = strdup(optarg);
+        break;
+      case OPT_REDACT:
+        // the first --redact replaces the default rules
+        if (!redact) {
+          redact_rules_free(server->redact);
+          server->redact = redact_rules_new();
+          redact = true;
+        }
+        if (!redact_rules_add(server->redact, optarg)) {
+          fprintf(stderr, "cmdr: invalid redact rule: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_SHELL_INTEGRATION:
+        shell_integration = true;
+        break;
+      case OPT_FILES_ROOT:
+        files_root = optarg;
+        break;
       case 'p':
         info.port = parse_int("port", optarg);
         if (info.port < 0) {
@@ -566,13 +652,30 @@ int main(int argc, char **argv) {
         return -1;
     }
   }
+  struct json_object *o = NULL;
+  if (json_object_object_get_ex(client_prefs, "enableZmodem", &o) && json_object_get_boolean(o))
+    server->binary_output = true;
+  if (json_object_object_get_ex(client_prefs, "enableTrzsz", &o) && json_object_get_boolean(o))
+    server->binary_output = true;
   server->prefs_json = strdup(json_object_to_json_string(client_prefs));
   json_object_put(client_prefs);
+  if (redact_rules_empty(server->redact)) {
+    redact_rules_free(server->redact);
+    server->redact = NULL;
+  }
 
   if (server->command == NULL || strlen(server->command) == 0) {
     fprintf(stderr, "cmdr: missing start command\n");
     return -1;
   }
+  if (shell_integration) server->shell_integration = shell_integration_new();
+  // pinned at startup, never taken from the cwd a session's shell reports
+  if (files_root == NULL) files_root = server->cwd != NULL ? server->cwd : ".";
+  server->files_root = realpath(files_root, NULL);
+  if (server->files_root == NULL) {
+    fprintf(stderr, "cmdr: invalid files root: %s\n", files_root);
+    return -1;
+  }
 
   lws_set_log_level(debug_level, NULL);
 
@@ -645,6 +748,16 @@ int main(int argc, char **argv) {
     lwsl_err("libwebsockets vhost creation failed\n");
     return 1;
   }
+  if (profile) profile_start(server->loop, profile_path);
+  if (trace) trace_start(server->loop, trace_path);
+  if (attach) {
+    if (attach_path == NULL) {
+      attach_default_path(attach_default, sizeof(attach_default));
+      attach_path = attach_default;
+    }
+    if (!attach_listen(server->loop, attach_path)) return 1;
+  }
+
   int port = lws_get_vhost_listen_port(vhost);
   lwsl_notice(" Listening on port: %d\n", port);
 
@@ -673,10 +786,15 @@ int main(int argc, char **argv) {
   }
 #undef sig_count
 
+  profile_stop();
+  trace_stop();
+  attach_close();
   lws_context_destroy(context);
 
   // cleanup
   server_free(server);
+  int leaks = pool_report_leaks();
+  if (leaks > 0) lwsl_warn("%d pool blocks still allocated at exit\n", leaks);
 
   return 0;
 }
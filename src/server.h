@@ -3,14 +3,25 @@
 #include <time.h>
 #include <uv.h>
 
+#include "attach.h"
+#include "files.h"
+#include "inband.h"
+#include "osc.h"
 #include "pty.h"
+#include "redact.h"
+#include "screen.h"
+#include "shell_integration.h"
 #include "updater.h"
+#include "utf8.h"
 
 // client message
 #define INPUT '0'
 #define RESIZE_TERMINAL '1'
 #define PAUSE '2'
 #define RESUME '3'
+#define ACK_STATE '4'
+#define FLOW_REPORT '5'
+#define FETCH_SCROLLBACK '6'
 #define JSON_DATA '{'
 
 // server message
@@ -19,6 +30,24 @@
 #define SET_PREFERENCES '2'
 #define UPDATE_STATUS '3'
 #define UPDATE_PROGRESS '4'
+#define SCREEN_FRAME '5'
+#define TERMINAL_MODE '6'
+#define SCROLLBACK '7'
+#define TRIGGER_EVENT '8'
+
+// FETCH_SCROLLBACK page limits
+#define SCROLLBACK_PAGE_LINES 500
+#define SCROLLBACK_PAGE_LINES_MAX 5000
+#define SCROLLBACK_PAGE_BYTES_MAX (256 * 1024)
+
+// PTY output buffered per connection while the socket is busy, sized from FLOW_REPORT
+#define READ_AHEAD_MIN (16 * 1024)
+#define READ_AHEAD_DEFAULT (64 * 1024)
+#define READ_AHEAD_MAX (1024 * 1024)
+// smallest bufferSize a client may ask for in the handshake
+#define BUFFER_SIZE_MIN 1024
+// permessage-deflate level outside zmodem/trzsz transfers (lws' default), inside them it is 0
+#define DEFLATE_LEVEL "1"
 
 // url paths
 struct endpoints {
@@ -34,21 +63,23 @@ extern struct server *server;
 extern struct endpoints endpoints;
 
 struct pss_http {
-  char path[128];
+  char path[1024];  // request URI, longer ones are refused
   char *buffer;
   char *ptr;
   size_t len;
+  bool embedded;  // buffer points into html.h, not to be freed
+  file_transfer_t *transfer;  // FILES_PREFIX download or upload in progress
 };
 
 struct pss_tty {
   bool initialized;
   int initial_cmd_index;
   bool authenticated;
-  char user[30];
-  char address[50];
-  char path[128];
-  char session_id[64];  // Session ID for ChatGPT-style session management
-  char default_shell[256]; // User-selected shell path
+  // heap strings instead of fixed arrays, most of that space goes unused on every connection
+  char *user;           // from --auth-header, NULL without it
+  char *address;
+  char *session_id;     // Session ID for ChatGPT-style session management
+  char *default_shell;  // User-selected shell path, NULL runs the server command
   char **args;
   int argc;
 
@@ -57,14 +88,46 @@ struct pss_tty {
   size_t len;
 
   pty_process *process;
-  pty_buf_t *pty_buf;
+  pty_buf_t *pty_buf;   // output not sent yet, reads are appended up to read_ahead bytes
+  size_t read_ahead;
+  size_t buffer_size;   // client's bufferSize, caps read_ahead, 0 if not set
+  bool client_paused;   // PAUSE received, only RESUME restarts reading
+  uint32_t frame_interval_ms;  // from the client's frameRateLimit, 0 for no limit
+  uint64_t last_output_ms;
+  uint64_t trace_id;    // --trace flow of the oldest read in pty_buf
+  utf8_stream_t utf8;  // holds back split UTF-8 sequences between OUTPUT frames
 
   int lws_close_status;
+  bool mode_pending;  // PTY line discipline changed, TERMINAL_MODE not sent yet
+
+  // zmodem/trzsz running in the PTY, NULL unless binary_output
+  inband_detector_t *inband;
+  bool in_transfer;
+  attach_client_t *attached;  // `cmdr attach` clients mirroring this connection
+
+  // Title and cwd tracking from OSC sequences in the output
+  osc_scanner_t *osc;
+  char *title;
+  bool title_pending;
+
+  // SCROLLBACK reply waiting for the socket, LWS_PRE headroom included in the allocation
+  char *scrollback;
+  size_t scrollback_len;
+
+  // Screen-diff transport, NULL when the client asked for the raw byte stream
+  screen_transport_t *screen;
+  uv_timer_t *frame_timer;
 
   // Persistent session connection
   struct persistent_session *persistent_session;
+  uint64_t event_sent;  // seq of the last trigger event sent as TRIGGER_EVENT
 };
 
+// lws allocates this for every WebSocket, idle ones included: rarely used state goes behind a
+// pointer, allocated when needed (`make idle-footprint` measures the whole connection)
+#define PSS_TTY_BUDGET 320
+_Static_assert(sizeof(struct pss_tty) <= PSS_TTY_BUDGET, "struct pss_tty is over its per-connection budget");
+
 typedef struct {
   struct pss_tty *pss;
   bool ws_closed;
@@ -76,6 +139,7 @@ struct session_data {
   char *name;          // user-friendly session name
   char *command;       // command run in this session
   char *working_dir;   // working directory for session
+  char *title;         // last window title reported by the program (optional)
   time_t created_at;   // session creation timestamp
   time_t last_used;    // last access timestamp
   bool is_active;      // whether session is currently active
@@ -106,6 +170,7 @@ struct server {
   char **argv;             // command with arguments
   int argc;                // command + arguments count
   char *cwd;               // working directory
+  char *files_root;        // realpath FILES_PREFIX transfers are confined to
   int sig_code;            // close signal
   char sig_name[20];       // human readable signal string
   bool url_arg;            // allow client to send cli arguments in URL
@@ -116,6 +181,11 @@ struct server {
   bool exit_no_conn;       // whether exit on all clients disconnection
   char socket_path[255];   // UNIX domain socket path
   char terminal_type[30];  // terminal type to report
+  bool binary_output;      // zmodem/trzsz enabled, OUTPUT has to stay byte exact
+  char **triggers;         // --trigger patterns, watched for in every session's output
+  int trigger_count;
+  redact_rules_t *redact;  // masks secrets in the stored copy of session output, NULL if --redact=none
+  shell_integration_t *shell_integration;  // --shell-integration startup files for bash and zsh
 
   uv_loop_t *loop;         // the libuv event loop
   
@@ -144,6 +214,9 @@ char* session_list_to_json(struct session_manager *mgr);
 void session_cleanup_old(struct session_manager *mgr);
 void session_delete_by_index(struct session_manager *mgr, int index);
 
+// Protocol helpers
+struct json_object *parse_window_size(const char *buf, size_t len, uint16_t *cols, uint16_t *rows);
+
 // Update system functions
 bool server_init_updater(struct server *srv);
 void server_cleanup_updater(struct server *srv);
@@ -1,3 +1,4 @@
+#include "json_writer.h"
 #include "server.h"
 #include "utils.h"
 
@@ -52,6 +53,7 @@ struct session_data* session_create(struct session_manager *mgr, const char *nam
     session->is_archived = false;
     session->process_pid = 0;
     session->history = NULL;
+    session->title = NULL;
     
     mgr->sessions[mgr->session_count++] = session;
     
@@ -86,6 +88,7 @@ bool session_delete(struct session_manager *mgr, const char *id) {
             free(session->name);
             free(session->command);
             free(session->working_dir);
+            if (session->title) free(session->title);
             if (session->history) free(session->history);
             free(session);
             
@@ -117,28 +120,36 @@ bool session_rename(struct session_manager *mgr, const char *id, const char *new
 
 // Get sessions as JSON
 char* session_list_to_json(struct session_manager *mgr) {
-    json_object *root = json_object_new_array();
+    json_writer_t w;
+    json_writer_init(&w, 0, (size_t)mgr->session_count * 256 + 2);
+    json_writer_begin_array(&w);
     
     for (int i = 0; i < mgr->session_count; i++) {
         struct session_data *session = mgr->sessions[i];
-        json_object *obj = json_object_new_object();
-        
-        json_object_object_add(obj, "id", json_object_new_string(session->id));
-        json_object_object_add(obj, "name", json_object_new_string(session->name));
-        json_object_object_add(obj, "command", json_object_new_string(session->command));
-        json_object_object_add(obj, "working_dir", json_object_new_string(session->working_dir));
-        json_object_object_add(obj, "created_at", json_object_new_int64(session->created_at));
-        json_object_object_add(obj, "last_used", json_object_new_int64(session->last_used));
-        json_object_object_add(obj, "is_active", json_object_new_boolean(session->is_active));
-        
-        json_object_array_add(root, obj);
+        json_writer_begin_object(&w);
+        json_writer_key(&w, "id");
+        json_writer_string(&w, session->id);
+        json_writer_key(&w, "name");
+        json_writer_string(&w, session->name);
+        json_writer_key(&w, "command");
+        json_writer_string(&w, session->command);
+        json_writer_key(&w, "working_dir");
+        json_writer_string(&w, session->working_dir);
+        if (session->title) {
+            json_writer_key(&w, "title");
+            json_writer_string(&w, session->title);
+        }
+        json_writer_key(&w, "created_at");
+        json_writer_int(&w, session->created_at);
+        json_writer_key(&w, "last_used");
+        json_writer_int(&w, session->last_used);
+        json_writer_key(&w, "is_active");
+        json_writer_bool(&w, session->is_active);
+        json_writer_end_object(&w);
     }
     
-    const char *json_str = json_object_to_json_string(root);
-    char *result = strdup(json_str);
-    json_object_put(root);
-    
-    return result;
+    json_writer_end_array(&w);
+    return json_writer_finish(&w, NULL);
 }
 
 // Save sessions to file
@@ -175,7 +186,7 @@ void session_manager_load(struct session_manager *mgr) {
             if (obj) {
                 struct session_data *session = xmalloc(sizeof(struct session_data));
                 
-                json_object *id_obj, *name_obj, *cmd_obj, *cwd_obj, *created_obj, *used_obj, *active_obj;
+                json_object *id_obj, *name_obj, *cmd_obj, *cwd_obj, *title_obj, *created_obj, *used_obj, *active_obj;
                 
                 if (json_object_object_get_ex(obj, "id", &id_obj))
                     session->id = strdup(json_object_get_string(id_obj));
@@ -195,6 +206,9 @@ void session_manager_load(struct session_manager *mgr) {
                 session->is_archived = false;
                 session->process_pid = 0;
                 session->history = NULL;
+                session->title = NULL;
+                if (json_object_object_get_ex(obj, "title", &title_obj))
+                    session->title = strdup(json_object_get_string(title_obj));
                 
                 mgr->sessions[mgr->session_count++] = session;
             }
@@ -234,6 +248,7 @@ void session_delete_by_index(struct session_manager *mgr, int index) {
     free(session->name);
     free(session->command);
     free(session->working_dir);
+    if (session->title) free(session->title);
     if (session->history) free(session->history);
     free(session);
     
@@ -253,6 +268,7 @@ void session_manager_free(struct session_manager *mgr) {
         free(session->name);
         free(session->command);
         free(session->working_dir);
+        if (session->title) free(session->title);
         if (session->history) free(session->history);
         free(session);
     }
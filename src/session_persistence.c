@@ -1,5 +1,11 @@
 #include "session_persistence.h"
+#include "json_writer.h"
+#include "pool.h"
+#include "profile.h"
+#include "probes.h"
 #include "server.h"
+#include "trace.h"
+#include "utf8.h"
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,6 +19,9 @@
 #include <stdarg.h>
 #include <libwebsockets.h>
 
+// Typical length of one session's info JSON, sizes the list buffer up front
+#define SESSION_JSON_HINT 384
+
 // Global error state
 static session_error_t g_last_error = SESSION_ERROR_NONE;
 
@@ -177,8 +186,9 @@ bool persistent_session_validate_id(const char *id) {
     return false;
 }
 
-// Create terminal buffer with specified capacity
-terminal_buffer_t* terminal_buffer_create(size_t capacity, size_t max_lines) {
+// Create terminal buffer holding up to max_capacity bytes and max_lines lines. Both start small
+// and grow on demand, most sessions never produce enough output to need the full size.
+terminal_buffer_t* terminal_buffer_create(size_t max_capacity, size_t max_lines) {
     terminal_buffer_t *buffer = malloc(sizeof(terminal_buffer_t));
     if (!buffer) {
         session_set_last_error(SESSION_ERROR_MEMORY);
@@ -189,6 +199,9 @@ terminal_buffer_t* terminal_buffer_create(size_t capacity, size_t max_lines) {
     // Initialize buffer structure
     memset(buffer, 0, sizeof(terminal_buffer_t));
     
+    size_t capacity = max_capacity < INITIAL_BUFFER_SIZE ? max_capacity : INITIAL_BUFFER_SIZE;
+    size_t line_slots = max_lines < INITIAL_BUFFER_LINES ? max_lines : INITIAL_BUFFER_LINES;
+    
     // Allocate data buffer
     buffer->data = malloc(capacity);
     if (!buffer->data) {
@@ -198,25 +211,30 @@ terminal_buffer_t* terminal_buffer_create(size_t capacity, size_t max_lines) {
         return NULL;
     }
     
-    // Allocate line pointer array
-    buffer->lines = malloc(sizeof(char*) * max_lines);
-    if (!buffer->lines) {
+    // Allocate line index
+    buffer->line_starts = malloc(sizeof(uint64_t) * line_slots);
+    if (!buffer->line_starts) {
         session_set_last_error(SESSION_ERROR_MEMORY);
-        session_log(LOG_ERROR, NULL, "Failed to allocate line pointer array (%zu lines)", max_lines);
+        session_log(LOG_ERROR, NULL, "Failed to allocate line index (%zu lines)", line_slots);
         free(buffer->data);
         free(buffer);
         return NULL;
     }
     
     buffer->capacity = capacity;
+    buffer->max_capacity = max_capacity;
+    buffer->line_slots = line_slots;
     buffer->max_lines = max_lines;
     buffer->size = 0;
     buffer->head = 0;
     buffer->is_full = false;
-    buffer->line_count = 0;
     
-    session_log(LOG_DEBUG, NULL, "Created terminal buffer: capacity=%zu, max_lines=%zu", 
-                capacity, max_lines);
+    // Line 0 starts at offset 0
+    buffer->line_starts[0] = 0;
+    buffer->line_count = 1;
+    
+    session_log(LOG_DEBUG, NULL, "Created terminal buffer: capacity=%zu/%zu, max_lines=%zu", 
+                capacity, max_capacity, max_lines);
     
     return buffer;
 }
@@ -233,14 +251,69 @@ void terminal_buffer_destroy(terminal_buffer_t *buffer) {
         buffer->data = NULL;
     }
     
-    if (buffer->lines) {
-        free(buffer->lines);
-        buffer->lines = NULL;
+    if (buffer->line_starts) {
+        free(buffer->line_starts);
+        buffer->line_starts = NULL;
     }
     
     free(buffer);
 }
 
+// Start offset of an indexed line, slot relative to the oldest
+static uint64_t line_start(terminal_buffer_t *buffer, size_t slot) {
+    return buffer->line_starts[(buffer->line_head + slot) % buffer->line_slots];
+}
+
+// Double the line index up to max_lines, unrolled so the oldest line is in slot 0 again
+static bool grow_lines(terminal_buffer_t *buffer) {
+    if (buffer->line_slots >= buffer->max_lines) return false;
+    size_t slots = buffer->line_slots * 2 < buffer->max_lines ? buffer->line_slots * 2 : buffer->max_lines;
+    uint64_t *line_starts = malloc(sizeof(uint64_t) * slots);
+    if (!line_starts) return false;
+    for (size_t i = 0; i < buffer->line_count; i++) line_starts[i] = line_start(buffer, i);
+    free(buffer->line_starts);
+    buffer->line_starts = line_starts;
+    buffer->line_slots = slots;
+    buffer->line_head = 0;
+    return true;
+}
+
+// Grow the data ring towards max_capacity so that need bytes fit. Only before the first wrap:
+// the data is still linear then and realloc keeps it in place.
+static void grow_data(terminal_buffer_t *buffer, size_t need) {
+    if (buffer->is_full || need <= buffer->capacity || buffer->capacity >= buffer->max_capacity) return;
+    size_t capacity = buffer->capacity * 2 > need ? buffer->capacity * 2 : need;
+    if (capacity > buffer->max_capacity) capacity = buffer->max_capacity;
+    char *data = realloc(buffer->data, capacity);
+    if (!data) return;  // wrap within what we have
+    buffer->data = data;
+    buffer->capacity = capacity;
+}
+
+// Index every line started in data, which was appended at absolute offset base
+static void index_lines(terminal_buffer_t *buffer, const char *data, size_t length, uint64_t base) {
+    const char *p = data, *end = data + length;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        if (buffer->line_count == buffer->line_slots && !grow_lines(buffer)) {
+            // index full, forget the oldest line
+            buffer->line_head = (buffer->line_head + 1) % buffer->line_slots;
+            buffer->line_count--;
+            buffer->first_line++;
+        }
+        buffer->line_starts[(buffer->line_head + buffer->line_count) % buffer->line_slots] = base + (p - data);
+        buffer->line_count++;
+    }
+    
+    // drop lines whose successor starts in overwritten data, the oldest kept line may be partial
+    uint64_t oldest = buffer->total_written - buffer->size;
+    while (buffer->line_count > 1 && line_start(buffer, 1) <= oldest) {
+        buffer->line_head = (buffer->line_head + 1) % buffer->line_slots;
+        buffer->line_count--;
+        buffer->first_line++;
+    }
+}
+
 // Append data to terminal buffer (circular buffer implementation)
 bool terminal_buffer_append(terminal_buffer_t *buffer, const char *data, size_t length) {
     if (!buffer || !data || length == 0) {
@@ -248,14 +321,21 @@ bool terminal_buffer_append(terminal_buffer_t *buffer, const char *data, size_t
         return false;
     }
     
+    PROFILE_ENTER(PROF_BUFFER_APPEND);
+    uint64_t base = buffer->total_written;
+    buffer->total_written += length;
+    grow_data(buffer, buffer->head + length);
+    
     // If data is larger than entire buffer, just keep the last part
-    if (length >= buffer->capacity) {
+    if (length >= buffer->max_capacity || length > buffer->capacity) {
         memcpy(buffer->data, data + (length - buffer->capacity), buffer->capacity);
         buffer->size = buffer->capacity;
         buffer->head = 0;
         buffer->is_full = true;
+        index_lines(buffer, data, length, base);
         session_log(LOG_DEBUG, NULL, "Buffer overflow: truncated %zu bytes to %zu", 
                     length, buffer->capacity);
+        PROFILE_LEAVE(PROF_BUFFER_APPEND);
         return true;
     }
     
@@ -278,10 +358,12 @@ bool terminal_buffer_append(terminal_buffer_t *buffer, const char *data, size_t
             buffer->size = buffer->head;
         }
     }
+    index_lines(buffer, data, length, base);
     
     session_log(LOG_DEBUG, NULL, "Appended %zu bytes to terminal buffer (total: %zu/%zu)", 
                 length, buffer->size, buffer->capacity);
     
+    PROFILE_LEAVE(PROF_BUFFER_APPEND);
     return true;
 }
 
@@ -320,6 +402,95 @@ char* terminal_buffer_get_contents(terminal_buffer_t *buffer, size_t *length) {
     return contents;
 }
 
+// Number of the oldest line still (at least partially) in the buffer
+uint64_t terminal_buffer_oldest_line(terminal_buffer_t *buffer) {
+    return buffer ? buffer->first_line : 0;
+}
+
+// One past the newest line, the newest one is still being written
+uint64_t terminal_buffer_end_line(terminal_buffer_t *buffer) {
+    return buffer ? buffer->first_line + buffer->line_count : 0;
+}
+
+// Absolute offset where a line starts, clamped to the data still in the ring
+static uint64_t line_offset(terminal_buffer_t *buffer, uint64_t line) {
+    uint64_t oldest = buffer->total_written - buffer->size;
+    if (line >= terminal_buffer_end_line(buffer)) return buffer->total_written;
+    uint64_t start = line_start(buffer, line - buffer->first_line);
+    return start < oldest ? oldest : start;
+}
+
+// Copy lines [*first, *end) into a new buffer. The range is clamped to the indexed lines and
+// shrunk by whole lines to max_bytes, dropping the oldest when keep_end is set and the newest
+// otherwise (a single line longer than max_bytes is cut). *first and *end are updated to the
+// lines returned.
+char* terminal_buffer_read_lines(terminal_buffer_t *buffer, uint64_t *first, uint64_t *end, size_t max_bytes,
+                                 bool keep_end, size_t *length) {
+    if (!buffer || !first || !end || !length) {
+        session_log(LOG_WARN, NULL, "Invalid parameters for terminal_buffer_read_lines");
+        return NULL;
+    }
+    
+    uint64_t oldest_line = terminal_buffer_oldest_line(buffer);
+    uint64_t end_line = terminal_buffer_end_line(buffer);
+    if (*first < oldest_line) *first = oldest_line;
+    if (*first > end_line) *first = end_line;
+    if (*end < *first) *end = *first;
+    if (*end > end_line) *end = end_line;
+    
+    while (*end - *first > 1 && line_offset(buffer, *end) - line_offset(buffer, *first) > max_bytes) {
+        if (keep_end) (*first)++;
+        else (*end)--;
+    }
+    
+    uint64_t from = line_offset(buffer, *first);
+    uint64_t to = line_offset(buffer, *end);
+    if (to - from > max_bytes) {
+        if (keep_end) from = to - max_bytes;
+        else to = from + max_bytes;
+    }
+    
+    return terminal_buffer_read_range(buffer, from, to, length);
+}
+
+// Copy the bytes between absolute offsets [from, to) into a new NUL terminated buffer, clamped
+// to the data still in the ring
+char* terminal_buffer_read_range(terminal_buffer_t *buffer, uint64_t from, uint64_t to, size_t *length) {
+    if (!buffer || !length) {
+        session_log(LOG_WARN, NULL, "Invalid parameters for terminal_buffer_read_range");
+        return NULL;
+    }
+    
+    uint64_t oldest = buffer->total_written - buffer->size;
+    if (from < oldest) from = oldest;
+    if (to > buffer->total_written) to = buffer->total_written;
+    if (to < from) to = from;
+    
+    *length = (size_t)(to - from);
+    char *contents = malloc(*length + 1);
+    if (!contents) {
+        session_set_last_error(SESSION_ERROR_MEMORY);
+        session_log(LOG_ERROR, NULL, "Failed to allocate memory for buffer range");
+        return NULL;
+    }
+    
+    // the newest byte sits right before head
+    if (*length > 0) {
+        size_t pos = (buffer->head + buffer->capacity - (size_t)((buffer->total_written - from) % buffer->capacity)) %
+                     buffer->capacity;
+        size_t first_chunk = buffer->capacity - pos;
+        if (first_chunk >= *length) {
+            memcpy(contents, buffer->data + pos, *length);
+        } else {
+            memcpy(contents, buffer->data + pos, first_chunk);
+            memcpy(contents + first_chunk, buffer->data, *length - first_chunk);
+        }
+    }
+    contents[*length] = '\0';
+    
+    return contents;
+}
+
 // Create session registry
 session_registry_t* session_registry_create(const char *state_dir) {
     session_registry_t *registry = malloc(sizeof(session_registry_t));
@@ -359,6 +530,26 @@ session_registry_t* session_registry_create(const char *state_dir) {
     return registry;
 }
 
+static void add_trigger(persistent_session_t *session, const char *pattern) {
+    if (session->trigger_count >= SESSION_TRIGGERS || !trigger_pattern_valid(pattern)) return;
+    size_t bytes = strlen(pattern);
+    for (size_t i = 0; i < session->trigger_count; i++) bytes += strlen(session->triggers[i]);
+    if (bytes > SESSION_TRIGGER_BYTES) return;
+    session->triggers = xrealloc(session->triggers, (session->trigger_count + 1) * sizeof(char *));
+    session->triggers[session->trigger_count++] = safe_strdup(pattern);
+}
+
+static void free_triggers(persistent_session_t *session) {
+    for (size_t i = 0; i < session->trigger_count; i++) free(session->triggers[i]);
+    free(session->triggers);
+    session->triggers = NULL;
+    session->trigger_count = 0;
+    trigger_scanner_free(session->trigger_scanner);
+    session->trigger_scanner = NULL;
+    free(session->events);
+    session->events = NULL;
+}
+
 // Destroy session registry and all sessions
 void session_registry_destroy(session_registry_t *registry) {
     if (!registry) return;
@@ -382,6 +573,7 @@ void session_registry_destroy(session_registry_t *registry) {
         if (current->id) free(current->id);
         if (current->name) free(current->name);
         if (current->working_directory) free(current->working_directory);
+        if (current->title) free(current->title);
         if (current->command) free(current->command);
         if (current->environment) {
             session_free_environment(current->environment, current->env_count);
@@ -389,6 +581,10 @@ void session_registry_destroy(session_registry_t *registry) {
         if (current->buffer) {
             terminal_buffer_destroy(current->buffer);
         }
+        free_triggers(current);
+        redactor_free(current->redactor);
+        osc_scanner_free(current->marks);
+        free(current->commands);
         
         free(current);
         current = next;
@@ -457,7 +653,7 @@ persistent_session_t* persistent_session_create_new(session_registry_t *registry
     session->terminal_rows = 24;
     
     // Create terminal buffer
-    session->buffer = terminal_buffer_create(MAX_BUFFER_SIZE, 1000);
+    session->buffer = terminal_buffer_create(MAX_BUFFER_SIZE, MAX_BUFFER_LINES);
     if (!session->buffer) {
         session_log(LOG_ERROR, session->id, "Failed to create terminal buffer");
         free(session->id);
@@ -505,6 +701,132 @@ persistent_session_t* persistent_session_find_by_id(session_registry_t *registry
     return NULL;
 }
 
+// Absolute offset of the next output byte, bytes held back by the redactor included
+static uint64_t output_offset(persistent_session_t *session) {
+    return session->buffer->total_written + (session->redactor ? session->redactor->hold_len : 0);
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Command line echoed between two offsets, with escape sequences and control characters dropped
+// and line editing (backspaces) applied
+static void command_text(persistent_session_t *session, uint64_t from, uint64_t to, char *text) {
+    text[0] = '\0';
+    if (from == 0 || to <= from) return;
+    if (to - from > 4 * COMMAND_TEXT_MAX) to = from + 4 * COMMAND_TEXT_MAX;
+    size_t raw_len = 0;
+    char *raw = terminal_buffer_read_range(session->buffer, from, to, &raw_len);
+    if (!raw) return;
+    
+    enum { TEXT, ESC, CSI, STRING } state = TEXT;
+    size_t len = 0;
+    for (size_t i = 0; i < raw_len; i++) {
+        unsigned char c = (unsigned char)raw[i];
+        switch (state) {
+            case ESC:
+                state = c == '[' ? CSI : (c == ']' || c == 'P' || c == '_') ? STRING : TEXT;
+                continue;
+            case CSI:
+                if (c >= 0x40 && c <= 0x7e) state = TEXT;
+                continue;
+            case STRING:
+                if (c == 0x07) state = TEXT;
+                else if (c == 0x1b) state = ESC;
+                continue;
+            default:
+                break;
+        }
+        if (c == 0x1b) {
+            state = ESC;
+        } else if (c == '\b') {
+            if (len > 0) len--;
+        } else if (c >= 0x20 && c != 0x7f && len < COMMAND_TEXT_MAX) {
+            text[len++] = (char)c;
+        }
+    }
+    free(raw);
+    
+    while (len > 0 && text[len - 1] == ' ') len--;
+    size_t start = 0;
+    while (start < len && text[start] == ' ') start++;
+    len = utf8_valid_prefix(text + start, len - start);
+    memmove(text, text + start, len);
+    text[len] = '\0';
+}
+
+// End the running command, if any, at offset at
+static void end_command(persistent_session_t *session, uint64_t at, int exit_code) {
+    if (!session->started_ms || !session->commands) return;
+    session_command_t *command = &session->commands[(session->command_seq - 1) % SESSION_COMMANDS];
+    command->end = at > command->output ? at : command->output;
+    command->exit_code = exit_code;
+    command->duration_ms = monotonic_ms() - session->started_ms;
+    session->started_ms = 0;
+    session_log(LOG_DEBUG, session->id, "Command %llu finished: exit=%d, %llu ms, %llu bytes",
+                (unsigned long long)command->seq, exit_code, (unsigned long long)command->duration_ms,
+                (unsigned long long)(command->end - command->output));
+}
+
+typedef struct {
+    persistent_session_t *session;
+    uint64_t base;  // absolute offset of the data being scanned
+} mark_ctx_t;
+
+// osc_cb for OSC 133: A starts the prompt, B the command line, C the output, D[;exit code]
+// ends it. Marks are placed where their sequence starts, C and B where it ends.
+static void shell_mark(void *ctx, int code, const char *payload, size_t len) {
+    if (code != OSC_SHELL_MARK || len == 0) return;
+    mark_ctx_t *m = (mark_ctx_t *)ctx;
+    persistent_session_t *session = m->session;
+    uint64_t end = m->base + session->marks->end;
+    uint64_t start = end > session->marks->length ? end - session->marks->length : 0;
+    
+    switch (payload[0]) {
+        case 'A':
+            // a shell without D marks, the prompt ends the command
+            end_command(session, start, -1);
+            session->prompt_at = start;
+            session->input_at = 0;
+            break;
+        case 'B':
+            session->input_at = end;
+            break;
+        case 'C': {
+            end_command(session, start, -1);
+            if (!session->commands) session->commands = xmalloc(SESSION_COMMANDS * sizeof(session_command_t));
+            session_command_t *command = &session->commands[session->command_seq % SESSION_COMMANDS];
+            memset(command, 0, sizeof(session_command_t));
+            command->seq = ++session->command_seq;
+            command->prompt = session->prompt_at;
+            command->output = end;
+            command->exit_code = -1;
+            command->started = time(NULL);
+            command_text(session, session->input_at ? session->input_at : session->prompt_at, start, command->text);
+            session->started_ms = monotonic_ms();
+            session->input_at = 0;
+            break;
+        }
+        case 'D':
+            // sent at every prompt by some integrations, also when no command ran
+            end_command(session, start, len > 2 && payload[1] == ';' ? atoi(payload + 2) : -1);
+            break;
+        default:
+            break;
+    }
+}
+
+// redact_cb for the session's terminal buffer
+static void append_redacted(void *ctx, const char *data, size_t len) {
+    persistent_session_t *session = (persistent_session_t *)ctx;
+    if (!terminal_buffer_append(session->buffer, data, len)) {
+        session_log(LOG_ERROR, session->id, "Failed to append data to terminal buffer");
+    }
+}
+
 // Attach connection to session
 bool persistent_session_attach_connection(persistent_session_t *session, void *pss, void *wsi) {
     if (!session || !pss || !wsi) {
@@ -520,6 +842,7 @@ bool persistent_session_attach_connection(persistent_session_t *session, void *p
     
     session->current_pss = pss;
     session->current_wsi = wsi;
+    CMDR_PROBE2(session__attach, session->id, wsi);
     session->is_active = true;
     session->last_accessed = time(NULL);
     session->needs_save = true;
@@ -539,6 +862,10 @@ bool persistent_session_detach_connection(persistent_session_t *session) {
     session_log(LOG_INFO, session->id, "Detaching connection: pss=%p, wsi=%p", 
                 session->current_pss, session->current_wsi);
     
+    CMDR_PROBE2(session__detach, session->id, session->current_wsi);
+    // the PTY goes with the connection, an unfinished run held back for redaction is stored as is
+    if (session->redactor && session->buffer) redact_flush(session->redactor, append_redacted, session);
+    if (session->buffer) end_command(session, session->buffer->total_written, -1);
     session->current_pss = NULL;
     session->current_wsi = NULL;
     session->is_active = false;
@@ -585,8 +912,99 @@ void persistent_session_mark_dirty(persistent_session_t *session) {
     }
 }
 
+// Update the window title reported by the program, control characters are replaced
+// so the value stays on one line in the state file
+void persistent_session_set_title(persistent_session_t *session, const char *title) {
+    if (!session || !title) return;
+    if (session->title && strcmp(session->title, title) == 0) return;
+
+    char *copy = safe_strdup(title);
+    if (!copy) return;
+    for (char *p = copy; *p; p++) {
+        if ((unsigned char)*p < 0x20 || *p == 0x7f) *p = ' ';
+    }
+    // keep it short enough for the fixed size info JSON, cut at a UTF-8 boundary
+    size_t len = strlen(copy);
+    if (len > MAX_TITLE_LENGTH) {
+        len = MAX_TITLE_LENGTH;
+        while (len > 0 && ((unsigned char)copy[len] & 0xc0) == 0x80) len--;
+        copy[len] = '\0';
+    }
+    if (session->title) free(session->title);
+    session->title = copy;
+    persistent_session_mark_dirty(session);
+    session_log(LOG_DEBUG, session->id, "Title changed: %s", session->title);
+}
+
+// Record the working directory reported by the shell, used when the session is respawned
+void persistent_session_set_working_directory(persistent_session_t *session, const char *path) {
+    if (!session || !path || strchr(path, '\n')) return;
+    if (session->cwd_tracked && session->working_directory && strcmp(session->working_directory, path) == 0) return;
+
+    char *copy = safe_strdup(path);
+    if (!copy) return;
+    if (session->working_directory) free(session->working_directory);
+    session->working_directory = copy;
+    session->cwd_tracked = true;
+    persistent_session_mark_dirty(session);
+    session_log(LOG_DEBUG, session->id, "Working directory changed: %s", session->working_directory);
+}
+
+// Compile the --trigger patterns and the session's own into one automaton, a match in
+// progress is dropped with the old one
+static void compile_triggers(persistent_session_t *session) {
+    trigger_scanner_free(session->trigger_scanner);
+    session->trigger_scanner = NULL;
+
+    int defaults = server != NULL ? server->trigger_count : 0;
+    size_t count = 0;
+    char **patterns = xmalloc((defaults + session->trigger_count + 1) * sizeof(char *));
+    for (int i = 0; i < defaults; i++) patterns[count++] = server->triggers[i];
+    for (size_t i = 0; i < session->trigger_count; i++) {
+        size_t j = 0;
+        while (j < count && strcmp(patterns[j], session->triggers[i]) != 0) j++;
+        if (j == count) patterns[count++] = session->triggers[i];
+    }
+    trigger_set_t *set = count > 0 ? trigger_set_new(patterns, (int)count) : NULL;
+    free(patterns);
+    if (!set) return;
+
+    session->trigger_scanner = trigger_scanner_new(set);
+    session_log(LOG_INFO, session->id, "Watching output for %d triggers (%u states)", set->count, set->states);
+}
+
+// Replace the session's trigger patterns, invalid ones (empty, over TRIGGER_MAX_LEN bytes or
+// with control characters) and those past SESSION_TRIGGERS or SESSION_TRIGGER_BYTES are skipped
+void persistent_session_set_triggers(persistent_session_t *session, char *const *patterns, size_t count) {
+    if (!session) return;
+    for (size_t i = 0; i < session->trigger_count; i++) free(session->triggers[i]);
+    free(session->triggers);
+    session->triggers = NULL;
+    session->trigger_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (patterns[i]) add_trigger(session, patterns[i]);
+    }
+    compile_triggers(session);
+    persistent_session_mark_dirty(session);
+}
+
+static void trigger_matched(void *ctx, int pattern, const char *line, size_t len) {
+    persistent_session_t *session = (persistent_session_t *)ctx;
+    if (!session->events) session->events = xmalloc(SESSION_EVENTS * sizeof(trigger_event_t));
+
+    trigger_event_t *event = &session->events[session->event_seq % SESSION_EVENTS];
+    event->seq = ++session->event_seq;
+    event->time = time(NULL);
+    snprintf(event->pattern, sizeof(event->pattern), "%s", session->trigger_scanner->set->patterns[pattern]);
+    // the line may have been cut in the middle of a character
+    len = utf8_boundary(line, len);
+    memcpy(event->line, line, len);
+    event->line[len] = '\0';
+    session_log(LOG_INFO, session->id, "Trigger '%s' matched: %s", event->pattern, event->line);
+}
+
 // Save session to disk
-bool persistent_session_save_to_disk(persistent_session_t *session) {
+static bool save_to_disk(persistent_session_t *session) {
     if (!session) {
         session_log(LOG_WARN, NULL, "Invalid session for disk save");
         return false;
@@ -612,6 +1030,9 @@ bool persistent_session_save_to_disk(persistent_session_t *session) {
     fprintf(fp, "NAME=%s\n", session->name);
     fprintf(fp, "COMMAND=%s\n", session->command);
     fprintf(fp, "WORKING_DIR=%s\n", session->working_directory);
+    fprintf(fp, "CWD_TRACKED=%s\n", session->cwd_tracked ? "true" : "false");
+    if (session->title) fprintf(fp, "TITLE=%s\n", session->title);
+    for (size_t i = 0; i < session->trigger_count; i++) fprintf(fp, "TRIGGER=%s\n", session->triggers[i]);
     fprintf(fp, "CREATED_AT=%ld\n", session->created_at);
     fprintf(fp, "LAST_ACCESSED=%ld\n", session->last_accessed);
     fprintf(fp, "TERMINAL_COLS=%u\n", session->terminal_cols);
@@ -653,8 +1074,19 @@ bool persistent_session_save_to_disk(persistent_session_t *session) {
     return true;
 }
 
+bool persistent_session_save_to_disk(persistent_session_t *session) {
+    PROFILE_ENTER(PROF_PERSIST);
+    uint64_t trace_ts = TRACE_ON ? trace_now() : 0;
+    CMDR_PROBE1(session__save__start, session ? session->id : NULL);
+    bool ok = save_to_disk(session);
+    CMDR_PROBE2(session__save__done, session ? session->id : NULL, ok);
+    if (TRACE_ON) trace_span("save", "persistence", trace_ts, 0, TRACE_FLOW_NONE, 0);
+    PROFILE_LEAVE(PROF_PERSIST);
+    return ok;
+}
+
 // Load session from disk
-persistent_session_t* persistent_session_load_from_disk(const char *session_id, const char *state_dir) {
+static persistent_session_t* load_from_disk(const char *session_id, const char *state_dir) {
     if (!session_id || !persistent_session_validate_id(session_id)) {
         session_log(LOG_WARN, session_id, "Invalid session ID for disk load");
         return NULL;
@@ -687,8 +1119,6 @@ persistent_session_t* persistent_session_load_from_disk(const char *session_id,
     // Read session metadata
     char line[1024];
     size_t buffer_size = 0;
-    size_t buffer_head = 0;
-    bool buffer_full = false;
     bool reading_buffer = false;
     
     while (fgets(line, sizeof(line), fp)) {
@@ -713,6 +1143,12 @@ persistent_session_t* persistent_session_load_from_disk(const char *session_id,
             session->command = safe_strdup(value);
         } else if (strcmp(key, "WORKING_DIR") == 0) {
             session->working_directory = safe_strdup(value);
+        } else if (strcmp(key, "CWD_TRACKED") == 0) {
+            session->cwd_tracked = (strcmp(value, "true") == 0);
+        } else if (strcmp(key, "TITLE") == 0) {
+            session->title = safe_strdup(value);
+        } else if (strcmp(key, "TRIGGER") == 0) {
+            add_trigger(session, value);
         } else if (strcmp(key, "CREATED_AT") == 0) {
             session->created_at = atol(value);
         } else if (strcmp(key, "LAST_ACCESSED") == 0) {
@@ -729,26 +1165,20 @@ persistent_session_t* persistent_session_load_from_disk(const char *session_id,
             session->save_count = atol(value);
         } else if (strcmp(key, "BUFFER_SIZE") == 0) {
             buffer_size = atol(value);
-        } else if (strcmp(key, "BUFFER_HEAD") == 0) {
-            buffer_head = atol(value);
-        } else if (strcmp(key, "BUFFER_FULL") == 0) {
-            buffer_full = (strcmp(value, "true") == 0);
         }
     }
     
     // Create buffer and load data if present
     if (buffer_size > 0) {
-        session->buffer = terminal_buffer_create(MAX_BUFFER_SIZE, 1000);
+        session->buffer = terminal_buffer_create(MAX_BUFFER_SIZE, MAX_BUFFER_LINES);
         if (session->buffer && reading_buffer) {
             // Read buffer data
             char *buffer_data = malloc(buffer_size);
             if (buffer_data) {
                 size_t bytes_read = fread(buffer_data, 1, buffer_size, fp);
                 if (bytes_read == buffer_size) {
-                    memcpy(session->buffer->data, buffer_data, buffer_size);
-                    session->buffer->size = buffer_size;
-                    session->buffer->head = buffer_head;
-                    session->buffer->is_full = buffer_full;
+                    // saved linearized, appending rebuilds the ring and the line index
+                    terminal_buffer_append(session->buffer, buffer_data, buffer_size);
                     
                     session_log(LOG_INFO, session_id, "Loaded buffer data: %zu bytes", buffer_size);
                 } else {
@@ -761,7 +1191,7 @@ persistent_session_t* persistent_session_load_from_disk(const char *session_id,
     }
     
     if (!session->buffer) {
-        session->buffer = terminal_buffer_create(MAX_BUFFER_SIZE, 1000);
+        session->buffer = terminal_buffer_create(MAX_BUFFER_SIZE, MAX_BUFFER_LINES);
     }
     
     fclose(fp);
@@ -782,6 +1212,17 @@ persistent_session_t* persistent_session_load_from_disk(const char *session_id,
     return session;
 }
 
+persistent_session_t* persistent_session_load_from_disk(const char *session_id, const char *state_dir) {
+    PROFILE_ENTER(PROF_PERSIST);
+    uint64_t trace_ts = TRACE_ON ? trace_now() : 0;
+    CMDR_PROBE1(session__load__start, session_id);
+    persistent_session_t *session = load_from_disk(session_id, state_dir);
+    CMDR_PROBE2(session__load__done, session_id, session != NULL);
+    if (TRACE_ON) trace_span("load", "persistence", trace_ts, 0, TRACE_FLOW_NONE, 0);
+    PROFILE_LEAVE(PROF_PERSIST);
+    return session;
+}
+
 // Load all sessions from disk into registry
 bool session_registry_load_from_disk(session_registry_t *registry) {
     if (!registry) {
@@ -870,51 +1311,189 @@ void session_free_environment(char **env, size_t count) {
     free(env);
 }
 
+static void write_info_json(json_writer_t *w, persistent_session_t *session) {
+    json_writer_begin_object(w);
+    json_writer_key(w, "id");
+    json_writer_string(w, session->id);
+    json_writer_key(w, "name");
+    json_writer_string(w, session->name);
+    json_writer_key(w, "command");
+    json_writer_string(w, session->command);
+    json_writer_key(w, "working_directory");
+    json_writer_string(w, session->working_directory);
+    json_writer_key(w, "title");
+    json_writer_string(w, session->title ? session->title : "");
+    json_writer_key(w, "created_at");
+    json_writer_int(w, session->created_at);
+    json_writer_key(w, "last_accessed");
+    json_writer_int(w, session->last_accessed);
+    json_writer_key(w, "last_saved");
+    json_writer_int(w, session->last_saved);
+    json_writer_key(w, "is_active");
+    json_writer_bool(w, session->is_active);
+    json_writer_key(w, "process_pid");
+    json_writer_int(w, session->process_pid);
+    json_writer_key(w, "terminal_cols");
+    json_writer_uint(w, session->terminal_cols);
+    json_writer_key(w, "terminal_rows");
+    json_writer_uint(w, session->terminal_rows);
+    json_writer_key(w, "raw_mode");
+    json_writer_bool(w, session->terminal_mode != 0 && !(session->terminal_mode & PTY_MODE_CANONICAL));
+    json_writer_key(w, "buffer_size");
+    json_writer_uint(w, session->buffer ? session->buffer->size : 0);
+    json_writer_key(w, "total_bytes_written");
+    json_writer_uint(w, session->total_bytes_written);
+    json_writer_key(w, "save_count");
+    json_writer_uint(w, session->save_count);
+    json_writer_key(w, "trigger_events");
+    json_writer_uint(w, session->event_seq);
+    json_writer_key(w, "redacted");
+    json_writer_uint(w, session->redactor ? session->redactor->masked : 0);
+    json_writer_key(w, "commands");
+    json_writer_uint(w, session->command_seq);
+    json_writer_end_object(w);
+}
+
 // Get session info as JSON string
 char* persistent_session_get_info_json(persistent_session_t *session) {
     if (!session) return NULL;
     
-    // Simple JSON creation (could use a library for more complex cases)
-    char *json = malloc(2048);
-    if (!json) {
-        session_set_last_error(SESSION_ERROR_MEMORY);
+    json_writer_t w;
+    json_writer_init(&w, 0, SESSION_JSON_HINT);
+    write_info_json(&w, session);
+    return json_writer_finish(&w, NULL);
+}
+
+// The trigger patterns in effect and the matches newer than after, oldest first. The JSON
+// starts pre bytes into the returned buffer.
+char* persistent_session_get_events_json(persistent_session_t *session, uint64_t after, size_t pre, size_t *length) {
+    if (!session) return NULL;
+
+    json_writer_t w;
+    json_writer_init(&w, pre, 1024);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "session_id");
+    json_writer_string(&w, session->id);
+    json_writer_key(&w, "triggers");
+    json_writer_begin_array(&w);
+    if (session->trigger_scanner) {
+        trigger_set_t *set = session->trigger_scanner->set;
+        for (int i = 0; i < set->count; i++) json_writer_string(&w, set->patterns[i]);
+    }
+    json_writer_end_array(&w);
+    json_writer_key(&w, "events");
+    json_writer_begin_array(&w);
+    uint64_t first = session->event_seq > SESSION_EVENTS ? session->event_seq - SESSION_EVENTS + 1 : 1;
+    if (first <= after) first = after + 1;
+    for (uint64_t seq = first; seq <= session->event_seq; seq++) {
+        trigger_event_t *event = &session->events[(seq - 1) % SESSION_EVENTS];
+        json_writer_begin_object(&w);
+        json_writer_key(&w, "seq");
+        json_writer_uint(&w, event->seq);
+        json_writer_key(&w, "time");
+        json_writer_int(&w, event->time);
+        json_writer_key(&w, "pattern");
+        json_writer_string(&w, event->pattern);
+        json_writer_key(&w, "line");
+        json_writer_string(&w, event->line);
+        json_writer_end_object(&w);
+    }
+    json_writer_end_array(&w);
+    json_writer_end_object(&w);
+    return json_writer_finish(&w, length);
+}
+
+// Command index as JSON, oldest first. "available" is false once the start of a command's
+// output has been overwritten in the ring.
+char* persistent_session_get_commands_json(persistent_session_t *session) {
+    if (!session) return NULL;
+
+    uint64_t oldest = session->buffer ? session->buffer->total_written - session->buffer->size : 0;
+    json_writer_t w;
+    json_writer_init(&w, 0, 1024);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "session_id");
+    json_writer_string(&w, session->id);
+    json_writer_key(&w, "oldest");
+    json_writer_uint(&w, oldest);
+    json_writer_key(&w, "commands");
+    json_writer_begin_array(&w);
+    uint64_t first = session->command_seq > SESSION_COMMANDS ? session->command_seq - SESSION_COMMANDS + 1 : 1;
+    for (uint64_t seq = first; seq <= session->command_seq; seq++) {
+        session_command_t *command = &session->commands[(seq - 1) % SESSION_COMMANDS];
+        json_writer_begin_object(&w);
+        json_writer_key(&w, "seq");
+        json_writer_uint(&w, command->seq);
+        json_writer_key(&w, "text");
+        json_writer_string(&w, command->text);
+        json_writer_key(&w, "prompt");
+        json_writer_uint(&w, command->prompt);
+        json_writer_key(&w, "output");
+        json_writer_uint(&w, command->output);
+        json_writer_key(&w, "end");
+        if (command->end) json_writer_uint(&w, command->end);
+        else json_writer_null(&w);
+        json_writer_key(&w, "exit_code");
+        if (command->exit_code >= 0) json_writer_int(&w, command->exit_code);
+        else json_writer_null(&w);
+        json_writer_key(&w, "started");
+        json_writer_int(&w, command->started);
+        json_writer_key(&w, "duration_ms");
+        json_writer_uint(&w, command->duration_ms);
+        json_writer_key(&w, "available");
+        json_writer_bool(&w, command->output >= oldest);
+        json_writer_end_object(&w);
+    }
+    json_writer_end_array(&w);
+    json_writer_end_object(&w);
+    return json_writer_finish(&w, NULL);
+}
+
+// Output of command seq straight from the ring, NULL if the command is not indexed (any more).
+// The output of a running command is what it printed so far; "truncated" is set when its start
+// was overwritten.
+char* persistent_session_get_command_output_json(persistent_session_t *session, uint64_t seq) {
+    if (!session || !session->buffer || seq == 0 || seq > session->command_seq ||
+        session->command_seq - seq >= SESSION_COMMANDS) {
         return NULL;
     }
-    
-    snprintf(json, 2048,
-        "{"
-        "\"id\":\"%s\","
-        "\"name\":\"%s\","
-        "\"command\":\"%s\","
-        "\"working_directory\":\"%s\","
-        "\"created_at\":%ld,"
-        "\"last_accessed\":%ld,"
-        "\"last_saved\":%ld,"
-        "\"is_active\":%s,"
-        "\"process_pid\":%d,"
-        "\"terminal_cols\":%u,"
-        "\"terminal_rows\":%u,"
-        "\"buffer_size\":%zu,"
-        "\"total_bytes_written\":%zu,"
-        "\"save_count\":%zu"
-        "}",
-        session->id,
-        session->name,
-        session->command,
-        session->working_directory,
-        session->created_at,
-        session->last_accessed,
-        session->last_saved,
-        session->is_active ? "true" : "false",
-        session->process_pid,
-        session->terminal_cols,
-        session->terminal_rows,
-        session->buffer ? session->buffer->size : 0,
-        session->total_bytes_written,
-        session->save_count
-    );
-    
-    return json;
+
+    session_command_t *command = &session->commands[(seq - 1) % SESSION_COMMANDS];
+    uint64_t oldest = session->buffer->total_written - session->buffer->size;
+    uint64_t end = command->end ? command->end : session->buffer->total_written;
+    size_t len = 0;
+    char *output = terminal_buffer_read_range(session->buffer, command->output, end, &len);
+    if (!output) return NULL;
+
+    // The range may start or end inside a character and binary output is no UTF-8 at all:
+    // continuation bytes at the start are dropped, invalid sequences become U+FFFD
+    size_t skip = 0;
+    while (skip < len && skip < 3 && ((unsigned char)output[skip] & 0xc0) == 0x80) skip++;
+    utf8_stream_t utf8 = {0};
+    char *text = NULL;
+    size_t text_len = 0;
+    bool copied = utf8_stream_frame(&utf8, output + skip, len - skip, &text, &text_len);
+
+    json_writer_t w;
+    json_writer_init(&w, 0, text_len + 256);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "seq");
+    json_writer_uint(&w, command->seq);
+    json_writer_key(&w, "text");
+    json_writer_string(&w, command->text);
+    json_writer_key(&w, "exit_code");
+    if (command->exit_code >= 0) json_writer_int(&w, command->exit_code);
+    else json_writer_null(&w);
+    json_writer_key(&w, "running");
+    json_writer_bool(&w, command->end == 0);
+    json_writer_key(&w, "truncated");
+    json_writer_bool(&w, command->output < oldest);
+    json_writer_key(&w, "output");
+    json_writer_string_len(&w, text, text_len);
+    json_writer_end_object(&w);
+    if (copied) pool_free(text);
+    free(output);
+    return json_writer_finish(&w, NULL);
 }
 
 // Print session registry statistics
@@ -970,12 +1549,26 @@ bool persistent_session_handle_pty_output(persistent_session_t *session, const c
     session->last_accessed = time(NULL);
     session->total_bytes_written += length;
     
-    // Store in terminal buffer
+    // Store in terminal buffer, with secrets masked: the client has been sent data as is
     if (session->buffer) {
-        if (!terminal_buffer_append(session->buffer, data, length)) {
+        if (!session->redactor && server != NULL && server->redact != NULL) {
+            session->redactor = redactor_new(server->redact);
+        }
+        mark_ctx_t marks = {session, output_offset(session)};
+        if (session->redactor) {
+            redact_feed(session->redactor, data, length, append_redacted, session);
+        } else if (!terminal_buffer_append(session->buffer, data, length)) {
             session_log(LOG_ERROR, session->id, "Failed to append data to terminal buffer");
             return false;
         }
+        
+        // after the append, a command line is read back from the buffer
+        if (!session->marks) session->marks = osc_scanner_new();
+        osc_scan(session->marks, data, length, shell_mark, &marks);
+    }
+    
+    if (session->trigger_scanner) {
+        trigger_scan(session->trigger_scanner, data, length, trigger_matched, session);
     }
     
     // Mark session as needing save
@@ -989,8 +1582,9 @@ bool persistent_session_handle_pty_output(persistent_session_t *session, const c
     return true;
 }
 
-// Send session's terminal buffer to a newly connected client
-bool persistent_session_send_buffer_to_client(persistent_session_t *session) {
+// Send session's terminal buffer to a newly connected client, only the last replay_lines
+// lines if non-zero (older ones can be fetched with FETCH_SCROLLBACK)
+bool persistent_session_send_buffer_to_client(persistent_session_t *session, size_t replay_lines) {
     if (!session || !session->current_wsi || !session->buffer) {
         session_log(LOG_WARN, session ? session->id : NULL, "Invalid parameters for buffer send");
         return false;
@@ -1002,7 +1596,14 @@ bool persistent_session_send_buffer_to_client(persistent_session_t *session) {
     }
     
     size_t length;
-    char *contents = terminal_buffer_get_contents(session->buffer, &length);
+    char *contents;
+    if (replay_lines > 0) {
+        uint64_t end = terminal_buffer_end_line(session->buffer);
+        uint64_t first = end > replay_lines ? end - replay_lines : 0;
+        contents = terminal_buffer_read_lines(session->buffer, &first, &end, MAX_BUFFER_SIZE, true, &length);
+    } else {
+        contents = terminal_buffer_get_contents(session->buffer, &length);
+    }
     if (!contents) {
         session_log(LOG_ERROR, session->id, "Failed to get buffer contents");
         return false;
@@ -1016,6 +1617,12 @@ bool persistent_session_send_buffer_to_client(persistent_session_t *session) {
         size_t remaining = length - sent;
         size_t current_chunk = remaining > chunk_size ? chunk_size : remaining;
         
+        // Don't split multibyte characters across frames
+        if (current_chunk < remaining) {
+            size_t aligned = utf8_boundary(contents + sent, current_chunk);
+            if (aligned > 0) current_chunk = aligned;
+        }
+        
         size_t buf_size = LWS_PRE + current_chunk + 1;
         unsigned char *buf = malloc(buf_size);
         if (!buf) {
@@ -1054,7 +1661,8 @@ bool persistent_session_send_buffer_to_client(persistent_session_t *session) {
 persistent_session_t* persistent_session_handle_websocket_connection(session_registry_t *registry, 
                                                                      const char *session_id, 
                                                                      void *pss, void *wsi,
-                                                                     const char *working_dir) {
+                                                                     const char *working_dir,
+                                                                     size_t replay_lines) {
     if (!registry || !session_id || !pss || !wsi) {
         session_log(LOG_ERROR, session_id, "Invalid parameters for WebSocket connection");
         return NULL;
@@ -1071,6 +1679,7 @@ persistent_session_t* persistent_session_handle_websocket_connection(session_reg
     
     if (session) {
         session_log(LOG_INFO, session_id, "Attaching to existing persistent session");
+        if (!session->trigger_scanner) compile_triggers(session);
         
         // Attach connection
         if (!persistent_session_attach_connection(session, pss, wsi)) {
@@ -1079,7 +1688,7 @@ persistent_session_t* persistent_session_handle_websocket_connection(session_reg
         }
         
         // Send existing buffer to client
-        persistent_session_send_buffer_to_client(session);
+        persistent_session_send_buffer_to_client(session, replay_lines);
         
         return session;
     } else {
@@ -1099,6 +1708,7 @@ persistent_session_t* persistent_session_handle_websocket_connection(session_reg
             session_log(LOG_ERROR, session_id, "Failed to set requested session ID");
             return NULL;
         }
+        compile_triggers(session);
         
         // Attach connection
         if (!persistent_session_attach_connection(session, pss, wsi)) {
@@ -1149,58 +1759,27 @@ bool persistent_session_handle_session_close(session_registry_t *registry, const
     return persistent_session_destroy(registry, session_id);
 }
 
-// Get list of all sessions as JSON
-char* session_registry_get_sessions_json(session_registry_t *registry) {
+// Get list of all sessions as JSON, in one pass and sized up front so that it is usually a
+// single allocation
+static char* sessions_json(session_registry_t *registry) {
     if (!registry) return NULL;
     
-    // Simple JSON array creation
-    size_t json_size = 1024; // Start with 1KB
-    char *json = malloc(json_size);
-    if (!json) {
-        session_set_last_error(SESSION_ERROR_MEMORY);
-        return NULL;
+    json_writer_t w;
+    json_writer_init(&w, 0, registry->total_count * SESSION_JSON_HINT + 2);
+    json_writer_begin_array(&w);
+    for (persistent_session_t *current = registry->sessions; current; current = current->next) {
+        write_info_json(&w, current);
     }
-    
-    strcpy(json, "[");
-    size_t json_len = 1;
-    
-    persistent_session_t *current = registry->sessions;
-    bool first = true;
-    
-    while (current) {
-        char *session_json = persistent_session_get_info_json(current);
-        if (session_json) {
-            size_t session_json_len = strlen(session_json);
-            size_t needed = json_len + session_json_len + 10; // Extra space for comma, etc.
-            
-            if (needed > json_size) {
-                json_size = needed * 2;
-                char *new_json = realloc(json, json_size);
-                if (!new_json) {
-                    free(json);
-                    free(session_json);
-                    session_set_last_error(SESSION_ERROR_MEMORY);
-                    return NULL;
-                }
-                json = new_json;
-            }
-            
-            if (!first) {
-                strcat(json, ",");
-                json_len++;
-            }
-            strcat(json, session_json);
-            json_len += session_json_len;
-            first = false;
-            
-            free(session_json);
-        }
-        current = current->next;
-    }
-    
-    strcat(json, "]");
+    json_writer_end_array(&w);
     
     session_log(LOG_DEBUG, NULL, "Generated sessions JSON list (%zu sessions)", registry->total_count);
+    return json_writer_finish(&w, NULL);
+}
+
+char* session_registry_get_sessions_json(session_registry_t *registry) {
+    PROFILE_ENTER(PROF_JSON);
+    char *json = sessions_json(registry);
+    PROFILE_LEAVE(PROF_JSON);
     return json;
 }
 
@@ -1246,6 +1825,7 @@ bool persistent_session_destroy(session_registry_t *registry, const char *id) {
             if (current->id) free(current->id);
             if (current->name) free(current->name);
             if (current->working_directory) free(current->working_directory);
+            if (current->title) free(current->title);
             if (current->command) free(current->command);
             if (current->environment) {
                 session_free_environment(current->environment, current->env_count);
@@ -1253,6 +1833,10 @@ bool persistent_session_destroy(session_registry_t *registry, const char *id) {
             if (current->buffer) {
                 terminal_buffer_destroy(current->buffer);
             }
+            free_triggers(current);
+            redactor_free(current->redactor);
+            osc_scanner_free(current->marks);
+            free(current->commands);
             free(current);
             
             session_log(LOG_INFO, id, "Session destroyed successfully");
@@ -1366,6 +1950,7 @@ void session_registry_cleanup_old(session_registry_t *registry) {
             // Free memory
             if (current->name) free(current->name);
             if (current->working_directory) free(current->working_directory);
+            if (current->title) free(current->title);
             if (current->command) free(current->command);
             if (current->environment) {
                 session_free_environment(current->environment, current->env_count);
@@ -1373,6 +1958,10 @@ void session_registry_cleanup_old(session_registry_t *registry) {
             if (current->buffer) {
                 terminal_buffer_destroy(current->buffer);
             }
+            free_triggers(current);
+            redactor_free(current->redactor);
+            osc_scanner_free(current->marks);
+            free(current->commands);
             free(current);
         } else {
             prev = current;
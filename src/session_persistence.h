@@ -6,30 +6,73 @@
 #include <time.h>
 #include <sys/types.h>
 
+#include "osc.h"
+#include "redact.h"
+#include "trigger.h"
+
 // Constants for session persistence
 #define SESSION_STATE_DIR "/tmp/cmdr-sessions"
 #define SESSION_ID_LENGTH 36
-#define MAX_BUFFER_SIZE (1024 * 1024)  // 1MB max terminal buffer
+#define MAX_BUFFER_SIZE (1024 * 1024)     // 1MB max terminal buffer
+#define MAX_BUFFER_LINES 32768            // lines indexed per terminal buffer
+#define INITIAL_BUFFER_SIZE (16 * 1024)   // buffers start this small and double up to the max
+#define INITIAL_BUFFER_LINES 512
 #define MAX_PATH_LENGTH 1024
+#define MAX_TITLE_LENGTH 256
 #define PERSISTENCE_SAVE_INTERVAL 30  // Save every 30 seconds
+#define SESSION_EVENTS 32             // trigger matches kept per session
+#define SESSION_COMMANDS 256          // shell commands indexed per session
+#define COMMAND_TEXT_MAX 256
+// Patterns a session may set on top of --trigger: clients set them, and every pattern byte is
+// a row of the session's automaton
+#define SESSION_TRIGGERS 32
+#define SESSION_TRIGGER_BYTES 1024
 
 // Terminal buffer structure for storing output history
 typedef struct terminal_buffer {
     char *data;              // Terminal output data
     size_t capacity;         // Total allocated size
+    size_t max_capacity;     // Size the data may grow to before it wraps
     size_t size;             // Current data size
     size_t head;             // Current write position (for circular buffer)
     bool is_full;            // Whether buffer has wrapped around
-    char **lines;            // Array of line pointers for quick access
+    uint64_t total_written;  // Bytes ever appended, absolute offset of the next byte
+    uint64_t *line_starts;   // Ring of absolute line start offsets, oldest at line_head
+    size_t line_head;        // Slot of the oldest indexed line
     size_t line_count;       // Number of lines
+    size_t line_slots;       // Allocated entries of line_starts
     size_t max_lines;        // Maximum number of lines to store
+    uint64_t first_line;     // Absolute number of the oldest indexed line
 } terminal_buffer_t;
 
+// One output trigger match
+typedef struct trigger_event {
+    uint64_t seq;                       // 1 for the session's first match
+    time_t time;
+    char pattern[TRIGGER_MAX_LEN + 1];
+    char line[TRIGGER_LINE_MAX + 1];    // visible text of the line, escape sequences stripped
+} trigger_event_t;
+
+// One command run at the shell prompt, from the OSC 133 marks of shell integration. Offsets
+// are absolute, as terminal_buffer_t's total_written.
+typedef struct session_command {
+    uint64_t seq;                       // 1 for the session's first command
+    uint64_t prompt;                    // where the prompt starts (A)
+    uint64_t output;                    // where the output starts (C)
+    uint64_t end;                       // where it ends (D), 0 while the command runs
+    int exit_code;                      // -1 if not reported
+    time_t started;
+    uint64_t duration_ms;
+    char text[COMMAND_TEXT_MAX + 1];    // command line as echoed after the prompt (B), escape sequences stripped
+} session_command_t;
+
 // Persistent session state structure
 typedef struct persistent_session {
     char *id;                           // Session ID (variable length)
     char *name;                         // User-friendly session name
     char *working_directory;            // Current working directory
+    bool cwd_tracked;                   // working_directory was reported by the shell (OSC 7)
+    char *title;                        // Last window title set by the program (OSC 0/2), NULL if none
     char *command;                      // Initial command
     char **environment;                 // Environment variables
     size_t env_count;                   // Number of environment variables
@@ -41,8 +84,25 @@ typedef struct persistent_session {
     pid_t process_pid;                  // Current process PID (0 if not running)
     uint16_t terminal_cols;             // Terminal columns
     uint16_t terminal_rows;             // Terminal rows
+    uint8_t terminal_mode;              // PTY line discipline flags (PTY_MODE_*), 0 if unknown
     
     terminal_buffer_t *buffer;          // Terminal output buffer
+    redactor_t *redactor;               // Masks secrets on their way into buffer, NULL until output with --redact rules
+    
+    // Output triggers, matched in persistent_session_handle_pty_output
+    char **triggers;                    // Patterns set for this session, saved with it
+    size_t trigger_count;
+    trigger_scanner_t *trigger_scanner; // Session and --trigger patterns compiled, NULL if none
+    trigger_event_t *events;            // Ring of the last SESSION_EVENTS matches, NULL before the first
+    uint64_t event_seq;                 // Matches so far, seq of the newest event
+    
+    // Shell command index, fed by OSC 133 marks in the output
+    osc_scanner_t *marks;               // NULL before the first output
+    session_command_t *commands;        // Ring of the last SESSION_COMMANDS commands, NULL before the first
+    uint64_t command_seq;               // Commands so far, seq of the newest one
+    uint64_t prompt_at;                 // Offsets of the last A and B marks, for the next command
+    uint64_t input_at;
+    uint64_t started_ms;                // When the newest command started, 0 once it ended
     
     bool is_active;                     // Whether session has active connection
     bool needs_save;                    // Whether session state needs saving
@@ -110,19 +170,30 @@ bool persistent_session_save_to_disk(persistent_session_t *session);
 persistent_session_t* persistent_session_load_from_disk(const char *session_id, const char *state_dir);
 bool persistent_session_needs_saving(persistent_session_t *session);
 void persistent_session_mark_dirty(persistent_session_t *session);
+void persistent_session_set_title(persistent_session_t *session, const char *title);
+void persistent_session_set_working_directory(persistent_session_t *session, const char *path);
+void persistent_session_set_triggers(persistent_session_t *session, char *const *patterns, size_t count);
 
 // Terminal buffer management
-terminal_buffer_t* terminal_buffer_create(size_t capacity, size_t max_lines);
+terminal_buffer_t* terminal_buffer_create(size_t max_capacity, size_t max_lines);
 void terminal_buffer_destroy(terminal_buffer_t *buffer);
 bool terminal_buffer_append(terminal_buffer_t *buffer, const char *data, size_t length);
 char* terminal_buffer_get_contents(terminal_buffer_t *buffer, size_t *length);
 char** terminal_buffer_get_lines(terminal_buffer_t *buffer, size_t *line_count);
+uint64_t terminal_buffer_oldest_line(terminal_buffer_t *buffer);
+uint64_t terminal_buffer_end_line(terminal_buffer_t *buffer);
+char* terminal_buffer_read_lines(terminal_buffer_t *buffer, uint64_t *first, uint64_t *end, size_t max_bytes,
+                                 bool keep_end, size_t *length);
+char* terminal_buffer_read_range(terminal_buffer_t *buffer, uint64_t from, uint64_t to, size_t *length);
 bool terminal_buffer_save_to_file(terminal_buffer_t *buffer, const char *filepath);
 bool terminal_buffer_load_from_file(terminal_buffer_t *buffer, const char *filepath);
 void terminal_buffer_clear(terminal_buffer_t *buffer);
 
 // Session information and debugging
 char* persistent_session_get_info_json(persistent_session_t *session);
+char* persistent_session_get_events_json(persistent_session_t *session, uint64_t after, size_t pre, size_t *length);
+char* persistent_session_get_commands_json(persistent_session_t *session);
+char* persistent_session_get_command_output_json(persistent_session_t *session, uint64_t seq);
 char* session_registry_get_stats_json(session_registry_t *registry);
 void persistent_session_print_debug_info(persistent_session_t *session);
 void session_registry_print_stats(session_registry_t *registry);
@@ -159,11 +230,12 @@ void session_set_last_error(session_error_t error);
 // Integration functions for existing server code
 struct session_data* persistent_session_to_session_data(persistent_session_t *persistent);
 bool persistent_session_handle_pty_output(persistent_session_t *session, const char *data, size_t length);
-bool persistent_session_send_buffer_to_client(persistent_session_t *session);
+bool persistent_session_send_buffer_to_client(persistent_session_t *session, size_t replay_lines);
 persistent_session_t* persistent_session_handle_websocket_connection(session_registry_t *registry, 
                                                                      const char *session_id, 
                                                                      void *pss, void *wsi,
-                                                                     const char *working_dir);
+                                                                     const char *working_dir,
+                                                                     size_t replay_lines);
 bool persistent_session_handle_websocket_disconnection(persistent_session_t *session);
 bool persistent_session_handle_session_close(session_registry_t *registry, const char *session_id);
 char* session_registry_get_sessions_json(session_registry_t *registry);
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shell_integration.h"
+#include "utils.h"
+
+// D with the status of the last command and A from PROMPT_COMMAND, B at the end of PS1, C from
+// PS0 once a command line is accepted
+static const char bashrc[] =
+    "# cmdr shell integration: OSC 133 prompt and command marks\n"
+    "[ -f ~/.bashrc ] && . ~/.bashrc\n"
+    "__cmdr_prompt() {\n"
+    "  local status=$?\n"
+    "  printf '\\e]133;D;%s\\a\\e]133;A\\a' \"$status\"\n"
+    "  return $status\n"
+    "}\n"
+    "PROMPT_COMMAND=\"__cmdr_prompt${PROMPT_COMMAND:+;$PROMPT_COMMAND}\"\n"
+    "PS1=\"$PS1\"'\\[\\e]133;B\\a\\]'\n"
+    "PS0=\"$PS0\"$'\\e]133;C\\a'\n";
+
+// The user's .zshrc usually sets PS1 after this runs, so B is added back at every prompt;
+// precmd goes first to see the status of the command
+static const char zshenv[] =
+    "# cmdr shell integration: OSC 133 prompt and command marks\n"
+    "if [[ -n $CMDR_USER_ZDOTDIR ]]; then\n"
+    "  ZDOTDIR=$CMDR_USER_ZDOTDIR\n"
+    "  unset CMDR_USER_ZDOTDIR\n"
+    "else\n"
+    "  unset ZDOTDIR\n"
+    "fi\n"
+    "[[ -f ${ZDOTDIR:-$HOME}/.zshenv ]] && source ${ZDOTDIR:-$HOME}/.zshenv\n"
+    "if [[ -o interactive ]]; then\n"
+    "  __cmdr_precmd() {\n"
+    "    local st=$?\n"
+    "    print -n \"\\e]133;D;$st\\a\\e]133;A\\a\"\n"
+    "    [[ $PS1 == *$'\\e]133;B\\a'* ]] || PS1=\"$PS1\"$'%{\\e]133;B\\a%}'\n"
+    "  }\n"
+    "  __cmdr_preexec() { print -n \"\\e]133;C\\a\" }\n"
+    "  autoload -Uz add-zsh-hook\n"
+    "  precmd_functions=(__cmdr_precmd $precmd_functions)\n"
+    "  add-zsh-hook preexec __cmdr_preexec\n"
+    "fi\n";
+
+static char *path_join(const char *dir, const char *name) {
+  size_t len = strlen(dir) + strlen(name) + 2;
+  char *path = xmalloc(len);
+  snprintf(path, len, "%s/%s", dir, name);
+  return path;
+}
+
+static bool write_file(const char *path, const char *data) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) return false;
+  bool ok = fputs(data, f) >= 0;
+  return fclose(f) == 0 && ok;
+}
+
+void shell_integration_free(shell_integration_t *si) {
+  if (si == NULL) return;
+  if (si->zdotdir != NULL) {
+    char *zshenv_path = path_join(si->zdotdir, ".zshenv");
+    unlink(zshenv_path);
+    free(zshenv_path);
+    rmdir(si->zdotdir);
+  }
+  if (si->bash_rcfile != NULL) unlink(si->bash_rcfile);
+  if (si->dir != NULL) rmdir(si->dir);
+  free(si->bash_rcfile);
+  free(si->zdotdir);
+  free(si->dir);
+  free(si);
+}
+
+shell_integration_t *shell_integration_new() {
+#ifdef _WIN32
+  return NULL;
+#else
+  char dir[] = "/tmp/cmdr-shell-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    lwsl_err("shell integration: mkdtemp failed: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  shell_integration_t *si = xmalloc(sizeof(shell_integration_t));
+  memset(si, 0, sizeof(shell_integration_t));
+  si->dir = strdup(dir);
+  si->bash_rcfile = path_join(dir, "bashrc");
+  if (!write_file(si->bash_rcfile, bashrc)) goto error;
+  si->zdotdir = path_join(dir, "zsh");
+  if (mkdir(si->zdotdir, 0700) != 0) goto error;
+  char *zshenv_path = path_join(si->zdotdir, ".zshenv");
+  bool ok = write_file(zshenv_path, zshenv);
+  free(zshenv_path);
+  if (!ok) goto error;
+
+  lwsl_notice("  shell integration: %s\n", si->dir);
+  return si;
+
+error:
+  lwsl_err("shell integration: failed to write %s: %s\n", si->dir, strerror(errno));
+  shell_integration_free(si);
+  return NULL;
+#endif
+}
+
+shell_kind_t shell_integration_kind(const char *path) {
+  const char *name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+  if (strcmp(name, "bash") == 0) return SHELL_BASH;
+  if (strcmp(name, "zsh") == 0) return SHELL_ZSH;
+  return SHELL_OTHER;
+}
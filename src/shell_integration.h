@@ -0,0 +1,24 @@
+#ifndef CMDR_SHELL_INTEGRATION_H
+#define CMDR_SHELL_INTEGRATION_H
+
+#include <stdbool.h>
+
+typedef enum { SHELL_OTHER, SHELL_BASH, SHELL_ZSH } shell_kind_t;
+
+// Startup files making bash and zsh mark their prompt, command line and output with OSC 133,
+// written to a private directory for the lifetime of the server. They load the user's own
+// startup files first.
+typedef struct {
+  char *dir;
+  char *bash_rcfile;  // passed with --rcfile
+  char *zdotdir;      // ZDOTDIR, its .zshenv restores the user's before loading anything
+} shell_integration_t;
+
+// NULL if the files could not be written
+shell_integration_t *shell_integration_new();
+// removes the directory
+void shell_integration_free(shell_integration_t *si);
+// by the name of the executable
+shell_kind_t shell_integration_kind(const char *path);
+
+#endif  // CMDR_SHELL_INTEGRATION_H
@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <libwebsockets.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+
+bool trace_enabled = false;
+
+typedef struct {
+  const char *name;
+  const char *cat;
+  uint64_t ts;
+  uint64_t dur;
+  uint64_t id;
+  uint64_t bytes;
+  trace_flow_t flow;
+} trace_event_t;
+
+// Single writer ring per thread. Readers take the published head and copy what is behind it,
+// an event overwritten while being copied is the price of not locking the writer.
+typedef struct trace_buffer_ {
+  struct trace_buffer_ *next;
+  uint32_t tid;
+  uint64_t head;
+  trace_event_t events[TRACE_BUFFER_EVENTS];
+} trace_buffer_t;
+
+static trace_buffer_t *buffers;
+static uint32_t next_tid;
+static uint64_t next_id;
+static __thread trace_buffer_t *local;
+static __thread uint64_t current_flow;
+
+static char *trace_path;
+static uv_signal_t *dump_signal;
+
+uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+uint64_t trace_new_id() { return __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED); }
+
+void trace_set_flow(uint64_t id) { current_flow = id; }
+
+uint64_t trace_flow() { return current_flow; }
+
+static trace_buffer_t *local_buffer() {
+  if (local != NULL) return local;
+  trace_buffer_t *buf = calloc(1, sizeof(trace_buffer_t));
+  if (buf == NULL) return NULL;
+  buf->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+  buf->next = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&buffers, &buf->next, buf, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+    ;
+  local = buf;
+  return buf;
+}
+
+void trace_span(const char *name, const char *cat, uint64_t start, uint64_t id, trace_flow_t flow, uint64_t bytes) {
+  if (!trace_enabled) return;
+  trace_buffer_t *buf = local_buffer();
+  if (buf == NULL) return;
+
+  uint64_t head = buf->head;
+  trace_event_t *e = &buf->events[head % TRACE_BUFFER_EVENTS];
+  e->name = name;
+  e->cat = cat;
+  e->ts = start;
+  e->dur = trace_now() - start;
+  e->id = id;
+  e->bytes = bytes;
+  e->flow = id != 0 ? flow : TRACE_FLOW_NONE;
+  __atomic_store_n(&buf->head, head + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} json_buf_t;
+
+static void append(json_buf_t *b, const char *fmt, ...) {
+  va_list ap;
+  for (;;) {
+    va_start(ap, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (b->len + (size_t)n < b->cap) {
+      b->len += (size_t)n;
+      return;
+    }
+    b->cap = (b->cap + (size_t)n) * 2;
+    b->data = xrealloc(b->data, b->cap);
+  }
+}
+
+// Complete ("X") events, plus flow events binding the spans of one message into an arrow
+// chain in the trace viewer.
+char *trace_json(size_t *len) {
+  static const char flow_phase[] = {0, 's', 't', 'f'};
+  json_buf_t b = {.data = xmalloc(4096), .len = 0, .cap = 4096};
+  bool first = true;
+
+  append(&b, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (trace_buffer_t *buf = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); buf != NULL; buf = buf->next) {
+    uint64_t head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0;
+    for (uint64_t i = start; i < head; i++) {
+      trace_event_t e = buf->events[i % TRACE_BUFFER_EVENTS];
+      append(&b,
+             "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%u,"
+             "\"args\":{\"id\":%llu,\"bytes\":%llu}}",
+             first ? "" : ",", e.name, e.cat, (unsigned long long)e.ts, (unsigned long long)e.dur, buf->tid,
+             (unsigned long long)e.id, (unsigned long long)e.bytes);
+      first = false;
+      if (e.flow == TRACE_FLOW_NONE) continue;
+      append(&b,
+             ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"id\":%llu,\"ts\":%llu,\"pid\":1,\"tid\":%u%s}",
+             e.cat, e.cat, flow_phase[e.flow], (unsigned long long)e.id, (unsigned long long)e.ts, buf->tid,
+             e.flow == TRACE_FLOW_END ? ",\"bp\":\"e\"" : "");
+    }
+  }
+  append(&b, "]}");
+
+  *len = b.len;
+  return b.data;
+}
+
+bool trace_dump(const char *path) {
+  char tmp[1024];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    lwsl_err("trace: can not write %s: %s\n", tmp, strerror(errno));
+    return false;
+  }
+
+  size_t len;
+  char *json = trace_json(&len);
+  bool ok = fwrite(json, 1, len, fp) == len;
+  free(json);
+  if (fclose(fp) != 0) ok = false;
+  if (ok && rename(tmp, path) != 0) ok = false;
+  if (!ok) {
+    lwsl_err("trace: can not write %s\n", path);
+    unlink(tmp);
+    return false;
+  }
+  lwsl_notice("trace: written to %s\n", path);
+  return true;
+}
+
+static void signal_cb(uv_signal_t *handle, int signum) { trace_dump(trace_path); }
+
+static void signal_close_cb(uv_handle_t *handle) { free(handle); }
+
+bool trace_start(uv_loop_t *loop, const char *path) {
+  trace_path = strdup(path != NULL && path[0] != '\0' ? path : "cmdr-trace.json");
+#ifdef SIGUSR2
+  dump_signal = xmalloc(sizeof(uv_signal_t));
+  uv_signal_init(loop, dump_signal);
+  uv_signal_start(dump_signal, signal_cb, SIGUSR2);
+  uv_unref((uv_handle_t *)dump_signal);
+#endif
+
+  trace_enabled = true;
+  lwsl_notice("tracing enabled, SIGUSR2 writes %s\n", trace_path);
+  return true;
+}
+
+void trace_stop() {
+  if (!trace_enabled) return;
+  trace_dump(trace_path);
+  trace_enabled = false;
+  if (dump_signal != NULL) {
+    uv_signal_stop(dump_signal);
+    uv_close((uv_handle_t *)dump_signal, signal_close_cb);
+    dump_signal = NULL;
+  }
+  free(trace_path);
+  trace_path = NULL;
+
+  // only the loop thread records, nothing writes to the buffers any more
+  trace_buffer_t *buf = buffers;
+  while (buf != NULL) {
+    trace_buffer_t *next = buf->next;
+    free(buf);
+    buf = next;
+  }
+  buffers = NULL;
+  local = NULL;
+}
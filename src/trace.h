@@ -0,0 +1,45 @@
+#ifndef CMDR_TRACE_H
+#define CMDR_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// events kept per thread, older ones are overwritten
+#define TRACE_BUFFER_EVENTS 65536
+
+// how a span takes part in the message flow it belongs to
+typedef enum {
+  TRACE_FLOW_NONE,
+  TRACE_FLOW_BEGIN,
+  TRACE_FLOW_STEP,
+  TRACE_FLOW_END,
+} trace_flow_t;
+
+// set once by trace_start(), checked before recording anything
+extern bool trace_enabled;
+
+#define TRACE_ON __builtin_expect(trace_enabled, 0)
+
+bool trace_start(uv_loop_t *loop, const char *path);
+void trace_stop();
+
+// monotonic microseconds
+uint64_t trace_now();
+// new id linking the spans of one message
+uint64_t trace_new_id();
+
+// The flow id of the message the current thread is working on, so callees without access
+// to the connection state can attach their spans to it.
+void trace_set_flow(uint64_t id);
+uint64_t trace_flow();
+
+// record a span [start, now); name and cat must be string literals
+void trace_span(const char *name, const char *cat, uint64_t start, uint64_t id, trace_flow_t flow, uint64_t bytes);
+
+// Chrome/Perfetto trace JSON of all buffered events, malloc'd
+char *trace_json(size_t *len);
+bool trace_dump(const char *path);
+
+#endif  // CMDR_TRACE_H
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigger.h"
+#include "utils.h"
+
+#define NO_STATE UINT16_MAX
+#define TRIGGER_MATCH 0x8000
+
+enum { ESC_NONE, ESC_START, ESC_CSI, ESC_STRING, ESC_STRING_END };
+
+static inline unsigned char fold(unsigned char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+bool trigger_pattern_valid(const char *pattern) {
+  size_t len = strlen(pattern);
+  if (len == 0 || len > TRIGGER_MAX_LEN) return false;
+  for (const unsigned char *p = (const unsigned char *)pattern; *p; p++) {
+    if (*p < 0x20 || *p == 0x7f) return false;
+  }
+  return true;
+}
+
+void trigger_set_free(trigger_set_t *set) {
+  if (set == NULL) return;
+  for (int i = 0; i < set->count; i++) free(set->patterns[i]);
+  free(set->patterns);
+  free(set->delta);
+  free(set->out);
+  free(set->matches);
+  free(set);
+}
+
+// Missing edges are filled in breadth first from the fail state's row, which is complete by
+// then since it is shallower; outputs are inherited the same way.
+static void build(trigger_set_t *set, size_t bytes) {
+  uint32_t classes = set->classes;
+  uint32_t max_states = (uint32_t)bytes + 1;
+  set->delta = xmalloc((size_t)max_states * classes * sizeof(uint16_t));
+  memset(set->delta, 0xff, (size_t)max_states * classes * sizeof(uint16_t));
+  int *own = xmalloc(max_states * sizeof(int));  // last pattern ending in the state, -1 if none
+  int *own_next = xmalloc(set->count * sizeof(int));
+  for (uint32_t s = 0; s < max_states; s++) own[s] = -1;
+
+  uint32_t states = 1;
+  for (int i = 0; i < set->count; i++) {
+    uint32_t s = 0;
+    for (const unsigned char *p = (const unsigned char *)set->patterns[i]; *p; p++) {
+      uint16_t *edge = &set->delta[(size_t)s * classes + set->class_of[*p]];
+      if (*edge == NO_STATE) *edge = (uint16_t)states++;
+      s = *edge;
+    }
+    own_next[i] = own[s];
+    own[s] = i;
+  }
+  set->states = states;
+
+  uint32_t *fail = xmalloc(states * sizeof(uint32_t));
+  uint32_t *queue = xmalloc(states * sizeof(uint32_t));
+  uint32_t *count = xmalloc(states * sizeof(uint32_t));
+  uint32_t head = 0, tail = 0;
+  fail[0] = 0;
+  count[0] = 0;
+  for (uint32_t c = 0; c < classes; c++) {
+    uint16_t t = set->delta[c];
+    if (t == NO_STATE) {
+      set->delta[c] = 0;
+    } else {
+      fail[t] = 0;
+      queue[tail++] = t;
+    }
+  }
+  while (head < tail) {
+    uint32_t s = queue[head++];
+    uint16_t *row = &set->delta[(size_t)s * classes];
+    const uint16_t *fail_row = &set->delta[(size_t)fail[s] * classes];
+    for (uint32_t c = 0; c < classes; c++) {
+      if (row[c] == NO_STATE) {
+        row[c] = fail_row[c];
+      } else {
+        fail[row[c]] = fail_row[c];
+        queue[tail++] = row[c];
+      }
+    }
+    count[s] = count[fail[s]];
+    for (int i = own[s]; i >= 0; i = own_next[i]) count[s]++;
+  }
+
+  set->out = xmalloc((states + 1) * sizeof(uint32_t));
+  set->out[0] = 0;
+  for (uint32_t s = 0; s < states; s++) set->out[s + 1] = set->out[s] + count[s];
+  set->matches = xmalloc((set->out[states] > 0 ? set->out[states] : 1) * sizeof(uint16_t));
+  for (uint32_t q = 0; q < tail; q++) {
+    uint32_t s = queue[q], k = set->out[s];
+    for (int i = own[s]; i >= 0; i = own_next[i]) set->matches[k++] = (uint16_t)i;
+    for (uint32_t j = set->out[fail[s]]; j < set->out[fail[s] + 1]; j++) set->matches[k++] = set->matches[j];
+  }
+
+  // flag the edges into states with a match, the scan loop then needs no second lookup
+  for (size_t i = 0; i < (size_t)states * classes; i++) {
+    if (count[set->delta[i]] > 0) set->delta[i] |= TRIGGER_MATCH;
+  }
+
+  free(own);
+  free(own_next);
+  free(fail);
+  free(queue);
+  free(count);
+}
+
+trigger_set_t *trigger_set_new(char *const *patterns, int count) {
+  trigger_set_t *set = xmalloc(sizeof(trigger_set_t));
+  memset(set, 0, sizeof(trigger_set_t));
+  set->patterns = xmalloc((count > 0 ? count : 1) * sizeof(char *));
+
+  bool used[256] = {false};
+  size_t bytes = 0;
+  for (int i = 0; i < count && set->count < TRIGGER_MAX_PATTERNS; i++) {
+    if (!trigger_pattern_valid(patterns[i])) continue;
+    size_t len = strlen(patterns[i]);
+    if (bytes + len > TRIGGER_MAX_BYTES) break;
+    bytes += len;
+    set->patterns[set->count++] = strdup(patterns[i]);
+    for (const unsigned char *p = (const unsigned char *)patterns[i]; *p; p++) used[fold(*p)] = true;
+  }
+  if (set->count == 0) {
+    trigger_set_free(set);
+    return NULL;
+  }
+
+  // class 0 is every byte no pattern uses
+  set->classes = 1;
+  for (int c = 0; c < 256; c++) {
+    if (used[c]) set->class_of[c] = (uint8_t)set->classes++;
+  }
+  for (int c = 'A'; c <= 'Z'; c++) set->class_of[c] = set->class_of[fold((unsigned char)c)];
+
+  build(set, bytes);
+  return set;
+}
+
+trigger_scanner_t *trigger_scanner_new(trigger_set_t *set) {
+  trigger_scanner_t *scanner = xmalloc(sizeof(trigger_scanner_t));
+  memset(scanner, 0, sizeof(trigger_scanner_t));
+  scanner->set = set;
+  return scanner;
+}
+
+void trigger_scanner_free(trigger_scanner_t *scanner) {
+  if (scanner == NULL) return;
+  trigger_set_free(scanner->set);
+  free(scanner);
+}
+
+static void add_pending(trigger_scanner_t *s, uint32_t state) {
+  const trigger_set_t *set = s->set;
+  for (uint32_t k = set->out[state]; k < set->out[state + 1]; k++) {
+    uint16_t m = set->matches[k];
+    int i = 0;
+    while (i < s->pending_count && s->pending[i] != m) i++;
+    if (i == s->pending_count && s->pending_count < TRIGGER_PENDING_MAX) s->pending[s->pending_count++] = m;
+  }
+}
+
+static void report(trigger_scanner_t *s, trigger_cb cb, void *ctx) {
+  for (int i = 0; i < s->pending_count; i++) cb(ctx, s->pending[i], s->line, s->line_len);
+  s->pending_count = 0;
+}
+
+// CSI up to its final byte; OSC, DCS, SOS, PM and APC strings up to BEL or ST
+static int skip_escape(int esc, unsigned char c) {
+  switch (esc) {
+    case ESC_START:
+      if (c == '[') return ESC_CSI;
+      if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') return ESC_STRING;
+      // intermediates, as in ESC ( B, keep going
+      return c >= 0x20 && c <= 0x2f ? ESC_START : ESC_NONE;
+    case ESC_CSI:
+      return c >= 0x40 && c <= 0x7e ? ESC_NONE : ESC_CSI;
+    case ESC_STRING:
+      if (c == 0x07 || c == 0x18 || c == 0x1a) return ESC_NONE;
+      return c == 0x1b ? ESC_STRING_END : ESC_STRING;
+    default:
+      return c == '\\' ? ESC_NONE : c == 0x1b ? ESC_STRING_END : ESC_STRING;
+  }
+}
+
+// The loop keeps its state in locals: stores into the line buffer could alias the scanner's
+// fields and force a reload per byte.
+void trigger_scan(trigger_scanner_t *s, const char *data, size_t len, trigger_cb cb, void *ctx) {
+  const trigger_set_t *set = s->set;
+  const uint16_t *delta = set->delta;
+  const uint32_t classes = set->classes;
+  uint32_t state = s->state;
+  int esc = s->esc;
+  size_t line_len = s->line_len;
+
+  for (const unsigned char *p = (const unsigned char *)data, *end = p + len; p < end; p++) {
+    unsigned char c = *p;
+    if (esc != ESC_NONE) {
+      esc = skip_escape(esc, c);
+      continue;
+    }
+    if (c < 0x20 || c == 0x7f) {
+      switch (c) {
+        case 0x1b:
+          esc = ESC_START;
+          continue;
+        case '\t':
+          c = ' ';
+          break;
+        case '\n':
+        case '\r':
+          s->line_len = line_len;
+          report(s, cb, ctx);
+          line_len = 0;
+          state = 0;
+          continue;
+        case '\b':
+          if (line_len > 0) line_len--;
+          state = 0;
+          continue;
+        default:
+          state = 0;
+          continue;
+      }
+    }
+    uint16_t next = delta[(size_t)state * classes + set->class_of[c]];
+    state = next & ~TRIGGER_MATCH;
+    if (line_len < TRIGGER_LINE_MAX) s->line[line_len++] = (char)c;
+    if (next & TRIGGER_MATCH) add_pending(s, state);
+  }
+
+  s->state = state;
+  s->esc = esc;
+  s->line_len = line_len;
+  report(s, cb, ctx);
+}
@@ -0,0 +1,58 @@
+#ifndef CMDR_TRIGGER_H
+#define CMDR_TRIGGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRIGGER_MAX_PATTERNS 1024
+#define TRIGGER_MAX_LEN 128
+// sum of the pattern lengths, bounds the automaton to as many states (15-bit state numbers)
+#define TRIGGER_MAX_BYTES 16384
+// visible text of a line kept for the match report, the rest of a long line is dropped
+#define TRIGGER_LINE_MAX 160
+// distinct patterns reported per line
+#define TRIGGER_PENDING_MAX 8
+
+// Literal output patterns compiled into an Aho-Corasick automaton, ASCII case-insensitive.
+// The automaton is a dense DFA over byte classes (the bytes the patterns use, everything
+// else shares one class), so a scanned byte costs one table lookup whatever the number of
+// patterns.
+typedef struct {
+  char **patterns;
+  int count;
+  uint32_t states;
+  uint32_t classes;
+  uint8_t class_of[256];
+  uint16_t *delta;    // next state, states * classes, the top bit set if it has matches
+  uint32_t *out;      // matches[out[s] .. out[s + 1]] end in state s, fail-link outputs included
+  uint16_t *matches;  // pattern indexes
+} trigger_set_t;
+
+typedef void (*trigger_cb)(void *ctx, int pattern, const char *line, size_t len);
+
+// Streaming scanner, state is carried across PTY reads. Escape sequences are skipped without
+// resetting the automaton, so a match survives colouring in the middle of it.
+typedef struct {
+  trigger_set_t *set;
+  uint32_t state;
+  int esc;
+  size_t line_len;
+  char line[TRIGGER_LINE_MAX];
+  int pending_count;
+  uint16_t pending[TRIGGER_PENDING_MAX];
+} trigger_scanner_t;
+
+// NULL if none of the patterns is usable (empty, too long or with control characters)
+trigger_set_t *trigger_set_new(char *const *patterns, int count);
+void trigger_set_free(trigger_set_t *set);
+bool trigger_pattern_valid(const char *pattern);
+
+// takes over the set
+trigger_scanner_t *trigger_scanner_new(trigger_set_t *set);
+void trigger_scanner_free(trigger_scanner_t *scanner);
+// Matches are reported once per pattern and line, with the visible text of the line: at its
+// end, or at the end of the data for a line still being written (a prompt).
+void trigger_scan(trigger_scanner_t *scanner, const char *data, size_t len, trigger_cb cb, void *ctx);
+
+#endif  // CMDR_TRIGGER_H
@@ -1,6 +1,6 @@
+#include "json_writer.h"
 #include "server.h"
 #include "updater.h"
-#include <json.h>
 #include <pthread.h>
 
 // Structure for passing data to update thread
@@ -11,6 +11,14 @@ typedef struct {
     char data[512];
 } update_thread_data_t;
 
+// Writes the finished JSON as a text frame, straight from the writer's LWS_PRE headroom
+static void send_json(struct lws *wsi, json_writer_t *w) {
+    size_t json_len;
+    unsigned char *buf = (unsigned char *)json_writer_finish(w, &json_len);
+    lws_write(wsi, &buf[LWS_PRE], json_len, LWS_WRITE_TEXT);
+    free(buf);
+}
+
 // Thread function for checking updates
 static void* update_check_thread(void* arg) {
     update_thread_data_t *thread_data = (update_thread_data_t*)arg;
@@ -30,25 +38,21 @@ static void* update_check_thread(void* arg) {
         server_send_update_status(wsi, "update_available", "Update available", update_info.version);
         
         // Send additional update info
-        json_object *response = json_object_new_object();
-        json_object_object_add(response, "type", json_object_new_string("update_info"));
-        json_object_object_add(response, "version", json_object_new_string(update_info.version));
-        json_object_object_add(response, "downloadSize", json_object_new_int64(update_info.download_size));
-        json_object_object_add(response, "changelog", json_object_new_string(update_info.changelog));
-        json_object_object_add(response, "critical", json_object_new_boolean(update_info.is_critical));
-        
-        const char *json_str = json_object_to_json_string(response);
-        size_t json_len = strlen(json_str);
-        
-        unsigned char *buf = malloc(LWS_PRE + json_len + 1);
-        if (buf) {
-            buf[LWS_PRE + json_len] = '\0';
-            memcpy(&buf[LWS_PRE], json_str, json_len);
-            lws_write(wsi, &buf[LWS_PRE], json_len, LWS_WRITE_TEXT);
-            free(buf);
-        }
-        
-        json_object_put(response);
+        json_writer_t w;
+        json_writer_init(&w, LWS_PRE, 256 + strlen(update_info.changelog));
+        json_writer_begin_object(&w);
+        json_writer_key(&w, "type");
+        json_writer_string(&w, "update_info");
+        json_writer_key(&w, "version");
+        json_writer_string(&w, update_info.version);
+        json_writer_key(&w, "downloadSize");
+        json_writer_int(&w, update_info.download_size);
+        json_writer_key(&w, "changelog");
+        json_writer_string(&w, update_info.changelog);
+        json_writer_key(&w, "critical");
+        json_writer_bool(&w, update_info.is_critical);
+        json_writer_end_object(&w);
+        send_json(wsi, &w);
     } else {
         server_send_update_status(wsi, "no_update", "No update available", NULL);
     }
@@ -192,50 +196,40 @@ void server_handle_update_message(struct lws *wsi, const char *action, const cha
 void server_send_update_status(struct lws *wsi, const char *status, const char *message, const char *version) {
     if (!wsi || !status || !message) return;
     
-    json_object *response = json_object_new_object();
-    json_object_object_add(response, "type", json_object_new_string("update_status"));
-    json_object_object_add(response, "status", json_object_new_string(status));
-    json_object_object_add(response, "message", json_object_new_string(message));
+    json_writer_t w;
+    json_writer_init(&w, LWS_PRE, 256);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "type");
+    json_writer_string(&w, "update_status");
+    json_writer_key(&w, "status");
+    json_writer_string(&w, status);
+    json_writer_key(&w, "message");
+    json_writer_string(&w, message);
     
     if (version) {
-        json_object_object_add(response, "version", json_object_new_string(version));
+        json_writer_key(&w, "version");
+        json_writer_string(&w, version);
     }
     
-    const char *json_str = json_object_to_json_string(response);
-    size_t json_len = strlen(json_str);
-    
-    unsigned char *buf = malloc(LWS_PRE + json_len + 1);
-    if (buf) {
-        buf[LWS_PRE + json_len] = '\0';
-        memcpy(&buf[LWS_PRE], json_str, json_len);
-        lws_write(wsi, &buf[LWS_PRE], json_len, LWS_WRITE_TEXT);
-        free(buf);
-    }
-    
-    json_object_put(response);
+    json_writer_end_object(&w);
+    send_json(wsi, &w);
 }
 
 // Send update progress message to client
 void server_send_update_progress(struct lws *wsi, int progress, const char *message) {
     if (!wsi || !message) return;
     
-    json_object *response = json_object_new_object();
-    json_object_object_add(response, "type", json_object_new_string("update_progress"));
-    json_object_object_add(response, "progress", json_object_new_int(progress));
-    json_object_object_add(response, "message", json_object_new_string(message));
-    
-    const char *json_str = json_object_to_json_string(response);
-    size_t json_len = strlen(json_str);
-    
-    unsigned char *buf = malloc(LWS_PRE + json_len + 1);
-    if (buf) {
-        buf[LWS_PRE + json_len] = '\0';
-        memcpy(&buf[LWS_PRE], json_str, json_len);
-        lws_write(wsi, &buf[LWS_PRE], json_len, LWS_WRITE_TEXT);
-        free(buf);
-    }
-    
-    json_object_put(response);
+    json_writer_t w;
+    json_writer_init(&w, LWS_PRE, 256);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "type");
+    json_writer_string(&w, "update_progress");
+    json_writer_key(&w, "progress");
+    json_writer_int(&w, progress);
+    json_writer_key(&w, "message");
+    json_writer_string(&w, message);
+    json_writer_end_object(&w);
+    send_json(wsi, &w);
 }
 
 // Progress callback for updater
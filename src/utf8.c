@@ -0,0 +1,169 @@
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "pool.h"
+#include "utf8.h"
+
+enum { SEQ_VALID, SEQ_INVALID, SEQ_TRUNCATED };
+
+static const char replacement[] = "\xef\xbf\xbd";
+
+// length of the leading run of ASCII bytes
+static size_t ascii_run(const unsigned char *s, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+#else
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, sizeof(word));
+    if (word & 0x8080808080808080ULL) break;
+  }
+#endif
+  while (i < len && s[i] < 0x80) i++;
+  return i;
+}
+
+// Check the multibyte sequence at s (RFC 3629, no overlongs, surrogates or code points above
+// U+10FFFF). Sets *n to its length, or for invalid input to the length of the maximal subpart
+// that is replaced by a single U+FFFD.
+static int check_seq(const unsigned char *s, size_t avail, size_t *n) {
+  unsigned char c = s[0];
+  size_t need;
+  unsigned char lo = 0x80, hi = 0xbf;  // range of the second byte
+
+  if (c >= 0xc2 && c <= 0xdf) {
+    need = 2;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    need = 3;
+    if (c == 0xe0) lo = 0xa0;
+    if (c == 0xed) hi = 0x9f;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    need = 4;
+    if (c == 0xf0) lo = 0x90;
+    if (c == 0xf4) hi = 0x8f;
+  } else {
+    *n = 1;
+    return SEQ_INVALID;
+  }
+
+  for (size_t i = 1; i < need; i++) {
+    if (i >= avail) {
+      *n = i;
+      return SEQ_TRUNCATED;
+    }
+    unsigned char b = s[i];
+    if (i == 1 ? (b < lo || b > hi) : (b & 0xc0) != 0x80) {
+      *n = i;
+      return SEQ_INVALID;
+    }
+  }
+  *n = need;
+  return SEQ_VALID;
+}
+
+// length of the longest valid UTF-8 prefix
+size_t utf8_valid_prefix(const char *data, size_t len) {
+  const unsigned char *s = (const unsigned char *)data;
+  size_t i = 0, n;
+  while (i < len) {
+    i += ascii_run(s + i, len - i);
+    if (i == len || check_seq(s + i, len - i, &n) != SEQ_VALID) break;
+    i += n;
+  }
+  return i;
+}
+
+// largest length <= len that does not end inside a multibyte sequence
+size_t utf8_boundary(const char *data, size_t len) {
+  const unsigned char *s = (const unsigned char *)data;
+  for (size_t back = 1; back <= 3 && back <= len; back++) {
+    unsigned char c = s[len - back];
+    if ((c & 0xc0) == 0x80) continue;
+    size_t need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    return need > back ? len - back : len;
+  }
+  return len;
+}
+
+static size_t emit(utf8_stream_t *stream, char *dst, const unsigned char *s, size_t n, int status) {
+  if (status == SEQ_VALID) {
+    memcpy(dst, s, n);
+    return n;
+  }
+  stream->replaced++;
+  memcpy(dst, replacement, 3);
+  return 3;
+}
+
+// Turn a chunk of PTY output into a self-contained, valid UTF-8 frame. At most 3 trailing
+// bytes of an incomplete sequence are held back for the next call, invalid sequences become
+// U+FFFD. Valid output without a pending carry is returned in place (*out points into data,
+// returns false); otherwise *out is a new pool block the caller releases with pool_free (returns true).
+bool utf8_stream_frame(utf8_stream_t *stream, const char *data, size_t len, char **out, size_t *out_len) {
+  const unsigned char *s = (const unsigned char *)data;
+  size_t n;
+
+  if (stream->carry_len == 0) {
+    size_t valid = utf8_valid_prefix(data, len);
+    if (valid == len || (len - valid < 4 && check_seq(s + valid, len - valid, &n) == SEQ_TRUNCATED)) {
+      memcpy(stream->carry, s + valid, len - valid);
+      stream->carry_len = len - valid;
+      *out = (char *)data;
+      *out_len = valid;
+      return false;
+    }
+  }
+
+  // every input byte expands to at most 3 output bytes
+  stream->slow_frames++;
+  char *dst = pool_alloc((stream->carry_len + len) * 3 + 1);
+  size_t o = 0, i = 0;
+
+  if (stream->carry_len > 0) {
+    unsigned char tmp[4];
+    size_t take = len < 4 - stream->carry_len ? len : 4 - stream->carry_len;
+    memcpy(tmp, stream->carry, stream->carry_len);
+    memcpy(tmp + stream->carry_len, s, take);
+    int status = check_seq(tmp, stream->carry_len + take, &n);
+    if (status == SEQ_TRUNCATED) {
+      // still incomplete, len is smaller than what the sequence is missing
+      memcpy(stream->carry + stream->carry_len, s, len);
+      stream->carry_len += len;
+      *out = dst;
+      *out_len = 0;
+      return true;
+    }
+    o += emit(stream, dst + o, tmp, n, status);
+    // the carry was a valid prefix, so n never ends inside it
+    i = n - stream->carry_len;
+    stream->carry_len = 0;
+  }
+
+  while (i < len) {
+    size_t run = ascii_run(s + i, len - i);
+    memcpy(dst + o, s + i, run);
+    o += run;
+    i += run;
+    if (i == len) break;
+
+    int status = check_seq(s + i, len - i, &n);
+    if (status == SEQ_TRUNCATED) {
+      memcpy(stream->carry, s + i, len - i);
+      stream->carry_len = len - i;
+      break;
+    }
+    o += emit(stream, dst + o, s + i, n, status);
+    i += n;
+  }
+
+  *out = dst;
+  *out_len = o;
+  return true;
+}
@@ -0,0 +1,20 @@
+#ifndef CMDR_UTF8_H
+#define CMDR_UTF8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// per connection state for utf8_stream_frame()
+typedef struct {
+  unsigned char carry[3];  // incomplete sequence held back from the previous frame
+  size_t carry_len;
+  uint64_t replaced;       // invalid sequences replaced with U+FFFD
+  uint64_t slow_frames;    // frames that needed a copy
+} utf8_stream_t;
+
+size_t utf8_valid_prefix(const char *data, size_t len);
+size_t utf8_boundary(const char *data, size_t len);
+bool utf8_stream_frame(utf8_stream_t *stream, const char *data, size_t len, char **out, size_t *out_len);
+
+#endif  // CMDR_UTF8_H
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "profile.h"
+
 #if defined(__linux__) && !defined(__ANDROID__)
 const char *sys_signame[NSIG] = {
     "zero", "HUP",  "INT",  "QUIT", "ILL",    "TRAP",   "ABRT",  "UNUSED", "FPE",  "KILL", "USR1",
@@ -25,6 +27,7 @@ const char *sys_signame[NSIG] = {
 
 void *xmalloc(size_t size) {
   if (size == 0) return NULL;
+  if (__builtin_expect(profile_enabled, 0)) profile_alloc(size);
   void *p = malloc(size);
   if (!p) abort();
   return p;
@@ -32,6 +35,7 @@ void *xmalloc(size_t size) {
 
 void *xrealloc(void *p, size_t size) {
   if ((size == 0) && (p == NULL)) return NULL;
+  if (__builtin_expect(profile_enabled, 0)) profile_alloc(size);
   p = realloc(p, size);
   if (!p) abort();
   return p;